@@ -21,11 +21,20 @@
  ** this will allocate memory in a way that is compatible with the cache tests, using a different value for
  ** the memory block type so that it won't be garbage collected
  **
+ ** with --churn, memory is filled with a mix of cache entry sized blocks and small and medium sized blocks, which
+ ** are then randomly freed and reallocated; allocation failures, speed and fragmentation are reported as it goes;
+ ** with --churn --defrag, the background defragmenter is also run 8 times per round, as the cache gc timer would
+ **
+ ** with --contention, 1 to 32 processes allocate and free small blocks in the same cluster, and then a process exits
+ ** without returning the blocks in its magazines, which should be reclaimed by agent_memory_check
+ **
  **/
 
 #include "platform.h"
 #include "thread.h"
 
+#include <sys/wait.h>
+
 #include "alloc.h"
 
 #define THREADS                             5
@@ -38,13 +47,35 @@
 
 #define TEST_DATA_TYPE                      3
 
+#define CHURN_MEMORY                        (CLUSTERS * 256 * 1024)
+
+#define CHURN_BLOCKS                        30000
+
+#define CHURN_ROUNDS                        10
+
+#define CHURN_FIXED_SIZE                    3084                                      /* size of a cache entry */
+
+#define CONTENTION_PROCS                    32
 
-int master_recovery_process(pid_t pid)
+#define CONTENTION_OPS                      200000
+
+
+/* thread.c uses am_free (utility.c) which is not linked in here */
+void am_free(void *ptr)
 {
-    printf("alloc test recovery process: TBD\n");
+    free(ptr);
+}
 
-    return 0;
+/* agent_cache.c uses am_random_bytes (utility.c) which is not linked in here */
+int am_random_bytes(void *buf, size_t buflen)
+{
+    unsigned char                          *p = buf;
+    size_t                                  i;
 
+    for (i = 0; i < buflen; i++) {
+        p[i] = (unsigned char) rand();
+    }
+    return 0;                                                                         /* AM_SUCCESS */
 }
 
 void *mem_test_thread(void * data)
@@ -130,6 +161,176 @@ void *mem_control_thread(void * data)
     
 }
 
+static uint32_t churn_size()
+{
+    int                                     r = rand() % 100;
+
+    if (r < 20)
+        return CHURN_FIXED_SIZE;
+    if (r < 90)
+        return 16 + rand() % (16 << (rand() % 7));                                    /* mostly small user entries */
+    return 1024 + rand() % 7168;
+
+}
+
+static void churn(int defrag)
+{
+    void                                  **ptrs = calloc(CHURN_BLOCKS, sizeof(void *));
+    uint32_t                               *sizes = calloc(CHURN_BLOCKS, sizeof(uint32_t));
+    struct agent_memory_usage               u;
+    struct agent_memory_metrics             m;
+
+    const pid_t                             pid = getpid();
+
+    uint64_t                                requested = 0;
+    int                                     failures = 0;
+
+    int                                     i, n;
+    long                                    t0;
+    double                                  dt;
+
+    agent_memory_fixed_size(CHURN_FIXED_SIZE);
+
+    for (i = 0; i < CHURN_BLOCKS; i++)
+    {
+        sizes[i] = churn_size();
+
+        if ((ptrs[i] = agent_memory_alloc(pid, i % CLUSTERS, TEST_DATA_TYPE, sizes[i])))
+            requested += sizes[i];
+        else
+            failures++;
+    }
+
+    for (n = 0; n <= CHURN_ROUNDS; n++)
+    {
+        agent_memory_usage(pid, &u);
+
+        printf("round %2d: requested %6.2lf%% of %u bytes, used %6.2lf%%, free %6.2lf%%, slab free %6.2lf%%, free blocks %u, "
+               "largest free %u, failed allocs %d\n", n, 100.0 * requested / CHURN_MEMORY, CHURN_MEMORY, 100.0 * u.used / CHURN_MEMORY,
+               100.0 * u.free / CHURN_MEMORY, 100.0 * u.slab_free / CHURN_MEMORY, u.free_blocks, u.largest_free, failures);
+
+        agent_memory_metrics(&m);
+
+        printf("          free list lengths [%u, %u, %u, %u], slab blocks %u, inline compactions %llu, cluster failures %llu, "
+               "defragmented %llu\n", m.free_list_length[0], m.free_list_length[1], m.free_list_length[2], m.free_list_length[3],
+               m.slab_blocks, (unsigned long long)m.compactions, (unsigned long long)m.failures, (unsigned long long)m.defrags);
+
+        if (m.largest_free != u.largest_free)
+            printf("          largest free block in the cluster headers is %u, found %u\n", m.largest_free, u.largest_free);
+
+        if (n == CHURN_ROUNDS)
+            break;
+
+        failures = 0;
+
+        t0 = clock();
+
+        for (i = 0; i < CHURN_BLOCKS; i++)
+        {
+            int                             j = rand() % CHURN_BLOCKS;
+
+            if (ptrs[j])
+            {
+                agent_memory_free(pid, ptrs[j]);
+                requested -= sizes[j];
+            }
+
+            sizes[j] = churn_size();
+
+            if ((ptrs[j] = agent_memory_alloc(pid, j % CLUSTERS, TEST_DATA_TYPE, sizes[j])))
+                requested += sizes[j];
+            else
+                failures++;
+
+            if (defrag && i % (CHURN_BLOCKS / 8) == 0)
+                agent_memory_defragment(pid, 1000);
+        }
+
+        dt = ((double) (clock() - t0)) / CLOCKS_PER_SEC;
+        printf("          %d frees and allocs in %lf secs\n", CHURN_BLOCKS, dt);
+    }
+
+    if (agent_memory_check(pid, 0, 0))
+        printf("******** memory check failed\n");
+
+    free(ptrs);
+    free(sizes);
+
+}
+
+static void contention_process(int ops)
+{
+    void                                   *ptrs[16];
+
+    const pid_t                             pid = getpid();
+
+    int                                     i, j;
+
+    for (i = 0; i < ops; i += 16)
+    {
+        for (j = 0; j < 16; j++)
+            ptrs[j] = agent_memory_alloc(pid, 0, TEST_DATA_TYPE, 16 + (j * 37) % 512);
+
+        for (j = 0; j < 16; j++)
+            if (ptrs[j])
+                agent_memory_free(pid, ptrs[j]);
+    }
+
+}
+
+static void contention()
+{
+    struct agent_memory_usage               before, after;
+    pid_t                                   pids[CONTENTION_PROCS];
+    struct timeval                          t0, t1;
+
+    int                                     n, i;
+    double                                  dt;
+
+    for (n = 1; n <= CONTENTION_PROCS; n *= 2)
+    {
+        fflush(stdout);
+        gettimeofday(&t0, NULL);
+
+        for (i = 0; i < n; i++)
+        {
+            if ((pids[i] = fork()) == 0)
+            {
+                contention_process(CONTENTION_OPS);
+                agent_memory_shutdown(0);
+                _exit(0);
+            }
+        }
+
+        for (i = 0; i < n; i++)
+            waitpid(pids[i], NULL, 0);
+
+        gettimeofday(&t1, NULL);
+        dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1000000.0;
+
+        printf("%2d processes: %d allocs and frees each in %lf secs, %.0lf ops/sec\n", n, CONTENTION_OPS, dt, 2.0 * n * CONTENTION_OPS / dt);
+    }
+
+    fflush(stdout);
+    if ((pids[0] = fork()) == 0)
+    {
+        contention_process(16);
+        _exit(0);                                                                     /* magazines not drained */
+    }
+    waitpid(pids[0], NULL, 0);
+
+    agent_memory_usage(getpid(), &before);
+
+    if (agent_memory_check(getpid(), 0, 0))
+        printf("******** memory check failed\n");
+
+    agent_memory_usage(getpid(), &after);
+
+    printf("exited process: magazine bytes %llu before, %llu after reclaim\n",
+        (unsigned long long)before.magazine, (unsigned long long)after.magazine);
+
+}
+
 int main(int argc, char *argv[])
 {
     am_thread_t                             threads[THREADS];
@@ -139,6 +340,28 @@ int main(int argc, char *argv[])
     long                                    t0;
     double                                  dt;
 
+    if (argc >= 2 && strcmp(argv[1], "--churn") == 0)
+    {
+        agent_memory_initialise(CHURN_MEMORY, 0);
+
+        churn(argc == 3 && strcmp(argv[2], "--defrag") == 0);
+
+        agent_memory_shutdown(1);
+
+        exit(0);
+    }
+
+    if (argc == 2 && strcmp(argv[1], "--contention") == 0)
+    {
+        agent_memory_initialise(CHURN_MEMORY, 0);
+
+        contention();
+
+        agent_memory_shutdown(1);
+
+        exit(0);
+    }
+
     agent_memory_initialise(CLUSTERS * 4096 * 1024, 0);
     
     if (argc == 2 && strcmp(argv[1], "--check") == 0)
@@ -0,0 +1,224 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2016 ForgeRock AS.
+ */
+
+/**
+ ** request arena benchmark
+ **
+ ** the strings setup_request_data and handle_not_enforced make for a request (first client ip and host,
+ ** normalized, overridden and goto urls, path info removal, post preservation path, absolute access denied
+ ** url) are made first with the heap, as they used to be, and released one by one as am_request_free did,
+ ** then from the request arena, released at once; requests/sec and allocator calls (malloc, calloc,
+ ** realloc and free, counted by wrapping the glibc allocator) per request are reported for both
+ **
+ **/
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+
+#include <stdarg.h>
+
+#define REQUESTS                            100000
+
+#define RUN_SECS                            1.0
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static unsigned long allocator_calls = 0;
+
+static volatile size_t sink = 0;
+
+void *malloc(size_t size)
+{
+    allocator_calls++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    allocator_calls++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocator_calls++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if (ptr != NULL)
+        allocator_calls++;
+    __libc_free(ptr);
+}
+
+static double now_secs()
+{
+    struct timeval                          tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+
+}
+
+static char *heap_asprintf(const char *fmt, ...)
+{
+    va_list                                 args;
+    char                                   *p;
+
+    va_start(args, fmt);
+    if (vasprintf(&p, fmt, args) < 0)
+        p = NULL;
+    va_end(args);
+    return p;
+
+}
+
+struct request
+{
+    const char                             *client_ip;
+    const char                             *client_host;
+    const char                             *path;
+    const char                             *query;
+
+};
+
+static const struct request                 requests[] = {
+    { "192.0.2.7, 10.0.0.1", "www.example.com:8080", "/app/index.html", "" },
+    { "2001:db8::7", NULL, "/app/public/js/application.js", "?v=1.2.3" },
+    { "10.1.2.3", "client.example.com", "/protected/reports/2016/q3/summary.html", "?sort=desc&page=4" },
+    { "172.16.0.9", NULL, "/cgi-bin/index.cgi/extra/path/info", "" }
+};
+
+#define NUM_REQUESTS                        (sizeof(requests) / sizeof(requests[0]))
+
+/* the former setup_request_data and handle_not_enforced allocations, released as am_request_free did */
+static size_t heap_request(const struct request *q)
+{
+    char                                   *client_ip, *client_host = NULL, *normalized, *overridden, *goto_url,
+                                           *pathinfo, *tmp, *pdp_path, *denied;
+    struct url                             *parsed;
+    const char                             *s;
+    size_t                                  n;
+
+    s = strchr(q->client_ip, ',');
+    client_ip = s != NULL ? strndup(q->client_ip, s - q->client_ip) : strdup(q->client_ip);
+    if (q->client_host != NULL)
+        client_host = strdup(q->client_host);
+    normalized = heap_asprintf("%s://%s:%d%s%s", "http", "www.example.com", 80, q->path, q->query);
+    overridden = heap_asprintf("%s://%s:%d%s%s", "https", "agent.example.com", 443, q->path, q->query);
+    goto_url = heap_asprintf("%s://%s:%d%s%s", "https", "agent.example.com", 443, q->path, q->query);
+    tmp = strdup(q->path);
+    pathinfo = heap_asprintf("%s://%s:%d%s%s", "http", "www.example.com", 80, tmp, q->query);
+    free(tmp);
+    pdp_path = heap_asprintf("%s%s%s", "/", "", "/dummypost/sunpostpreserve");
+    free(pdp_path);
+    parsed = malloc(sizeof(struct url));
+    free(parsed);
+    denied = heap_asprintf("%s://%s:%d%s%s", "https", "login.example.com", 443, "/denied.html", "");
+    free(denied);
+
+    n = strlen(client_ip) + strlen(normalized) + strlen(overridden) + strlen(goto_url) + strlen(pathinfo);
+
+    free(normalized);
+    free(overridden);
+    free(pathinfo);
+    free(goto_url);
+    free(client_ip);
+    free(client_host);
+    return n;
+
+}
+
+static size_t arena_request(const struct request *q)
+{
+    am_request_t                            r;
+    char                                   *client_ip, *normalized, *overridden, *goto_url, *pathinfo, *tmp;
+    const char                             *s;
+    size_t                                  n;
+
+    memset(&r, 0, sizeof(r));
+
+    s = strchr(q->client_ip, ',');
+    client_ip = s != NULL ? am_request_strndup(&r, q->client_ip, s - q->client_ip) : am_request_strdup(&r, q->client_ip);
+    if (q->client_host != NULL)
+        am_request_strdup(&r, q->client_host);
+    normalized = am_request_asprintf(&r, "%s://%s:%d%s%s", "http", "www.example.com", 80, q->path, q->query);
+    overridden = am_request_asprintf(&r, "%s://%s:%d%s%s", "https", "agent.example.com", 443, q->path, q->query);
+    goto_url = am_request_asprintf(&r, "%s://%s:%d%s%s", "https", "agent.example.com", 443, q->path, q->query);
+    tmp = am_request_strdup(&r, q->path);
+    pathinfo = am_request_asprintf(&r, "%s://%s:%d%s%s", "http", "www.example.com", 80, tmp, q->query);
+    am_request_asprintf(&r, "%s%s%s", "/", "", "/dummypost/sunpostpreserve");
+    am_request_alloc(&r, sizeof(struct url));
+    am_request_asprintf(&r, "%s://%s:%d%s%s", "https", "login.example.com", 443, "/denied.html", "");
+
+    n = strlen(client_ip) + strlen(normalized) + strlen(overridden) + strlen(goto_url) + strlen(pathinfo);
+
+    am_request_arena_free(&r);
+    return n;
+
+}
+
+static void run(const char *name, size_t (*request)(const struct request *))
+{
+    unsigned long                           n = 0, calls;
+    int                                     i;
+    double                                  t0, dt;
+
+    /* allocator calls of a single pass, after a warm up (the arena backing block is then cached) */
+    request(&requests[0]);
+    calls = allocator_calls;
+    for (i = 0; i < NUM_REQUESTS; i++)
+        request(&requests[i]);
+    calls = allocator_calls - calls;
+
+    t0 = now_secs();
+    do
+    {
+        for (i = 0; i < REQUESTS; i++)
+            sink += request(&requests[i % NUM_REQUESTS]);
+        n += REQUESTS;
+    }
+    while ((dt = now_secs() - t0) < RUN_SECS);
+
+    printf("%-6s %12.1lf requests/sec, %5.1lf allocator calls/request\n", name, n / dt,
+        (double)calls / NUM_REQUESTS);
+
+}
+
+int main(int argc, char *argv[])
+{
+    int                                     i;
+
+    for (i = 0; i < NUM_REQUESTS; i++)
+    {
+        if (heap_request(&requests[i]) != arena_request(&requests[i]))
+        {
+            printf("results differ for %s\n", requests[i].path);
+            exit(1);
+        }
+    }
+
+    run("heap", heap_request);
+    run("arena", arena_request);
+
+    exit(0);
+
+}
@@ -48,6 +48,24 @@ struct bucket
 
 uint8_t                                     random_buffer[RANDOM_BUFFER_SZ];          /* reduce time generating random data */
 
+/* thread.c uses am_free (utility.c) which is not linked in here */
+void am_free(void *ptr)
+{
+    free(ptr);
+}
+
+/* agent_cache.c uses am_random_bytes (utility.c) which is not linked in here */
+int am_random_bytes(void *buf, size_t buflen)
+{
+    unsigned char                          *p = buf;
+    size_t                                  i;
+
+    for (i = 0; i < buflen; i++) {
+        p[i] = (unsigned char) rand();
+    }
+    return 0;                                                                         /* AM_SUCCESS */
+}
+
 
 static void initialise_random_buffer()
 {
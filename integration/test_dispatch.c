@@ -0,0 +1,133 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2016 ForgeRock AS.
+ */
+
+/**
+ ** dispatch throughput test for the worker pool
+ **
+ ** a number of producer threads submit short work items to the pool as fast as they can, backing off
+ ** when the pool rejects work (queues full); the run is repeated for an increasing number of producers
+ **
+ **/
+
+#include "platform.h"
+#include "am.h"
+#include "thread.h"
+
+#define MAX_PRODUCERS                       32
+
+#define TEST_WORK                           2000000
+
+#define WORK_SPIN                           64
+
+static volatile uint32_t                    done;
+
+static int                                  producers;
+
+/* thread.c uses am_free (utility.c) which is not linked in here */
+void am_free(void *ptr)
+{
+    free(ptr);
+}
+
+static uint64_t now_usec()
+{
+    struct timeval                          tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+}
+
+static void work(void *arg)
+{
+    volatile int                            i;
+
+    for (i = 0; i < WORK_SPIN; i++)
+        ;
+
+    __sync_fetch_and_add(&done, 1);
+
+}
+
+void *producer_thread(void *data)
+{
+    int                                     n = TEST_WORK / producers;
+    int                                     i;
+
+    for (i = 0; i < n; i++)
+    {
+        while (am_worker_dispatch(work, data) == AM_EAGAIN)
+        {
+            sched_yield();
+        }
+    }
+
+    return data;
+
+}
+
+int main(int argc, char *argv[])
+{
+    am_thread_t                             threads[MAX_PRODUCERS];
+    int                                     args[MAX_PRODUCERS];
+    struct am_worker_pool_metrics           m;
+
+    int                                     i;
+    uint32_t                                total;
+    uint64_t                                t0;
+    double                                  dt;
+
+    for (producers = 1; producers <= MAX_PRODUCERS; producers *= 2)
+    {
+        am_worker_pool_init_main();
+
+        done = 0;
+        total = (TEST_WORK / producers) * producers;
+
+        t0 = now_usec();
+
+        for (i = 0; i < producers; i++)
+        {
+            args[i] = i;
+
+            AM_THREAD_CREATE(threads[i], producer_thread, args + i);
+        }
+
+        for (i = 0; i < producers; i++)
+        {
+            AM_THREAD_JOIN(threads[i]);
+        }
+
+        while (__sync_fetch_and_add(&done, 0) < total)
+        {
+            usleep(100);
+        }
+
+        dt = (double)(now_usec() - t0) / 1000000.0;
+
+        am_worker_pool_metrics(&m);
+
+        printf("%2d producers: %u work items in %lf secs, %.0lf items/sec\n", producers, total, dt, total / dt);
+        printf("    threads %u, rejected %llu, stolen %llu, max queue depth %u, avg wait %.2lf usec, avg run %.2lf usec\n",
+            m.threads, (unsigned long long)m.rejected, (unsigned long long)m.stolen, m.queued_max,
+            m.completed ? (double)m.wait_time / m.completed : 0.0, m.completed ? (double)m.run_time / m.completed : 0.0);
+
+        am_worker_pool_shutdown_main();
+    }
+
+    exit(0);
+
+}
@@ -0,0 +1,119 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2016 ForgeRock AS.
+ */
+
+/**
+ ** URL pattern matching benchmark
+ **
+ ** policy_compare_url is timed with typical policy resource patterns and with pathological ones, where a
+ ** backtracking matcher retries every way of dividing the resource between many * or -*- wildcards before it
+ ** fails; each case is run for about a second, or once if a single evaluation takes longer
+ **
+ **/
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+
+#include <stdarg.h>
+
+#define RUN_SECS                            1.0
+
+struct match_case
+{
+    const char                             *name;
+    const char                             *pattern;
+    const char                             *resource;
+    int                                     ignore_case;
+
+};
+
+static struct match_case                    cases[] = {
+    { "exact",                  "http://www.example.com:80/app/index.html",
+                                "http://www.example.com:80/app/index.html", 0 },
+    { "trailing wildcard",      "http://www.example.com:80/app/*",
+                                "http://www.example.com:80/app/some/deeper/path/index.html", 0 },
+    { "several wildcards",      "http*://*.example.com:*/app/-*-/index.*?*",
+                                "https://www.example.com:443/app/module/index.html?a=b", 0 },
+    { "ignore case",            "HTTP://WWW.EXAMPLE.COM:80/APPLICATION/RESOURCES/STATIC/*",
+                                "http://www.example.com:80/application/resources/static/images/logo.png", 1 },
+    { "pathological *",         "http://h:80/*a*a*a*a*a*a*a*a*b?",
+                                "http://h:80/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa?", 0 },
+    { "pathological -*-",       "http://h:80/-*-a-*-a-*-a-*-a-*-a-*-a-*-a-*-b/",
+                                "http://h:80/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa/", 0 },
+    { "pathological mixed",     "http://h:80/*a-*-a*a-*-a*a-*-a*a-*-a*b?",
+                                "http://h:80/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa?", 0 },
+};
+
+void am_free(void *ptr)
+{
+    free(ptr);
+}
+
+/* policy.c uses am_asprintf (utility.c) which is not linked in here */
+int am_asprintf(char **buffer, const char *fmt, ...)
+{
+    va_list                                 args;
+    int                                     rv;
+
+    va_start(args, fmt);
+    rv = vasprintf(buffer, fmt, args);
+    va_end(args);
+    return rv;
+
+}
+
+static double now_secs()
+{
+    struct timeval                          tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+
+}
+
+int main(int argc, char *argv[])
+{
+    am_config_t                             config;
+    am_request_t                            r;
+
+    int                                     i, status = AM_NO_MATCH;
+    unsigned long                           n;
+    double                                  t0, dt;
+
+    memset(&config, 0, sizeof(config));
+    memset(&r, 0, sizeof(r));
+    r.conf = &config;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        config.url_eval_case_ignore = cases[i].ignore_case;
+
+        t0 = now_secs();
+        n = 0;
+        do
+        {
+            status = policy_compare_url(&r, cases[i].pattern, cases[i].resource);
+            n++;
+        }
+        while ((dt = now_secs() - t0) < RUN_SECS);
+
+        printf("%-20s %-20s %12.1lf evals/sec (%lu in %lf secs)\n", cases[i].name, am_policy_strerror(status),
+            n / dt, n, dt);
+    }
+
+    exit(0);
+
+}
@@ -0,0 +1,334 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2016 ForgeRock AS.
+ */
+
+/**
+ ** not enforced rule evaluation benchmark
+ **
+ ** not enforced url, client ip and extended lists of RULES entries each (a tenth of them method specific) are
+ ** evaluated for a mix of request urls and client addresses, first entry by entry as handle_not_enforced used
+ ** to (parsing every entry on every request), then with the compiled rules; the two must agree on every request
+ **
+ **/
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+
+#include <stdarg.h>
+
+#define RULES                               10000
+
+#define REQUESTS                            2000
+
+#define RUN_SECS                            1.0
+
+void am_free(void *ptr)
+{
+    free(ptr);
+}
+
+/* policy.c uses am_asprintf (utility.c) which is not linked in here */
+int am_asprintf(char **buffer, const char *fmt, ...)
+{
+    va_list                                 args;
+    int                                     rv;
+
+    va_start(args, fmt);
+    rv = vasprintf(buffer, fmt, args);
+    va_end(args);
+    return rv;
+
+}
+
+/* not_enforced.c uses am_method_str_to_num (utility.c), only GET and POST are used here */
+int am_method_str_to_num(const char *method_str)
+{
+    if (strcasecmp(method_str, "GET") == 0)
+        return AM_REQUEST_GET;
+    if (strcasecmp(method_str, "POST") == 0)
+        return AM_REQUEST_POST;
+    return AM_REQUEST_UNKNOWN;
+
+}
+
+static double now_secs()
+{
+    struct timeval                          tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+
+}
+
+static char *key(int i)
+{
+    char                                   *k;
+
+    am_asprintf(&k, i % 10 == 0 ? "GET,%d" : "%d", i);
+    return k;
+
+}
+
+static void setup_rules(am_config_t *c)
+{
+    int                                     i;
+
+    c->not_enforced_map_sz = c->not_enforced_ip_map_sz = c->not_enforced_ext_map_sz = RULES;
+    c->not_enforced_map = calloc(RULES, sizeof(am_config_map_t));
+    c->not_enforced_ip_map = calloc(RULES, sizeof(am_config_map_t));
+    c->not_enforced_ext_map = calloc(RULES, sizeof(am_config_map_t));
+
+    for (i = 0; i < RULES; i++)
+    {
+        c->not_enforced_map[i].name = key(i);
+        if (i % 3 == 0)
+            am_asprintf(&c->not_enforced_map[i].value, "http://www.example.com:80/app%d/public/*", i);
+        else if (i % 3 == 1)
+            am_asprintf(&c->not_enforced_map[i].value, "http://www.example.com:80/app%d/-*-/logo.png", i);
+        else
+            am_asprintf(&c->not_enforced_map[i].value, "http://www.example.com:80/app%d/index.html", i);
+
+        c->not_enforced_ip_map[i].name = key(i);
+        if (i % 2)
+            am_asprintf(&c->not_enforced_ip_map[i].value, "10.%d.%d.0/24", i / 256, i % 256);
+        else
+            am_asprintf(&c->not_enforced_ip_map[i].value, "2001:db8:%x::1-2001:db8:%x::ff", i, i);
+
+        c->not_enforced_ext_map[i].name = key(i);
+        am_asprintf(&c->not_enforced_ext_map[i].value, "172.16.%d.0/24 172.17.%d.1-172.17.%d.9|"
+            "http://www.example.com:80/ext%d/* http://www.example.com:80/ext%d.html", i % 256, i % 256, i % 256, i, i);
+    }
+
+}
+
+/* the former handle_not_enforced evaluation, without logging */
+static int linear_not_enforced(am_request_t *r, const char *url)
+{
+    am_config_t                            *c = r->conf;
+    char                                   *p, *v, *t, *is, *us;
+    int                                     i, found;
+
+    for (i = 0; i < c->not_enforced_ip_map_sz; i++)
+    {
+        am_config_map_t                    *m = &c->not_enforced_ip_map[i];
+        const char                         *l[1] = { m->value };
+
+        if ((p = strstr(m->name, ",")) != NULL)
+        {
+            char                           *pv = strndup(m->name, p - m->name);
+            int                             mtn = am_method_str_to_num(pv);
+
+            free(pv);
+            if (r->method != mtn)
+                continue;
+        }
+        if (ip_address_match(r->client_ip, l, 1, 0) == AM_SUCCESS)
+            return 1;
+    }
+
+    for (i = 0; i < c->not_enforced_map_sz; i++)
+    {
+        am_config_map_t                    *m = &c->not_enforced_map[i];
+
+        if ((p = strstr(m->name, ",")) != NULL)
+        {
+            char                           *pv = strndup(m->name, p - m->name);
+            int                             mtn = am_method_str_to_num(pv);
+
+            free(pv);
+            if (r->method != mtn)
+                continue;
+        }
+        if (policy_compare_url(r, m->value, url) != AM_NO_MATCH)
+            return 1;
+    }
+
+    for (i = 0; i < c->not_enforced_ext_map_sz; i++)
+    {
+        am_config_map_t                    *m = &c->not_enforced_ext_map[i];
+
+        p = strstr(m->value, "|");
+        is = strndup(m->value, p - m->value);
+        us = strdup(p + 1);
+        found = 0;
+        for (v = strtok_r(is, " ", &t); v; v = strtok_r(NULL, " ", &t))
+        {
+            const char                     *vlist[1] = { v };
+
+            if (ip_address_match(r->client_ip, vlist, 1, 0) == AM_SUCCESS)
+            {
+                found = 1;
+                break;
+            }
+        }
+        if (found)
+        {
+            found = 0;
+            for (v = strtok_r(us, " ", &t); v; v = strtok_r(NULL, " ", &t))
+            {
+                if (policy_compare_url(r, v, url) != AM_NO_MATCH)
+                {
+                    found = 1;
+                    break;
+                }
+            }
+        }
+        free(is);
+        free(us);
+        if (found)
+            return 1;
+    }
+
+    return 0;
+
+}
+
+static int compiled_not_enforced(am_request_t *r, const char *url)
+{
+    struct am_not_enforced_rules           *rules = am_not_enforced_rules_get(r->conf);
+    struct am_ip_addr                       client;
+    int                                     found;
+
+    am_ip_addr_parse(r->client_ip, &client);
+    found = am_not_enforced_ip_match(rules, r, &client) || am_not_enforced_url_match(rules, r, url) != NULL ||
+        am_not_enforced_ext_match(rules, r, url, &client) != NULL;
+    am_not_enforced_rules_release(&rules);
+    return found;
+
+}
+
+struct request
+{
+    char                                   *url;
+    char                                   *ip;
+    int                                     method;
+
+};
+
+static void setup_requests(struct request *req)
+{
+    unsigned int                            seed = 1;
+    int                                     i, n;
+
+    for (i = 0; i < REQUESTS; i++)
+    {
+        n = rand_r(&seed) % RULES;
+        switch (rand_r(&seed) % 6)
+        {
+            case 0:
+                am_asprintf(&req[i].url, "http://www.example.com:80/app%d/public/js/app.js", n);
+                break;
+            case 1:
+                am_asprintf(&req[i].url, "http://www.example.com:80/app%d/img/logo.png", n);
+                break;
+            case 2:
+                am_asprintf(&req[i].url, "http://www.example.com:80/ext%d/index.html", n);
+                break;
+            default:
+                /* most requests are enforced */
+                am_asprintf(&req[i].url, "http://www.example.com:80/protected/app%d/index.html", n);
+                break;
+        }
+        switch (rand_r(&seed) % 8)
+        {
+            case 0:
+                am_asprintf(&req[i].ip, "10.%d.%d.7", n / 256, n % 256);
+                break;
+            case 1:
+                am_asprintf(&req[i].ip, "172.16.%d.7", n % 256);
+                break;
+            case 2:
+                am_asprintf(&req[i].ip, "2001:db8:%x::7", n);
+                break;
+            default:
+                am_asprintf(&req[i].ip, "192.0.2.%d", n % 256);
+                break;
+        }
+        req[i].method = rand_r(&seed) % 2 ? AM_REQUEST_GET : AM_REQUEST_POST;
+    }
+
+}
+
+static double run(am_request_t *r, struct request *req, int (*evaluate)(am_request_t *, const char *), int *found)
+{
+    unsigned long                           n = 0;
+    int                                     i;
+    double                                  t0 = now_secs(), dt;
+
+    do
+    {
+        for (i = 0, *found = 0; i < REQUESTS; i++)
+        {
+            r->client_ip = req[i].ip;
+            r->method = req[i].method;
+            *found += evaluate(r, req[i].url);
+        }
+        n += REQUESTS;
+    }
+    while ((dt = now_secs() - t0) < RUN_SECS);
+
+    return n / dt;
+
+}
+
+int main(int argc, char *argv[])
+{
+    static struct request                   req[REQUESTS];
+    am_config_t                             config;
+    am_request_t                            r;
+
+    int                                     i, found_linear, found_compiled, differ = 0;
+    double                                  rate_linear, rate_compiled, t0;
+    struct am_not_enforced_rules           *rules;
+
+    memset(&config, 0, sizeof(config));
+    memset(&r, 0, sizeof(r));
+    r.conf = &config;
+    config.instance_id = 1;
+    config.ts = time(NULL);
+
+    setup_rules(&config);
+    setup_requests(req);
+
+    t0 = now_secs();
+    rules = am_not_enforced_rules_get(&config);
+    printf("%d url, %d client ip and %d extended rules compiled in %lf secs\n", RULES, RULES, RULES, now_secs() - t0);
+    am_not_enforced_rules_release(&rules);
+
+    for (i = 0; i < REQUESTS; i++)
+    {
+        r.client_ip = req[i].ip;
+        r.method = req[i].method;
+        if (linear_not_enforced(&r, req[i].url) != compiled_not_enforced(&r, req[i].url))
+        {
+            printf("results differ for %s %s from %s\n", req[i].method == AM_REQUEST_GET ? "GET" : "POST",
+                req[i].url, req[i].ip);
+            differ++;
+        }
+    }
+
+    rate_linear = run(&r, req, linear_not_enforced, &found_linear);
+    rate_compiled = run(&r, req, compiled_not_enforced, &found_compiled);
+
+    printf("entry by entry: %12.1lf requests/sec (%d of %d not enforced)\n", rate_linear, found_linear, REQUESTS);
+    printf("compiled:       %12.1lf requests/sec (%d of %d not enforced)\n", rate_compiled, found_compiled, REQUESTS);
+    printf("%d differences\n", differ);
+
+    am_not_enforced_rules_shutdown();
+
+    exit(differ ? 1 : 0);
+
+}
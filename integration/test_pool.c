@@ -0,0 +1,177 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2016 ForgeRock AS.
+ */
+
+/**
+ ** test utility for the am_shm_t pool allocator (config and audit pools)
+ **
+ ** 1 to 16 processes allocate, fill, verify and free blocks of mixed sizes in one pool, as audit entries and
+ ** config entries would be; the pool starts small so that it is extended (and remapped by every process) while
+ ** others are allocating and freeing; data corruption and allocation failures are reported
+ **
+ ** blocks are kept as offsets, as the config and audit code does, because a pool is remapped when it is extended
+ **
+ **/
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "list.h"
+
+#include <sys/wait.h>
+
+#define MAX_PROCS                           16
+
+#define OPS                                 200000
+
+#define LIVE                                64
+
+/* thread.c uses am_free (utility.c) which is not linked in here */
+void am_free(void *ptr)
+{
+    free(ptr);
+}
+
+/* agent_cache.c uses am_random_bytes (utility.c) which is not linked in here */
+int am_random_bytes(void *buf, size_t buflen)
+{
+    unsigned char                          *p = buf;
+    size_t                                  i;
+
+    for (i = 0; i < buflen; i++) {
+        p[i] = (unsigned char) rand();
+    }
+    return 0;                                                                         /* AM_SUCCESS */
+}
+
+static double now_secs()
+{
+    struct timeval                          tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+
+}
+
+static uint32_t block_size(unsigned int *seed)
+{
+    int                                     r = rand_r(seed) % 100;
+
+    if (r < 90)
+        return 8 + rand_r(seed) % 600;                                                /* config entries, typical audit entries */
+    return 4096 + rand_r(seed) % 16384;
+
+}
+
+#define BLOCK(pool, ofs)                    ((uint8_t *)AM_GET_POINTER((pool)->pool, ofs))
+
+static int worker(am_shm_t *pool, int n)
+{
+    uint32_t                                offsets[LIVE] = { 0 };
+    uint32_t                                sizes[LIVE];
+    uint8_t                                *p;
+    unsigned int                            seed = n * 7919 + 1;
+
+    int                                     i, j, errors = 0;
+
+    for (i = 0; i < OPS; i++)
+    {
+        j = rand_r(&seed) % LIVE;
+
+        if (offsets[j])
+        {
+            p = BLOCK(pool, offsets[j]);
+
+            if (p[0] != (uint8_t)(j + n) || p[sizes[j] - 1] != (uint8_t)(j + n))
+                errors++;
+
+            am_shm_free(pool, p);
+        }
+
+        sizes[j] = block_size(&seed);
+
+        if ((p = am_shm_alloc(pool, sizes[j])))
+        {
+            memset(p, j + n, sizes[j]);
+            offsets[j] = AM_GET_OFFSET(pool->pool, p);
+        }
+        else
+        {
+            offsets[j] = 0;
+            errors++;
+        }
+    }
+
+    for (j = 0; j < LIVE; j++)
+        if (offsets[j])
+            am_shm_free(pool, BLOCK(pool, offsets[j]));
+
+    return errors;
+
+}
+
+int main(int argc, char *argv[])
+{
+    pid_t                                   pids[MAX_PROCS];
+    am_shm_t                               *pool;
+
+    int                                     n, i, status, failed;
+    double                                  t0, dt;
+
+    am_shm_delete("am_test_pool");
+
+    if ((pool = am_shm_create("am_test_pool", 0x10000, AM_FALSE, NULL, NULL)) == NULL || pool->error)
+    {
+        printf("unable to create pool\n");
+        exit(1);
+    }
+
+    for (n = 1; n <= MAX_PROCS; n *= 2)
+    {
+        fflush(stdout);
+        t0 = now_secs();
+
+        for (i = 0; i < n; i++)
+        {
+            if ((pids[i] = fork()) == 0)
+            {
+                status = worker(pool, i);
+                fflush(stdout);
+                _exit(status ? 1 : 0);
+            }
+        }
+
+        for (failed = i = 0; i < n; i++)
+        {
+            waitpid(pids[i], &status, 0);
+
+            if (! WIFEXITED(status) || WEXITSTATUS(status))
+                failed++;
+        }
+
+        dt = now_secs() - t0;
+
+        am_shm_lock(pool);
+        printf("%2d processes: %d allocs and frees each in %lf secs, %.0lf ops/sec, pool size %llu, %d failed\n",
+            n, OPS, dt, 2.0 * n * OPS / dt, (unsigned long long)pool->local_size, failed);
+        am_shm_unlock(pool);
+    }
+
+    am_shm_destroy(pool);
+    am_shm_delete("am_test_pool");
+
+    exit(0);
+
+}
@@ -0,0 +1,164 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2016 ForgeRock AS.
+ */
+
+/**
+ ** rendered user attribute table benchmark
+ **
+ ** requests of a number of concurrent sessions (picked at random) look up their rendered attribute headers
+ ** and cookies, and render and keep them when they are not in the table; the hit rate and requests/sec are
+ ** reported for a table the size of the former direct mapped one (64 sessions) and for the default table
+ **
+ **/
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+
+#define REQUESTS                            200000
+
+#define HEADERS                             12
+
+static const int                            sessions[] = { 32, 64, 128, 256, 1024, 4096 };
+
+#define NUM_SESSIONS                        (sizeof(sessions) / sizeof(sessions[0]))
+
+static volatile size_t                      sink = 0;
+
+uint32_t am_hash(const void *k)
+{
+    const unsigned char                    *p = k;
+    uint32_t                                h = 2166136261U;
+
+    while (*p)
+        h = (h ^ *p++) * 16777619U;
+    return h;
+
+}
+
+static am_status_t set_header_in_request(am_request_t *r, const char *name, const char *value)
+{
+    sink += strlen(name) + (value != NULL ? strlen(value) : 0);
+    return 0; /* AM_SUCCESS */
+
+}
+
+static am_status_t add_header_in_response(am_request_t *r, const char *name, const char *value)
+{
+    sink += strlen(name);
+    return 0; /* AM_SUCCESS */
+
+}
+
+static double now_secs()
+{
+    struct timeval                          tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+
+}
+
+/* what set_attribute_headers makes for a session, recorded */
+static struct am_attr_render *render(am_request_t *r, const struct am_attr_render_key *key, const char *token)
+{
+    struct am_attr_render                  *set = am_attr_render_create(key, token);
+    int                                     i;
+
+    for (i = 0; set != NULL && i < HEADERS; i++)
+    {
+        char                               *name = am_request_asprintf(r, "X-User-Attribute-%d", i);
+        char                               *value = am_request_asprintf(r, "%s,value-%d,group-%d", token, i, i * 7);
+
+        if (name == NULL || value == NULL || am_attr_render_add(&set, AM_FALSE, name, value) != 0)
+        {
+            am_attr_render_delete(&set);
+            return NULL;
+        }
+    }
+    if (set != NULL)
+        am_attr_render_add(&set, AM_TRUE, am_request_asprintf(r, "am_uid=%s;Path=/;Max-Age=300;"
+            "Expires=Thu, 01 Jan 1970 00:00:00 GMT", token), NULL);
+    return set;
+
+}
+
+static void run(const char *table, int num_sessions)
+{
+    struct am_attr_render_key               key;
+    char                                  **tokens = calloc(num_sessions, sizeof(char *));
+    unsigned long                           hits = 0;
+    unsigned int                            seed = 1;
+    double                                  t0, dt;
+    int                                     i;
+
+    memset(&key, 0, sizeof(key));
+    key.entry_digest = 0x5eed5eed5eed5eedULL;
+    key.ts = 1;
+    key.entry = -1;
+    for (i = 0; i < num_sessions; i++)
+        asprintf(&tokens[i], "AQIC5wM2LY4Sfcz%08x.*AAJTSQACMDEAAlNLABM3NjA0ODkyNjg3NjI0OTIyMzM0*", i * 2654435761U);
+
+    t0 = now_secs();
+    for (i = 0; i < REQUESTS; i++)
+    {
+        const char                         *token = tokens[rand_r(&seed) % num_sessions];
+        struct am_attr_render              *set;
+        am_request_t                        r;
+
+        memset(&r, 0, sizeof(r));
+        r.am_set_header_in_request_f = set_header_in_request;
+        r.am_add_header_in_response_f = add_header_in_response;
+
+        set = am_attr_render_get(&r, &key, token);
+        if (set != NULL)
+        {
+            hits++;
+            am_attr_render_replay(&r, set);
+        }
+        else if ((set = render(&r, &key, token)) != NULL)
+        {
+            am_attr_render_replay(&r, set);
+            am_attr_render_put(&set);
+        }
+        am_request_arena_free(&r);
+    }
+    dt = now_secs() - t0;
+
+    printf("%-8s table, %5d sessions: %5.1lf%% hits, %10.1lf requests/sec\n", table, num_sessions,
+        100.0 * hits / REQUESTS, REQUESTS / dt);
+
+    am_attr_render_shutdown();
+    for (i = 0; i < num_sessions; i++)
+        free(tokens[i]);
+    free(tokens);
+
+}
+
+int main(int argc, char *argv[])
+{
+    int                                     i;
+
+    for (i = 0; i < NUM_SESSIONS; i++)
+    {
+        setenv("AM_ATTR_RENDER_SESSIONS", "64", 1);
+        run("64", sessions[i]);
+        unsetenv("AM_ATTR_RENDER_SESSIONS");
+        run("default", sessions[i]);
+    }
+
+    exit(0);
+
+}
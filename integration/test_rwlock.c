@@ -15,8 +15,11 @@
  */
 
 /**
- ** test utility for read-write lock using sysv semaphores
+ ** test utility and benchmark for the read-write lock
  **
+ ** by default, the read lock throughput on a single hot lock is measured for 1 to 512 reader processes (with a
+ ** writer updating the locked data), followed by a check that a lock held by a process that exits is recovered;
+ ** run with the argument "stress" for the original multi-threaded stress test
  **
  **/
 
@@ -25,8 +28,15 @@
 
 #include "rwlock.h"
 
+#include <sys/mman.h>
+#include <sys/wait.h>
+
 #define THREADS                             21
 
+#define MAX_READERS                         512
+
+#define BENCH_SECS                          1
+
 #define N_SEMS                              128
 
 #define MAX_DATA_LN                         4096
@@ -41,22 +51,48 @@ struct bucket
 
 };
 
+struct shared
+{
+    struct readlock                         locks[N_SEMS];
+    struct reader_registry                  registry;
+    struct bucket                           bucket;
+
+    volatile uint32_t                       stop;
+    volatile uint64_t                       reads;
+    volatile uint64_t                       writes;
+
+};
+
+struct shared                              *shared;
+
 struct readlock                            *locks;
 
-struct bucket                               bucket;
+struct bucket                              *bucket;
 
 
 static void initialise_locks()
 {
     int                                     i;
 
-    locks = malloc(N_SEMS * sizeof(struct readlock));
+    shared = mmap(NULL, sizeof(struct shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+
+    memset(shared, 0, sizeof(struct shared));
+
+    locks = shared->locks;
+    bucket = &shared->bucket;
 
     for (i = 0; i < N_SEMS; i++)
     {
         locks[i] = readlock_init;
     }
 
+    read_lock_registry(&shared->registry, locks);
+
 }
 
 void update_bucket(struct bucket *bucket)
@@ -107,7 +143,7 @@ void *multi_lock_thread(void *data)
         {
             if (read_lock(locks + l, pid))
             {
-                if (verify_bucket(&bucket) == 0)
+                if (verify_bucket(bucket) == 0)
                 {
                     printf("******** bucket not stable, lock counter -> %d\n", locks[l].readers);
                     return 0;
@@ -125,7 +161,7 @@ void *multi_lock_thread(void *data)
             {
                 if (read_try_unique(locks + l, 10))
                 {
-                    update_bucket(&bucket);
+                    update_bucket(bucket);
                     read_release_unique(locks + l);
 
                     updates++;
@@ -169,7 +205,7 @@ void *single_lock_thread(void *data)
         {
             if (read_lock(locks + l, pid))
             {
-                if (verify_bucket(&bucket) == 0)
+                if (verify_bucket(bucket) == 0)
                 {
                     printf("******** bucket not stable\n");
                 }
@@ -184,7 +220,7 @@ void *single_lock_thread(void *data)
         {
             if (read_block(locks + l, pid))
             {
-                update_bucket(&bucket);
+                update_bucket(bucket);
 
                 //usleep(1000);
 
@@ -200,7 +236,7 @@ void *single_lock_thread(void *data)
             {
                 if (read_try_unique(locks + l, 1))
                 {
-                    update_bucket(&bucket);
+                    update_bucket(bucket);
                     read_release_unique(locks + l);
 
                     updates++;
@@ -229,6 +265,264 @@ void *single_lock_thread(void *data)
 }
 
 
+static uint64_t now_usec()
+{
+    struct timeval                          tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+}
+
+static void reader_process()
+{
+    pid_t                                   pid = getpid();
+    uint64_t                                n = 0;
+    uint64_t                                sum = 0;
+
+    while (shared->stop == 0)
+    {
+        if (read_lock(locks, pid))
+        {
+            sum += bucket->checksum;
+            read_release(locks, pid);
+            n++;
+        }
+    }
+
+    __sync_fetch_and_add(&shared->reads, n);
+
+    exit(sum == 1);
+
+}
+
+static void writer_process()
+{
+    pid_t                                   pid = getpid();
+    uint64_t                                n = 0;
+
+    while (shared->stop == 0)
+    {
+        if (read_lock(locks, pid))
+        {
+            if (read_try_unique(locks, 10))
+            {
+                bucket->checksum++;
+                read_release_unique(locks);
+                n++;
+            }
+            read_release(locks, pid);
+        }
+        usleep(1000);
+    }
+
+    __sync_fetch_and_add(&shared->writes, n);
+
+    exit(0);
+
+}
+
+static void benchmark(int readers)
+{
+    pid_t                                   pids[MAX_READERS + 1];
+    int                                     i;
+    uint64_t                                t0;
+    double                                  dt;
+
+    shared->stop = 0;
+    shared->reads = shared->writes = 0;
+
+    fflush(stdout);
+
+    t0 = now_usec();
+
+    for (i = 0; i <= readers; i++)
+    {
+        if ((pids[i] = fork()) == 0)
+        {
+            if (i == readers)
+                writer_process();
+            else
+                reader_process();
+        }
+    }
+
+    sleep(BENCH_SECS);
+    shared->stop = 1;
+
+    for (i = 0; i <= readers; i++)
+    {
+        waitpid(pids[i], NULL, 0);
+    }
+
+    dt = (double)(now_usec() - t0) / 1000000.0;
+
+    printf("%3d readers: %10.0lf read locks/sec, %8.0lf per reader, %4llu writes, readers %d\n",
+        readers, shared->reads / dt, shared->reads / dt / readers, (unsigned long long)shared->writes, locks->readers);
+
+}
+
+/*
+ * a process that exits while holding a read lock must not block writers forever
+ *
+ */
+static void recovery()
+{
+    pid_t                                   pid;
+    uint64_t                                t0;
+
+    fflush(stdout);
+
+    if ((pid = fork()) == 0)
+    {
+        read_lock(locks, getpid());
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+
+    t0 = now_usec();
+
+    if (read_block(locks, getpid()) && read_unblock(locks, getpid()))
+    {
+        printf("recovered lock held by exited process %d in %llu usec, readers %d\n",
+            (int)pid, (unsigned long long)(now_usec() - t0), locks->readers);
+    }
+    else
+    {
+        printf("******** lock held by exited process %d not recovered\n", (int)pid);
+    }
+
+}
+
+/*
+ * a reader that can't be recorded in a full registry must still hold off writers
+ *
+ */
+static void untracked_reader()
+{
+    pid_t                                   pid;
+    int                                     i;
+
+    fflush(stdout);
+
+    for (i = 0; i < READER_PROCESSES; i++)
+    {
+        shared->registry.processes[i].pid = 1;                                         /* a live process in every slot */
+    }
+    shared->stop = 0;
+
+    if ((pid = fork()) == 0)
+    {
+        read_lock(locks, getpid());
+        shared->stop = 1;                                                              /* reading */
+        usleep(200000);
+        shared->stop = 2;                                                              /* done reading */
+        read_release(locks, getpid());
+        _exit(0);
+    }
+
+    while (shared->stop == 0)
+    {
+        usleep(1000);
+    }
+
+    if (read_block(locks, getpid()) && shared->stop == 2)
+    {
+        printf("untracked reader held off writer, untracked %u\n", shared->registry.untracked[0]);
+    }
+    else
+    {
+        printf("******** writer ran while untracked reader was reading\n");
+    }
+    read_unblock(locks, getpid());
+
+    waitpid(pid, NULL, 0);
+
+    for (i = 0; i < READER_PROCESSES; i++)
+    {
+        shared->registry.processes[i].pid = 0;
+    }
+    shared->stop = 0;
+
+}
+
+/*
+ * a process holding more read locks than it has hold records does not wait for a record, its readers still hold off
+ * writers, and they are discarded when it exits
+ *
+ */
+static void readers_beyond_records()
+{
+    struct readlock                        *lock = locks + READER_HOLDS;
+    pid_t                                   pid;
+    int                                     i;
+
+    fflush(stdout);
+
+    shared->stop = 0;
+
+    if ((pid = fork()) == 0)
+    {
+        for (i = 0; i <= READER_HOLDS; i++)
+        {
+            read_lock(locks + i, getpid());
+        }
+        shared->stop = 1;                                                              /* reading */
+        usleep(200000);
+        shared->stop = 2;                                                              /* done reading */
+        for (i = 0; i <= READER_HOLDS; i++)
+        {
+            read_release(locks + i, getpid());
+        }
+        _exit(0);
+    }
+
+    while (shared->stop == 0)
+    {
+        usleep(1000);
+    }
+
+    if (read_block(lock, getpid()) && shared->stop == 2)
+    {
+        printf("reader beyond the hold records held off writer\n");
+    }
+    else
+    {
+        printf("******** writer ran while a reader beyond the hold records was reading\n");
+    }
+    read_unblock(lock, getpid());
+
+    waitpid(pid, NULL, 0);
+
+    shared->stop = 0;
+
+    if ((pid = fork()) == 0)
+    {
+        for (i = 0; i <= READER_HOLDS; i++)
+        {
+            read_lock(locks + i, getpid());
+        }
+        _exit(0);                                                                      /* exits holding the locks */
+    }
+    waitpid(pid, NULL, 0);
+
+    if (read_block(lock, getpid()) && read_unblock(lock, getpid()))
+    {
+        printf("recovered lock held beyond the hold records by exited process %d\n", (int)pid);
+    }
+    else
+    {
+        printf("******** lock held beyond the hold records by exited process %d not recovered\n", (int)pid);
+    }
+
+    for (i = 0; i < READER_HOLDS; i++)
+    {
+        read_block(locks + i, getpid());                                               /* recover the others too */
+        read_unblock(locks + i, getpid());
+    }
+
+}
+
 int main(int argc, char *argv[])
 {
     am_thread_t                             threads[THREADS];
@@ -240,7 +534,23 @@ int main(int argc, char *argv[])
 
     initialise_locks();
 
-    update_bucket(&bucket);
+    update_bucket(bucket);
+
+    if (argc < 2 || strcmp(argv[1], "stress"))
+    {
+        for (i = 1; i <= MAX_READERS; i *= 2)
+        {
+            benchmark(i);
+        }
+
+        recovery();
+
+        untracked_reader();
+
+        readers_beyond_records();
+
+        exit(0);
+    }
 
     t0 = clock();
     
@@ -262,4 +572,3 @@ int main(int argc, char *argv[])
     exit(0);
 
 }
-
@@ -0,0 +1,199 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2016 ForgeRock AS.
+ */
+
+/**
+ ** shared memory page settings benchmark
+ **
+ ** the agent cache is initialised, filled, and then looked up and swept (garbage collection and expiry scan)
+ ** with each combination of huge pages (AM_SHARED_HUGE_PAGES) and pre-faulting (AM_SHARED_PREFAULT); each
+ ** run is made in a fresh process so that the options are read and the segments mapped afresh
+ **
+ ** the cache size is AM_MAX_SESSION_CACHE_SIZE, if set, or 256MB; the number of huge pages actually mapped
+ ** is taken from /proc/self/smaps_rollup where it is available
+ **
+ **/
+
+#include "platform.h"
+#include "thread.h"
+
+#include <sys/wait.h>
+
+#include "alloc.h"
+#include "agent_cache.h"
+
+#define ENTRIES                             200000
+
+#define LOOKUPS                             2000000
+
+#define SWEEPS                              4
+
+#define DATA_SZ                             256
+
+#ifndef offsetof
+#define offsetof(type, field)               ( (char *)(&((type *)0)->field) - (char *)0 )
+#endif
+
+struct entry
+{
+    uint32_t                                key;
+    uint8_t                                 data[DATA_SZ];
+
+};
+
+/* thread.c uses am_free (utility.c) which is not linked in here */
+void am_free(void *ptr)
+{
+    free(ptr);
+}
+
+/* agent_cache.c uses am_random_bytes (utility.c) which is not linked in here */
+int am_random_bytes(void *buf, size_t buflen)
+{
+    unsigned char                          *p = buf;
+    size_t                                  i;
+
+    for (i = 0; i < buflen; i++) {
+        p[i] = (unsigned char) rand();
+    }
+    return 0;                                                                         /* AM_SUCCESS */
+}
+
+static double now_secs()
+{
+    struct timeval                          tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+
+}
+
+static int entry_identity(void *a, void *b)
+{
+    return ((struct entry *)a)->key == ((struct entry *)b)->key;
+
+}
+
+static unsigned long huge_pages_mapped()
+{
+    FILE                                   *f = fopen("/proc/self/smaps_rollup", "r");
+    char                                    line[256];
+    unsigned long                           kb = 0, v;
+
+    if (f == NULL)
+        return 0;
+
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "ShmemPmdMapped: %lu kB", &v) == 1 || sscanf(line, "Shared_Hugetlb: %lu kB", &v) == 1)
+            kb += v;
+    }
+    fclose(f);
+
+    return kb / 2048;
+
+}
+
+static void run(const char *huge_pages, const char *prefault)
+{
+    struct entry                            e;
+    void                                   *ptr;
+    uint32_t                                ln;
+
+    int                                     i, found = 0, added = 0;
+    double                                  t0, t_init, t_fill, t_lookup, t_sweep;
+
+    setenv("AM_SHARED_HUGE_PAGES", huge_pages, 1);
+    setenv("AM_SHARED_PREFAULT", prefault, 1);
+
+    cache_cleanup(0);
+
+    t0 = now_secs();
+    if (cache_initialise(0))
+    {
+        printf("unable to initialise cache\n");
+        return;
+    }
+    t_init = now_secs() - t0;
+
+    memset(&e, 0x5a, sizeof(e));
+
+    t0 = now_secs();
+    for (i = 0; i < ENTRIES; i++)
+    {
+        e.key = i;
+        if (cache_add(i, &e, sizeof(e), time(0) + 3600, entry_identity) == 0)
+            added++;
+    }
+    t_fill = now_secs() - t0;
+
+    t0 = now_secs();
+    for (i = 0; i < LOOKUPS; i++)
+    {
+        e.key = (uint32_t)rand() % ENTRIES;
+        if (cache_get_readlocked_ptr(e.key, &ptr, &ln, &e, time(0), entry_identity) == 0)
+        {
+            found++;
+            cache_release_readlocked_ptr(e.key);
+        }
+    }
+    t_lookup = now_secs() - t0;
+
+    t0 = now_secs();
+    for (i = 0; i < SWEEPS; i++)
+    {
+        cache_garbage_collect();
+        cache_purge_expired_entries(getpid());
+    }
+    t_sweep = (now_secs() - t0) / SWEEPS;
+
+    printf("huge pages %-7s prefault %-3s: init %7.3lf secs, fill %7.3lf secs (%d added), lookups %9.0lf/sec (%d found), "
+           "sweep %7.3lf secs, huge pages mapped %lu\n", huge_pages, prefault, t_init, t_fill, added,
+           LOOKUPS / t_lookup, found, t_sweep, huge_pages_mapped());
+
+    cache_shutdown(1);
+
+}
+
+int main(int argc, char *argv[])
+{
+    static const char                      *settings[][2] = {
+        { "off", "off" }, { "off", "on" }, { "thp", "off" }, { "thp", "on" }, { "hugetlb", "on" }
+    };
+
+    pid_t                                   pid;
+    int                                     i, status;
+
+    setenv("AM_MAX_SESSION_CACHE_SIZE", "0x10000000", 0);
+
+    for (i = 0; i < sizeof(settings) / sizeof(settings[0]); i++)
+    {
+        fflush(stdout);
+
+        if ((pid = fork()) == 0)
+        {
+            run(settings[i][0], settings[i][1]);
+            fflush(stdout);
+            _exit(0);
+        }
+        waitpid(pid, &status, 0);
+
+        if (! WIFEXITED(status) || WEXITSTATUS(status))
+            printf("huge pages %s prefault %s: run failed (status %d)\n", settings[i][0], settings[i][1], status);
+    }
+
+    exit(0);
+
+}
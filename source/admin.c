@@ -522,6 +522,7 @@ static int create_agent_instance(int status,
                 install_log("failed to parse_url %s, %s", agent_url, am_strerror(rv));
                 break;
             }
+            url_free(&u); /* only the host value is used */
 
             install_log("updating %s with %s", AM_INSTALL_AGENT_FQDN, u.host);
             rv = string_replace(&agent_conf_template, AM_INSTALL_AGENT_FQDN, u.host, &agent_conf_template_sz);
@@ -1611,7 +1612,7 @@ static void install_interactive(int argc, char **argv) {
          * Get the URL of OpenAM and try to verify it.
          */
         do {
-            int httpcode = 0;
+            int httpcode = 0, url_status;
             struct url parsed_url;
             
             if (!upgrade && ISVALID(openam_url)) {
@@ -1641,7 +1642,9 @@ static void install_interactive(int argc, char **argv) {
             
             /* ensure that the OpenAM URL is syntactically valid */
             /* should be able to connect to OpenAM server during installation */
-            if (parse_url(openam_url, &parsed_url) == AM_ERROR) {
+            url_status = parse_url(openam_url, &parsed_url);
+            url_free(&parsed_url);
+            if (url_status == AM_ERROR) {
                 fprintf(stdout, "That OpenAM URL (%s) doesn't appear to be valid\n", openam_url);
                 install_log("parse_url fails the OpenAM URL \"%s\"", openam_url);
             } else if (am_url_validate(0, openam_url, &net_options, &httpcode) == AM_SUCCESS && httpcode != 0) {
@@ -1674,7 +1677,7 @@ static void install_interactive(int argc, char **argv) {
          */
         do {
             struct url parsed_url;
-            int httpcode = 0;
+            int httpcode = 0, url_status;
             
             if (!upgrade && ISVALID(agent_url)) {
                 if (!get_confirmation("\nAgent URL: %s\n", agent_url)) {
@@ -1697,7 +1700,9 @@ static void install_interactive(int argc, char **argv) {
             }
             
             /* ensure the URL is syntactically valid */
-            if (parse_url(agent_url, &parsed_url) == AM_ERROR) {
+            url_status = parse_url(agent_url, &parsed_url);
+            url_free(&parsed_url);
+            if (url_status == AM_ERROR) {
                 fprintf(stdout, "That Agent URL (%s) doesn't appear to be valid\n", agent_url);
                 install_log("parse_url fails the Agent URL \"%s\"", agent_url);
                 RESET_INPUT_STRING(agent_url);
@@ -44,6 +44,8 @@
 #define STATFILE                            "stats"
 #define LOCKFILE                            "lockfile"
 #define HASHFILE                            "hashtable"
+#define EXPIRYFILE                          "expiry"
+#define READERFILE                          "readers"
 
 #define N_LOCKS                             4096
 
@@ -53,10 +55,18 @@
 
 #define GC_MARKER                           0xa4420810u
 
+#define EXPIRY_SLOTS                        64                                        /* expiry index covers EXPIRY_SLOTS * EXPIRY_RESOLUTION secs */
+
+#define EXPIRY_RESOLUTION                   4                                         /* seconds */
+
+#define EXPIRY_WORDS                        ((HASH_SZ + 31) / 32)
+
 #if defined _WIN32
 
 #define incr(p)                             InterlockedIncrement(p)
 #define reset(p)                            InterlockedExchange(p, 0)
+#define swap(p, v)                          InterlockedExchange(p, v)
+#define set_bits(p, v)                      InterlockedOr((volatile LONG *)(p), v)
 
 #define casv(p, old, new)                   InterlockedCompareExchange(p, new, old)
 #define cas(p, old, new)                    (casv(p, old, new) == (old))
@@ -67,6 +77,8 @@
 #include <sys/atomic.h>
 #define incr(p)                             atomic_add_32_nv(p, 1)
 #define reset(p)                            atomic_swap_32(p, 0)
+#define swap(p, v)                          atomic_swap_32(p, v)
+#define set_bits(p, v)                      atomic_or_32(p, v)
 
 #define casv(p, old, new)                   atomic_cas_32(p, old, new)
 #define cas(p, old, new)                    (atomic_cas_32(p, old, new) == (old))
@@ -76,6 +88,8 @@
 
 #define incr(p)                             __sync_fetch_and_add(p, 1)
 #define reset(p)                            __sync_fetch_and_and(p, 0)
+#define swap(p, v)                          __sync_lock_test_and_set(p, v)
+#define set_bits(p, v)                      __sync_fetch_and_or(p, v)
 
 #define casv(p, old, new)                   __sync_val_compare_and_swap(p, old, new)
 #define cas(p, old, new)                    __sync_bool_compare_and_swap(p, old, new)
@@ -135,12 +149,30 @@ struct stats {
 
     int64_t                                 basetime;
 
+    uint64_t                                key_seed[2];                              /* cache key digest key, random per cache */
+
+    int32_t                                 key_status;                               /* AM_SUCCESS once key_seed is random */
+
     union cache_stat                        reads, updates, writes, failures, deletes, expires, lru;
 
     struct cache_gc_stat                    cache, data;
 
 };
 
+/*
+ * expiry index: for each EXPIRY_RESOLUTION seconds time slot, a bitmap of hash table collision lists that have entries
+ * expiring in that slot; the gc takes whole slots as they become due, so that only collision lists with expired entries
+ * are visited
+ *
+ */
+struct expiry_index {
+
+    volatile uint32_t                       due;                                      /* next slot to be purged */
+
+    volatile uint32_t                       map[EXPIRY_SLOTS][EXPIRY_WORDS];
+
+};
+
 static const size_t                         user_hdr_sz = offsetof(struct user_entry, data);
 
 static struct stats                        *stats = 0;
@@ -149,7 +181,11 @@ static struct readlock                     *locks = 0;
 
 static offset                              *hashtable = 0;
 
-static am_shm_t                            *stats_pool = 0, *locks_pool = 0, *hashtable_pool = 0;
+static struct expiry_index                 *expiry = 0;
+
+static struct reader_registry              *readers = 0;
+
+static am_shm_t                            *stats_pool = 0, *locks_pool = 0, *hashtable_pool = 0, *expiry_pool = 0, *readers_pool = 0;
 
 
 #define lock_for_hash(h)                    (locks + ((h) & (N_LOCKS - 1)))
@@ -164,6 +200,10 @@ static void reset_stats(void *cbdata, void *p) {
     memset(stats, 0, sizeof(struct stats));
 
     stats->basetime = time(0);
+    stats->key_status = am_random_bytes(stats->key_seed, sizeof (stats->key_seed));
+    if (stats->key_status != AM_SUCCESS) {
+        AM_LOG_ERROR(0, "%s failed to read a random cache key", thisfunc);
+    }
     
     AM_LOG_DEBUG(0, "%s cache stats reset", thisfunc);
 }
@@ -183,6 +223,31 @@ static void reset_hashtable(void *cbdata, void *p) {
     AM_LOG_DEBUG(0, "%s cache hashtable reset", thisfunc);
 }
 
+static void reset_expiry(void *cbdata, void *p) {
+
+    static const char                      *thisfunc = "reset_expiry():";
+
+    struct expiry_index                    *index = p;
+
+    memset(index, 0, sizeof(struct expiry_index));
+
+    if (stats) {
+        index->due = (time(0) - stats->basetime) / EXPIRY_RESOLUTION;
+    }
+
+    AM_LOG_DEBUG(0, "%s cache expiry index reset", thisfunc);
+}
+
+static void reset_readers(void *cbdata, void *p) {
+
+    static const char                      *thisfunc = "reset_readers():";
+
+    memset(p, 0, sizeof(struct reader_registry));
+
+    AM_LOG_DEBUG(0, "%s cache reader registry reset", thisfunc);
+
+}
+
 static void reset_locks(void *cbdata, void *p) {
 
     static const char                      *thisfunc = "reset_locks():";
@@ -252,17 +317,26 @@ uint32_t cache_memory_size() {
 }
 
 int cache_initialise(int id) {
+    static const char *thisfunc = "cache_initialise():";
     int rv;
     uint32_t sz = cache_memory_size();
 
     rv = agent_memory_initialise(sz, id);
     if (rv != AM_SUCCESS)
         return rv;
+    agent_memory_fixed_size(sizeof (struct cache_entry));                            /* cache entries get their own slab class */
 
     rv = get_memory_segment(&stats_pool, STATFILE, sizeof (struct stats), reset_stats, NULL, id);
     if (rv != AM_SUCCESS)
         return rv;
     stats = stats_pool->base_ptr;
+    if (stats->key_status != AM_SUCCESS) {
+        /* cache keys would be digests under a known key (see cache_key_seed); drop the segment so that it is set up again */
+        AM_LOG_ERROR(0, "%s cache has no random key, not using it", thisfunc);
+        stats = NULL;
+        remove_memory_segment(&stats_pool, AM_TRUE);
+        return AM_ERROR;
+    }
 
     rv = get_memory_segment(&locks_pool, LOCKFILE, sizeof (struct readlock) * N_LOCKS, reset_locks, NULL, id);
     if (rv != AM_SUCCESS)
@@ -274,9 +348,37 @@ int cache_initialise(int id) {
         return rv;
     hashtable = hashtable_pool->base_ptr;
 
+    rv = get_memory_segment(&expiry_pool, EXPIRYFILE, sizeof (struct expiry_index), reset_expiry, NULL, id);
+    if (rv != AM_SUCCESS)
+        return rv;
+    expiry = expiry_pool->base_ptr;
+
+    rv = get_memory_segment(&readers_pool, READERFILE, sizeof (struct reader_registry), reset_readers, NULL, id);
+    if (rv != AM_SUCCESS)
+        return rv;
+    readers = readers_pool->base_ptr;
+
+    read_lock_registry(readers, locks);
+
     return AM_SUCCESS;
 }
 
+/*
+ * key for cache key digests: it is created with the cache, so that digests of a deployment can not be predicted from outside
+ * and do not outlive its cache entries
+ *
+ */
+void cache_key_seed(uint64_t seed[2]) {
+
+    if (stats == NULL) {
+        seed[0] = seed[1] = 0;
+    } else {
+        seed[0] = stats->key_seed[0];
+        seed[1] = stats->key_seed[1];
+    }
+
+}
+
 int is_agent_cache_ready() {
     static const char *thisfunc = "is_agent_cache_ready():";
     if (stats == NULL) {
@@ -291,6 +393,14 @@ int is_agent_cache_ready() {
         AM_LOG_WARNING(0, "%s shared memory '%s' is not ready", thisfunc, HASHFILE);
         return AM_ERROR;
     }
+    if (expiry == NULL) {
+        AM_LOG_WARNING(0, "%s shared memory '%s' is not ready", thisfunc, EXPIRYFILE);
+        return AM_ERROR;
+    }
+    if (readers == NULL) {
+        AM_LOG_WARNING(0, "%s shared memory '%s' is not ready", thisfunc, READERFILE);
+        return AM_ERROR;
+    }
     return AM_SUCCESS;
 }
 
@@ -302,12 +412,18 @@ void cache_reinitialise() {
 
 int cache_shutdown(int destroy) {
 
+    read_lock_registry(NULL, NULL);
+
     remove_memory_segment(&stats_pool, destroy);
 
     remove_memory_segment(&locks_pool, destroy);
 
     remove_memory_segment(&hashtable_pool, destroy);
 
+    remove_memory_segment(&expiry_pool, destroy);
+
+    remove_memory_segment(&readers_pool, destroy);
+
     agent_memory_shutdown(destroy);
 
     return 0;
@@ -327,6 +443,12 @@ int cache_cleanup(int id) {
     if (delete_memory_segment(HASHFILE, id))
         errors++;
 
+    if (delete_memory_segment(EXPIRYFILE, id))
+        errors++;
+
+    if (delete_memory_segment(READERFILE, id))
+        errors++;
+
     if (agent_memory_cleanup(id))
         errors++;
 
@@ -379,6 +501,21 @@ void cache_readlock_total_barrier(pid_t pid) {
     }
 }
 
+/*
+ * as above, for a 1/slices part of the locks at a time
+ *
+ */
+void cache_readlock_barrier_slice(pid_t pid, int slices) {
+    static int slice = 0;
+    int i;
+    if (locks == NULL || slices <= 0)
+        return;
+    slice = (slice + 1) % slices;
+    for (i = slice * N_LOCKS / slices; i < (slice + 1) * N_LOCKS / slices; i++) {
+        wait_for_barrier(locks + i, pid);
+    }
+}
+
 int cache_readlock_block_all(pid_t pid) {
 
     int                                     i;
@@ -561,6 +698,149 @@ void cache_purge_expired_entries(pid_t pid) {
     }
 }
 
+/*
+ * record in the expiry index that collision list for hash has an entry expiring at (relative) time t; entries beyond
+ * the index range are recorded in its last slot and re-indexed when that slot is purged
+ *
+ */
+static void expiry_index_add(uint32_t hash, uint32_t t) {
+
+    uint32_t                                due, slot = t / EXPIRY_RESOLUTION;
+
+    if (expiry == NULL)
+        return;
+
+    due = expiry->due;
+
+    if ((int32_t)(slot - due) < 0) {
+        slot = due;
+    } else if (slot - due >= EXPIRY_SLOTS) {
+        slot = due + EXPIRY_SLOTS - 1;
+    }
+
+    set_bits(&expiry->map[slot % EXPIRY_SLOTS][hash / 32], 1u << (hash % 32));
+
+}
+
+/*
+ * remove expired entries from a collision list, re-indexing entries that are still live
+ *
+ */
+static int purge_due_entries(pid_t pid, uint32_t hash, struct cache_entry *e, uint32_t t) {
+
+    int                                     i, n = 0;
+
+    for (i = 0; i < BUCKET_SZ; i++) {
+        offset                              ofs = e->bucket[i];
+
+        if (~ ofs) {
+            uint32_t                        ex = e->expires[i];
+
+            if (ex < t) {
+                unlink_entry(pid, hash, e, i, ofs);
+                n++;
+incr(&stats->expires.v);
+            } else {
+                expiry_index_add(hash, ex);
+            }
+        }
+    }
+    return n;
+
+}
+
+/*
+ * remove cache entries that are due to expire, visiting only the collision lists recorded in the expiry index, and
+ * at most budget of them per call; the index is shared, so each due slot is taken by one process only
+ *
+ */
+void cache_purge_due_entries(pid_t pid, int budget) {
+    static const char *thisfunc = "cache_purge_due_entries():";
+    uint32_t now, due, t, bits;
+    int n = 0, w, b, visited = 0;
+    offset ofs;
+
+    if (hashtable == NULL || expiry == NULL)
+        return;
+
+    t = relative_time(time(0));
+    now = t / EXPIRY_RESOLUTION;
+
+    while (visited < budget) {
+        due = expiry->due;
+        if ((int32_t) (now - due) <= 0) {
+            break;                                                                    /* slot for current time is not complete */
+        }
+        if (cas(&expiry->due, due, due + 1) == 0) {
+            continue;                                                                 /* taken by someone else */
+        }
+
+        for (w = 0; w < EXPIRY_WORDS; w++) {
+            volatile uint32_t              *word = &expiry->map[due % EXPIRY_SLOTS][w];
+
+            if (*word == 0)
+                continue;
+
+            if (visited >= budget) {
+                set_bits(&expiry->map[(due + 1) % EXPIRY_SLOTS][w], swap(word, 0));  /* out of budget: leave it to the next slot */
+                continue;
+            }
+
+            bits = swap(word, 0);
+            for (b = 0; bits; b++, bits >>= 1) {
+                uint32_t                    hash = w * 32 + b;
+
+                if ((bits & 1) == 0)
+                    continue;
+
+                if (cache_readlock_p(hash, pid)) {
+                    if (~(ofs = hashtable[hash])) {
+                        n += purge_due_entries(pid, hash, agent_memory_ptr(ofs), t);
+                    }
+                    cache_readlock_release_p(hash, pid);
+                }
+                visited++;
+            }
+        }
+    }
+
+    if (n) {
+        AM_LOG_DEBUG(0, "%s expired cache entries unlinked: %d (%d lists visited)", thisfunc, n, visited);
+    }
+}
+
+/*
+ * age (and purge expired and least recently used entries from) a 1/slices part of the hash table; successive calls
+ * move on through the table, so that it is fully covered in slices calls
+ *
+ */
+void cache_purge_expired_entries_slice(pid_t pid, int slices) {
+    static const char *thisfunc = "cache_purge_expired_entries_slice():";
+    static int slice = 0;
+    int n = 0, i, first, last;
+    offset ofs;
+
+    if (hashtable == NULL || slices <= 0)
+        return;
+
+    slice = (slice + 1) % slices;
+    first = slice * HASH_SZ / slices;
+    last = (slice + 1) * HASH_SZ / slices;
+
+    for (i = first; i < last; i++) {
+        if (~ hashtable[i] && cache_readlock_p(i, pid)) {
+            if (~(ofs = hashtable[i])) {
+                n += purge_expired_entries(pid, i, agent_memory_ptr(ofs), time(0));
+            }
+            cache_readlock_release_p(i, pid);
+        }
+    }
+
+    if (n) {
+        AM_LOG_DEBUG(0, "%s expired cache entries unlinked: %d", thisfunc, n);
+    }
+}
+
 /*
  * replace any existing entry, then purge subsequent entries; if existing entry was found, link newentry to the
  * head of the hash table collision list (so that it will override) and the purge subsequent entries (which might have
@@ -669,6 +949,8 @@ incr(&stats->updates.v);
             ex = e->expires[i];
         }
 
+        expiry_index_add(hash, t);
+
         uint32_t                            cycles = e->cycles[i];
         
         while (cas(e->cycles + i, cycles, 0x80000000) == 0) {
@@ -686,6 +968,58 @@ incr(&stats->updates.v);
 
 }
 
+/*
+ * make an entry live at least until expires (it is left as it is when it lives longer), returns 0 when the entry was found
+ *
+ */
+int cache_extend(uint32_t h, void *data, int64_t expires, int (*identity)(void *, void *)) {
+
+    pid_t                                   pid = getpid();
+
+    uint32_t                                hash = h % HASH_SZ;
+
+    uint32_t                                t = relative_time(expires);
+
+    offset                                  ofs;
+
+    int                                     i = BUCKET_SZ;
+
+    agent_memory_validate(pid);
+
+    if (cache_readlock_p(hash, pid) == 0) {
+        return 1;
+    }
+
+    ofs = hashtable[hash];
+
+    if (~ ofs) {
+        struct cache_entry                 *e = agent_memory_ptr(ofs);
+
+        for (i = 0; i < BUCKET_SZ; i++) {
+            offset                          u = e->bucket[i];
+
+            if (~ u && identity(data, ((struct user_entry *)agent_memory_ptr(u))->data)) {
+                uint32_t                    ex = e->expires[i];
+
+                while (ex < t) {
+                    if (cas(e->expires + i, ex, t)) {
+                        expiry_index_add(hash, t);
+                        break;
+                    }
+                    ex = e->expires[i];
+                }
+incr(&stats->updates.v);
+                break;
+            }
+        }
+    }
+
+    cache_readlock_release_p(hash, pid);
+
+    return i == BUCKET_SZ;
+
+}
+
 /*
  * remove anything that matches from the collsion list
  *
@@ -879,6 +1213,45 @@ void cache_garbage_collect() {
 
 }
 
+void cache_garbage_collect_slice(int slices) {
+
+    static int                              slice = 0;
+
+    int                                     clusters = agent_memory_clusters();
+
+    if (slices <= 0)
+        return;
+
+    slice = (slice + 1) % slices;
+
+    agent_memory_scan_clusters(getpid(), slice * clusters / slices, (slice + 1) * clusters / slices, cache_garbage_checker, 0);
+
+}
+
+/*
+ * compact memory clusters within a time budget, reporting any allocations that failed since the last call
+ *
+ */
+void cache_defragment(uint32_t budget_usec) {
+
+    static const char                      *thisfunc = "cache_defragment():";
+
+    static uint64_t                         failures = 0;
+
+    struct agent_memory_metrics             metrics;
+
+    agent_memory_defragment(getpid(), budget_usec);
+
+    agent_memory_metrics(&metrics);
+
+    if (failures < metrics.failures) {
+        AM_LOG_WARNING(0, "%s %"PR_L64" cluster allocations failed (%"PR_L64" inline compactions), free %"PR_L64", largest free block %u",
+                thisfunc, (int64_t)(metrics.failures - failures), (int64_t)metrics.compactions, (int64_t)metrics.free_bytes, metrics.largest_free);
+    }
+    failures = metrics.failures;
+
+}
+
 static uint32_t get_and_reset(volatile uint32_t *p) {
 
     return reset(p);
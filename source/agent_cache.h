@@ -24,20 +24,30 @@ int cache_cleanup(int id);
 int is_agent_cache_ready();
 int is_agent_memory_ready();
 
+void cache_key_seed(uint64_t seed[2]);
+
 int cache_add(uint32_t hash, void *data, size_t ln, int64_t expires, int (*identity)(void *, void *));
 
+int cache_extend(uint32_t hash, void *data, int64_t expires, int (*identity)(void *, void *));
+
 void cache_delete(uint32_t hash, void *data, int (*identity)(void *, void *));
 
 int cache_get_readlocked_ptr(uint32_t hash, void **addr, uint32_t *ln, void *data, int64_t now, int (*identity)(void *, void *));
 void cache_release_readlocked_ptr(uint32_t hash);
 
 void cache_purge_expired_entries(pid_t pid);
+void cache_purge_expired_entries_slice(pid_t pid, int slices);
+void cache_purge_due_entries(pid_t pid, int budget);
 
 void cache_garbage_collect();
+void cache_garbage_collect_slice(int slices);
+
+void cache_defragment(uint32_t budget_usec);
 
 void cache_stats();
 
 void cache_readlock_total_barrier(pid_t pid);
+void cache_readlock_barrier_slice(pid_t pid, int slices);
 
 int cache_check_entries(pid_t pid);
 
@@ -31,6 +31,15 @@
  * This is faster than the OS X allocator (magazine_malloc) for small allocations (< 4K). Problems with
  * larger allocations are addressed by separate free lists for different block sizes.
  *
+ * Small blocks (up to 2K, in geometric size classes) and blocks of one fixed size (the cache entry) are allocated
+ * from slabs: runs of same-sized blocks carved out of the free lists, which are kept in per-class free lists when
+ * freed, so that allocation and free are O(1) and do not coalesce. Slab blocks are only returned to the general
+ * free lists when a cluster is compacted.
+ *
+ * Each process keeps a magazine of free slab blocks per size class, which is refilled from (and drained back to) the
+ * cluster slab lists a batch at a time, so most slab allocations and frees do not take a cluster lock. Blocks in a
+ * magazine are marked with the owning pid, so that those of a dead process can be reclaimed.
+ *
  * Note: this uses the idiom ~value and ~0 to test and set 0xffffffffu.
  *
  */
@@ -42,6 +51,7 @@
 
 #include "alloc.h"
 #include "share.h"
+#include "thread.h"
 
 #ifndef offsetof
 #define offsetof(type, field)               ( (char *)(&((type *)0)->field) - (char *)0 )
@@ -78,6 +88,22 @@
 #define MIN_SPLIT_BLOCKSIZE                 24
 #define VALIDATION_LOCK                     -1
 
+#define SLAB_CLASSES                        16                                        /* geometric size classes, and a fixed size class */
+#define SLAB_FIXED                          (SLAB_CLASSES - 1)
+#define SLAB_MAX_SIZE                       2048
+#define SLAB_RUN_SIZE                       16384                                     /* max bytes carved for a slab class at a time */
+#define SLAB_RUN_SHIFT                      8                                         /* and at most 1/256 of a cluster */
+#define SLAB_RUN_MAX                        32                                        /* blocks carved for a slab class at a time */
+#define FREELISTS                           (CLUSTER_FREELISTS + SLAB_CLASSES)
+#define SLAB_LIST(c)                        (CLUSTER_FREELISTS + (c))
+
+#define SLAB_FREE                           -2                                        /* lock value of free blocks in a slab class free list */
+#define SLAB_MAGAZINE                       -3                                        /* lock value of free blocks in a process magazine */
+
+#define MAGAZINE_SIZE                       32                                        /* max free blocks per process magazine */
+#define MAGAZINE_BATCH                      16                                        /* max blocks moved to/from a cluster at a time */
+#define MAGAZINE_BATCH_SIZE                 4096                                      /* and at most this many bytes (or 1 block) */
+
 
 #define HDR(ofs)                            ( (block_header_t *)( ((char *)cluster_base) + (ofs) ) )
 #define OFS(ptr)                            ( (offset) ( ( (char *)(ptr) ) - ( (char *)(cluster_base) ) ) )
@@ -111,6 +137,7 @@ typedef struct {
     align_win(64) volatile uint32_t seed align_attr(64);
     align_win(64) volatile int32_t error align_attr(64);
     align_win(64) volatile pid_t checker align_attr(64);
+    align_win(64) volatile uint32_t generation align_attr(64);
 } ctl_header_t;
 
 
@@ -137,7 +164,15 @@ typedef struct {
 
     align_win(256)  spinlock                lock align_attr(256);
     
-    volatile offset                         free[CLUSTER_FREELISTS];
+    volatile offset                         lists[FREELISTS];                         /* free lists by size, then slab class free lists */
+
+    volatile uint32_t                       length[FREELISTS];                        /* metrics: blocks in each list */
+
+    volatile uint32_t                       free_bytes, slab_bytes;                   /* bytes in free lists, and in slab class free lists */
+
+    volatile uint32_t                       largest_free, largest_count;              /* largest block in the free lists, and how many blocks have that size (0: stale) */
+
+    volatile uint32_t                       compactions, failures, defrags;          /* inline compactions, allocation failures, background passes */
      
 } cluster_header_t;
 
@@ -151,10 +186,36 @@ static am_shm_t                            *ctlblock_pool = 0, *cluster_hdrs_poo
 
 #define cluster_lock(c)                     cluster_hdrs[c].lock
 
-#define cluster_free_lists(c)               cluster_hdrs[c].free
+#define cluster_header(c)                   (cluster_hdrs + (c))
 
 static const size_t                         block_data_offset = offsetof(block_header_t, u.data);
 
+static const uint32_t                       slab_sizes[SLAB_FIXED] = { 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048 };
+
+static uint8_t                              slab_class_index[SLAB_MAX_SIZE / 8 + 1];
+
+static uint32_t                             slab_fixed_size = 0;
+
+/*
+ * per-process magazine of free blocks in a slab class: this is process memory, the blocks are in the clusters
+ *
+ */
+struct magazine {
+
+    volatile int32_t                        lock;
+
+    pid_t                                   pid;                                      /* owner: the magazine is emptied after fork */
+    uint32_t                                generation;                               /* and after the clusters are reset */
+
+    uint32_t                                n;
+    offset                                  blocks[MAGAZINE_SIZE];
+
+};
+
+static struct magazine                      magazines[SLAB_CLASSES];
+
+static void magazines_drain(pid_t pid);
+
 
 extern int master_recovery_process(pid_t pid);
 
@@ -277,6 +338,12 @@ void agent_memory_validate(pid_t pid) {
 
 }
 
+int agent_memory_clusters() {
+
+    return ctlblock ? ctlblock->number_of_clusters : 0;
+
+}
+
 /*
  * get new seed for memory operations, distributing operations to clusters on round-robin basis
  *
@@ -297,6 +364,71 @@ static uint32_t free_list_offset_for_size(uint32_t size) {
     
 }
 
+/*
+ * size class lookup table, so that the slab class for a block size is found in O(1)
+ *
+ */
+static void slab_classes_init() {
+
+    int                                     c = 0;
+
+    for (uint32_t i = 0; i <= SLAB_MAX_SIZE / 8; i++) {
+        while (slab_sizes[c] < i * 8)
+            c++;
+        slab_class_index[i] = c;
+    }
+
+}
+
+/*
+ * slab class for an allocation of the required (8 byte aligned) block size, or -1 if it is allocated from the free lists
+ *
+ */
+static int slab_class_for_size(uint32_t required) {
+
+    if (required == slab_fixed_size)
+        return SLAB_FIXED;
+
+    if (required <= SLAB_MAX_SIZE)
+        return slab_class_index[required >> 3];
+
+    return -1;
+
+}
+
+/*
+ * slab class of an allocated block, or -1 if it was not allocated from a slab
+ *
+ */
+static int slab_class_for_block(uint32_t size) {
+
+    if (size == slab_fixed_size)
+        return SLAB_FIXED;
+
+    if (size <= SLAB_MAX_SIZE && slab_sizes[slab_class_index[size >> 3]] == size)
+        return slab_class_index[size >> 3];
+
+    return -1;
+
+}
+
+static uint32_t slab_size(int c) {
+
+    return c == SLAB_FIXED ? slab_fixed_size : slab_sizes[c];
+
+}
+
+/*
+ * register the fixed size slab class (for blocks of the size most commonly allocated); this is per-process, and it should
+ * be the same in all processes
+ *
+ */
+void agent_memory_fixed_size(uint32_t size) {
+
+    slab_fixed_size = UP64(block_data_offset + size);
+
+}
+
 /*
  * acquire a spinlock, but backout and check global errors after a while
  *
@@ -335,13 +467,15 @@ static int spinlock_lock(spinlock *l, uint32_t pid) {
 }
 
 /*
- * add block to freelist with header
+ * add block to a freelist of a cluster, keeping the cluster metrics
  *
  */
-static void push_free_ptr(volatile offset *header, offset ofs) {
+static void push_free_ptr(cluster_header_t *ch, unsigned list, offset ofs) {
 
     block_header_t                         *h = HDR(ofs);
 
+    volatile offset                        *header = ch->lists + list;
+
     h->u.free.p = ~ 0;
     h->u.free.n = *header;
     
@@ -349,25 +483,98 @@ static void push_free_ptr(volatile offset *header, offset ofs) {
         HDR(h->u.free.n)->u.free.p = ofs;
     
     *header = ofs;
+
+    ch->length[list]++;
+
+    if (list < CLUSTER_FREELISTS) {
+        ch->free_bytes += h->size;
+
+        if (ch->largest_free < h->size) {
+            ch->largest_free = h->size;
+            ch->largest_count = 1;
+        } else if (ch->largest_free == h->size) {
+            ch->largest_count++;
+        }
+    } else {
+        ch->slab_bytes += h->size;
+    }
     
 }
 
 /*
- * remove block from freelist with header
+ * find the largest block in the free lists of a cluster, after the last one of that size was removed (this is done when
+ * metrics are read, rather than on the allocation path): it is in the highest non-empty list, as the lists are by size
+ *
+ */
+static void find_largest_free(cluster_header_t *ch) {
+
+    ch->largest_free = ch->largest_count = 0;
+
+    for (int x = CLUSTER_FREELISTS; x--; ) {
+        for (offset ofs = ch->lists[x]; ~ ofs; ofs = HDR(ofs)->u.free.n) {
+            uint32_t                        size = HDR(ofs)->size;
+
+            if (ch->largest_free < size) {
+                ch->largest_free = size;
+                ch->largest_count = 1;
+            } else if (ch->largest_free == size) {
+                ch->largest_count++;
+            }
+        }
+        if (ch->largest_count)
+            break;
+    }
+
+}
+
+/*
+ * remove block from a freelist of a cluster
  *
  */
-static void unlink_free_ptr(volatile offset *header, block_header_t *h) {
+static void unlink_free_ptr(cluster_header_t *ch, unsigned list, block_header_t *h) {
 
     if (~ h->u.free.p)
         HDR(h->u.free.p)->u.free.n = h->u.free.n;
     else
-        *header = h->u.free.n;
+        ch->lists[list] = h->u.free.n;
     
     if (~ h->u.free.n)
         HDR(h->u.free.n)->u.free.p = h->u.free.p;
+
+    ch->length[list]--;
+
+    if (list < CLUSTER_FREELISTS) {
+        ch->free_bytes -= h->size;
+
+        if (h->size == ch->largest_free && ch->largest_count)
+            ch->largest_count--;                                                      /* none left: largest_free is stale until found again */
+    } else {
+        ch->slab_bytes -= h->size;
+    }
     
 }
 
+/*
+ * empty the free lists of a cluster, and reset the metrics for them
+ *
+ */
+static void reset_free_lists(cluster_header_t *ch, unsigned first, unsigned last) {
+
+    for (unsigned x = first; x < last; x++) {
+        ch->lists[x] = ~ 0;
+        ch->length[x] = 0;
+    }
+
+    if (first < CLUSTER_FREELISTS) {
+        ch->free_bytes = 0;
+        ch->largest_free = ch->largest_count = 0;
+    }
+    if (CLUSTER_FREELISTS < last) {
+        ch->slab_bytes = 0;
+    }
+
+}
+
 /*
  * initialise control memory
  *
@@ -377,6 +584,7 @@ static void reset_ctlblock(void *cbdata, void *p) {
     *ctl = (ctl_header_t){
         .seed = 0,
         .checker = 0,
+        .generation = 0,
         .error = 0,
         .cluster_capacity = 0,
         .number_of_clusters = 0
@@ -433,9 +641,11 @@ static void reset_headers(void *cbdata, void *p) {
  
         ch->lock = spinlock_init;
 
-        for (int x = 0; x < CLUSTER_FREELISTS; x++) ch->free[x] = ~ 0;
+        reset_free_lists(ch, 0, FREELISTS);
+
+        ch->compactions = ch->failures = ch->defrags = 0;
 
-        push_free_ptr(ch->free + free_list_offset_for_size(ctlblock->cluster_capacity), ofs);
+        push_free_ptr(ch, free_list_offset_for_size(ctlblock->cluster_capacity), ofs);
     }
 }
 
@@ -447,6 +657,8 @@ int agent_memory_initialise(uint32_t sz, int id) {
     int rv;
     cluster_limit_t limit = {.size_limit = 0u, .orig_size = sz};
 
+    slab_classes_init();
+
     rv = get_memory_segment(&ctlblock_pool, CTLFILE,
             sizeof (ctl_header_t), reset_ctlblock, NULL, id);
     if (rv != AM_SUCCESS)
@@ -489,6 +701,10 @@ int is_agent_memory_ready() {
  */
 void agent_memory_shutdown(int unlink) {
 
+    if (ctlblock && cluster_base && cluster_hdrs) {
+        magazines_drain(getpid());
+    }
+
     remove_memory_segment(&ctlblock_pool, unlink);
 
     remove_memory_segment(&cluster_base_pool, unlink);
@@ -522,7 +738,7 @@ int agent_memory_cleanup(int id) {
  * coalesce small series of free blocks
  *
  */
-static uint32_t coalesce(volatile offset *free, offset ofs, offset end) {
+static uint32_t coalesce(cluster_header_t *ch, offset ofs, offset end) {
 
     offset                                  start = ofs + HDR(ofs)->size, i = start;
 
@@ -532,7 +748,7 @@ static uint32_t coalesce(volatile offset *free, offset ofs, offset end) {
         if (h->locks)
             break;
         
-        unlink_free_ptr(free + free_list_offset_for_size(h->size), h);
+        unlink_free_ptr(ch, free_list_offset_for_size(h->size), h);
         i += h->size;
     }
     return i - start;
@@ -548,16 +764,31 @@ static int offset_comparator_reverse(const void *a, const void *b) {
 }
 
 /*
- * coalesce any contiguous blocks in an entire cluster
+ * coalesce any contiguous blocks in an entire cluster, optionally returning free slab blocks to the free lists first;
+ * the free lists are left in address order
  *
  */
-static int compact_cluster(volatile offset *freelists) {
+static int compact_cluster(cluster_header_t *ch, int release_slabs) {
 
-    offset                                 *buffer = malloc(sizeof(offset) * (ctlblock->cluster_capacity / sizeof(block_header_t)));
+    for (int x = 0; release_slabs && x < SLAB_CLASSES; x++) {
+        offset                              ofs;
+
+        while (~ ( ofs = ch->lists[SLAB_LIST(x)] )) {
+            unlink_free_ptr(ch, SLAB_LIST(x), HDR(ofs));
+
+            HDR(ofs)->locks = 0;
+            push_free_ptr(ch, free_list_offset_for_size(HDR(ofs)->size), ofs);
+        }
+    }
+
+    offset                                 *buffer = malloc(sizeof(offset) * (ch->length[0] + ch->length[1] + ch->length[2] + ch->length[3] + 1));
     size_t                                  n = 0;
+
+    if (buffer == 0)
+        return 0;
     
     for (int x = 0; x < CLUSTER_FREELISTS; x++)
-        for (offset ofs = freelists[x]; ~ ofs; ofs = HDR(ofs)->u.free.n)
+        for (offset ofs = ch->lists[x]; ~ ofs; ofs = HDR(ofs)->u.free.n)
             buffer[n++] = ofs;
     
     if (n < 2) {
@@ -568,8 +799,7 @@ static int compact_cluster(volatile offset *freelists) {
 
     qsort(buffer, n, sizeof(offset), offset_comparator_reverse);
     
-    for (int x = 0; x < CLUSTER_FREELISTS; x++)
-        freelists[x] = ~ 0;
+    reset_free_lists(ch, 0, CLUSTER_FREELISTS);
     
     register int                            c = 0;
     
@@ -581,11 +811,11 @@ static int compact_cluster(volatile offset *freelists) {
             HDR(p)->size += HDR(base)->size;
             c++;
         } else {
-            push_free_ptr(freelists + free_list_offset_for_size(HDR(base)->size), base);
+            push_free_ptr(ch, free_list_offset_for_size(HDR(base)->size), base);
         }
         base = p;
     }
-    push_free_ptr(freelists + free_list_offset_for_size(HDR(base)->size), base);
+    push_free_ptr(ch, free_list_offset_for_size(HDR(base)->size), base);
 
     free(buffer);
     
@@ -597,10 +827,10 @@ static int compact_cluster(volatile offset *freelists) {
  * allocation, scan through a clusters' freelists
  *
  */
-static void *alloc(volatile offset *freelists, unsigned seq, int32_t type, const uint32_t required) {
+static void *alloc(cluster_header_t *ch, unsigned seq, int32_t type, const uint32_t required) {
 
     while (seq < CLUSTER_FREELISTS) {
-        offset                              ofs = freelists[seq];
+        offset                              ofs = ch->lists[seq];
 
         while (~ ofs) {
             block_header_t                 *h = HDR(ofs);
@@ -610,15 +840,16 @@ static void *alloc(volatile offset *freelists, unsigned seq, int32_t type, const
             } else {
                 uint32_t                    remainder = h->size - required;
 
+                unlink_free_ptr(ch, seq, h);
+
                 if (MIN_SPLIT_BLOCKSIZE <= remainder) {
                     HDR(ofs + required)->locks = 0;
                     HDR(ofs + required)->size = remainder;
-                    push_free_ptr(freelists + free_list_offset_for_size(remainder), ofs + required);
+                    push_free_ptr(ch, free_list_offset_for_size(remainder), ofs + required);
                     
                     h->size = required;
                 }
                 h->locks = type;
-                unlink_free_ptr(freelists + seq, h);
                 
                 return USR(ofs);
             }
@@ -633,20 +864,27 @@ static void *alloc(volatile offset *freelists, unsigned seq, int32_t type, const
  * try allocate within a cluster but perform cluster-wide reorganisation of freelists if allocation fails, then try again
  *
  */
-static void *alloc_with_compact(volatile offset *freelists, unsigned seq, int32_t type, const uint32_t required) {
+static void *alloc_with_compact(cluster_header_t *ch, unsigned seq, int32_t type, const uint32_t required) {
 
     void                                   *p = 0;
     unsigned                                s = seq;
     
-    while (freelists[s] == ~ 0) {
+    while (ch->lists[s] == ~ 0) {
         s++;
-        if (s == CLUSTER_FREELISTS)
+        if (s == CLUSTER_FREELISTS) {
+            ch->failures++;
             return 0;
+        }
     }
     
-    if (( p = alloc(freelists, s, type, required) ) == 0) {
-        if (compact_cluster(freelists)) {
-            p = alloc(freelists, seq, type, required);
+    if (( p = alloc(ch, s, type, required) ) == 0) {
+        ch->compactions++;
+
+        if (compact_cluster(ch, 1)) {
+            p = alloc(ch, seq, type, required);
+        }
+        if (p == 0) {
+            ch->failures++;
         }
     }
 
@@ -655,30 +893,288 @@ static void *alloc_with_compact(volatile offset *freelists, unsigned seq, int32_
 }
 
 /*
- * allocate memory within a cluster
+ * carve a run of blocks for a slab class out of the free lists, falling back to a single block
  *
  */
-void *agent_memory_alloc(pid_t pid, uint32_t cluster, int32_t type, uint32_t size) {
+static int carve_slab(cluster_header_t *ch, int c) {
 
-    uint32_t                                required = UP64(block_data_offset + size);
+    uint32_t                                size = slab_size(c), run = ctlblock->cluster_capacity >> SLAB_RUN_SHIFT, n;
 
-    unsigned                                seq = free_list_offset_for_size(required);
-    
-    void                                   *p;
+    void                                   *p = 0;
+
+    n = (run < SLAB_RUN_SIZE ? run : SLAB_RUN_SIZE) / size;
+
+    if (n > SLAB_RUN_MAX)
+        n = SLAB_RUN_MAX;
+    else if (n == 0)
+        n = 1;
+
+    while (n && ( p = alloc(ch, free_list_offset_for_size(n * size), SLAB_FREE, n * size) ) == 0) {
+        n = n > 1 ? 1 : 0;
+    }
+
+    if (p == 0)
+        return 0;
+
+    offset                                  ofs = OFS(p) - block_data_offset;
+    uint32_t                                total = HDR(ofs)->size;
+
+    for (uint32_t i = n; i--; ) {
+        offset                              o = ofs + i * size;
+
+        HDR(o)->locks = SLAB_FREE;
+        HDR(o)->size = i == n - 1 ? total - i * size : size;                          /* any unsplit remainder goes with the last block */
+
+        push_free_ptr(ch, SLAB_LIST(c), o);
+    }
+
+    return n;
+
+}
+
+/*
+ * release a block within a locked cluster: slab blocks go back to their class, others are coalesced with following blocks
+ *
+ */
+static void free_block(unsigned cluster, offset ofs) {
+
+    block_header_t                         *h = HDR(ofs);
+
+    int                                     c = slab_class_for_block(h->size);
+
+    if (c < 0) {
+        h->size += coalesce(cluster_header(cluster), ofs, (cluster + 1) * ctlblock->cluster_capacity);
+        h->locks = 0;
+
+        push_free_ptr(cluster_header(cluster), free_list_offset_for_size(h->size), ofs);
+    } else {
+        h->locks = SLAB_FREE;
+
+        push_free_ptr(cluster_header(cluster), SLAB_LIST(c), ofs);
+    }
+
+}
+
+/*
+ * lock the magazine (which is only shared by threads in this process), discarding its contents if they are not
+ * ours: after a fork they belong to the parent, and after a reset they no longer exist
+ *
+ */
+static void magazine_lock(struct magazine *m, pid_t pid) {
+
+    while (cas(&m->lock, 0, 1) == 0) {
+        yield();
+    }
+
+    if (m->pid != pid || m->generation != ctlblock->generation) {
+        m->pid = pid;
+        m->generation = ctlblock->generation;
+        m->n = 0;
+    }
+
+}
+
+static void magazine_unlock(struct magazine *m) {
+
+    spinlock_unlock(&m->lock);
+
+}
+
+/*
+ * number of blocks moved between a magazine and a cluster at a time; a magazine holds up to twice this number
+ *
+ */
+static uint32_t magazine_batch(int c) {
+
+    uint32_t                                n = MAGAZINE_BATCH_SIZE / slab_size(c);
+
+    return n == 0 ? 1 : n < MAGAZINE_BATCH ? n : MAGAZINE_BATCH;
+
+}
+
+/*
+ * refill a magazine with a batch of blocks from the slab list of a cluster, carving and compacting as for any allocation
+ *
+ */
+static int magazine_refill(struct magazine *m, pid_t pid, uint32_t cluster, int c) {
+
+    cluster_header_t                       *ch = cluster_hdrs + cluster;
+
+    uint32_t                                batch = magazine_batch(c);
 
     if (spinlock_lock(&cluster_lock(cluster), pid)) {
         return 0;
     }
 
-    p = alloc_with_compact(cluster_free_lists(cluster), seq, type, required);
+    while (m->n < batch) {
+        offset                              ofs;
+        block_header_t                     *h;
+
+        if (ch->lists[SLAB_LIST(c)] == ~ 0 && carve_slab(ch, c) == 0) {
+            if (m->n)
+                break;
+
+            ch->compactions++;
+            compact_cluster(ch, 1);
+
+            if (carve_slab(ch, c) == 0) {
+                ch->failures++;
+                break;
+            }
+        }
+
+        h = HDR(ofs = ch->lists[SLAB_LIST(c)]);
+        unlink_free_ptr(ch, SLAB_LIST(c), h);
+
+        h->locks = SLAB_MAGAZINE;
+        h->u.free.p = (offset)pid;
+
+        m->blocks[m->n++] = ofs;
+    }
+
     spinlock_unlock(&cluster_lock(cluster));
+
+    return m->n;
+
+}
+
+/*
+ * drain the oldest n blocks of a magazine back to the slab lists of their clusters
+ *
+ */
+static void magazine_drain(struct magazine *m, pid_t pid, int c, uint32_t n) {
+
+    unsigned                                locked = ~ 0u;
+
+    for (uint32_t i = 0; i < n; i++) {
+        offset                              ofs = m->blocks[i];
+        unsigned                            cluster = ofs / ctlblock->cluster_capacity;
+
+        if (cluster != locked) {
+            if (~ locked) {
+                spinlock_unlock(&cluster_lock(locked));
+            }
+            if (spinlock_lock(&cluster_lock(cluster), pid)) {
+                locked = ~ 0u;                                                        /* abandoned: these blocks are reclaimed on recovery */
+                continue;
+            }
+            locked = cluster;
+        }
+
+        HDR(ofs)->locks = SLAB_FREE;
+        push_free_ptr(cluster_header(cluster), SLAB_LIST(c), ofs);
+    }
+
+    if (~ locked) {
+        spinlock_unlock(&cluster_lock(locked));
+    }
+
+    memmove(m->blocks, m->blocks + n, (m->n - n) * sizeof(offset));
+    m->n -= n;
+
+}
+
+/*
+ * return all blocks in this process's magazines to the clusters
+ *
+ */
+static void magazines_drain(pid_t pid) {
+
+    for (int c = 0; c < SLAB_CLASSES; c++) {
+        struct magazine                    *m = magazines + c;
+
+        magazine_lock(m, pid);
+        magazine_drain(m, pid, c, m->n);
+        magazine_unlock(m);
+    }
+
+}
+
+/*
+ * return blocks in magazines of dead processes to the slab lists of a locked cluster
+ *
+ */
+static int reclaim_magazine_blocks(unsigned cluster) {
+    static const char                      *thisfunc = "reclaim_magazine_blocks():";
+
+    offset                                  base = cluster * ctlblock->cluster_capacity, end = base + ctlblock->cluster_capacity;
+
+    pid_t                                   owner = 0;
+    int                                     dead = 0, n = 0;
+
+    for (offset ofs = base; ofs != end; ofs += HDR(ofs)->size) {
+        block_header_t                     *h = HDR(ofs);
+        int                                 c;
+
+        if (h->locks != SLAB_MAGAZINE)
+            continue;
+
+        if ((pid_t)h->u.free.p != owner) {
+            owner = (pid_t)h->u.free.p;
+            dead = process_dead(owner);
+        }
+
+        if (dead) {
+            if (( c = slab_class_for_block(h->size) ) < 0) {
+                h->locks = 0;
+                push_free_ptr(cluster_header(cluster), free_list_offset_for_size(h->size), ofs);
+            } else {
+                h->locks = SLAB_FREE;
+                push_free_ptr(cluster_header(cluster), SLAB_LIST(c), ofs);
+            }
+            n++;
+        }
+    }
+
+    if (n) {
+        AM_LOG_DEBUG(0, "%s cluster %u: reclaimed %d blocks from magazines of dead processes", thisfunc, cluster, n);
+    }
+
+    return n;
+
+}
+
+/*
+ * allocate memory within a cluster, or from this process's magazine for small blocks
+ *
+ */
+void *agent_memory_alloc(pid_t pid, uint32_t cluster, int32_t type, uint32_t size) {
+
+    uint32_t                                required = UP64(block_data_offset + size);
+
+    int                                     c = slab_class_for_size(required);
+    
+    void                                   *p = 0;
+
+    if (c < 0) {
+        if (spinlock_lock(&cluster_lock(cluster), pid)) {
+            return 0;
+        }
+
+        p = alloc_with_compact(cluster_hdrs + cluster, free_list_offset_for_size(required), type, required);
+
+        spinlock_unlock(&cluster_lock(cluster));
+    } else {
+        struct magazine                    *m = magazines + c;
+
+        magazine_lock(m, pid);
+
+        if (m->n || magazine_refill(m, pid, cluster, c)) {
+            offset                          ofs = m->blocks[--m->n];
+
+            HDR(ofs)->locks = type;
+            p = USR(ofs);
+        }
+
+        magazine_unlock(m);
+    }
     
     return p;
 
 }
 
 /*
- * free, always trying to coalesce with nearby blocks
+ * free, to this process's magazine for slab blocks, or coalescing with nearby blocks
  *
  */
 int agent_memory_free(pid_t pid, void *p) {
@@ -687,14 +1183,33 @@ int agent_memory_free(pid_t pid, void *p) {
     block_header_t                         *h = HDR(ofs);
 
     unsigned                                cluster = ofs / ctlblock->cluster_capacity;
+
+    int                                     c = slab_class_for_block(h->size);
+
+    if (c >= 0) {
+        struct magazine                    *m = magazines + c;
+        int32_t                             type = h->locks;
+
+        magazine_lock(m, pid);
+
+        if (m->n >= 2 * magazine_batch(c)) {
+            magazine_drain(m, pid, c, magazine_batch(c));
+        }
+
+        if (0 < type && cas(&h->locks, type, SLAB_MAGAZINE)) {                        /* the gc scan might be freeing it */
+            h->u.free.p = (offset)pid;
+            m->blocks[m->n++] = ofs;
+        }
+
+        magazine_unlock(m);
+
+        return 1;
+    }
     
     if (spinlock_lock(&cluster_lock(cluster), pid))
         return 0;
     
-    h->size += coalesce(cluster_free_lists(cluster), ofs, (cluster + 1) * ctlblock->cluster_capacity);
-    h->locks = 0;
-    
-    push_free_ptr(cluster_free_lists(cluster) + free_list_offset_for_size(h->size), ofs);
+    free_block(cluster, ofs);
     
     spinlock_unlock(&cluster_lock(cluster));
     
@@ -763,7 +1278,7 @@ static int validate_cluster_format(unsigned cluster) {
             break;
         }
 
-        if (HDR(ofs)->locks) {
+        if (HDR(ofs)->locks && HDR(ofs)->locks != SLAB_FREE) {
             used += HDR(ofs)->size;
         } else {
             buffer[n++] = ofs;
@@ -778,10 +1293,10 @@ static int validate_cluster_format(unsigned cluster) {
 
         qsort(buffer, n, sizeof(offset), offset_comparator_reverse);
 
-        for (freelist_offset = 0; freelist_offset < CLUSTER_FREELISTS; freelist_offset++) {
+        for (freelist_offset = 0; freelist_offset < FREELISTS; freelist_offset++) {
             offset                          prior = ~ 0u;
 
-            for (ofs = cluster_free_lists(cluster)[freelist_offset]; ~ ofs; ofs = HDR(ofs)->u.free.n) {
+            for (ofs = cluster_header(cluster)->lists[freelist_offset]; ~ ofs; ofs = HDR(ofs)->u.free.n) {
                 if (( ptr = bsearch(&ofs, buffer, n, sizeof(offset), offset_comparator_reverse) ) == 0) {
                     AM_LOG_DEBUG(0, "%s block validation: cluster %u free list %d: entry is not a block offset",
                                      thisfunc, cluster, freelist_offset);
@@ -853,10 +1368,12 @@ int agent_memory_check(pid_t pid, int verbose, int clearup) {
         } while (--tries);
 
         if (locker == 0) {
+            reclaim_magazine_blocks(cluster);
+
             if (clearup) {
                 offset                      base = cluster * ctlblock->cluster_capacity;
 
-                HDR(base)->size = coalesce(cluster_free_lists(cluster), base, base + ctlblock->cluster_capacity);
+                HDR(base)->size = coalesce(cluster_header(cluster), base, base + ctlblock->cluster_capacity);
             }
             spinlock_unlock(&cluster_lock(cluster));
         } else if (locker == VALIDATION_LOCK) {
@@ -891,6 +1408,8 @@ void agent_memory_reset(pid_t pid) {
     unsigned                                cluster;
     pid_t                                   locker;
 
+    incr(&ctlblock->generation);                                                      /* empty all process magazines */
+
     for (cluster = 0; cluster < ctlblock->number_of_clusters; cluster++) {
         while (( locker = casv(&cluster_lock(cluster), 0, pid) )) {
             if (locker == VALIDATION_LOCK) {
@@ -908,17 +1427,14 @@ void agent_memory_reset(pid_t pid) {
             }
         }
 
-        int                                 i;
-
         offset                              ofs = cluster * ctlblock->cluster_capacity;
         block_header_t                     *h = HDR(ofs);
 
         *h = (block_header_t) { .locks = 0, .size = ctlblock->cluster_capacity, .u.free = { ~ 0u, ~ 0u } };
 
-        for (i = 0; i < CLUSTER_FREELISTS; i++)
-            cluster_free_lists(cluster)[i] = ~ 0;
+        reset_free_lists(cluster_header(cluster), 0, FREELISTS);
 
-        push_free_ptr(cluster_free_lists(cluster) + free_list_offset_for_size(h->size), ofs);
+        push_free_ptr(cluster_header(cluster), free_list_offset_for_size(h->size), ofs);
 
         spinlock_unlock(&cluster_lock(cluster));
     }
@@ -929,6 +1445,19 @@ void agent_memory_reset(pid_t pid) {
  *
  */
 void agent_memory_scan(pid_t pid, int (*checker)(void *cbdata, pid_t pid, int32_t type, void *p), void *cbdata) {
+
+    if (ctlblock == NULL)
+        return;
+
+    agent_memory_scan_clusters(pid, 0, ctlblock->number_of_clusters, checker, cbdata);
+
+}
+
+/*
+ * scan clusters [first, last) only, so that the gc can be spread over a number of calls
+ *
+ */
+void agent_memory_scan_clusters(pid_t pid, unsigned first, unsigned last, int (*checker)(void *cbdata, pid_t pid, int32_t type, void *p), void *cbdata) {
     static const char *thisfunc = "agent_memory_scan():";
     unsigned cluster;
     int c = 0;
@@ -937,7 +1466,10 @@ void agent_memory_scan(pid_t pid, int (*checker)(void *cbdata, pid_t pid, int32_
     if (ctlblock == NULL)
         return;
 
-    for (cluster = 0; cluster < ctlblock->number_of_clusters; cluster++) {
+    if (last > ctlblock->number_of_clusters)
+        last = ctlblock->number_of_clusters;
+
+    for (cluster = first; cluster < last; cluster++) {
         const offset base = cluster * ctlblock->cluster_capacity, end = base + ctlblock->cluster_capacity;
         offset ofs = base;
 
@@ -947,20 +1479,20 @@ void agent_memory_scan(pid_t pid, int (*checker)(void *cbdata, pid_t pid, int32_
             return;
         }
 
+        reclaim_magazine_blocks(cluster);
+
         while (ofs != end) {
             block_header_t *h = HDR(ofs);
+            int32_t type = h->locks;
 
-            if (h->locks) {
-                if (checker(cbdata, pid, h->locks, USR(ofs))) {
-                    h->size += coalesce(cluster_free_lists(cluster), ofs, end);
-                    h->locks = 0;
-
-                    push_free_ptr(cluster_free_lists(cluster) + free_list_offset_for_size(h->size), ofs);
+            if (type > 0) {
+                if (checker(cbdata, pid, type, USR(ofs)) && cas(&h->locks, type, SLAB_FREE)) {   /* unless it has just been freed to a magazine */
+                    free_block(cluster, ofs);
                     c++;
                 }
             }
 
-            if (h->locks == 0) {
+            if (h->locks == 0 || h->locks == SLAB_FREE) {
                 free += h->size;
             }
 
@@ -969,20 +1501,22 @@ void agent_memory_scan(pid_t pid, int (*checker)(void *cbdata, pid_t pid, int32_
         spinlock_unlock(&cluster_lock(cluster));
     }
 
-    AM_LOG_DEBUG(0, "%s blocks unlinked during scan: %d, current memory free: %f", thisfunc, c,
-            (float) free / (float) (ctlblock->number_of_clusters * ctlblock->cluster_capacity));
+    if (last > first) {
+        AM_LOG_DEBUG(0, "%s blocks unlinked during scan: %d, current memory free: %f", thisfunc, c,
+                (float) free / (float) ((last - first) * ctlblock->cluster_capacity));
+    }
 }
 
 /*
  * print agent memory
  *
  */
-static void analyse_cluster(int cluster, uint32_t *use_ptr, uint32_t *free_ptr, uint32_t *block_ptr, uint32_t *freelists) {
+static void analyse_cluster(int cluster, struct agent_memory_usage *usage, uint32_t *freelists, int verbose) {
     static const char                      *thisfunc = "analyse_cluster():";
 
     offset                                  base = cluster * ctlblock->cluster_capacity, end = base + ctlblock->cluster_capacity;
 
-    uint32_t                                used = 0, free = 0, blocks = 0;
+    uint32_t                                used = 0, free = 0, slab = 0, blocks = 0;
 
     uint32_t                                locks[4] = { 0, 0, 0, 0 }, overflows = 0;
 
@@ -995,7 +1529,15 @@ static void analyse_cluster(int cluster, uint32_t *use_ptr, uint32_t *free_ptr,
             locks[lock]++;
 
             freelists[free_list_offset_for_size(sz)]++;
-        } else if (lock < 4) {
+
+            usage->free_blocks++;
+            if (usage->largest_free < sz)
+                usage->largest_free = sz;
+        } else if (lock == SLAB_FREE) {
+            slab += sz;
+        } else if (lock == SLAB_MAGAZINE) {
+            usage->magazine += sz;
+        } else if (0 < lock && lock < 4) {
             used += sz;
             locks[lock]++;
         } else {
@@ -1005,12 +1547,121 @@ static void analyse_cluster(int cluster, uint32_t *use_ptr, uint32_t *free_ptr,
         blocks++;
     }
 
-    AM_LOG_DEBUG(0, "%s cluster %5u: used %8u, free %8u, blocks %5u locks types [%5u, %5u, %5u, %5u, (%u)]",
-                      thisfunc, cluster, used, free, blocks, locks[0], locks[1], locks[2], locks[3], overflows);
+    if (verbose) {
+        AM_LOG_DEBUG(0, "%s cluster %5u: used %8u, free %8u, slab free %8u, blocks %5u locks types [%5u, %5u, %5u, %5u, (%u)]",
+                          thisfunc, cluster, used, free, slab, blocks, locks[0], locks[1], locks[2], locks[3], overflows);
+    }
+
+    usage->used += used;
+    usage->free += free;
+    usage->slab_free += slab;
+    usage->blocks += blocks;
+
+}
+
+/*
+ * memory usage and fragmentation over all clusters
+ *
+ */
+void agent_memory_usage(pid_t pid, struct agent_memory_usage *usage) {
+    static const char                      *thisfunc = "agent_memory_usage():";
+
+    uint32_t                                freelists[CLUSTER_FREELISTS] = { 0 };
+
+    memset(usage, 0, sizeof(struct agent_memory_usage));
+
+    for (unsigned cluster = 0; cluster < ctlblock->number_of_clusters; cluster++) {
+        if (spinlock_lock(&cluster_lock(cluster), pid)) {
+            AM_LOG_ERROR(0, "%s abandoning scan of cluster %u", thisfunc, cluster);
+
+            break;
+        }
+
+        analyse_cluster(cluster, usage, freelists, 0);
+
+        spinlock_unlock(&cluster_lock(cluster));
+    }
+
+}
+
+/*
+ * free list metrics maintained in each cluster header, summed over all clusters without waiting for cluster locks; a
+ * cluster whose largest free block was allocated is searched for the next one if its lock is free
+ *
+ */
+void agent_memory_metrics(struct agent_memory_metrics *metrics) {
+
+    const pid_t                             pid = getpid();
 
-    *use_ptr += used;
-    *free_ptr += free;
-    *block_ptr += blocks;
+    memset(metrics, 0, sizeof(struct agent_memory_metrics));
+
+    for (unsigned cluster = 0; cluster < ctlblock->number_of_clusters; cluster++) {
+        cluster_header_t                   *ch = cluster_header(cluster);
+
+        if (ch->largest_count == 0 && ch->largest_free && cas(&cluster_lock(cluster), 0, pid)) {
+            find_largest_free(ch);                                                    /* otherwise this is an upper bound */
+            spinlock_unlock(&cluster_lock(cluster));
+        }
+
+        for (int x = 0; x < CLUSTER_FREELISTS; x++)
+            metrics->free_list_length[x] += ch->length[x];
+
+        for (int x = 0; x < SLAB_CLASSES; x++)
+            metrics->slab_blocks += ch->length[SLAB_LIST(x)];
+
+        metrics->free_bytes += ch->free_bytes;
+        metrics->slab_bytes += ch->slab_bytes;
+
+        if (metrics->largest_free < ch->largest_free)
+            metrics->largest_free = ch->largest_free;
+
+        metrics->compactions += ch->compactions;
+        metrics->failures += ch->failures;
+        metrics->defrags += ch->defrags;
+    }
+
+}
+
+/*
+ * background defragmentation: compact clusters in turn, starting where the last pass in this process stopped, until
+ * the time budget is spent; clusters that are busy, or have nothing to gain from compaction, are skipped
+ *
+ */
+int agent_memory_defragment(pid_t pid, uint32_t budget_usec) {
+
+    static unsigned                         next_cluster = 0;
+
+    struct timespec                         start, now;
+
+    unsigned                                n, compacted = 0;
+
+    am_clock_gettime(&start);
+
+    for (n = 0; n < ctlblock->number_of_clusters; n++) {
+        unsigned                            cluster = next_cluster++ % ctlblock->number_of_clusters;
+
+        cluster_header_t                   *ch = cluster_header(cluster);
+
+        int                                 release_slabs = ch->free_bytes < ch->slab_bytes;
+
+        if (! release_slabs && ch->length[0] + ch->length[1] + ch->length[2] + ch->length[3] < 2)
+            continue;
+
+        if (! cas(&ch->lock, 0, pid))
+            continue;
+
+        compact_cluster(ch, release_slabs);
+        ch->defrags++;
+        compacted++;
+
+        spinlock_unlock(&ch->lock);
+
+        am_clock_gettime(&now);
+        if ((uint64_t) (now.tv_sec - start.tv_sec) * 1000000 + now.tv_nsec / 1000 - start.tv_nsec / 1000 >= budget_usec)
+            break;
+    }
+
+    return compacted;
 
 }
 
@@ -1021,10 +1672,12 @@ static void analyse_cluster(int cluster, uint32_t *use_ptr, uint32_t *free_ptr,
 void agent_memory_print(pid_t pid) {
     static const char                      *thisfunc = "agent_memory_print():";
 
-    uint32_t                                used = 0, free = 0, blocks = 0;
+    struct agent_memory_usage               usage;
 
     uint32_t                                freelists[CLUSTER_FREELISTS];
 
+    memset(&usage, 0, sizeof(struct agent_memory_usage));
+
     for (int hdr = 0; hdr < CLUSTER_FREELISTS; hdr++) {
         freelists[hdr] = 0;
     }
@@ -1036,16 +1689,24 @@ void agent_memory_print(pid_t pid) {
             break;
         }
 
-        analyse_cluster(cluster, &used, &free, &blocks, freelists);
+        analyse_cluster(cluster, &usage, freelists, 1);
 
         spinlock_unlock(&cluster_lock(cluster));
     }
 
-    AM_LOG_DEBUG(0, "%s avg blocks per cluster %f, blocks in use %u, free %u", thisfunc, (float)blocks / ctlblock->number_of_clusters, used, free);
+    AM_LOG_DEBUG(0, "%s avg blocks per cluster %f, blocks in use %"PR_L64", free %"PR_L64", slab free %"PR_L64"", thisfunc,
+                     (float)usage.blocks / ctlblock->number_of_clusters, (int64_t)usage.used, (int64_t)usage.free, (int64_t)usage.slab_free);
     for (int x = 0; x < CLUSTER_FREELISTS; x++) {
         AM_LOG_DEBUG(0, "%s blocks in freelists type %d: %u ", thisfunc, x, freelists[x]); 
     }
 
+    struct agent_memory_metrics             metrics;
+
+    agent_memory_metrics(&metrics);
+
+    AM_LOG_DEBUG(0, "%s largest free block %u, inline compactions %"PR_L64", allocation failures %"PR_L64", background defragmentations %"PR_L64"",
+                     thisfunc, metrics.largest_free, (int64_t)metrics.compactions, (int64_t)metrics.failures, (int64_t)metrics.defrags);
+
 }
 
 offset agent_memory_offset(void *ptr) {
@@ -27,6 +27,23 @@
 
 typedef uint32_t                                       offset;
 
+struct agent_memory_usage {
+    uint64_t                                           used, free, slab_free;  /* bytes in use, in the free lists and in slab free lists */
+    uint64_t                                           magazine;               /* bytes in process magazines */
+    uint32_t                                           blocks, free_blocks;
+    uint32_t                                           largest_free;           /* largest block in the free lists */
+};
+
+struct agent_memory_metrics {
+    uint64_t                                           free_bytes, slab_bytes; /* bytes in the free lists and in slab free lists */
+    uint32_t                                           free_list_length[4];    /* blocks in each free list */
+    uint32_t                                           slab_blocks;            /* blocks in slab free lists */
+    uint32_t                                           largest_free;           /* largest block in the free lists of any cluster */
+    uint64_t                                           compactions;            /* compactions forced by an allocation */
+    uint64_t                                           failures;               /* allocations that failed in a cluster, even after compaction */
+    uint64_t                                           defrags;                /* clusters compacted by the background defragmenter */
+};
+
 uint32_t cache_memory_size();
 
 offset agent_memory_offset(void *ptr);
@@ -38,6 +55,8 @@ int agent_memory_cleanup(int id);
 
 int agent_memory_clusters(void);
 
+void agent_memory_fixed_size(uint32_t size);
+
 void agent_memory_barrier(pid_t pid);
 
 uint32_t agent_memory_seed();
@@ -48,6 +67,12 @@ int agent_memory_free(pid_t pid, void *ptr);
 
 int agent_memory_check(pid_t pid, int verbose, int cleanup);
 void agent_memory_scan(pid_t pid, int (*checker)(void *cbdata, pid_t pid, int32_t type, void *p), void *cbdata);
+void agent_memory_scan_clusters(pid_t pid, unsigned first, unsigned last, int (*checker)(void *cbdata, pid_t pid, int32_t type, void *p), void *cbdata);
+
+void agent_memory_usage(pid_t pid, struct agent_memory_usage *usage);
+void agent_memory_print(pid_t pid);
+void agent_memory_metrics(struct agent_memory_metrics *metrics);
+int agent_memory_defragment(pid_t pid, uint32_t budget_usec);
 
 void agent_memory_barrier(pid_t pid);
 void agent_memory_validate(pid_t pid);
@@ -71,6 +71,18 @@ typedef enum {
 #define AM_SHARED_MAX_SIZE_VAR      "AM_MAX_SHARED_POOL_SIZE" /* env var used to limit resizable pool maximum size */
 #endif
 
+#ifndef AM_SHARED_HUGE_PAGES_VAR
+#define AM_SHARED_HUGE_PAGES_VAR    "AM_SHARED_HUGE_PAGES" /* env var: "thp" (or "on") advises transparent huge pages, "hugetlb" tries MAP_HUGETLB first */
+#endif
+
+#ifndef AM_SHARED_PREFAULT_VAR
+#define AM_SHARED_PREFAULT_VAR      "AM_SHARED_PREFAULT" /* env var: "on" pre-faults large shared memory segments when they are mapped */
+#endif
+
+#ifndef AM_SHARED_LARGE_SIZE
+#define AM_SHARED_LARGE_SIZE        0x200000 /* segments of at least this size are eligible for huge pages and pre-faulting */
+#endif
+
 #ifndef AM_MAX_INSTANCES
 #define AM_MAX_INSTANCES            32 /* max number of agent configuration instances */
 #endif
@@ -87,6 +99,14 @@ typedef enum {
 #define AM_MAX_THREADS_POOL         AM_MAX_INSTANCES
 #endif
 
+#ifndef AM_WORKER_QUEUE_SIZE
+#define AM_WORKER_QUEUE_SIZE        128 /* max number of queued work items, per worker thread; must be a power of two */
+#endif
+
+#ifndef AM_WORKER_OVERFLOW_SIZE
+#define AM_WORKER_OVERFLOW_SIZE     1024 /* max number of work items kept past full work queues (am_worker_dispatch_reliable) */
+#endif
+
 #ifndef AM_LOG_QUEUE_SIZE
 #define AM_LOG_QUEUE_SIZE           16384 /* must be a power of two */
 #endif
@@ -232,8 +252,9 @@ struct url {
     char ssl;
     char proto[AM_PROTO_SIZE + 1];
     char host[AM_HOST_SIZE + 1];
-    char path[AM_URI_SIZE + 1];
-    char query[AM_URI_SIZE + 1];
+    char *path; /* normalized path */
+    char *query; /* sorted query parameters with the leading '?', or an empty string */
+    char *buf; /* path and query storage (see parse_url and url_free) */
 };
 
 typedef struct am_request {
@@ -270,9 +291,13 @@ typedef struct am_request {
 
     struct am_namevalue *sattr; /*session attributes (cache or direct)*/
     struct am_policy_result *pattr; /*policy attributes (cache or direct)*/
+    struct am_policy_index *pattr_index; /*resource index over pattr entries*/
+    uint64_t pattr_digest; /*digest of the session/policy cache entry pattr was read from*/
     struct am_namevalue *response_attributes; /*pointers to the data inside policy am_policy_result if any*/
     struct am_namevalue *response_decisions;
     struct am_namevalue *policy_advice;
+    struct am_attr_index *attr_index[3]; /*name index over sattr, response_decisions and response_attributes, see get_attr_value*/
+    struct attr_recording *attr_recording; /*user attribute headers being recorded, see render_user_attributes*/
 
     const char *client_fqdn;
 
@@ -284,6 +309,8 @@ typedef struct am_request {
     unsigned long instance_id;
     am_config_t *conf; /*agent configuration*/
 
+    struct am_arena *arena; /*request scoped allocations (see am_request_alloc), released by am_request_free*/
+
     void *ctx; /*web container/request context*/
 #ifdef _WIN32
     void *ctx_class;
@@ -0,0 +1,262 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2016 ForgeRock AS.
+ */
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+
+/*
+ * Request scoped (bump) allocator.
+ *
+ * Strings made while processing a request (client address, normalized and overridden urls, temporary
+ * copies) live exactly as long as the am_request_t, so instead of being allocated and released one by one
+ * they are carved out of a per-request arena (am_request_alloc and friends) and all released at once by
+ * am_request_free. Memory from the arena must not be passed to free or am_free, nor kept after the request.
+ *
+ * The arena header lives at the start of its first (backing) block. When the arena is released, the backing
+ * block is kept for the next request on the same thread, so a request that fits in AM_ARENA_BLOCK_SIZE
+ * makes no heap allocation for its arena at all; larger requests chain further blocks, and allocations of
+ * more than a quarter of a block get a block of their own, so that a single large value does not waste
+ * the free space left in the current block.
+ */
+
+#define AM_ARENA_BLOCK_SIZE 8192
+
+#define AM_ARENA_ALIGN(s) (((s) + 15) & ~((size_t) 15))
+
+struct arena_block {
+    struct arena_block *next;
+};
+
+struct am_arena {
+    struct arena_block *blocks; /* blocks chained after the backing block */
+    char *pos;
+    char *end;
+};
+
+#define ARENA_HEADER_SIZE AM_ARENA_ALIGN(sizeof (struct am_arena))
+#define BLOCK_HEADER_SIZE AM_ARENA_ALIGN(sizeof (struct arena_block))
+
+#ifdef _WIN32
+static DWORD arena_cache = FLS_OUT_OF_INDEXES;
+static INIT_ONCE arena_cache_initialized = INIT_ONCE_STATIC_INIT;
+
+static VOID WINAPI arena_cache_free(PVOID block) {
+    free(block);
+}
+
+static BOOL CALLBACK init_arena_cache(PINIT_ONCE once, PVOID param, PVOID *context) {
+    arena_cache = FlsAlloc(arena_cache_free);
+    return TRUE;
+}
+
+static void *arena_cache_get() {
+    void *block;
+    InitOnceExecuteOnce(&arena_cache_initialized, init_arena_cache, NULL, NULL);
+    if (arena_cache == FLS_OUT_OF_INDEXES) {
+        return NULL;
+    }
+    block = FlsGetValue(arena_cache);
+    if (block != NULL) {
+        FlsSetValue(arena_cache, NULL);
+    }
+    return block;
+}
+
+static am_bool_t arena_cache_put(void *block) {
+    if (arena_cache == FLS_OUT_OF_INDEXES || FlsGetValue(arena_cache) != NULL) {
+        return AM_FALSE;
+    }
+    return FlsSetValue(arena_cache, block) ? AM_TRUE : AM_FALSE;
+}
+#else
+static pthread_key_t arena_cache;
+static int arena_cache_status = -1;
+static pthread_once_t arena_cache_initialized = PTHREAD_ONCE_INIT;
+
+static void init_arena_cache() {
+    /* backing blocks cached by a thread are released when the thread exits */
+    arena_cache_status = pthread_key_create(&arena_cache, free);
+}
+
+static void *arena_cache_get() {
+    void *block;
+    pthread_once(&arena_cache_initialized, init_arena_cache);
+    if (arena_cache_status != 0) {
+        return NULL;
+    }
+    block = pthread_getspecific(arena_cache);
+    if (block != NULL) {
+        pthread_setspecific(arena_cache, NULL);
+    }
+    return block;
+}
+
+static am_bool_t arena_cache_put(void *block) {
+    if (arena_cache_status != 0 || pthread_getspecific(arena_cache) != NULL) {
+        return AM_FALSE;
+    }
+    return pthread_setspecific(arena_cache, block) == 0 ? AM_TRUE : AM_FALSE;
+}
+#endif
+
+static struct am_arena *arena_create() {
+    struct am_arena *arena = arena_cache_get();
+    if (arena == NULL) {
+        arena = malloc(AM_ARENA_BLOCK_SIZE);
+        if (arena == NULL) {
+            return NULL;
+        }
+    }
+    arena->blocks = NULL;
+    arena->pos = (char *) arena + ARENA_HEADER_SIZE;
+    arena->end = (char *) arena + AM_ARENA_BLOCK_SIZE;
+    return arena;
+}
+
+/**
+ * Allocate size bytes (16 byte aligned) from the request arena, which is set up on first use.
+ *
+ * @return pointer to the memory, valid until am_request_free, or NULL on allocation failure
+ */
+void *am_request_alloc(am_request_t *r, size_t size) {
+    struct am_arena *arena;
+    struct arena_block *block;
+    char *p;
+
+    if (r == NULL) {
+        return NULL;
+    }
+    if (r->arena == NULL && (r->arena = arena_create()) == NULL) {
+        return NULL;
+    }
+    arena = r->arena;
+    size = AM_ARENA_ALIGN(size == 0 ? 1 : size);
+
+    if (size <= (size_t) (arena->end - arena->pos)) {
+        p = arena->pos;
+        arena->pos += size;
+        return p;
+    }
+
+    if (size > (AM_ARENA_BLOCK_SIZE - BLOCK_HEADER_SIZE) / 4) {
+        /* a block of its own; the current block stays in use */
+        block = malloc(BLOCK_HEADER_SIZE + size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = arena->blocks;
+        arena->blocks = block;
+        return (char *) block + BLOCK_HEADER_SIZE;
+    }
+
+    block = malloc(AM_ARENA_BLOCK_SIZE);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->next = arena->blocks;
+    arena->blocks = block;
+    p = (char *) block + BLOCK_HEADER_SIZE;
+    arena->pos = p + size;
+    arena->end = (char *) block + AM_ARENA_BLOCK_SIZE;
+    return p;
+}
+
+char *am_request_strndup(am_request_t *r, const char *s, size_t n) {
+    char *p;
+    size_t len;
+
+    if (s == NULL) {
+        return NULL;
+    }
+    for (len = 0; len < n && s[len] != '\0'; len++)
+        ;
+    p = am_request_alloc(r, len + 1);
+    if (p != NULL) {
+        memcpy(p, s, len);
+        p[len] = '\0';
+    }
+    return p;
+}
+
+char *am_request_strdup(am_request_t *r, const char *s) {
+    return s != NULL ? am_request_strndup(r, s, strlen(s)) : NULL;
+}
+
+/**
+ * printf into the request arena. The value is formatted in place when it fits in the free space
+ * of the current block, otherwise it is formatted a second time into memory of the right size.
+ *
+ * @return formatted value, valid until am_request_free, or NULL on failure
+ */
+char *am_request_asprintf(am_request_t *r, const char *fmt, ...) {
+    struct am_arena *arena;
+    va_list ap;
+    size_t avail;
+    int size;
+    char *p;
+
+    if (r == NULL || fmt == NULL) {
+        return NULL;
+    }
+    if (r->arena == NULL && (r->arena = arena_create()) == NULL) {
+        return NULL;
+    }
+    arena = r->arena;
+    avail = arena->end - arena->pos;
+
+    va_start(ap, fmt);
+    size = vsnprintf(arena->pos, avail, fmt, ap);
+    va_end(ap);
+    if (size < 0) {
+        return NULL;
+    }
+    if ((size_t) size < avail) {
+        p = arena->pos;
+        arena->pos += AM_ARENA_ALIGN((size_t) size + 1); /* blocks are sized in multiples of the alignment */
+        return p;
+    }
+
+    p = am_request_alloc(r, (size_t) size + 1);
+    if (p != NULL) {
+        va_start(ap, fmt);
+        vsnprintf(p, (size_t) size + 1, fmt, ap);
+        va_end(ap);
+    }
+    return p;
+}
+
+/**
+ * Release everything allocated from the request arena (called by am_request_free).
+ */
+void am_request_arena_free(am_request_t *r) {
+    struct am_arena *arena;
+    struct arena_block *block;
+
+    if (r == NULL || r->arena == NULL) {
+        return;
+    }
+    arena = r->arena;
+    r->arena = NULL;
+    while (arena->blocks != NULL) {
+        block = arena->blocks;
+        arena->blocks = block->next;
+        free(block);
+    }
+    if (!arena_cache_put(arena)) {
+        free(arena);
+    }
+}
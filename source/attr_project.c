@@ -0,0 +1,307 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2016 ForgeRock AS.
+ */
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "list.h"
+#include "thread.h"
+
+/*
+ * Attribute projection.
+ *
+ * A session/policy call returns every session property and every policy response attribute, while the agent
+ * only ever reads a few of them back: the names in the attribute maps (session_attr_map, response_attr_map and
+ * profile_attr_map), the user id parameter and a few built-in session properties. Those names (the working set)
+ * are collected once per agent configuration, and am_attr_project removes all other attributes from a
+ * session/policy call result before it is cached, so that cache entries are smaller and faster to read.
+ *
+ * Names are matched exactly, as get_attr_value looks them up, using the attribute name index (am_attr_index_new)
+ * built over the names of each kind. Working sets are cached per process for each agent instance and replaced when
+ * the configuration changes; configurations that do not come from the configuration cache (no timestamp) get a
+ * working set for the call only.
+ *
+ * Session/policy cache entries are shared by agent instances (and configurations) reading the same token, so each
+ * entry records the digest of the working set it was projected with (am_attr_project_digest) and a reader with a
+ * different working set does not use it, see session_policy_read.
+ */
+
+enum {
+    PROJECT_SESSION = 0, /* session property */
+    PROJECT_RESPONSE, /* policy response attribute */
+    PROJECT_PROFILE, /* policy response decision (profile attribute) */
+    PROJECT_KINDS
+};
+
+static const char *session_builtin[] = {
+    "timeleft", "maxcaching", /* session ttl */
+    "Host", /* client ip validation */
+    "sunIdentityUserPassword" /* user password */
+};
+
+struct attr_working_set {
+    unsigned long instance_id;
+    uint64_t ts;
+    uint64_t generation;
+    int key[3];
+    uint64_t digest;
+    struct am_namevalue *names[PROJECT_KINDS]; /* names of each kind (no values) */
+    struct am_attr_index *index[PROJECT_KINDS]; /* over names, NULL if there are none */
+    struct attr_working_set *next;
+};
+
+static struct attr_working_set *working_sets = NULL;
+static am_static_mutex_t project_lock = AM_STATIC_MUTEX_INITIALIZER;
+
+static void lock_project() {
+    AM_STATIC_MUTEX_LOCK(&project_lock);
+}
+
+static void unlock_project() {
+    AM_STATIC_MUTEX_UNLOCK(&project_lock);
+}
+
+static void working_set_key(am_config_t *conf, int *key) {
+    key[0] = conf->session_attr_map_sz;
+    key[1] = conf->response_attr_map_sz;
+    key[2] = conf->profile_attr_map_sz;
+}
+
+/*
+ * pass each name the configuration uses to add (names may repeat)
+ */
+static int working_set_names(am_config_t *conf, int (*add)(void *, const char *, int), void *arg) {
+    int status = 0, i;
+
+    for (i = 0; status == 0 && i < (int) ARRAY_SIZE(session_builtin); i++) {
+        status = add(arg, session_builtin[i], PROJECT_SESSION);
+    }
+    for (i = 0; status == 0 && i < conf->session_attr_map_sz; i++) {
+        status = add(arg, conf->session_attr_map[i].name, PROJECT_SESSION);
+    }
+    for (i = 0; status == 0 && i < conf->response_attr_map_sz; i++) {
+        status = add(arg, conf->response_attr_map[i].name, PROJECT_RESPONSE);
+    }
+    for (i = 0; status == 0 && i < conf->profile_attr_map_sz; i++) {
+        status = add(arg, conf->profile_attr_map[i].name, PROJECT_PROFILE);
+    }
+    if (status == 0 && ISVALID(conf->userid_param) && ISVALID(conf->userid_param_type)) {
+        if (strcasecmp(conf->userid_param_type, "LDAP") == 0) {
+            status = add(arg, conf->userid_param, PROJECT_PROFILE);
+        } else if (strcasecmp(conf->userid_param_type, "SESSION") == 0) {
+            status = add(arg, conf->userid_param, PROJECT_SESSION);
+        }
+    }
+    return status;
+}
+
+/*
+ * working set digest: a sum, so that it does not depend on the order of the names
+ */
+static int digest_add(void *arg, const char *name, int kind) {
+    if (ISVALID(name)) {
+        *(uint64_t *) arg += (am_digest64(name, strlen(name)) + (uint64_t) kind) * 0x9e3779b97f4a7c15ULL;
+    }
+    return 0;
+}
+
+static uint64_t working_set_digest(am_config_t *conf) {
+    uint64_t digest = 0;
+    working_set_names(conf, digest_add, &digest);
+    return digest != 0 ? digest : 1; /* 0 stands for unprojected */
+}
+
+static int working_set_add(void *arg, const char *name, int kind) {
+    struct attr_working_set *set = arg;
+    struct am_namevalue *e;
+
+    if (!ISVALID(name)) {
+        return 0;
+    }
+    /* the configuration goes away with the request, keep a copy of the name */
+    e = calloc(1, sizeof (struct am_namevalue));
+    if (e == NULL || (e->n = strdup(name)) == NULL) {
+        free(e);
+        return 1;
+    }
+    e->ns = strlen(name);
+    e->next = set->names[kind];
+    set->names[kind] = e;
+    return 0;
+}
+
+static void delete_working_set(struct attr_working_set *set) {
+    int kind;
+
+    if (set == NULL) {
+        return;
+    }
+    for (kind = 0; kind < PROJECT_KINDS; kind++) {
+        am_attr_index_delete(&set->index[kind]);
+        delete_am_namevalue_list(&set->names[kind]);
+    }
+    free(set);
+}
+
+static struct attr_working_set *working_set_create(am_config_t *conf) {
+    struct attr_working_set *set = calloc(1, sizeof (struct attr_working_set));
+    int kind;
+
+    if (set == NULL) {
+        return NULL;
+    }
+    set->instance_id = conf->instance_id;
+    set->ts = conf->ts;
+    set->generation = conf->generation;
+    working_set_key(conf, set->key);
+    set->digest = working_set_digest(conf);
+
+    if (working_set_names(conf, working_set_add, set) != 0) {
+        delete_working_set(set);
+        return NULL;
+    }
+    for (kind = 0; kind < PROJECT_KINDS; kind++) {
+        if (set->names[kind] != NULL && (set->index[kind] = am_attr_index_new(set->names[kind])) == NULL) {
+            delete_working_set(set);
+            return NULL;
+        }
+    }
+    return set;
+}
+
+static am_bool_t same_snapshot(struct attr_working_set *set, am_config_t *conf) {
+    int key[3];
+    working_set_key(conf, key);
+    return set->instance_id == conf->instance_id && set->ts == conf->ts &&
+            set->generation == conf->generation && memcmp(set->key, key, sizeof (key)) == 0;
+}
+
+/*
+ * working set for the configuration, called with the lock held
+ */
+static struct attr_working_set *working_set_get(am_config_t *conf) {
+    struct attr_working_set *set, *e, *prev;
+
+    for (prev = NULL, e = working_sets; e != NULL; prev = e, e = e->next) {
+        if (e->instance_id == conf->instance_id) break;
+    }
+    if (e != NULL && same_snapshot(e, conf)) {
+        return e;
+    }
+    set = working_set_create(conf);
+    if (set == NULL) {
+        return NULL;
+    }
+    if (e != NULL) {
+        /* replace the working set of an earlier configuration */
+        if (prev == NULL) {
+            working_sets = e->next;
+        } else {
+            prev->next = e->next;
+        }
+        delete_working_set(e);
+    }
+    set->next = working_sets;
+    working_sets = set;
+    return set;
+}
+
+static void project_list(struct attr_working_set *set, struct am_namevalue **list, int kind) {
+    struct am_namevalue **p = list, *e;
+    const char **values;
+
+    while ((e = *p) != NULL) {
+        if (e->n != NULL && am_attr_index_find(set->index[kind], e->n, NULL, &values) > 0) {
+            p = &e->next;
+            continue;
+        }
+        *p = e->next;
+        AM_FREE(e->n, e->v, e);
+    }
+}
+
+/**
+ * Digest of the working set of an agent configuration, recorded with the session/policy cache entries projected
+ * with it; 0 when there is no configuration (nothing is projected).
+ */
+uint64_t am_attr_project_digest(am_config_t *conf) {
+    struct attr_working_set *set;
+    uint64_t digest;
+
+    if (conf == NULL) {
+        return 0;
+    }
+    if (conf->ts == 0) {
+        return working_set_digest(conf);
+    }
+    lock_project();
+    set = working_set_get(conf);
+    digest = set != NULL ? set->digest : working_set_digest(conf);
+    unlock_project();
+    return digest;
+}
+
+/**
+ * Remove the attributes the agent configuration does not use from a session/policy call result.
+ */
+void am_attr_project(am_config_t *conf, struct am_policy_result *policy, struct am_namevalue **session) {
+    struct attr_working_set *set;
+    struct am_policy_result *p;
+
+    if (conf == NULL) {
+        return;
+    }
+
+    if (conf->ts == 0) {
+        /* not a cached configuration snapshot */
+        set = working_set_create(conf);
+    } else {
+        lock_project();
+        set = working_set_get(conf);
+    }
+
+    if (set != NULL) {
+        if (session != NULL) {
+            project_list(set, session, PROJECT_SESSION);
+        }
+        for (p = policy; p != NULL; p = p->next) {
+            project_list(set, &p->response_attributes, PROJECT_RESPONSE);
+            project_list(set, &p->response_decisions, PROJECT_PROFILE);
+        }
+    }
+
+    if (conf->ts == 0) {
+        delete_working_set(set);
+    } else {
+        unlock_project();
+    }
+}
+
+/**
+ * Drop all cached working sets.
+ */
+void am_attr_project_shutdown() {
+    struct attr_working_set *e, *next, *list;
+
+    lock_project();
+    list = working_sets;
+    working_sets = NULL;
+    unlock_project();
+    for (e = list; e != NULL; e = next) {
+        next = e->next;
+        delete_working_set(e);
+    }
+}
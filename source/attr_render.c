@@ -0,0 +1,326 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2016 ForgeRock AS.
+ */
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "thread.h"
+
+/*
+ * Rendered user attribute headers and cookies.
+ *
+ * For a session, the session/policy cache entry its attributes were read from, the matching policy entry
+ * and the agent configuration snapshot, set_user_attributes makes the same request headers and response
+ * cookies on every request. They are recorded once (am_attr_render_add) and kept in a per-process table,
+ * so that later requests of the session replay them to the container callbacks instead of looking up,
+ * joining, encoding and formatting every mapped attribute again.
+ *
+ * The table is set associative: a session maps to a row of ATTR_RENDER_WAYS entries and replaces the least
+ * recently used one of them. It keeps ATTR_RENDER_SESSIONS sessions, or the number given with the
+ * AM_ATTR_RENDER_SESSIONS environment variable (up to ATTR_RENDER_MAX_SESSIONS), and is made when the first
+ * set is kept.
+ *
+ * A rendered set is a single block: the set header, the session token it belongs to and one record per
+ * header or cookie, so that it is copied in and out of the table at once. Persistent cookies get a new
+ * Expires date (from their Max-Age value) when they are replayed.
+ */
+
+#define ATTR_RENDER_WAYS 4
+#define ATTR_RENDER_SESSIONS 1024
+#define ATTR_RENDER_MAX_SESSIONS 65536
+#define ATTR_RENDER_MAX_SIZE 32768 /* larger sets are not kept */
+#define ATTR_RENDER_NONE UINT32_MAX
+
+struct attr_render_op {
+    uint32_t size; /* record size, name and value included */
+    uint32_t value; /* offset of the value in the record, or ATTR_RENDER_NONE */
+    uint32_t expires; /* offset of the cookie Expires date in the record, or ATTR_RENDER_NONE */
+    uint32_t expires_sz;
+    int32_t max_age;
+    char response; /* response header (cookie) or request header */
+};
+
+struct am_attr_render {
+    struct am_attr_render_key key;
+    uint64_t used;
+    uint32_t token_sz;
+    uint32_t count;
+    size_t size; /* bytes in use, set header included */
+    size_t capacity;
+};
+
+#define ATTR_RENDER_ALIGN(s) (((s) + 7) & ~((size_t) 7))
+#define ATTR_RENDER_TOKEN(set) ((char *) ((set) + 1))
+#define ATTR_RENDER_FIRST(set) ((struct attr_render_op *) ((char *) ((set) + 1) + ATTR_RENDER_ALIGN((set)->token_sz + 1)))
+#define ATTR_RENDER_NAME(op) ((char *) ((op) + 1))
+
+static struct am_attr_render **render_cache = NULL; /* render_sets rows of ATTR_RENDER_WAYS */
+static uint32_t render_sets = 0;
+static uint64_t render_clock = 0;
+static am_static_mutex_t render_lock = AM_STATIC_MUTEX_INITIALIZER;
+
+static void lock_render() {
+    AM_STATIC_MUTEX_LOCK(&render_lock);
+}
+
+static void unlock_render() {
+    AM_STATIC_MUTEX_UNLOCK(&render_lock);
+}
+
+static uint32_t render_table_sets() {
+    char *env = getenv("AM_ATTR_RENDER_SESSIONS");
+    uint32_t sessions = ATTR_RENDER_SESSIONS;
+
+    if (env != NULL) {
+        char *endp = NULL;
+        unsigned long v = strtoul(env, &endp, AM_BASE_TEN);
+        if (env < endp && *endp == '\0' && v > 0 && v <= ATTR_RENDER_MAX_SESSIONS) {
+            sessions = (uint32_t) v;
+        }
+    }
+    return (sessions + ATTR_RENDER_WAYS - 1) / ATTR_RENDER_WAYS;
+}
+
+/* called with the table locked, NULL if there is no table */
+static struct am_attr_render **render_set(const struct am_attr_render_key *key, const char *token) {
+    if (render_cache == NULL) {
+        return NULL;
+    }
+    return render_cache + ((key->entry_digest ^ am_hash(token)) % render_sets) * ATTR_RENDER_WAYS;
+}
+
+static am_bool_t render_matches(const struct am_attr_render *set, const struct am_attr_render_key *key, const char *token) {
+    return set->key.entry_digest == key->entry_digest && set->key.ts == key->ts &&
+            set->key.generation == key->generation && set->key.instance_id == key->instance_id &&
+            set->key.entry == key->entry && set->key.context == key->context &&
+            strcmp(ATTR_RENDER_TOKEN(set), token) == 0;
+}
+
+/**
+ * Start recording a set of headers and cookies for a session.
+ *
+ * @return empty set, or NULL on allocation failure
+ */
+struct am_attr_render *am_attr_render_create(const struct am_attr_render_key *key, const char *token) {
+    struct am_attr_render *set;
+    size_t token_sz = strlen(token), size = sizeof (struct am_attr_render) + ATTR_RENDER_ALIGN(token_sz + 1);
+    size_t capacity = size + 1024;
+
+    set = malloc(capacity);
+    if (set == NULL) {
+        return NULL;
+    }
+    set->key = *key;
+    set->token_sz = (uint32_t) token_sz;
+    set->count = 0;
+    set->size = size;
+    set->capacity = capacity;
+    memcpy(ATTR_RENDER_TOKEN(set), token, token_sz + 1);
+    return set;
+}
+
+/**
+ * Record a request header (value NULL clears it) or a response header (a cookie, value NULL).
+ *
+ * @return AM_SUCCESS or AM_ENOMEM
+ */
+am_status_t am_attr_render_add(struct am_attr_render **set, char response, const char *name, const char *value) {
+    struct am_attr_render *s = *set;
+    struct attr_render_op *op;
+    size_t name_sz = strlen(name), value_sz = value != NULL ? strlen(value) + 1 : 0;
+    size_t size = ATTR_RENDER_ALIGN(sizeof (struct attr_render_op) + name_sz + 1 + value_sz);
+    const char *max_age;
+
+    if (s->size + size > s->capacity) {
+        size_t capacity = (s->size + size) * 2;
+        s = realloc(s, capacity);
+        if (s == NULL) {
+            return AM_ENOMEM;
+        }
+        s->capacity = capacity;
+        *set = s;
+    }
+
+    op = (struct attr_render_op *) ((char *) s + s->size);
+    op->size = (uint32_t) size;
+    op->response = response;
+    op->expires = ATTR_RENDER_NONE;
+    op->expires_sz = 0;
+    op->max_age = 0;
+    memcpy(ATTR_RENDER_NAME(op), name, name_sz + 1);
+    if (value != NULL) {
+        op->value = (uint32_t) (sizeof (struct attr_render_op) + name_sz + 1);
+        memcpy((char *) op + op->value, value, value_sz);
+    } else {
+        op->value = ATTR_RENDER_NONE;
+    }
+
+    /* a persistent cookie: name=value[;...];Max-Age=seconds;Expires=date[;...] */
+    if (response && value == NULL && (max_age = strstr(ATTR_RENDER_NAME(op), ";Max-Age=")) != NULL) {
+        const char *next, *expires;
+        while ((next = strstr(max_age + 1, ";Max-Age=")) != NULL) {
+            max_age = next;
+        }
+        op->max_age = (int32_t) strtol(max_age + 9, (char **) &expires, AM_BASE_TEN);
+        if (op->max_age > 0 && strncmp(expires, ";Expires=", 9) == 0) {
+            expires += 9;
+            op->expires = (uint32_t) (expires - (char *) op);
+            op->expires_sz = (uint32_t) strcspn(expires, ";");
+        }
+    }
+
+    s->size += size;
+    s->count++;
+    return AM_SUCCESS;
+}
+
+/**
+ * Make the recorded headers and cookies with the request callbacks. Persistent cookie dates are updated
+ * in place, so the set must be a private copy (am_attr_render_get or a set being recorded).
+ */
+void am_attr_render_replay(am_request_t *r, struct am_attr_render *set) {
+    struct attr_render_op *op = ATTR_RENDER_FIRST(set);
+    char time_string[32];
+    struct tm now;
+    time_t raw;
+    uint32_t i;
+
+    for (i = 0; i < set->count; i++, op = (struct attr_render_op *) ((char *) op + op->size)) {
+        char *name = ATTR_RENDER_NAME(op);
+        const char *value = op->value != ATTR_RENDER_NONE ? (char *) op + op->value : NULL;
+
+        if (!op->response) {
+            r->am_set_header_in_request_f(r, name, value);
+            continue;
+        }
+        if (op->expires != ATTR_RENDER_NONE) {
+            char *expires = (char *) op + op->expires;
+            time(&raw);
+            raw += op->max_age;
+#ifdef _WIN32
+            gmtime_s(&now, &raw);
+            strftime(time_string, sizeof (time_string), AM_COOKIE_TIME_FORMAT, &now);
+#else
+            strftime(time_string, sizeof (time_string), AM_COOKIE_TIME_FORMAT, gmtime_r(&raw, &now));
+#endif
+            if (strlen(time_string) == op->expires_sz) {
+                memcpy(expires, time_string, op->expires_sz);
+            } else {
+                name = am_request_asprintf(r, "%.*s%s%s", (int) (expires - name), name, time_string,
+                        expires + op->expires_sz);
+                if (name == NULL) {
+                    continue;
+                }
+            }
+        }
+        r->am_add_header_in_response_f(r, name, value);
+    }
+}
+
+/**
+ * Find the headers and cookies recorded for a session.
+ *
+ * @return copy of the set in the request arena, or NULL if there is none
+ */
+struct am_attr_render *am_attr_render_get(am_request_t *r, const struct am_attr_render_key *key, const char *token) {
+    struct am_attr_render **set, *copy = NULL;
+    int i;
+
+    lock_render();
+    set = render_set(key, token);
+    for (i = 0; set != NULL && i < ATTR_RENDER_WAYS; i++) {
+        if (set[i] != NULL && render_matches(set[i], key, token)) {
+            set[i]->used = ++render_clock;
+            copy = am_request_alloc(r, set[i]->size);
+            if (copy != NULL) {
+                memcpy(copy, set[i], set[i]->size);
+                copy->capacity = set[i]->size;
+            }
+            break;
+        }
+    }
+    unlock_render();
+    return copy;
+}
+
+/**
+ * Keep a recorded set (the table takes it over, or it is deleted when it is too large or there is no table).
+ */
+void am_attr_render_put(struct am_attr_render **set) {
+    struct am_attr_render *s = *set, **ways, *old;
+    int i, way = 0;
+
+    *set = NULL;
+    if (s == NULL) {
+        return;
+    }
+    if (s->size > ATTR_RENDER_MAX_SIZE) {
+        free(s);
+        return;
+    }
+    lock_render();
+    if (render_cache == NULL) {
+        uint32_t sets = render_table_sets();
+        render_cache = calloc((size_t) sets * ATTR_RENDER_WAYS, sizeof (struct am_attr_render *));
+        if (render_cache == NULL) {
+            unlock_render();
+            free(s);
+            return;
+        }
+        render_sets = sets;
+    }
+    ways = render_set(&s->key, ATTR_RENDER_TOKEN(s));
+    for (i = 0; i < ATTR_RENDER_WAYS; i++) {
+        if (ways[i] == NULL || render_matches(ways[i], &s->key, ATTR_RENDER_TOKEN(s))) {
+            way = i;
+            break;
+        }
+        if (ways[i]->used < ways[way]->used) {
+            way = i;
+        }
+    }
+    s->used = ++render_clock;
+    old = ways[way];
+    ways[way] = s;
+    unlock_render();
+    free(old);
+}
+
+void am_attr_render_delete(struct am_attr_render **set) {
+    if (set != NULL) {
+        free(*set);
+        *set = NULL;
+    }
+}
+
+/**
+ * Drop all rendered sets.
+ */
+void am_attr_render_shutdown() {
+    struct am_attr_render **list;
+    uint32_t i, count;
+
+    lock_render();
+    list = render_cache;
+    count = render_sets * ATTR_RENDER_WAYS;
+    render_cache = NULL;
+    render_sets = 0;
+    unlock_render();
+    for (i = 0; list != NULL && i < count; i++) {
+        free(list[i]);
+    }
+    free(list);
+}
@@ -23,9 +23,15 @@
 
 #define AUDIT_SHM_LOCK_TIMEOUT 500 /* msec */
 #define THROTTLE_CNTRL 50 /* default max number of batch messages per second */
-#define BATCH_SIZE 20
+#define BATCH_SIZE 512 /* max number of audit entries in one batch message */
+#define BATCH_MAX_SIZE 0x40000 /* max size of a batch message (bytes) */
+#define BATCH_MAX_SIZE_COMPRESSED 0x100000 /* max size of a batch message, before compression (bytes) */
 #define DEFAULT_RUN_INTERVAL 5 /* minutes */
 
+#define AUDIT_SPILL_FILE "remote_audit_%lu.jnl"
+#define AUDIT_SPILL_MAGIC 0x41554454u
+#define AUDIT_SPILL_MAX_RECORD 0x100000
+
 #define AUDIT_ENTRY_LINKS(offset) (&((struct am_audit_entry *) AM_GET_POINTER(audit_shm->pool, (offset)))->lh)
 
 #define OFFSET_LIST_APPEND(hdr, links, offset) do {\
@@ -64,8 +70,12 @@ struct am_audit {
         unsigned long instance_id;
         int interval;
         int last;
+        int compress; /* send gzip compressed batch messages */
+        int spill; /* overflow journal has pending entries */
+        uint64_t spill_offset; /* overflow journal read position */
         struct offset_list_hdr list_hdr;
         char config_file[AM_PATH_SIZE];
+        char spill_file[AM_PATH_SIZE];
         char openam[AM_URI_SIZE];
     } config[AM_MAX_INSTANCES];
 };
@@ -85,6 +95,26 @@ struct am_audit_transfer {
     char *config_file;
 };
 
+/* overflow journal record header, followed by the message itself */
+struct am_audit_spill_record {
+    uint32_t magic;
+    uint32_t size;
+    char server_id[12];
+};
+
+struct am_audit_batch {
+    struct am_audit_config *config;
+    am_status_t(*callback)(const char *openam, int count, struct am_audit_transfer *batch);
+    struct am_audit_transfer *entries;
+    int count;
+    int total;
+    int sent;
+    int ratio;
+    uint64_t size;
+    uint64_t max_size;
+    am_timer_t tm;
+};
+
 static am_timer_event_t *audit_timer = NULL;
 static am_shm_t *audit_shm = NULL;
 
@@ -156,15 +186,71 @@ static struct am_audit_config *get_audit_config(unsigned long instance_id) {
     return NULL;
 }
 
+/**
+ * Append an audit entry to the instance overflow journal. Caller must hold the audit_shm lock,
+ * which also serialises journal writers across processes.
+ */
+static am_status_t spill_audit_entry(struct am_audit_config *config,
+        const char *server_id, const char *message, size_t size) {
+    static const char *thisfunc = "spill_audit_entry():";
+    struct am_audit_spill_record rec;
+    FILE *file;
+    int error;
+
+    if (ISINVALID(config->spill_file) || size == 0 || size > AUDIT_SPILL_MAX_RECORD) {
+        return AM_ENOMEM;
+    }
+
+    memset(&rec, 0, sizeof (rec));
+    rec.magic = AUDIT_SPILL_MAGIC;
+    rec.size = (uint32_t) size;
+    if (ISVALID(server_id)) {
+        strncpy(rec.server_id, server_id, sizeof (rec.server_id) - 1);
+    }
+
+    file = fopen(config->spill_file, "ab");
+    if (file == NULL) {
+        AM_LOG_ERROR(config->instance_id, "%s unable to open %s (error: %d)",
+                thisfunc, config->spill_file, errno);
+        return AM_FILE_ERROR;
+    }
+    error = fwrite(&rec, sizeof (rec), 1, file) != 1 || fwrite(message, 1, size, file) != size;
+    if (fclose(file) != 0 || error) {
+        AM_LOG_ERROR(config->instance_id, "%s failed to write to %s", thisfunc, config->spill_file);
+        return AM_FILE_ERROR;
+    }
+    if (!config->spill) {
+        AM_LOG_WARNING(config->instance_id, "%s spilling audit entries to %s",
+                thisfunc, config->spill_file);
+    }
+    config->spill = AM_TRUE;
+    return AM_SUCCESS;
+}
+
 static am_status_t add_audit_entry(unsigned long instance_id,
         const char *server_id, const char *message, size_t size) {
     int offset;
     struct am_audit_entry *audit_entry;
     struct am_audit_config *config;
 
+    config = get_audit_config(instance_id);
+    if (config == NULL) {
+        return AM_EINVAL;
+    }
+
+    if (config->spill) {
+        /* keep entries in order until the overflow journal is drained */
+        return spill_audit_entry(config, server_id, message, size);
+    }
+
     audit_entry = am_shm_alloc(audit_shm, sizeof (struct am_audit_entry) +size + 1);
+    /* shared memory might have been resized (remapped) */
+    config = get_audit_config(instance_id);
+    if (config == NULL) {
+        return AM_EINVAL;
+    }
     if (audit_entry == NULL) {
-        return AM_ENOMEM;
+        return spill_audit_entry(config, server_id, message, size);
     }
 
     if (ISVALID(server_id)) {
@@ -179,12 +265,6 @@ static am_status_t add_audit_entry(unsigned long instance_id,
 
     audit_entry->lh.next = audit_entry->lh.prev = 0;
 
-    config = get_audit_config(instance_id);
-    if (config == NULL) {
-        am_shm_free(audit_shm, audit_entry);
-        return AM_EINVAL;
-    }
-
     offset = AM_GET_OFFSET(audit_shm->pool, audit_entry);
     OFFSET_LIST_APPEND(&config->list_hdr, AUDIT_ENTRY_LINKS, offset);
     return AM_SUCCESS;
@@ -240,6 +320,142 @@ int am_add_remote_audit_entry(unsigned long instance_id, const char *agent_token
     return status;
 }
 
+/**
+ * Send the batch. Entries of a batch that could not be sent are kept in the overflow journal.
+ * Caller must hold the audit_shm lock.
+ */
+static am_status_t flush_audit_batch(struct am_audit_batch *b) {
+    static const char *thisfunc = "extract_audit_entries():";
+    am_status_t status;
+    int i;
+
+    if (b->count == 0) {
+        return AM_SUCCESS;
+    }
+#ifdef UNIT_TEST
+    printf("sending batch size: %lld bytes, count: %d\n", b->size, b->count);
+#endif
+    AM_LOG_DEBUG(b->config->instance_id, "%s sending %d audit log messages to %s",
+            thisfunc, b->count, b->config->openam);
+    status = b->callback(b->config->openam, b->count, b->entries);
+    if (status != AM_SUCCESS) {
+        AM_LOG_WARNING(b->config->instance_id, "%s failed to send %d audit log messages to %s (%s), keeping them in %s",
+                thisfunc, b->count, b->config->openam, am_strerror(status), b->config->spill_file);
+        for (i = 0; i < b->count; i++) {
+            if (spill_audit_entry(b->config, b->entries[i].server_id, b->entries[i].message,
+                    strlen(b->entries[i].message)) != AM_SUCCESS) {
+                AM_LOG_ERROR(b->config->instance_id, "%s audit log message dropped", thisfunc);
+            }
+        }
+    }
+    for (i = 0; i < b->count; i++) {
+        AM_FREE(b->entries[i].message, b->entries[i].server_id, b->entries[i].config_file);
+        b->entries[i].message = b->entries[i].server_id = b->entries[i].config_file = NULL;
+    }
+    b->count = 0;
+    b->size = 0;
+    if (status == AM_SUCCESS) {
+        b->sent++;
+    }
+    return status;
+}
+
+/**
+ * Add an entry (message ownership is passed on) to the batch, sending the batch when it is full.
+ * Returns AM_TRUE when the batch message rate limit has been reached, or the batch could not be sent.
+ */
+static am_bool_t add_to_audit_batch(struct am_audit_batch *b, char *message, size_t size, const char *server_id) {
+    double elapsed;
+    struct am_audit_transfer *t = &b->entries[b->count];
+
+    if (message == NULL) {
+        return AM_FALSE;
+    }
+
+    t->message = message;
+    t->instance_id = b->config->instance_id;
+    t->server_id = strdup(server_id);
+    t->config_file = strdup(b->config->config_file);
+
+    b->count++;
+    b->total++;
+    b->size += size;
+
+    /* estimate the size of the next message (and overall batch size) */
+    if ((b->size + (size * 2)) < b->max_size && b->count < BATCH_SIZE) {
+        return AM_FALSE;
+    }
+
+    if (flush_audit_batch(b) != AM_SUCCESS) {
+        return AM_TRUE; /* try again next time */
+    }
+
+    elapsed = am_timer_elapsed(&b->tm);
+    if (elapsed > 1 && (b->sent / elapsed) > b->ratio) {
+#ifdef UNIT_TEST
+        printf("total: %d, batches: %d, elapsed: %f\n", b->total, b->sent, elapsed);
+#endif
+        return AM_TRUE;
+    }
+    return AM_FALSE;
+}
+
+/**
+ * Read entries from the overflow journal into the batch, starting at the last read position.
+ * The journal is removed once it is fully consumed.
+ */
+static am_bool_t drain_audit_spill(struct am_audit_batch *b) {
+    static const char *thisfunc = "drain_audit_spill():";
+    struct am_audit_config *config = b->config;
+    struct am_audit_spill_record rec;
+    am_bool_t stop = AM_FALSE, done = AM_FALSE;
+    char *message;
+    FILE *file;
+
+    file = fopen(config->spill_file, "rb");
+    if (file == NULL || fseek(file, (long) config->spill_offset, SEEK_SET) != 0) {
+        done = AM_TRUE;
+    }
+
+    while (!done && !stop) {
+        if (fread(&rec, sizeof (rec), 1, file) != 1) {
+            done = AM_TRUE;
+            break;
+        }
+        if (rec.magic != AUDIT_SPILL_MAGIC || rec.size == 0 || rec.size > AUDIT_SPILL_MAX_RECORD) {
+            AM_LOG_WARNING(config->instance_id, "%s invalid record at offset %"PR_L64" in %s, discarding the rest",
+                    thisfunc, config->spill_offset, config->spill_file);
+            done = AM_TRUE;
+            break;
+        }
+        message = malloc(rec.size + 1);
+        if (message == NULL) {
+            break;
+        }
+        if (fread(message, 1, rec.size, file) != rec.size) {
+            free(message);
+            done = AM_TRUE;
+            break;
+        }
+        message[rec.size] = '\0';
+        rec.server_id[sizeof (rec.server_id) - 1] = '\0';
+        config->spill_offset += sizeof (rec) + rec.size;
+
+        stop = add_to_audit_batch(b, message, rec.size, rec.server_id);
+    }
+
+    if (file != NULL) {
+        fclose(file);
+    }
+    if (done) {
+        AM_LOG_DEBUG(config->instance_id, "%s %s drained", thisfunc, config->spill_file);
+        am_delete_file(config->spill_file);
+        config->spill = AM_FALSE;
+        config->spill_offset = 0;
+    }
+    return stop;
+}
+
 #ifndef UNIT_TEST
 static
 #endif
@@ -248,136 +464,127 @@ am_status_t extract_audit_entries(unsigned long instance_id,
     static const char *thisfunc = "extract_audit_entries():";
     am_status_t status;
     struct am_audit_entry *e;
-    unsigned int offset = 0;
-    struct am_audit_config *config;
-    int i, c = 0, total = 0, ratio;
-    struct am_audit_transfer *batch;
-    uint64_t batch_size = 0;
-    am_timer_t tm;
-    double elapsed;
+    unsigned int offset, next;
+    struct am_audit_batch b;
+    am_bool_t stop = AM_FALSE;
 
-    batch = malloc(BATCH_SIZE * sizeof (struct am_audit_transfer));
-    if (batch == NULL) {
+    memset(&b, 0, sizeof (b));
+    b.entries = calloc(BATCH_SIZE, sizeof (struct am_audit_transfer));
+    if (b.entries == NULL) {
         return AM_ENOMEM;
     }
 
     status = am_shm_lock(audit_shm);
     if (status != AM_SUCCESS) {
-        AM_FREE(batch);
+        AM_FREE(b.entries);
         return status;
     }
 
-    config = get_audit_config(instance_id);
-    if (config == NULL) {
-        AM_FREE(batch);
+    b.config = get_audit_config(instance_id);
+    if (b.config == NULL) {
+        AM_FREE(b.entries);
         am_shm_unlock(audit_shm);
         return AM_EINVAL;
     }
 
-    ratio = throttle_ratio();
-    am_timer_start(&tm);
-
-    AM_OFFSET_LIST_FOR_EACH_OFFSET(audit_shm->pool, &config->list_hdr, e, offset) {
-        batch[c].message = strdup(e->value);
-        batch[c].instance_id = e->instance_id;
-        batch[c].server_id = strdup(e->server_id);
-        batch[c].config_file = strdup(config->config_file);
+    b.callback = callback;
+    b.ratio = throttle_ratio();
+    b.max_size = b.config->compress ? BATCH_MAX_SIZE_COMPRESSED : BATCH_MAX_SIZE;
+    am_timer_start(&b.tm);
 
-        c++;
-        total++;
-        batch_size += e->size;
+    for (offset = b.config->list_hdr.first; offset != 0 && !stop; offset = next) {
+        e = (struct am_audit_entry *) AM_GET_POINTER(audit_shm->pool, offset);
+        next = e->lh.next;
 
-        /* estimate the size of the next message (and overall batch_size) */
-        if ((batch_size + (e->size * 2)) >= 0x4000 || c == BATCH_SIZE) {
-#ifdef UNIT_TEST
-            printf("sending batch size: %lld bytes, count: %d\n", batch_size, c);
-#endif
-            AM_LOG_DEBUG(instance_id, "%s sending %d audit log messages to %s", thisfunc, c, config->openam);
-            callback(config->openam, c, batch);
-            for (i = 0; i < c; i++) {
-                AM_FREE(batch[i].message, batch[i].server_id, batch[i].config_file);
-                batch[i].message = batch[i].server_id = batch[i].config_file = NULL;
-            }
-            c = 0;
-            batch_size = 0;
-        }
+        stop = add_to_audit_batch(&b, strdup(e->value), e->size, e->server_id);
 
-        OFFSET_LIST_UNLINK(&config->list_hdr, AUDIT_ENTRY_LINKS, offset);
+        OFFSET_LIST_UNLINK(&b.config->list_hdr, AUDIT_ENTRY_LINKS, offset);
         am_shm_free(audit_shm, e);
-
-        elapsed = am_timer_elapsed(&tm);
-        if (elapsed > 1 && (total / elapsed) > ratio) {
-#ifdef UNIT_TEST
-            printf("total: %d, elapsed: %f\n", total, elapsed);
-#endif
-            for (i = 0; i < c; i++) {
-                AM_FREE(batch[i].message, batch[i].server_id, batch[i].config_file);
-                batch[i].message = batch[i].server_id = batch[i].config_file = NULL;
-            }
-            c = 0;
-            break;
-        }
     }
 
-    if (c) {
-        total += c;
-        AM_LOG_DEBUG(instance_id, "%s sending %d audit log messages to %s", thisfunc, c, config->openam);
-        callback(config->openam, c, batch);
-        for (i = 0; i < c; i++) {
-            AM_FREE(batch[i].message, batch[i].server_id, batch[i].config_file);
-        }
+    if (!stop && b.config->spill && b.config->list_hdr.first == 0) {
+        /* shared memory has been drained - catch up on the overflow journal */
+        drain_audit_spill(&b);
     }
 
-    if (total > 0) {
-        AM_LOG_DEBUG(instance_id, "%s processed %d entries (%f seconds)",
-                thisfunc, total, am_timer_elapsed(&tm));
+    flush_audit_batch(&b);
+
+    if (b.total > 0) {
+        AM_LOG_DEBUG(instance_id, "%s processed %d entries in %d batches (%f seconds)",
+                thisfunc, b.total, b.sent, am_timer_elapsed(&b.tm));
 #ifdef UNIT_TEST
-        printf("processed %d entries (%f seconds)\n", total, am_timer_elapsed(&tm));
+        printf("processed %d entries (%f seconds)\n", b.total, am_timer_elapsed(&b.tm));
 #endif
     }
 
-    am_timer_stop(&tm);
+    am_timer_stop(&b.tm);
 
     am_shm_unlock(audit_shm);
 
-    AM_FREE(batch);
+    AM_FREE(b.entries);
     return status;
 }
 
 static am_status_t write_entries_to_server(const char *openam, int count, struct am_audit_transfer *batch) {
     static const char *thisfunc = "write_entries_to_server():";
-    int i, msg_size;
+    int i, msg_size, status;
+    size_t msg_len = 0, msg_alloc = 0;
     struct audit_worker_data *wd;
-    char *server_id = NULL, *msg = NULL, *config_file = NULL;
+    struct am_audit_config *config;
+    char *server_id = NULL, *msg = NULL, *config_file = NULL, *entries;
+    size_t entries_sz = 0;
     unsigned long instance_id;
 
     if (count == 0 || batch == NULL || ISINVALID(openam)) {
         return AM_EINVAL;
     }
 
-    wd = malloc(sizeof (struct audit_worker_data));
+    wd = calloc(1, sizeof (struct audit_worker_data));
     if (wd == NULL) {
         return AM_ENOMEM;
     }
 
+    server_id = batch[0].server_id;
+    instance_id = batch[0].instance_id;
+    config_file = batch[0].config_file;
+
+    /* each message is a format string taking its request id and the rest of the batch; 
+     * render them, last one first, into a single buffer */
     for (i = 0; i < count; i++) {
-        if (msg == NULL) {
-            server_id = batch[i].server_id;
-            instance_id = batch[i].instance_id;
-            config_file = batch[i].config_file;
-            msg_size = am_asprintf(&msg, batch[i].message, i + 1, "");
-        } else {
-            msg_size = am_asprintf(&msg, batch[i].message, i + 1, msg);
-        }
-        if (msg_size <= 0 || msg == NULL) {
-            AM_FREE(wd, msg);
+        msg_alloc += strlen(batch[i].message) + 11;
+        entries_sz += strlen(batch[i].message) + 1;
+    }
+    msg = malloc(msg_alloc + 1);
+    /* the entries as they are, for the worker to keep in the overflow journal if the batch can't be sent */
+    entries = malloc(entries_sz);
+    if (msg == NULL || entries == NULL) {
+        AM_FREE(wd, msg, entries);
+        return AM_ENOMEM;
+    }
+    for (i = 0, entries_sz = 0; i < count; i++) {
+        size_t size = strlen(batch[i].message) + 1;
+        memcpy(entries + entries_sz, batch[i].message, size);
+        entries_sz += size;
+    }
+    msg[0] = '\0';
+    for (i = count - 1; i >= 0; i--) {
+        msg_size = snprintf(msg + msg_len, msg_alloc + 1 - msg_len, batch[i].message, i + 1, "");
+        if (msg_size <= 0 || msg_len + msg_size > msg_alloc) {
+            AM_FREE(wd, msg, entries);
             return AM_ENOMEM;
         }
+        msg_len += msg_size;
     }
 
+    config = get_audit_config(instance_id);
+
     wd->instance_id = instance_id;
+    wd->compress = config != NULL ? config->compress : AM_FALSE;
     wd->openam = strdup(openam);
     wd->logdata = msg;
+    wd->entries = entries;
+    wd->entries_sz = entries_sz;
+    wd->server_id = ISVALID(server_id) ? strdup(server_id) : NULL;
     wd->options = malloc(sizeof (am_net_options_t));
     if (wd->options != NULL) {
         am_config_t *conf = NULL;
@@ -388,11 +595,12 @@ static am_status_t write_entries_to_server(const char *openam, int count, struct
         am_config_free(&conf);
     }
 
-    if (am_worker_dispatch(remote_audit_worker, wd) != 0) {
-        AM_LOG_WARNING(instance_id, "%s failed to dispatch remote audit_shm log worker", thisfunc);
+    /* a batch the worker pool can't take is kept in the overflow journal, see flush_audit_batch */
+    if ((status = am_worker_dispatch(remote_audit_worker, wd)) != AM_SUCCESS) {
+        AM_LOG_WARNING(instance_id, "%s failed to dispatch remote audit_shm log worker (%s)", thisfunc, am_strerror(status));
         am_net_options_delete(wd->options);
-        AM_FREE(wd->openam, wd->logdata, wd->options, wd);
-        return AM_ERROR;
+        AM_FREE(wd->openam, wd->logdata, wd->entries, wd->server_id, wd->options, wd);
+        return status;
     }
     return AM_SUCCESS;
 }
@@ -452,6 +660,77 @@ void am_audit_processor_shutdown() {
     audit_timer = NULL;
 }
 
+/**
+ * Overflow journal is kept next to the local audit (or debug) log file.
+ */
+static void get_spill_file_name(am_config_t *conf, char *buf, size_t buf_sz) {
+    const char *log = ISVALID(conf->audit_file) ? conf->audit_file : conf->debug_file;
+    const char *sep = NULL;
+
+    memset(buf, 0, buf_sz);
+    if (ISINVALID(log)) {
+        return;
+    }
+    sep = strrchr(log, '/');
+#ifdef _WIN32
+    if (strrchr(log, '\\') > sep) {
+        sep = strrchr(log, '\\');
+    }
+#endif
+    if (sep == NULL) {
+        return;
+    }
+    snprintf(buf, buf_sz, "%.*s"FILE_PATH_SEP AUDIT_SPILL_FILE, (int) (sep - log), log, conf->instance_id);
+}
+
+void am_audit_compress_disable(unsigned long instance_id) {
+    struct am_audit_config *config;
+
+    if (am_shm_lock(audit_shm) != AM_SUCCESS) {
+        return;
+    }
+    config = get_audit_config(instance_id);
+    if (config != NULL) {
+        config->compress = AM_FALSE;
+    }
+    am_shm_unlock(audit_shm);
+}
+
+/**
+ * Keep the entries of a batch that could not be sent to OpenAM (see remote_audit_worker) in the instance overflow
+ * journal, so that they are sent again with the next batches.
+ *
+ * @param entries batch entries (as passed on to write_entries_to_server), each one nul terminated
+ * @param entries_sz size of entries
+ */
+am_status_t am_audit_spill_batch(unsigned long instance_id, const char *server_id, const char *entries, size_t entries_sz) {
+    static const char *thisfunc = "am_audit_spill_batch():";
+    struct am_audit_config *config;
+    am_status_t status = AM_SUCCESS, spill_status;
+    size_t offset, size;
+
+    if (entries == NULL || audit_shm == NULL) {
+        return AM_EINVAL;
+    }
+    if ((spill_status = am_shm_lock(audit_shm)) != AM_SUCCESS) {
+        return spill_status;
+    }
+    config = get_audit_config(instance_id);
+    if (config == NULL) {
+        am_shm_unlock(audit_shm);
+        return AM_EINVAL;
+    }
+    for (offset = 0; offset < entries_sz; offset += size + 1) {
+        size = strlen(entries + offset);
+        if ((spill_status = spill_audit_entry(config, server_id, entries + offset, size)) != AM_SUCCESS) {
+            AM_LOG_ERROR(instance_id, "%s audit log message dropped", thisfunc);
+            status = spill_status;
+        }
+    }
+    am_shm_unlock(audit_shm);
+    return status;
+}
+
 int am_audit_register_instance(am_config_t *conf) {
     int i;
     struct am_audit *audit_data;
@@ -480,8 +759,12 @@ int am_audit_register_instance(am_config_t *conf) {
         if (audit_data->config[i].instance_id == conf->instance_id) {
             audit_data->config[i].interval = conf->audit_remote_interval <= 0 ?
                     DEFAULT_RUN_INTERVAL : conf->audit_remote_interval;
+            audit_data->config[i].compress = conf->audit_remote_compress > 0;
             strncpy(audit_data->config[i].config_file, conf->config, sizeof (audit_data->config[i].config_file) - 1);
             strncpy(audit_data->config[i].openam, openam, sizeof (audit_data->config[i].openam) - 1);
+            if (!audit_data->config[i].spill) {
+                get_spill_file_name(conf, audit_data->config[i].spill_file, sizeof (audit_data->config[i].spill_file));
+            }
             am_shm_unlock(audit_shm);
             return AM_SUCCESS;
         }
@@ -493,8 +776,14 @@ int am_audit_register_instance(am_config_t *conf) {
             audit_data->config[i].interval = conf->audit_remote_interval <= 0 ?
                     DEFAULT_RUN_INTERVAL : conf->audit_remote_interval;
             audit_data->config[i].last = 0;
+            audit_data->config[i].compress = conf->audit_remote_compress > 0;
             strncpy(audit_data->config[i].config_file, conf->config, sizeof (audit_data->config[i].config_file) - 1);
             strncpy(audit_data->config[i].openam, openam, sizeof (audit_data->config[i].openam) - 1);
+            get_spill_file_name(conf, audit_data->config[i].spill_file, sizeof (audit_data->config[i].spill_file));
+            /* pick up entries left over in the overflow journal by a previous run */
+            audit_data->config[i].spill = ISVALID(audit_data->config[i].spill_file) &&
+                    file_exists(audit_data->config[i].spill_file);
+            audit_data->config[i].spill_offset = 0;
             break;
         }
     }
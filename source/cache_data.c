@@ -332,9 +332,9 @@ static int cache_object_read_map(struct cache_object_ctx *ctx, uint32_t *size) {
     return -1;
 }
 
-/* write initial key for the cache object */
-int cache_object_write_key(struct cache_object_ctx *ctx, char *key) {
-    return cache_object_write_str(ctx, key, (uint32_t) strlen(key));
+/* write initial key (a fixed size digest of the key value) for the cache object */
+int cache_object_write_key(struct cache_object_ctx *ctx, const uint64_t digest[2]) {
+    return cache_object_write_str(ctx, (const char *) digest, 2 * sizeof (uint64_t));
 }
 
 /* move reader past the key string */
@@ -504,6 +504,146 @@ struct am_policy_result *am_policy_result_deserialise(struct cache_object_ctx *c
     return list;
 }
 
+/* policy result without its creation time and action decision ttls, the part sessions can share */
+int am_policy_blob_serialise(struct cache_object_ctx *ctx, const struct am_policy_result *p) {
+    uint32_t count = 0;
+    struct am_action_decision *a;
+
+    cache_object_write_s32(ctx, p->index);
+    cache_object_write_s32(ctx, p->scope);
+    cache_object_write_str(ctx, p->resource, (uint32_t) strlen(p->resource));
+    am_name_value_serialise(ctx, p->response_attributes);
+    am_name_value_serialise(ctx, p->response_decisions);
+
+    for (a = p->action_decisions; a != NULL; a = a->next) {
+        count++;
+    }
+    cache_object_write_array(ctx, count);
+    for (a = p->action_decisions; a != NULL; a = a->next) {
+        cache_object_write_s32(ctx, a->method);
+        cache_object_write_s32(ctx, a->action);
+        am_name_value_serialise(ctx, a->advices);
+    }
+    return ctx->error;
+}
+
+/* fill in a policy result read by am_policy_reference_deserialise, its action decisions (ttls) are reused in order */
+int am_policy_blob_deserialise(struct cache_object_ctx *ctx, struct am_policy_result *p) {
+    uint32_t count = 0;
+    struct am_action_decision *a = p->action_decisions;
+
+    cache_object_read_s32(ctx, &p->index);
+    cache_object_read_s32(ctx, &p->scope);
+    cache_object_read_str(ctx, &p->resource, NULL);
+    p->response_attributes = am_name_value_deserialise(ctx);
+    p->response_decisions = am_name_value_deserialise(ctx);
+
+    cache_object_read_array(ctx, &count);
+    while (count-- && ctx->error == 0) {
+        if (a == NULL) {
+            ctx->error = AM_EINVAL; /* not the policy the reference was made for */
+            break;
+        }
+        cache_object_read_s32(ctx, &a->method);
+        cache_object_read_s32(ctx, &a->action);
+        a->advices = am_name_value_deserialise(ctx);
+        a = a->next;
+    }
+    if (a != NULL && ctx->error == 0) {
+        ctx->error = AM_EINVAL;
+    }
+    return ctx->error;
+}
+
+/* policy list as references to serialised policies (refs, one for each policy): either shared or kept inline */
+int am_policy_reference_serialise(struct cache_object_ctx *ctx, struct am_policy_result *list,
+        const struct am_policy_reference *refs) {
+    uint32_t count = 0, i = 0;
+    struct am_policy_result *p;
+    struct am_action_decision *a;
+
+    for (p = list; p != NULL; p = p->next) {
+        count++;
+    }
+    cache_object_write_array(ctx, count);
+
+    for (p = list; p != NULL; p = p->next, i++) {
+        count = 0;
+        for (a = p->action_decisions; a != NULL; a = a->next) {
+            count++;
+        }
+        cache_object_write_u64(ctx, p->created);
+        cache_object_write_array(ctx, count);
+        for (a = p->action_decisions; a != NULL; a = a->next) {
+            cache_object_write_u64(ctx, a->ttl);
+        }
+        cache_object_write_u64(ctx, refs[i].digest);
+        cache_object_write_u32(ctx, refs[i].size);
+        cache_object_write_str(ctx, refs[i].data, refs[i].data != NULL ? refs[i].size : 0);
+    }
+    return ctx->error;
+}
+
+/*
+ * read policy references: the policy results returned have their creation time and action decision ttls only,
+ * the rest is read with am_policy_blob_deserialise, from refs[i].data when the policy was kept inline (pointing
+ * into the context data) or from the shared policy refs[i].digest, refs[i].size otherwise
+ */
+struct am_policy_result *am_policy_reference_deserialise(struct cache_object_ctx *ctx,
+        struct am_policy_reference **refs, uint32_t *ref_count) {
+    struct am_policy_result *list = NULL;
+    uint32_t count = 0, i, n;
+
+    *refs = NULL;
+    *ref_count = 0;
+
+    cache_object_read_array(ctx, &count);
+    if (ctx->error || count == 0) {
+        return NULL;
+    }
+    if (count > ctx->data_size || (*refs = calloc(count, sizeof (struct am_policy_reference))) == NULL) {
+        ctx->error = ctx->error ? ctx->error : AM_ENOMEM;
+        return NULL;
+    }
+
+    for (i = 0; i < count && ctx->error == 0; i++) {
+        struct am_policy_reference *ref = *refs + i;
+        struct am_policy_result *r = calloc(1, sizeof (struct am_policy_result));
+        uint32_t inline_size = 0;
+
+        if (r == NULL) {
+            ctx->error = AM_ENOMEM;
+            break;
+        }
+        AM_LIST_INSERT(list, r);
+        cache_object_read_u64(ctx, &r->created);
+        n = 0;
+        cache_object_read_array(ctx, &n);
+        while (n-- && ctx->error == 0) {
+            struct am_action_decision *a = calloc(1, sizeof (struct am_action_decision));
+            if (a == NULL) {
+                ctx->error = AM_ENOMEM;
+                break;
+            }
+            AM_LIST_INSERT(r->action_decisions, a);
+            cache_object_read_u64(ctx, &a->ttl);
+        }
+        cache_object_read_u64(ctx, &ref->digest);
+        cache_object_read_u32(ctx, &ref->size);
+        if (cache_object_read_str_size(ctx, &inline_size) != 0 || ctx->data_size < ctx->offset + inline_size ||
+                (inline_size > 0 && inline_size != ref->size)) {
+            ctx->error = ctx->error ? ctx->error : AM_EINVAL;
+            break;
+        }
+        if (inline_size > 0) {
+            ref->data = (uint8_t *) ctx->data + ctx->offset;
+            ctx->offset += inline_size;
+        }
+        (*ref_count)++;
+    }
+    return list;
+}
+
 int am_policy_epoch_deserialise(struct cache_object_ctx *ctx, uint64_t *time_addr) {
     cache_object_read_u64(ctx, time_addr);
     return ctx->error;
@@ -514,4 +654,55 @@ int am_policy_epoch_serialise(struct cache_object_ctx *ctx, uint64_t time) {
     return ctx->error;
 }
 
+int am_attr_project_digest_deserialise(struct cache_object_ctx *ctx, uint64_t *digest) {
+    cache_object_read_u64(ctx, digest);
+    return ctx->error;
+}
+
+int am_attr_project_digest_serialise(struct cache_object_ctx *ctx, uint64_t digest) {
+    cache_object_write_u64(ctx, digest);
+    return ctx->error;
+}
+
+
+
+int am_policy_decision_memo_serialise(struct cache_object_ctx *ctx, uint64_t session_digest,
+        const struct am_policy_decision *decisions, uint32_t count) {
+    uint32_t i;
+
+    cache_object_write_u64(ctx, session_digest);
+    cache_object_write_array(ctx, count);
 
+    for (i = 0; i < count; i++) {
+        cache_object_write_u64(ctx, decisions[i].url_digest);
+        cache_object_write_s32(ctx, decisions[i].method);
+        cache_object_write_s32(ctx, decisions[i].scope);
+        cache_object_write_s32(ctx, decisions[i].context);
+        cache_object_write_s32(ctx, decisions[i].entry);
+        cache_object_write_s32(ctx, decisions[i].action);
+        cache_object_write_s32(ctx, decisions[i].status);
+        cache_object_write_u64(ctx, decisions[i].epoch);
+    }
+    return ctx->error;
+}
+
+int am_policy_decision_memo_deserialise(struct cache_object_ctx *ctx, uint64_t *session_digest,
+        struct am_policy_decision *decisions, uint32_t *count, uint32_t max) {
+    uint32_t i, n = 0;
+
+    cache_object_read_u64(ctx, session_digest);
+    cache_object_read_array(ctx, &n);
+
+    for (i = 0; i < n && i < max && ctx->error == 0; i++) {
+        cache_object_read_u64(ctx, &decisions[i].url_digest);
+        cache_object_read_s32(ctx, &decisions[i].method);
+        cache_object_read_s32(ctx, &decisions[i].scope);
+        cache_object_read_s32(ctx, &decisions[i].context);
+        cache_object_read_s32(ctx, &decisions[i].entry);
+        cache_object_read_s32(ctx, &decisions[i].action);
+        cache_object_read_s32(ctx, &decisions[i].status);
+        cache_object_read_u64(ctx, &decisions[i].epoch);
+    }
+    *count = i;
+    return ctx->error;
+}
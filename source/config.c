@@ -154,15 +154,19 @@ enum {
     AM_CONF_PROXY_USER,
     AM_CONF_PROXY_PASSWORD,
     AM_CONF_CDSSO_DENY_CLEANUP_DISABLE,
-    AM_CONF_POLICY_EVAL_APP
+    AM_CONF_POLICY_EVAL_APP,
+    AM_CONF_AUDIT_REMOTE_COMPRESS,
+    AM_CONF_INVALID_TOKEN_CACHE_VALID
 };
 
 struct am_instance {
     struct offset_list list; /* list of instance configurations */
+    uint64_t generation; /* instance configurations made */
 };
 
 struct am_instance_entry {
     uint64_t ts;
+    uint64_t generation; /* tells configurations made in the same second apart */
     unsigned long instance_id;
     char token[AM_MAX_TOKEN_LENGTH];
     char name[AM_HASH_TABLE_KEY_SIZE]; /* agent id */
@@ -203,6 +207,7 @@ int am_configuration_init(int id) {
         am_shm_lock(conf);
         /* initialize head node */
         instance_data->list.next = instance_data->list.prev = 0;
+        instance_data->generation = 0;
         /* store instance_data offset (for other processes) */
         am_shm_set_user_offset(conf, AM_GET_OFFSET(conf->pool, instance_data));
         am_shm_unlock(conf);
@@ -472,6 +477,9 @@ static int am_create_instance_entry_data(uint32_t h, am_config_t *c, char all) {
         if (c->token_cache_valid > 0) {
             SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_TOKEN_CACHE_VALID, 0), c->token_cache_valid);
         }
+        if (c->invalid_token_cache_valid != 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_INVALID_TOKEN_CACHE_VALID, 0), c->invalid_token_cache_valid);
+        }
         if (ISVALID(c->userid_param)) {
             SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_UID_PARAM, 0), c->userid_param);
         }
@@ -800,6 +808,9 @@ static int am_create_instance_entry_data(uint32_t h, am_config_t *c, char all) {
         if (ISVALID(c->audit_file_remote)) {
             SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_AUDIT_REMOTE_FILE, 0), c->audit_file_remote);
         }
+        if (c->audit_remote_compress > 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_AUDIT_REMOTE_COMPRESS, 0), c->audit_remote_compress);
+        }
         if (ISVALID(c->audit_file_disposition)) {
             SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_AUDIT_FILE_DISPOSITION, 0), c->audit_file_disposition);
         }
@@ -885,6 +896,9 @@ static am_config_t *am_get_stored_agent_config(struct am_instance_entry *c) {
             case AM_CONF_AUDIT_REMOTE_FILE:
                 r->audit_file_remote = strndup(i->value, i->size[0]);
                 break;
+            case AM_CONF_AUDIT_REMOTE_COMPRESS:
+                r->audit_remote_compress = i->num_value;
+                break;
             case AM_CONF_AUDIT_FILE_DISPOSITION:
                 r->audit_file_disposition = strndup(i->value, i->size[0]);
                 break;
@@ -986,6 +1000,9 @@ static am_config_t *am_get_stored_agent_config(struct am_instance_entry *c) {
             case AM_CONF_TOKEN_CACHE_VALID:
                 r->token_cache_valid = i->num_value;
                 break;
+            case AM_CONF_INVALID_TOKEN_CACHE_VALID:
+                r->invalid_token_cache_valid = i->num_value;
+                break;
             case AM_CONF_UID_PARAM:
                 r->userid_param = strndup(i->value, i->size[0]);
                 break;
@@ -1510,6 +1527,7 @@ static int am_set_agent_config(unsigned long instance_id, const char *xml,
 
     c->instance_id = instance_id;
     c->ts = time(NULL);
+    c->generation = ++instance_data->generation;
     memset(c->token, 0, sizeof (c->token));
     if (ISVALID(token)) {
         strncpy(c->token, token, sizeof (c->token) - 1);
@@ -1721,6 +1739,7 @@ int am_get_agent_config(unsigned long instance_id, const char *config_file, am_c
             if (*cnf != NULL) {
                 (*cnf)->instance_id = instance_id;
                 (*cnf)->ts = c->ts;
+                (*cnf)->generation = c->generation;
                 (*cnf)->token = strdup(c->token);
                 (*cnf)->config = strdup(c->config);
                 if (ISVALID((*cnf)->cert_key_pass)) {
@@ -1813,6 +1832,7 @@ int am_get_agent_config_cache_or_local(unsigned long instance_id, const char *co
         if (*cnf != NULL) {
             (*cnf)->instance_id = instance_id;
             (*cnf)->ts = entry->ts;
+            (*cnf)->generation = entry->generation;
             (*cnf)->token = strdup(entry->token);
             (*cnf)->config = strdup(entry->config);
             if (ISVALID((*cnf)->cert_key_pass)) {
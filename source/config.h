@@ -44,6 +44,7 @@ typedef struct am_config_map {
 
 typedef struct {
     uint64_t ts;
+    uint64_t generation; /* configuration cache entry, with ts */
     unsigned long instance_id;
     char *token;
     char *config;
@@ -71,6 +72,7 @@ typedef struct {
     char *audit_file;
     char *audit_file_remote;
     int audit_remote_interval; /* minutes */
+    int audit_remote_compress;
     char *audit_file_disposition;
 
     char *cert_key_file;
@@ -114,6 +116,7 @@ typedef struct {
     int url_eval_case_ignore;
     int policy_cache_valid; /* seconds */
     int token_cache_valid;
+    int invalid_token_cache_valid; /* seconds, 0 for the default, negative to disable */
 
     char *userid_param;
     char *userid_param_type;
@@ -308,6 +311,7 @@ typedef struct {
 
 #define AM_AGENTS_CONFIG_POLICY_CACHE_VALID "com.sun.identity.agents.config.policy.cache.polling.interval"        
 #define AM_AGENTS_CONFIG_TOKEN_CACHE_VALID "com.sun.identity.agents.config.sso.cache.polling.interval"       
+#define AM_AGENTS_CONFIG_INVALID_TOKEN_CACHE_VALID "org.forgerock.agents.config.sso.invalid.cache.lifetime"
 
 #define AM_AGENTS_CONFIG_UID_PARAM "com.sun.identity.agents.config.userid.param"        
 #define AM_AGENTS_CONFIG_UID_PARAM_TYPE "com.sun.identity.agents.config.userid.param.type"
@@ -408,6 +412,7 @@ typedef struct {
 
 #define AM_AGENTS_CONFIG_AUDIT_REMOTE_FILE "com.sun.identity.agents.config.remote.logfile"
 #define AM_AGENTS_CONFIG_AUDIT_REMOTE_INTERVAL "com.sun.identity.agents.config.remote.log.interval"
+#define AM_AGENTS_CONFIG_AUDIT_REMOTE_COMPRESS "org.forgerock.agents.config.remote.log.compress"
 #define AM_AGENTS_CONFIG_AUDIT_DISPOSITION "com.sun.identity.agents.config.log.disposition"
 
 #define AM_AGENTS_CONFIG_ANONYMOUS_USER_ENABLE "com.sun.identity.agents.config.anonymous.user.enable"
@@ -280,6 +280,7 @@ static void parse_other_options(am_xml_parser_ctx_t *ctx, const char *val, int l
     parse_config_value(ctx, AM_AGENTS_CONFIG_CMP_CASE_IGNORE, CONF_NUMBER, NULL, &ctx->conf->url_eval_case_ignore, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_POLICY_CACHE_VALID, CONF_NUMBER, NULL, &ctx->conf->policy_cache_valid, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_TOKEN_CACHE_VALID, CONF_NUMBER, NULL, &ctx->conf->token_cache_valid, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_INVALID_TOKEN_CACHE_VALID, CONF_NUMBER, NULL, &ctx->conf->invalid_token_cache_valid, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_UID_PARAM, CONF_STRING, NULL, &ctx->conf->userid_param, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_UID_PARAM_TYPE, CONF_STRING, NULL, &ctx->conf->userid_param_type, val, len);
 
@@ -376,6 +377,7 @@ static void parse_other_options(am_xml_parser_ctx_t *ctx, const char *val, int l
 
     parse_config_value(ctx, AM_AGENTS_CONFIG_AUDIT_REMOTE_INTERVAL, CONF_NUMBER, NULL, &ctx->conf->audit_remote_interval, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_AUDIT_REMOTE_FILE, CONF_STRING, NULL, &ctx->conf->audit_file_remote, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_AUDIT_REMOTE_COMPRESS, CONF_NUMBER, NULL, &ctx->conf->audit_remote_compress, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_AUDIT_DISPOSITION, CONF_STRING, NULL, &ctx->conf->audit_file_disposition, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_AUDIT_LEVEL, CONF_AUDIT_LEVEL, NULL, &ctx->conf->audit_level, val, len);
 
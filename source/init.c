@@ -88,13 +88,17 @@ int am_shutdown(int id) {
     am_url_validator_shutdown();
     am_audit_processor_shutdown();
     am_audit_shutdown();
+    am_cache_worker_shutdown(); /* before the worker pool its gc ticks are dispatched to */
 #ifdef _WIN32
     am_worker_pool_shutdown();
 #else
     am_worker_pool_shutdown_main();
 #endif
-    am_cache_worker_shutdown();
     am_cache_shutdown();
+    am_not_enforced_rules_shutdown();
+    am_attr_render_shutdown();
+    am_attr_project_shutdown();
+    am_session_decode_shutdown();
     am_configuration_shutdown();
     am_log_shutdown(id);
     am_net_shutdown();
@@ -111,6 +115,10 @@ void am_restart_workers() {
 
 int am_shutdown_worker() {
     am_worker_pool_shutdown();
+    am_not_enforced_rules_shutdown();
+    am_attr_render_shutdown();
+    am_attr_project_shutdown();
+    am_session_decode_shutdown();
     return 0;
 }
 
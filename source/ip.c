@@ -18,7 +18,6 @@
 #include "am.h"
 #include "utility.h"
 
-#define IP6_32BIT_COMPONENTS 4
 
 #ifndef s6_addr32
 #ifdef __sun
@@ -194,102 +193,6 @@ int ipv4_pton(const char * p, struct in_addr * n) {
     return -1;                                  /* ip v4 part fails */
 }
 
-/**
- * Test equivalence masked bits in two ipv4 addresses in network form
- * 
- * @return AM_TRUE if addr is within the masked ip v4 address range in net
- */
-static am_bool_t cidr_match(const struct in_addr * addr, const struct in_addr * net, int bits) {
-    if (bits == 0) {
-        /* the range is all inclusive - uint32_t << 32 is undefined */
-        return AM_TRUE;
-    }
-
-    /* here and in the function below, we are comparing quads (uint32_t) represented in the network byte
-     * order. xor (^) is used to identify differences between the quads, and then << is used to remove the
-     * differences outside of the network masks number of bits.
-     */
-
-    if ((addr->s_addr ^ net->s_addr) & htonl(0xFFFFFFFFu << (32 - bits)))
-        return AM_FALSE;
-
-    return AM_TRUE;
-}
-
-/**
- * Test masked bits in two ipv6 addresses in network form
- * 
- * @return AM_TRUE if addr is within the masked ip v6 address range in net
- */
-static am_bool_t cidr6_match(const struct in6_addr * addr, const struct in6_addr * net, int bits) {
-    const uint32_t * a = addr->s6_addr32;
-    const uint32_t * n = net->s6_addr32;
-
-    int quads = bits >> 5; /* number of whole quads masked = bits/32 */
-    int remainder = bits & 0x1F; /* number of bits masked in the subsequent quad = bits%32 */
-
-    if (quads) {
-        if (memcmp(a, n, quads * sizeof (uint32_t))) {
-            return AM_FALSE;
-        }
-    }
-
-    if (remainder) {
-        if ((a [quads] ^ n [quads]) & htonl(0xFFFFFFFFu << (32 - remainder))) {
-            return AM_FALSE;
-        }
-    }
-    return AM_TRUE;
-}
-
-/**
- * Tests whether the first argument is in the (inclusive) range of v6 addresses from adr_lo to addr_hi
- * 
- * @return 0 if the address is in the range
- */
-static signed int cmp_ip_range(const struct in_addr * addr, const struct in_addr * addr_lo,
-        const struct in_addr * addr_hi) {
-    const uint32_t a = addr->s_addr;
-    const uint32_t lo = addr_lo->s_addr;
-    const uint32_t hi = addr_hi->s_addr;
-    return ntohl(a) < ntohl(lo) ? -1 : ntohl(hi) < ntohl(a) ? 1 : 0;
-}
-
-/**
- *  Compares two uint32 arrays in network format (requiring ntohl translation)
- * 
- *  @return negative if a < b, positive if a > b, 0 if they are equal
- */
-static signed int cmp_net(const uint32_t * a, const uint32_t * b) {
-    int i, c = 0;
-    for (i = IP6_32BIT_COMPONENTS; 0 < i--;) {
-        uint32_t ha = ntohl(a [i]), hb = ntohl(b [i]);
-        c = CMP(ha, hb);
-        if (c) {
-            break;
-        }
-    }
-    return c;
-}
-
-/**
- * Tests whether the first argument is in the (inclusive) range of v6 addresses from adr_lo to addr_hi
- * 
- * @return 0 if the address is in the range, negative if below the range, positive if its above
- */
-static signed int cmp_ip6_range(const struct in6_addr * addr, const struct in6_addr * addr_lo, const struct in6_addr * addr_hi) {
-    int c;
-    c = cmp_net(addr_lo->s6_addr32, addr->s6_addr32);
-    if (0 < c) {
-        return -1;
-    }
-    c = cmp_net(addr->s6_addr32, addr_hi->s6_addr32);
-    if (0 < c) {
-        return 1;
-    }
-    return 0;
-}
-
 /**
  * Initialize and read an ipv4 presentation, returning in bpits the number of bits
  * 
@@ -346,106 +249,387 @@ static am_bool_t read_full_ip6(const char * ip, struct in6_addr * p) {
     return AM_FALSE;
 }
 
+
+/*
+ * Compiled ip address lists.
+ *
+ * An ip address list (range and CIDR notations, see ip_address_match) is parsed once:
+ *
+ * - CIDR networks go into a binary radix (path compressed) trie for each address family; ip v4 networks are
+ *   held left aligned in 128 bits. A lookup follows the address bits from the root and stops at the first
+ *   network that contains the address, so it takes at most one step per prefix bit, whatever the list size.
+ * - <LO>-<HI> ranges go into a sorted array of intervals for each address family, with overlapping and
+ *   adjacent ranges merged. A lookup is a binary search for the last interval starting at or below the address.
+ *
+ * Items that can never match (bad syntax, mixed families, empty ranges) are left out.
+ */
+
+#define IP_TRIE_NONE 0
+
+struct ip_key {
+    uint64_t hi, lo;
+};
+
+struct ip_trie_node {
+    struct ip_key prefix; /* left aligned, bits past the prefix length are 0 */
+    uint32_t child[2];
+    uint8_t bits;
+    uint8_t network; /* a listed network ends here */
+};
+
+struct ip_range {
+    struct ip_key lo, hi;
+};
+
+struct am_ip_set {
+    uint32_t root[2]; /* ip v4, ip v6 */
+    uint32_t nodes;
+    struct ip_trie_node *node; /* node 0 is unused */
+    unsigned int count[2];
+    struct ip_range *range[2];
+};
+
+#define IP_FAMILY_INDEX(f) ((f) == 6 ? 1 : 0)
+
+static void ip_addr_from_in(const struct in_addr *n, struct am_ip_addr *addr) {
+    addr->family = 4;
+    addr->hi = 0;
+    addr->lo = ntohl(n->s_addr);
+}
+
+static void ip_addr_from_in6(const struct in6_addr *n, struct am_ip_addr *addr) {
+    int i;
+    addr->family = 6;
+    addr->hi = addr->lo = 0;
+    for (i = 0; i < 8; i++) {
+        addr->hi = (addr->hi << 8) | n->s6_addr[i];
+        addr->lo = (addr->lo << 8) | n->s6_addr[i + 8];
+    }
+}
+
 /**
- * Test whether an ip address falls within two inclusive boundaries, ensuring that
- * all addresses are of the same family, v4 or v6, and are not ranges.
+ * Parse a single ip v4 or v6 address (no range), as ip_address_match reads a client address.
  *
- * @return AM_TRUE for success, false on address parse error or out of bounds
+ * @return AM_TRUE if the text is an ip address
  */
-static am_bool_t test_within_bounds(const char * addr_p, const char * lo_p, const char * hi_p) {
-    struct in_addr addr;
-    struct in6_addr addr6;
-    if (read_full_ip(addr_p, &addr)) {
-        struct in_addr lo, hi;
-        if (read_full_ip(lo_p, &lo) && read_full_ip(hi_p, &hi)) {
-            return cmp_ip_range(&addr, &lo, &hi) == 0;
+am_bool_t am_ip_addr_parse(const char *ip, struct am_ip_addr *addr) {
+    struct in_addr n;
+    struct in6_addr n6;
+
+    memset(addr, 0, sizeof (struct am_ip_addr));
+    if (ip == NULL) {
+        return AM_FALSE;
+    }
+    if (read_full_ip(ip, &n)) {
+        ip_addr_from_in(&n, addr);
+        return AM_TRUE;
+    }
+    if (read_full_ip6(ip, &n6)) {
+        ip_addr_from_in6(&n6, addr);
+        return AM_TRUE;
+    }
+    return AM_FALSE;
+}
+
+static struct ip_key ip_key_of(const struct am_ip_addr *addr) {
+    struct ip_key k;
+    if (addr->family == 6) {
+        k.hi = addr->hi;
+        k.lo = addr->lo;
+    } else {
+        k.hi = addr->lo << 32;
+        k.lo = 0;
+    }
+    return k;
+}
+
+static int cmp_ip_key(const struct ip_key *a, const struct ip_key *b) {
+    if (a->hi != b->hi) {
+        return a->hi < b->hi ? -1 : 1;
+    }
+    return a->lo < b->lo ? -1 : a->lo > b->lo ? 1 : 0;
+}
+
+/* key with all bits past the first "bits" cleared */
+static struct ip_key ip_key_prefix(struct ip_key k, int bits) {
+    if (bits <= 0) {
+        k.hi = k.lo = 0;
+    } else if (bits <= 64) {
+        k.hi &= bits == 64 ? UINT64_MAX : UINT64_MAX << (64 - bits);
+        k.lo = 0;
+    } else if (bits < 128) {
+        k.lo &= UINT64_MAX << (128 - bits);
+    }
+    return k;
+}
+
+static int ip_key_bit(const struct ip_key *k, int bit) {
+    return bit < 64 ? (int) (k->hi >> (63 - bit)) & 1 : (int) (k->lo >> (127 - bit)) & 1;
+}
+
+/* number of leading bits two keys have in common */
+static int ip_key_common(const struct ip_key *a, const struct ip_key *b) {
+    uint64_t x = a->hi ^ b->hi;
+    int n = 0;
+    if (x == 0) {
+        x = a->lo ^ b->lo;
+        n = 64;
+        if (x == 0) {
+            return 128;
         }
-    } else if (read_full_ip6(addr_p, &addr6)) {
-        struct in6_addr lo6, hi6;
-        if (read_full_ip6(lo_p, &lo6) && read_full_ip6(hi_p, &hi6)) {
-            return cmp_ip6_range(&addr6, &lo6, &hi6) == 0;
+    }
+    while (!(x & ((uint64_t) 1 << 63))) {
+        x <<= 1;
+        n++;
+    }
+    return n;
+}
+
+static uint32_t new_ip_trie_node(struct am_ip_set *set, const struct ip_key *prefix, int bits, int network) {
+    struct ip_trie_node *n = &set->node[set->nodes];
+    n->prefix = ip_key_prefix(*prefix, bits);
+    n->bits = (uint8_t) bits;
+    n->network = (uint8_t) network;
+    n->child[0] = n->child[1] = IP_TRIE_NONE;
+    return set->nodes++;
+}
+
+/* add a network to a trie; each call adds at most two nodes */
+static void ip_trie_insert(struct am_ip_set *set, uint32_t *root, const struct ip_key *prefix, int bits) {
+    uint32_t *link = root;
+
+    while (*link != IP_TRIE_NONE) {
+        struct ip_trie_node *n = &set->node[*link];
+        int common = ip_key_common(&n->prefix, prefix);
+        if (common > bits) common = bits;
+
+        if (common < n->bits) {
+            /* the network diverges within this node's prefix - split it */
+            uint32_t split = new_ip_trie_node(set, prefix, common, common == bits);
+            struct ip_trie_node *s = &set->node[split];
+            s->child[ip_key_bit(&set->node[*link].prefix, common)] = *link;
+            if (common < bits) {
+                s->child[ip_key_bit(prefix, common)] = new_ip_trie_node(set, prefix, bits, AM_TRUE);
+            }
+            *link = split;
+            return;
+        }
+        if (n->bits == bits) {
+            n->network = AM_TRUE;
+            return;
+        }
+        if (n->network) {
+            return; /* already covered by a shorter network */
         }
+        link = &n->child[ip_key_bit(prefix, n->bits)];
+    }
+    *link = new_ip_trie_node(set, prefix, bits, AM_TRUE);
+}
+
+static am_bool_t ip_trie_match(const struct am_ip_set *set, uint32_t n, const struct ip_key *k) {
+    while (n != IP_TRIE_NONE) {
+        const struct ip_trie_node *node = &set->node[n];
+        struct ip_key p = ip_key_prefix(*k, node->bits);
+        if (p.hi != node->prefix.hi || p.lo != node->prefix.lo) {
+            return AM_FALSE;
+        }
+        if (node->network) {
+            return AM_TRUE;
+        }
+        if (node->bits >= 128) {
+            return AM_FALSE;
+        }
+        n = node->child[ip_key_bit(k, node->bits)];
     }
     return AM_FALSE;
 }
 
 /**
- * Parse a <LO>-<HI> ip address range, and test that an ip address is in that range
- * 
- * @return 0 on success
+ * Parse one list item: a <LO>-<HI> range of full addresses of the same family, or a CIDR network.
+ *
+ * @return the address family (4 or 6), 0 if the item can never match; *bits is the network mask length for
+ *         a CIDR network and -1 for a range
  */
-static am_status_t get_in_bounded_range_status(const char * addr, const char * range) {
-    int c;
-    char *lo_p, *hi_p;
-    char *p = strchr(range, '-');
-    if (p == NULL) {
-        return AM_ENOMEM;
+static int read_ip_item(const char *item, struct ip_range *r, int *bits) {
+    const char *hp = strchr(item, '-');
+    const char *fs = strchr(item, '/');
+    struct am_ip_addr lo, hi;
+
+    if (hp != NULL && fs == NULL) {
+        char *lo_p = strndup(item, hp - item);
+        int family = 0;
+        if (lo_p != NULL && am_ip_addr_parse(lo_p, &lo) && am_ip_addr_parse(hp + 1, &hi) &&
+                lo.family == hi.family) {
+            r->lo = ip_key_of(&lo);
+            r->hi = ip_key_of(&hi);
+            if (cmp_ip_key(&r->lo, &r->hi) <= 0) {
+                family = lo.family;
+            }
+        }
+        am_free(lo_p);
+        *bits = -1;
+        return family;
     }
-    lo_p = strndup(range, p - range);
-    hi_p = strdup(p + 1);
-    if (lo_p && hi_p) {
-        c = test_within_bounds(addr, lo_p, hi_p) ? AM_SUCCESS : AM_NOT_FOUND;
-    } else {
-        c = AM_ENOMEM;
+
+    if (hp == NULL && fs != NULL) {
+        struct in_addr n;
+        struct in6_addr n6;
+        if (read_ip(item, &n, bits)) {
+            ip_addr_from_in(&n, &lo);
+            r->lo = ip_key_of(&lo);
+            return 4;
+        }
+        if (read_ip6(item, &n6, bits)) {
+            ip_addr_from_in6(&n6, &lo);
+            r->lo = ip_key_of(&lo);
+            return 6;
+        }
     }
-    am_free(lo_p);
-    am_free(hi_p);
-    return c;
+    return 0;
+}
+
+static int cmp_ip_range_start(const void *a, const void *b) {
+    return cmp_ip_key(&((const struct ip_range *) a)->lo, &((const struct ip_range *) b)->lo);
+}
+
+/* sort and merge overlapping or adjacent ranges in place, returning the new count */
+static unsigned int merge_ip_ranges(struct ip_range *r, unsigned int count, int family) {
+    struct ip_key top = {family == 6 ? UINT64_MAX : UINT64_MAX << 32, family == 6 ? UINT64_MAX : 0};
+    unsigned int i, n = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+    qsort(r, count, sizeof (struct ip_range), cmp_ip_range_start);
+    for (i = 1; i < count; i++) {
+        struct ip_range *last = &r[n];
+        struct ip_key next = last->hi; /* the address after the last range */
+        if (family == 6) {
+            if (++next.lo == 0) next.hi++;
+        } else {
+            next.hi += (uint64_t) 1 << 32; /* ip v4 keys are left aligned */
+        }
+        if (cmp_ip_key(&last->hi, &top) < 0 && cmp_ip_key(&r[i].lo, &next) > 0) {
+            r[++n] = r[i];
+        } else if (cmp_ip_key(&r[i].hi, &last->hi) > 0) {
+            last->hi = r[i].hi;
+        }
+    }
+    return n + 1;
 }
 
 /**
- * Test that an ip address is within a range specified by a CIDR in the same address family (v4 or v6).
+ * Compile an ip address list.
  *
- * @return AM_SUCCESS on match else NOT_FOUND
+ * @return the compiled list, or NULL if it can not be allocated
  */
-static am_status_t get_in_masked_range_status(const char * addr, const char * range) {
-    struct in_addr addr4;
-    struct in6_addr addr6;
-    int bits;
-    if (read_full_ip(addr, &addr4)) {
-        struct in_addr cidr;
-        if (read_ip(range, &cidr, &bits)) {
-            return cidr_match(&addr4, &cidr, bits) ? AM_SUCCESS : AM_NOT_FOUND;
+struct am_ip_set *am_ip_set_create(const char **list, unsigned int listsize) {
+    struct am_ip_set *set;
+    struct ip_range r;
+    unsigned int i;
+    int f, bits;
+
+    set = calloc(1, sizeof (struct am_ip_set) + (2 * listsize + 1) * sizeof (struct ip_trie_node) +
+            listsize * sizeof (struct ip_range));
+    if (set == NULL) {
+        return NULL;
+    }
+    set->node = (struct ip_trie_node *) (set + 1);
+    set->nodes = 1;
+    /* v4 ranges fill the array from the start, v6 ones from the end */
+    set->range[0] = (struct ip_range *) (set->node + 2 * listsize + 1);
+    set->range[1] = set->range[0] + listsize;
+
+    for (i = 0; list != NULL && i < listsize; i++) {
+        if (ISINVALID(list[i])) {
+            continue;
+        }
+        f = read_ip_item(list[i], &r, &bits);
+        if (f == 0) {
+            continue;
         }
-    } else if (read_full_ip6(addr, &addr6)) {
-        struct in6_addr cidr;
-        if (read_ip6(range, &cidr, &bits)) {
-            return cidr6_match(&addr6, &cidr, bits) ? AM_SUCCESS : AM_NOT_FOUND;
+        if (bits >= 0) {
+            ip_trie_insert(set, &set->root[IP_FAMILY_INDEX(f)], &r.lo, bits);
+        } else if (f == 4) {
+            set->range[0][set->count[0]++] = r;
+        } else {
+            *--set->range[1] = r;
+            set->count[1]++;
         }
     }
-    return AM_NOT_FOUND;
+    set->count[0] = merge_ip_ranges(set->range[0], set->count[0], 4);
+    set->count[1] = merge_ip_ranges(set->range[1], set->count[1], 6);
+    return set;
 }
 
 /**
- * Test that an ip address is within a range in the same address family (v4 or v6).
+ * Test that an address is in a compiled ip address list.
  *
- * @return AM_SUCCESS on match, else NOT_FOUND
+ * @return AM_TRUE if the address is in one of the listed networks or ranges
  */
-am_status_t ip_address_match(const char *ip, const char **list, unsigned int listsize, unsigned long instance_id) {
-    unsigned int i;
-    if (ip == NULL || list == NULL || listsize == 0) {
-        return AM_EINVAL;
+am_bool_t am_ip_set_match(const struct am_ip_set *set, const struct am_ip_addr *addr) {
+    const struct ip_range *r;
+    struct ip_key k;
+    unsigned int lo = 0, hi;
+    int f;
+
+    if (set == NULL || addr == NULL || addr->family == 0) {
+        return AM_FALSE;
     }
+    f = IP_FAMILY_INDEX(addr->family);
+    k = ip_key_of(addr);
 
-    for (i = 0; i < listsize; i++) {
-        const char *hp = strchr(list[i], '-');
-        const char *fs = strchr(list[i], '/');
+    if (ip_trie_match(set, set->root[f], &k)) {
+        return AM_TRUE;
+    }
 
-        if (hp != NULL && fs == NULL) {
-            /* make sure we get address range here: 192.168.1.1-192.168.2.3 */
-            if (get_in_bounded_range_status(ip, list[i]) == AM_SUCCESS) {
-                AM_LOG_INFO(instance_id, "ip_address_match(): found ip address %s in address range %s", ip, list[i]);
-                return AM_SUCCESS;
-            }
+    r = set->range[f];
+    hi = set->count[f];
+    /* find the number of ranges starting at or below the address */
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (cmp_ip_key(&r[mid].lo, &k) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
+    }
+    return lo > 0 && cmp_ip_key(&k, &r[lo - 1].hi) <= 0;
+}
 
-        if (hp == NULL && fs != NULL) {
-            /* and cidr spec here: 192.168.1.1/24 */
-            if (get_in_masked_range_status(ip, list[i]) == AM_SUCCESS) {
-                AM_LOG_INFO(instance_id, "ip_address_match(): found ip address %s in address range %s", ip, list[i]);
-                return AM_SUCCESS;
-            }
-        }
+void am_ip_set_delete(struct am_ip_set **set) {
+    if (set != NULL) {
+        free(*set);
+        *set = NULL;
+    }
+}
+
+/**
+ * Test that an ip address is within a range in the same address family (v4 or v6). The list is
+ * compiled for this call only - use am_ip_set_create for a list that is tested repeatedly.
+ *
+ * @return AM_SUCCESS on match, else NOT_FOUND
+ */
+am_status_t ip_address_match(const char *ip, const char **list, unsigned int listsize, unsigned long instance_id) {
+    struct am_ip_set *set;
+    struct am_ip_addr addr;
+    am_bool_t found;
+
+    if (ip == NULL || list == NULL || listsize == 0) {
+        return AM_EINVAL;
+    }
+    if (!am_ip_addr_parse(ip, &addr)) {
+        return AM_NOT_FOUND;
+    }
+    set = am_ip_set_create(list, listsize);
+    if (set == NULL) {
+        return AM_ENOMEM;
+    }
+    found = am_ip_set_match(set, &addr);
+    am_ip_set_delete(&set);
+    if (found) {
+        AM_LOG_DEBUG(instance_id, "ip_address_match(): found ip address %s in address list", ip);
+        return AM_SUCCESS;
     }
     return AM_NOT_FOUND;
 }
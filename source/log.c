@@ -823,8 +823,7 @@ int am_log_init(int id) {
         return AM_SHM_ERROR;
     }
 
-    log_handle->area = mmap(NULL, log_handle->area_size,
-            PROT_READ | PROT_WRITE, MAP_SHARED, log_handle->mapping, 0);
+    log_handle->area = am_shm_map(log_handle->mapping, log_handle->area_size);
     if (log_handle->area == MAP_FAILED) {
         fprintf(stderr, "am_log_init() mmap failed (%d)\n", errno);
         close(log_handle->mapping);
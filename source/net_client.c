@@ -631,6 +631,7 @@ int am_net_sync_connect(am_net_t *n) {
         return AM_EINVAL;
     }
 
+    url_free(&n->uv);
     if (parse_url(n->url, &n->uv) != 0) {
         AM_LOG_ERROR(n->instance_id,
                 "%s failed to parse url %s", LOGEMPTY(n->url));
@@ -878,6 +879,8 @@ int am_net_close(am_net_t *n) {
     }
     n->ra = NULL;
 
+    url_free(&n->uv);
+
     AM_FREE(n->req_headers);
     n->req_headers = NULL;
 
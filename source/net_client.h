@@ -126,7 +126,7 @@ int am_agent_policy_request(unsigned long instance_id, const char *openam,
 int am_url_validate(unsigned long instance_id, const char *url,
         am_net_options_t *options, int *httpcode);
 int am_agent_audit_request(unsigned long instance_id, const char *openam,
-        const char *logdata, am_net_options_t *options);
+        const char *logdata, int compress, am_net_options_t *options);
 
 void am_net_init();
 void am_net_shutdown();
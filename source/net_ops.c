@@ -931,6 +931,7 @@ static int do_net_connect(am_net_t *conn, struct request_data *req_data,
     status = am_net_sync_connect(conn);
     if (status != AM_SUCCESS) {
         am_net_close(conn);
+        url_free(&am_url);
         AM_FREE(proxy_url);
         return status;
     }
@@ -956,6 +957,7 @@ static int do_net_connect(am_net_t *conn, struct request_data *req_data,
     status = am_net_write(conn, proxy_connect, strlen(proxy_connect));
     if (status != AM_SUCCESS) {
         am_net_close(conn);
+        url_free(&am_url);
         AM_FREE(proxy_url, proxy_connect, proxy_auth);
         return status;
     }
@@ -966,6 +968,8 @@ static int do_net_connect(am_net_t *conn, struct request_data *req_data,
 
         /* reset url to the original request url */
         conn->url = openam;
+        /* the connection takes over the parsed url (path and query storage included) */
+        url_free(&conn->uv);
         memcpy(&conn->uv, &am_url, sizeof (struct url));
         conn->error = 0;
 
@@ -993,6 +997,7 @@ static int do_net_connect(am_net_t *conn, struct request_data *req_data,
         AM_LOG_ERROR(conn->instance_id,
                 "%s unable to establish proxy connection to %s (%s)",
                 thisfunc, openam, LOGEMPTY(req_data->data));
+        url_free(&am_url);
         status = AM_EHOSTUNREACH;
     }
 
@@ -1454,12 +1459,13 @@ int am_url_validate(unsigned long instance_id, const char* url, am_net_options_t
     return status;
 }
 
-int am_agent_audit_request(unsigned long instance_id, const char *openam, const char *logdata, am_net_options_t *options) {
+int am_agent_audit_request(unsigned long instance_id, const char *openam, const char *logdata,
+        int compress, am_net_options_t *options) {
     static const char *thisfunc = "am_agent_audit_request():";
     am_net_t *conn = NULL;
     int status = AM_ERROR;
-    size_t post_sz, post_data_sz;
-    char *post = NULL, *post_data = NULL;
+    size_t post_sz, post_data_sz, body_sz;
+    char *post = NULL, *post_data = NULL, *body = NULL, *tmp;
     struct request_data *req_data = NULL;
 
     if (!ISVALID(logdata) || !ISVALID(openam)) return AM_EINVAL;
@@ -1506,22 +1512,40 @@ int am_agent_audit_request(unsigned long instance_id, const char *openam, const
             "<RequestSet vers=\"1.0\" svcid=\"Logging\" reqid=\"0\">%s</RequestSet>",
             logdata);
     if (post_data != NULL) {
+        body_sz = post_data_sz;
+        if (compress && gzip_deflate(post_data, &body_sz, &body) != 0) {
+            AM_LOG_WARNING(instance_id, "%s failed to compress request data, sending it as is", thisfunc);
+            body_sz = post_data_sz;
+            compress = AM_FALSE;
+        }
         post_sz = am_asprintf(&post, "POST %s/loggingservice HTTP/1.1\r\n"
                 "Host: %s:%d\r\n"
                 "User-Agent: "MODINFO"\r\n"
                 "Accept: text/xml\r\n"
                 "Connection: Close\r\n"
                 "Content-Type: text/xml; charset=UTF-8\r\n"
-                "%s"
-                "Content-Length: %d\r\n\r\n"
-                "%s", conn->uv.path, conn->uv.host, conn->uv.port,
-                NOTNULL(conn->req_headers), post_data_sz, post_data);
+                "%s%s"
+                "Content-Length: %d\r\n\r\n", conn->uv.path, conn->uv.host, conn->uv.port,
+                NOTNULL(conn->req_headers), compress ? "Content-Encoding: gzip\r\n" : "", body_sz);
         if (post != NULL) {
-            AM_LOG_DEBUG(instance_id, "%s sending request:\n%s", thisfunc, post);
-            status = am_net_write(conn, post, post_sz);
+            tmp = realloc(post, post_sz + body_sz + 1);
+            if (tmp == NULL) {
+                free(post);
+                post = NULL;
+                status = AM_ENOMEM;
+            } else {
+                post = tmp;
+            }
+        }
+        if (post != NULL) {
+            AM_LOG_DEBUG(instance_id, "%s sending request:\n%s%s", thisfunc, post,
+                    compress ? "(gzip compressed data)" : post_data);
+            memcpy(post + post_sz, compress ? body : post_data, body_sz);
+            post[post_sz + body_sz] = '\0';
+            status = am_net_write(conn, post, post_sz + body_sz);
             free(post);
         }
-        free(post_data);
+        AM_FREE(post_data, body);
     }
 
     if (status == AM_SUCCESS) {
@@ -1531,6 +1555,12 @@ int am_agent_audit_request(unsigned long instance_id, const char *openam, const
     }
 
     AM_LOG_DEBUG(instance_id, "%s response status code: %d", thisfunc, conn->http_status);
+    if (status == AM_SUCCESS && compress &&
+            (conn->http_status == 400 || conn->http_status == 415)) {
+        AM_LOG_WARNING(instance_id, "%s server does not accept compressed audit data (status code: %d)",
+                thisfunc, conn->http_status);
+        status = AM_EOPNOTSUPP;
+    }
 
     am_net_close(conn);
     if (req_data != NULL) {
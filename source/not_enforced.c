@@ -0,0 +1,647 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2016 ForgeRock AS.
+ */
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "pcre.h"
+#include "thread.h"
+
+/*
+ * Compiled not enforced rules.
+ *
+ * The not enforced url (not_enforced_map), client ip (not_enforced_ip_map) and extended (not_enforced_ext_map)
+ * lists are compiled once per agent configuration into:
+ *
+ * - method bitmaps, for "[GET,0]=..." style entries, so that the method name is not parsed per request
+ * - compiled ip address sets (see am_ip_set_create), one per distinct method bitmap for the client ip list and
+ *   one per extended list entry
+ * - for wildcard patterns, a case-folded character trie keyed by the literal prefix of each pattern; a url can
+ *   only match a pattern if it starts with that prefix (see the policy resource index in policy.c), so a
+ *   lookup walks the url once and verifies the patterns at the nodes passed with policy_compare_url
+ * - for regular expressions, patterns compiled and studied once (pcre JIT is used where it is available)
+ *
+ * Every list is a set: the request is not enforced if any of its entries matches, so evaluation order does not
+ * change the result and the lists are evaluated exactly as handle_not_enforced did, entry by entry. Inverting
+ * the url list (not_enforced_invert) is left to the caller.
+ *
+ * Compiled rules are cached per process for each agent instance and shared (reference counted) between request
+ * threads; an entry is replaced when the configuration changes. Configurations that do not come from the
+ * configuration cache (no timestamp) are compiled for the request only.
+ */
+
+#define RULE_NONE 0
+
+#define METHODS_ALL (~(uint64_t) 0)
+
+enum {
+    SUBJECT_URL = 0,
+    SUBJECT_PATH /* path info or query removed */
+};
+
+struct rule_node {
+    uint32_t child;
+    uint32_t sibling;
+    uint32_t rules; /* position + 1 of the first rule keyed here */
+    unsigned char c;
+};
+
+struct rule {
+    char *pattern;
+    pcre *x;
+    pcre_extra *extra;
+    uint64_t methods;
+    uint32_t next; /* position + 1 of the next rule keyed at the same node */
+    int subject;
+    int group; /* extended list entry, -1 for the url list */
+};
+
+struct rule_set {
+    int count;
+    int size;
+    struct rule *rule;
+    am_bool_t regex;
+    uint32_t nodes;
+    struct rule_node *node; /* wildcard patterns only; node 0 is the root */
+};
+
+struct ip_rule {
+    uint64_t methods;
+    struct am_ip_set *set;
+};
+
+struct am_not_enforced_rules {
+    struct am_not_enforced_rules *next;
+    int refs;
+
+    /* configuration snapshot these rules were compiled from */
+    unsigned long instance_id;
+    uint64_t ts;
+    uint64_t generation;
+    int key[6];
+
+    int ip_count;
+    struct ip_rule *ip;
+
+    struct rule_set url;
+
+    int ext_count;
+    struct am_ip_set **ext_ip;
+    struct rule_set ext;
+};
+
+static struct am_not_enforced_rules *rules_cache = NULL;
+static am_static_mutex_t rules_lock = AM_STATIC_MUTEX_INITIALIZER;
+
+static void lock_rules() {
+    AM_STATIC_MUTEX_LOCK(&rules_lock);
+}
+
+static void unlock_rules() {
+    AM_STATIC_MUTEX_UNLOCK(&rules_lock);
+}
+
+static am_bool_t method_allowed(uint64_t methods, int method) {
+    if (methods == METHODS_ALL) {
+        return AM_TRUE;
+    }
+    return method >= 0 && method < 64 && (methods & ((uint64_t) 1 << method)) != 0;
+}
+
+/**
+ * Read the method of a "[method,]index" map key.
+ *
+ * @return method bitmap, METHODS_ALL when the key has no method
+ */
+static uint64_t read_methods(const char *key) {
+    char *p = key != NULL ? strstr(key, AM_COMMA_CHAR) : NULL;
+    char *pv;
+    int mtn;
+
+    if (p == NULL) {
+        return METHODS_ALL;
+    }
+    pv = strndup(key, p - key);
+    if (pv == NULL) {
+        return 0;
+    }
+    mtn = am_method_str_to_num(pv);
+    free(pv);
+    return mtn >= 0 && mtn < 64 ? (uint64_t) 1 << mtn : 0;
+}
+
+static am_status_t add_rule(struct rule_set *set, const char *pattern, size_t pattern_sz,
+        uint64_t methods, int subject, int group) {
+    struct rule *e;
+
+    if (set->count == set->size) {
+        int size = set->size == 0 ? 16 : set->size * 2;
+        struct rule *rule = realloc(set->rule, size * sizeof (struct rule));
+        if (rule == NULL) {
+            return AM_ENOMEM;
+        }
+        set->rule = rule;
+        set->size = size;
+    }
+    e = &set->rule[set->count];
+    memset(e, 0, sizeof (struct rule));
+    e->pattern = strndup(pattern, pattern_sz);
+    if (e->pattern == NULL) {
+        return AM_ENOMEM;
+    }
+    e->methods = methods;
+    e->subject = subject;
+    e->group = group;
+    set->count++;
+    return AM_SUCCESS;
+}
+
+static uint32_t rule_node_child(struct rule_set *set, uint32_t n, unsigned char c) {
+    uint32_t i;
+    for (i = set->node[n].child; i != RULE_NONE; i = set->node[i].sibling) {
+        if (set->node[i].c == c) {
+            return i;
+        }
+    }
+    return RULE_NONE;
+}
+
+static am_status_t compile_rule_set(unsigned long instance_id, struct rule_set *set) {
+    size_t nodes = 1;
+    int i;
+
+    if (set->count == 0) {
+        return AM_SUCCESS;
+    }
+
+    if (set->regex) {
+        for (i = 0; i < set->count; i++) {
+            struct rule *e = &set->rule[i];
+            const char *error = NULL;
+            int erroroffset;
+            e->x = pcre_compile(e->pattern, 0, &error, &erroroffset, NULL);
+            if (e->x == NULL) {
+                /* never matches, as with match() */
+                AM_LOG_DEBUG(instance_id, "compile_rule_set(): pcre_compile failed on \"%s\" with error %s",
+                        e->pattern, (error == NULL) ? "unknown" : error);
+                continue;
+            }
+            e->extra = pcre_study(e->x, PCRE_STUDY_JIT_COMPILE, &error);
+        }
+        return AM_SUCCESS;
+    }
+
+    for (i = 0; i < set->count; i++) {
+        nodes += am_url_pattern_prefix_length(set->rule[i].pattern);
+    }
+    if (nodes > UINT32_MAX) {
+        return AM_ENOMEM;
+    }
+    set->node = malloc(nodes * sizeof (struct rule_node));
+    if (set->node == NULL) {
+        return AM_ENOMEM;
+    }
+    memset(set->node, 0, sizeof (struct rule_node));
+    set->nodes = 1;
+
+    for (i = 0; i < set->count; i++) {
+        struct rule *e = &set->rule[i];
+        size_t k, len = am_url_pattern_prefix_length(e->pattern);
+        uint32_t n = 0;
+        for (k = 0; k < len; k++) {
+            unsigned char c = (unsigned char) tolower((unsigned char) e->pattern[k]);
+            uint32_t child = rule_node_child(set, n, c);
+            if (child == RULE_NONE) {
+                child = set->nodes++;
+                set->node[child].c = c;
+                set->node[child].child = RULE_NONE;
+                set->node[child].rules = 0;
+                set->node[child].sibling = set->node[n].child;
+                set->node[n].child = child;
+            }
+            n = child;
+        }
+        e->next = set->node[n].rules;
+        set->node[n].rules = i + 1;
+    }
+    return AM_SUCCESS;
+}
+
+static void delete_rule_set(struct rule_set *set) {
+    int i;
+    for (i = 0; i < set->count; i++) {
+        struct rule *e = &set->rule[i];
+        if (e->extra != NULL) {
+            pcre_free_study(e->extra);
+        }
+        if (e->x != NULL) {
+            pcre_free(e->x);
+        }
+        free(e->pattern);
+    }
+    AM_FREE(set->rule, set->node);
+}
+
+static void delete_rules(struct am_not_enforced_rules *rules) {
+    int i;
+    if (rules == NULL) {
+        return;
+    }
+    for (i = 0; i < rules->ip_count; i++) {
+        am_ip_set_delete(&rules->ip[i].set);
+    }
+    for (i = 0; i < rules->ext_count; i++) {
+        am_ip_set_delete(&rules->ext_ip[i]);
+    }
+    delete_rule_set(&rules->url);
+    delete_rule_set(&rules->ext);
+    AM_FREE(rules->ip, rules->ext_ip, rules);
+}
+
+static void rules_key(am_config_t *conf, int *key) {
+    key[0] = conf->not_enforced_map_sz;
+    key[1] = conf->not_enforced_ip_map_sz;
+    key[2] = conf->not_enforced_ext_map_sz;
+    key[3] = conf->not_enforced_regex_enable;
+    key[4] = conf->not_enforced_ext_regex_enable;
+    key[5] = conf->path_info_ignore_not_enforced || conf->path_info_ignore;
+}
+
+static am_status_t compile_ip_rules(am_config_t *conf, struct am_not_enforced_rules *rules) {
+    const char **list;
+    uint64_t *methods;
+    int i, j, n;
+
+    if (conf->not_enforced_ip_map_sz <= 0) {
+        return AM_SUCCESS;
+    }
+    list = malloc(conf->not_enforced_ip_map_sz * sizeof (char *));
+    methods = malloc(conf->not_enforced_ip_map_sz * sizeof (uint64_t));
+    rules->ip = calloc(conf->not_enforced_ip_map_sz, sizeof (struct ip_rule));
+    if (list == NULL || methods == NULL || rules->ip == NULL) {
+        AM_FREE(list, methods);
+        return AM_ENOMEM;
+    }
+    for (i = 0; i < conf->not_enforced_ip_map_sz; i++) {
+        methods[i] = read_methods(conf->not_enforced_ip_map[i].name);
+    }
+
+    /* one ip address list for each distinct method bitmap */
+    for (i = 0; i < conf->not_enforced_ip_map_sz; i++) {
+        for (j = 0; j < rules->ip_count; j++) {
+            if (rules->ip[j].methods == methods[i]) break;
+        }
+        if (j < rules->ip_count || methods[i] == 0) {
+            continue;
+        }
+        for (n = 0, j = i; j < conf->not_enforced_ip_map_sz; j++) {
+            if (methods[j] == methods[i]) {
+                list[n++] = conf->not_enforced_ip_map[j].value;
+            }
+        }
+        rules->ip[rules->ip_count].methods = methods[i];
+        rules->ip[rules->ip_count].set = am_ip_set_create(list, n);
+        if (rules->ip[rules->ip_count++].set == NULL) {
+            AM_FREE(list, methods);
+            return AM_ENOMEM;
+        }
+    }
+    AM_FREE(list, methods);
+    return AM_SUCCESS;
+}
+
+static am_status_t compile_url_rules(am_config_t *conf, struct am_not_enforced_rules *rules) {
+    am_bool_t path_subject = (conf->path_info_ignore_not_enforced || conf->path_info_ignore) &&
+            !conf->not_enforced_regex_enable;
+    int i;
+
+    rules->url.regex = conf->not_enforced_regex_enable ? AM_TRUE : AM_FALSE;
+    for (i = 0; i < conf->not_enforced_map_sz; i++) {
+        am_config_map_t *m = &conf->not_enforced_map[i];
+        uint64_t methods;
+        if (ISINVALID(m->value)) continue;
+        methods = read_methods(m->name);
+        if (methods == 0) continue;
+        if (add_rule(&rules->url, m->value, strlen(m->value), methods,
+                methods == METHODS_ALL && path_subject ? SUBJECT_PATH : SUBJECT_URL, -1) != AM_SUCCESS) {
+            return AM_ENOMEM;
+        }
+    }
+    return compile_rule_set(conf->instance_id, &rules->url);
+}
+
+static am_status_t compile_ext_rules(am_config_t *conf, struct am_not_enforced_rules *rules) {
+    int i;
+
+    if (conf->not_enforced_ext_map_sz <= 0) {
+        return AM_SUCCESS;
+    }
+    rules->ext.regex = conf->not_enforced_ext_regex_enable ? AM_TRUE : AM_FALSE;
+    rules->ext_ip = calloc(conf->not_enforced_ext_map_sz, sizeof (struct am_ip_set *));
+    if (rules->ext_ip == NULL) {
+        return AM_ENOMEM;
+    }
+
+    for (i = 0; i < conf->not_enforced_ext_map_sz; i++) {
+        am_config_map_t *m = &conf->not_enforced_ext_map[i];
+        char *p, *v, *t, *is;
+        const char **list;
+        int n = 0, status;
+        if (!ISVALID(m->value)) continue;
+        p = strstr(m->value, AM_PIPE_CHAR); /* 10.1.1.0/24 10.1.2.1-10.1.2.7|url1 url2 */
+        if (p == NULL) continue;
+        is = strndup(m->value, p - m->value);
+        list = malloc((p - m->value + 1) / 2 * sizeof (char *) + sizeof (char *));
+        if (is == NULL || list == NULL) {
+            AM_FREE(is, list);
+            return AM_ENOMEM;
+        }
+        for ((v = strtok_r(is, AM_SPACE_CHAR, &t)); v; (v = strtok_r(NULL, AM_SPACE_CHAR, &t))) {
+            list[n++] = v;
+        }
+        rules->ext_ip[rules->ext_count] = am_ip_set_create(list, n);
+        AM_FREE(is, list);
+        if (rules->ext_ip[rules->ext_count] == NULL) {
+            return AM_ENOMEM;
+        }
+
+        for (v = p + 1; *v != '\0';) {
+            size_t sz = strcspn(v, AM_SPACE_CHAR);
+            if (sz > 0) {
+                status = add_rule(&rules->ext, v, sz, METHODS_ALL, SUBJECT_URL, rules->ext_count);
+                if (status != AM_SUCCESS) {
+                    rules->ext_count++;
+                    return status;
+                }
+            }
+            v += sz;
+            v += strspn(v, AM_SPACE_CHAR);
+        }
+        rules->ext_count++;
+    }
+    return compile_rule_set(conf->instance_id, &rules->ext);
+}
+
+static struct am_not_enforced_rules *compile_rules(am_config_t *conf) {
+    struct am_not_enforced_rules *rules = calloc(1, sizeof (struct am_not_enforced_rules));
+
+    if (rules == NULL) {
+        return NULL;
+    }
+    rules->refs = 1;
+    rules->instance_id = conf->instance_id;
+    rules->ts = conf->ts;
+    rules->generation = conf->generation;
+    rules_key(conf, rules->key);
+
+    if (compile_ip_rules(conf, rules) != AM_SUCCESS ||
+            compile_url_rules(conf, rules) != AM_SUCCESS ||
+            compile_ext_rules(conf, rules) != AM_SUCCESS) {
+        delete_rules(rules);
+        return NULL;
+    }
+    AM_LOG_DEBUG(conf->instance_id, "compile_rules(): compiled %d not enforced url, %d extended url "
+            "and %d client ip rules", rules->url.count, rules->ext.count, conf->not_enforced_ip_map_sz);
+    return rules;
+}
+
+static am_bool_t same_snapshot(struct am_not_enforced_rules *rules, am_config_t *conf) {
+    int key[6];
+    rules_key(conf, key);
+    return rules->instance_id == conf->instance_id && rules->ts == conf->ts &&
+            rules->generation == conf->generation && memcmp(rules->key, key, sizeof (key)) == 0;
+}
+
+/**
+ * Get the compiled not enforced rules for the request configuration, compiling them when the configuration
+ * has changed. Release with am_not_enforced_rules_release.
+ *
+ * @return compiled rules, or NULL if they can not be allocated
+ */
+struct am_not_enforced_rules *am_not_enforced_rules_get(am_config_t *conf) {
+    struct am_not_enforced_rules *rules, *e, *prev;
+
+    if (conf == NULL) {
+        return NULL;
+    }
+    if (conf->ts == 0) {
+        /* not a cached configuration snapshot */
+        return compile_rules(conf);
+    }
+
+    lock_rules();
+    for (e = rules_cache; e != NULL; e = e->next) {
+        if (e->instance_id == conf->instance_id) break;
+    }
+    if (e != NULL && same_snapshot(e, conf)) {
+        e->refs++;
+        unlock_rules();
+        return e;
+    }
+    unlock_rules();
+
+    rules = compile_rules(conf);
+    if (rules == NULL) {
+        return NULL;
+    }
+
+    lock_rules();
+    for (prev = NULL, e = rules_cache; e != NULL; prev = e, e = e->next) {
+        if (e->instance_id == conf->instance_id) break;
+    }
+    if (e != NULL && same_snapshot(e, conf)) {
+        /* compiled by another thread meanwhile */
+        e->refs++;
+        unlock_rules();
+        delete_rules(rules);
+        return e;
+    }
+    if (e != NULL) {
+        /* replace rules compiled from an earlier configuration */
+        if (prev == NULL) {
+            rules_cache = e->next;
+        } else {
+            prev->next = e->next;
+        }
+        if (--e->refs == 0) {
+            delete_rules(e);
+        }
+    }
+    rules->refs++;
+    rules->next = rules_cache;
+    rules_cache = rules;
+    unlock_rules();
+    return rules;
+}
+
+void am_not_enforced_rules_release(struct am_not_enforced_rules **rules) {
+    struct am_not_enforced_rules *r = rules != NULL ? *rules : NULL;
+    int refs;
+
+    if (r == NULL) {
+        return;
+    }
+    *rules = NULL;
+    if (r->ts == 0) {
+        delete_rules(r);
+        return;
+    }
+    lock_rules();
+    refs = --r->refs;
+    unlock_rules();
+    if (refs == 0) {
+        delete_rules(r);
+    }
+}
+
+/**
+ * Drop all cached compiled rules (rules in use are deleted when they are released).
+ */
+void am_not_enforced_rules_shutdown() {
+    struct am_not_enforced_rules *e, *next, *list;
+
+    lock_rules();
+    list = rules_cache;
+    rules_cache = NULL;
+    for (e = list; e != NULL; e = next) {
+        next = e->next;
+        if (--e->refs == 0) {
+            delete_rules(e);
+        }
+    }
+    unlock_rules();
+}
+
+static am_bool_t rule_matches(am_request_t *r, struct rule_set *set, struct rule *e, const char *subject) {
+    if (set->regex) {
+        int offsets[3];
+        return e->x != NULL &&
+                pcre_exec(e->x, e->extra, subject, (int) strlen(subject), 0, 0, offsets, 3) >= 0;
+    }
+    return policy_compare_url(r, e->pattern, subject) != AM_NO_MATCH;
+}
+
+static am_bool_t rule_allowed(struct am_not_enforced_rules *rules, struct rule *e, int method,
+        const struct am_ip_addr *client) {
+    if (!method_allowed(e->methods, method)) {
+        return AM_FALSE;
+    }
+    return e->group < 0 || am_ip_set_match(rules->ext_ip[e->group], client);
+}
+
+/* test the rules of one subject kind against the subject, returning the matching pattern */
+static const char *rule_set_match(am_request_t *r, struct am_not_enforced_rules *rules, struct rule_set *set,
+        int subject_kind, const char *subject, const struct am_ip_addr *client) {
+    uint32_t n = 0, p;
+    const char *s = subject;
+    int i;
+
+    if (set->count == 0 || subject == NULL) {
+        return NULL;
+    }
+
+    if (set->regex) {
+        for (i = 0; i < set->count; i++) {
+            struct rule *e = &set->rule[i];
+            if (e->subject == subject_kind && rule_allowed(rules, e, r->method, client) &&
+                    rule_matches(r, set, e, subject)) {
+                return e->pattern;
+            }
+        }
+        return NULL;
+    }
+
+    do {
+        for (p = set->node[n].rules; p != 0; p = set->rule[p - 1].next) {
+            struct rule *e = &set->rule[p - 1];
+            if (e->subject == subject_kind && rule_allowed(rules, e, r->method, client) &&
+                    rule_matches(r, set, e, subject)) {
+                return e->pattern;
+            }
+        }
+        if (*s == '\0') {
+            break;
+        }
+        n = rule_node_child(set, n, (unsigned char) tolower((unsigned char) *s++));
+    } while (n != RULE_NONE);
+    return NULL;
+}
+
+/**
+ * Test the client ip address (parsed with am_ip_addr_parse) against the not enforced client ip list.
+ *
+ * @return AM_TRUE if the client ip address is not enforced
+ */
+am_bool_t am_not_enforced_ip_match(struct am_not_enforced_rules *rules, am_request_t *r,
+        const struct am_ip_addr *client) {
+    int i;
+
+    if (rules == NULL || client == NULL || client->family == 0) {
+        return AM_FALSE;
+    }
+    for (i = 0; i < rules->ip_count; i++) {
+        if (method_allowed(rules->ip[i].methods, r->method) && am_ip_set_match(rules->ip[i].set, client)) {
+            return AM_TRUE;
+        }
+    }
+    return AM_FALSE;
+}
+
+/**
+ * Test a url against the not enforced url list (before not_enforced_invert is applied).
+ *
+ * @return the matching pattern, NULL if none matches
+ */
+const char *am_not_enforced_url_match(struct am_not_enforced_rules *rules, am_request_t *r, const char *url) {
+    const char *matched, *path = url;
+    char *url_query_removed = NULL;
+
+    if (rules == NULL || url == NULL) {
+        return NULL;
+    }
+    matched = rule_set_match(r, rules, &rules->url, SUBJECT_URL, url, NULL);
+    if (matched != NULL || !rules->key[5] || rules->url.regex) {
+        return matched;
+    }
+
+    /* entries without a method are matched ignoring path info (or query parameters) */
+    if (ISVALID(r->normalized_url_pathinfo)) {
+        path = r->normalized_url_pathinfo;
+    } else {
+        char *qmark = strchr(url, '?');
+        if (qmark != NULL) {
+            path = url_query_removed = strndup(url, qmark - url);
+        }
+    }
+    AM_LOG_DEBUG(r->instance_id, "am_not_enforced_url_match(): validating %s ignoring %s",
+            LOGEMPTY(path), ISVALID(r->normalized_url_pathinfo) ? "path_info" : "query attributes");
+    matched = rule_set_match(r, rules, &rules->url, SUBJECT_PATH, path, NULL);
+    am_free(url_query_removed);
+    return matched;
+}
+
+/**
+ * Test the client ip address and a url against the extended not enforced list.
+ *
+ * @return the matching url pattern, NULL if none matches
+ */
+const char *am_not_enforced_ext_match(struct am_not_enforced_rules *rules, am_request_t *r, const char *url,
+        const struct am_ip_addr *client) {
+    if (rules == NULL || url == NULL || client == NULL || client->family == 0) {
+        return NULL;
+    }
+    return rule_set_match(r, rules, &rules->ext, SUBJECT_URL, url, client);
+}
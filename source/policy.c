@@ -17,8 +17,15 @@
 #include "platform.h"
 #include "am.h"
 #include "utility.h"
+#include "list.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define URL_MATCH_SSE2
+#endif
 
 #define URL_MATCH_FRAME_MAX 32
+#define URL_MATCH_PATTERN_MAX 255 /* longest pattern (section) matched with states on the stack */
 
 static const char *policy_fetch_scope_str[] = {
     "self",
@@ -60,33 +67,85 @@ am_bool_t compare_chars(am_request_t * r, char a, char b) {
 
 }
 
+/* character in a pattern or url span, reading as the terminating nul past its end */
+#define span_char(s, end, i)         ((s) + (i) < (end) ? (s)[i] : '\0')
+
+#define fold_char(c)                 ((c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c))
+
+/*
+ * length of the wildcard (* or -*-) at p, or 0 when p is not at a wildcard
+ */
+static size_t wildcard_at(const char *p, const char *end) {
+    if (p < end && *p == '*')
+        return 1;
+    if (end - p >= 3 && p[0] == '-' && p[1] == '*' && p[2] == '-')
+        return 3;
+    return 0;
+
+}
+
+/*
+ * compare spans of equal length, optionally ignoring (ASCII) case; 16 characters at a time where SSE2 is available.
+ */
+static am_bool_t span_equal(const char *a, const char *b, size_t len, am_bool_t ignore_case) {
+    size_t i;
+
+#ifdef URL_MATCH_SSE2
+    const __m128i before_a = _mm_set1_epi8('A' - 1), after_z = _mm_set1_epi8('Z' + 1), to_lower = _mm_set1_epi8('a' - 'A');
+
+    for (; len >= 16; a += 16, b += 16, len -= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) a);
+        __m128i y = _mm_loadu_si128((const __m128i *) b);
+
+        if (ignore_case) {
+            x = _mm_or_si128(x, _mm_and_si128(to_lower, _mm_and_si128(_mm_cmpgt_epi8(x, before_a), _mm_cmplt_epi8(x, after_z))));
+            y = _mm_or_si128(y, _mm_and_si128(to_lower, _mm_and_si128(_mm_cmpgt_epi8(y, before_a), _mm_cmplt_epi8(y, after_z))));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff)
+            return AM_FALSE;
+
+    }
+#endif
+
+    if (ignore_case) {
+        for (i = 0; i < len; i++)
+            if (fold_char((unsigned char) a[i]) != fold_char((unsigned char) b[i]))
+                return AM_FALSE;
+
+    } else if (memcmp(a, b, len)) {
+        return AM_FALSE;
+
+    }
+    return AM_TRUE;
+
+}
+
 /*
  * algorithm for matcing URLs with patterns that have * and -*- as wildcards
  *
- * this has full backtracking.
+ * this has full backtracking, and is only used for patterns with too many wildcards for url_pattern_match_states,
+ * where it fails in the same way that it always has when its stack overflows.
  */
 static am_bool_t url_pattern_match_with_backtrack(am_request_t *r, url_match_frame_t * stack, int stacksize,
-                      const char * pattern, const char * url) {
+                      const char *pattern, const char *pattern_end, const char *url, const char *url_end) {
     const char           *p = pattern, *u = url;
     url_match_frame_t    *top = stack, *const end = stack + stacksize;
+    size_t                w;
 
-#define handle_overflow              AM_LOG_ERROR(r->instance_id, "unable to match with pattern %s", pattern)
+#define handle_overflow              AM_LOG_ERROR(r->instance_id, "unable to match with pattern %.*s", (int) (pattern_end - pattern), pattern)
 #define push_state_with_check(s)     if (++top == end) { handle_overflow; return AM_FALSE; } top->p = p; top->u = u; top->skip = s
 
     /* only frame 0 has skip set to none */
 
     top->skip = none; 
 
-    while (*u) {
-        if (*p == '*') {
-            p += 1; push_state_with_check(multilevel);
-
-        } else if (*p == '-' && p[1] == '*' && p[2] == '-') {
-            p += 3; push_state_with_check(onelevel);
+    while (u < url_end) {
+        if ((w = wildcard_at(p, pattern_end))) {
+            p += w; push_state_with_check(w == 1 ? multilevel : onelevel);
 
         }
 
-        if (compare_chars(r, *p, *u)) {
+        if (compare_chars(r, span_char(p, pattern_end, 0), *u)) {
             p++; u++;
 
         } else {
@@ -113,12 +172,9 @@ static am_bool_t url_pattern_match_with_backtrack(am_request_t *r, url_match_fra
 
     }
 
-    while (*p)
-        if (*p == '*') {
-            p += 1; 
-
-        } else if (*p == '-' && p[1] == '*' && p[2] == '-') {
-            p += 3;
+    while (p < pattern_end)
+        if ((w = wildcard_at(p, pattern_end))) {
+            p += w;
 
         } else {
            return AM_FALSE;
@@ -130,29 +186,163 @@ static am_bool_t url_pattern_match_with_backtrack(am_request_t *r, url_match_fra
 }
 
 /*
- * decide whether a URL matches a pattern using a backtracking algorithm and a stack
- * allocated here.
+ * linear time matcher giving the same result as url_pattern_match_with_backtrack.
+ *
+ * at a wildcard the backtracking matcher first tries the rest of the pattern, and only when that fails lets the
+ * wildcard take one more character of the url (any but '?' for *, any but '?' and '/' for -*-). It decides as soon
+ * as the first attempt reaches the end of the url: a match if the rest of the pattern is all wildcards.
+ *
+ * here all attempts run in step over the url as a list of states, in the order in which the backtracking matcher
+ * would try them, so that the first state left at the end of the url is the attempt it would have finished with.
+ * A state is a pattern position, (p << 1), or a pattern position just after a wildcard that may take more
+ * characters, (p << 1) | 1. A state already in the list has precedence over a later duplicate, which is dropped.
  *
- * this uses a heap allocated stack large enough to allow 64 frames, which will suffice for
- * patterns with 32 wildcards (* or -*-).
+ * states, next and marks each have room for 2 * (pattern length + 1) states.
  */
-am_bool_t compare_pattern_resource(am_request_t *r, const char * pattern, const char * url) {
-    url_match_frame_t *stack = malloc(sizeof(url_match_frame_t) * URL_MATCH_FRAME_MAX);
-    am_bool_t out;
+static am_bool_t url_pattern_match_states(am_bool_t ignore_case, uint32_t *states, uint32_t *next, uint32_t *marks,
+                      const char *pattern, const char *pattern_end, const char *url, const char *url_end) {
+    const size_t          len = pattern_end - pattern;
+    size_t                count = 1, n, i, w;
+    uint32_t             *swap, stamp = 0;
+    const char           *star;
+
+#define url_match_add(s)             if (marks[s] != stamp) { marks[s] = stamp; next[n++] = (s); }
+#define url_match_takes(p, c)        (pattern[(p) - 1] == '*' ? (c) != '?' : (c) != '?' && (c) != '/')
+
+    memset(marks, 0, sizeof (uint32_t) * 2 * (len + 1));
+    states[0] = 0;
+
+    while (url < url_end) {
+        if (count == 1 && (states[0] & 1) == 0) {
+            size_t p = states[0] >> 1;
+
+            /* the only attempt is within a run of literal characters: compare the run as a whole */
+            if (p < len && wildcard_at(pattern + p, pattern_end) == 0) {
+                star = memchr(pattern + p, '*', len - p);
+                n = star ? (size_t) (star - pattern) - p : len - p;
+                if (star && n > 0 && star[-1] == '-' && star + 1 < pattern_end && star[1] == '-')
+                    n--;
+                if ((size_t) (url_end - url) < n)
+                    n = url_end - url;
+                if (! span_equal(pattern + p, url, n, ignore_case))
+                    return AM_FALSE;
+
+                states[0] = (uint32_t) (p + n) << 1;
+                url += n;
+                continue;
+
+            }
+
+        } else if (count == 1 && states[0] == (((uint32_t) len << 1) | 1)) {
+            /* the only attempt is a trailing wildcard, which takes the rest of the url or nothing */
+            for (; url < url_end; url++)
+                if (! url_match_takes(len, *url))
+                    return AM_FALSE;
 
-    if (stack) {
-        out = url_pattern_match_with_backtrack(r, stack, URL_MATCH_FRAME_MAX, pattern, url);
-        free(stack);
+            break;
+
+        }
+
+        n = 0;
+        stamp++;
+
+        for (i = 0; i < count; i++) {
+            size_t p = states[i] >> 1;
+            char c = *url;
+
+            if ((w = wildcard_at(pattern + p, pattern_end))) {
+                size_t f = p + w;
+
+                if (f < len && (ignore_case ? fold_char((unsigned char) pattern[f]) == fold_char((unsigned char) c) : pattern[f] == c)) {
+                    url_match_add((f + 1) << 1);
+                }
+                if (url_match_takes(f, c)) {
+                    url_match_add((f << 1) | 1);
+                }
+
+            } else if (p < len && (ignore_case ? fold_char((unsigned char) pattern[p]) == fold_char((unsigned char) c) : pattern[p] == c)) {
+                url_match_add((p + 1) << 1);
+
+            }
+
+            if ((states[i] & 1) && url_match_takes(p, c)) {
+                url_match_add(states[i]);
+            }
+        }
+
+        if (n == 0)
+            return AM_FALSE;
+
+        swap = states; states = next; next = swap;
+        count = n;
+        url++;
+
+    }
+
+    for (i = states[0] >> 1; i < len; i += w)
+        if ((w = wildcard_at(pattern + i, pattern_end)) == 0)
+            return AM_FALSE;
+
+    return AM_TRUE;
+
+}
+
+/*
+ * decide whether a span of a URL matches a span of a pattern, without copying either.
+ *
+ * patterns without wildcards are compared as a whole. Patterns of up to URL_MATCH_PATTERN_MAX characters use state
+ * lists on the stack, longer ones allocate them. Patterns with more wildcards than fit the backtracking matcher's
+ * stack are still handed to it, so that they fail as they always have.
+ */
+static am_bool_t url_pattern_match(am_request_t *r, const char *pattern, size_t pattern_len, const char *url, size_t url_len) {
+    const char           *pattern_end = pattern + pattern_len, *star;
+    am_bool_t             ignore_case = r->conf->url_eval_case_ignore ? AM_TRUE : AM_FALSE, out;
+    size_t                wildcards = 0, i;
+
+    for (i = 0; i < pattern_len && (star = memchr(pattern + i, '*', pattern_len - i)); i = star - pattern + 1)
+        wildcards++;
+
+    if (wildcards == 0)
+        return pattern_len == url_len && span_equal(pattern, url, url_len, ignore_case);
+
+    if (wildcards < URL_MATCH_FRAME_MAX) {
+        if (pattern_len <= URL_MATCH_PATTERN_MAX) {
+            uint32_t states[2 * (URL_MATCH_PATTERN_MAX + 1)], next[2 * (URL_MATCH_PATTERN_MAX + 1)];
+            uint32_t marks[2 * (URL_MATCH_PATTERN_MAX + 1)];
+
+            out = url_pattern_match_states(ignore_case, states, next, marks, pattern, pattern_end, url, url + url_len);
+
+        } else {
+            uint32_t *states = malloc(sizeof (uint32_t) * 6 * (pattern_len + 1));
+
+            if (states == NULL) {
+                AM_LOG_ERROR(r->instance_id, "unable to allocate URL pattern matching states");
+                return AM_FALSE;
+            }
+            out = url_pattern_match_states(ignore_case, states, states + 2 * (pattern_len + 1), states + 4 * (pattern_len + 1),
+                    pattern, pattern_end, url, url + url_len);
+            free(states);
+
+        }
 
     } else {
-        AM_LOG_ERROR(r->instance_id, "unable to allocate URL pattern matching stack");
-        out = AM_FALSE;
+        url_match_frame_t stack[URL_MATCH_FRAME_MAX];
+
+        out = url_pattern_match_with_backtrack(r, stack, URL_MATCH_FRAME_MAX, pattern, pattern_end, url, url + url_len);
 
     }
     return out;
 
 }
 
+/*
+ * decide whether a URL matches a pattern.
+ */
+am_bool_t compare_pattern_resource(am_request_t *r, const char * pattern, const char * url) {
+    return url_pattern_match(r, pattern, strlen(pattern), url, strlen(url));
+
+}
+
 #define end_of_protocol(offsets) (offsets [0])
 #define start_of_host(offsets) (end_of_protocol(offsets) + 3)
 
@@ -250,17 +440,8 @@ char *am_normalize_pattern(const char *url) {
 static char compare_pattern_sections(am_request_t *r,
                                      const char *pattern_base, size_t pattern_lo, size_t pattern_hi,
                                      const char *resource_base, size_t resource_lo, size_t resource_hi) {
-    char * pattern_section = strndup(pattern_base + pattern_lo, pattern_hi - pattern_lo);
-    char * resource_section = strndup(resource_base + resource_lo, resource_hi - resource_lo);
-    
-    char c;
-    if (pattern_section && resource_section)
-        c = compare_pattern_resource(r, pattern_section, resource_section);
-    else
-        c = AM_NO_MATCH;
-    
-    AM_FREE(pattern_section, resource_section);
-    return c;
+    return url_pattern_match(r, pattern_base + pattern_lo, pattern_hi - pattern_lo,
+            resource_base + resource_lo, resource_hi - resource_lo);
 }
 
 char policy_compare_url(am_request_t *r, const char *pattern, const char *resource) {
@@ -330,6 +511,158 @@ char policy_compare_url(am_request_t *r, const char *pattern, const char *resour
     return AM_EXACT_PATTERN_MATCH;
 }
 
+/*
+ * Resource index over a policy result list.
+ *
+ * Every pattern is keyed by its literal prefix: the text up to its first wildcard (* or -*-), or the whole
+ * pattern when it has none. policy_compare_url compares scheme, host, port and path sections separately, but
+ * the sections of a pattern up to its first wildcard must equal the same sections of a matching resource,
+ * and the separators between them are the same, so a resource can only match a pattern if it starts with
+ * that literal prefix. The prefixes are stored case-folded in a character trie (a case-sensitive match is
+ * also a case-insensitive one), and a lookup walks the URL once, marking the entries at each node passed.
+ *
+ * Marked entries are candidates only - the caller still verifies them with policy_compare_url, so results are
+ * identical; entries that are not marked cannot match and are skipped.
+ */
+
+#define POLICY_INDEX_NONE 0
+
+struct policy_index_node {
+    uint32_t child;
+    uint32_t sibling;
+    uint32_t entries; /* position + 1 of the first entry ending here */
+    unsigned char c;
+};
+
+struct am_policy_index {
+    int count;
+    uint32_t nodes;
+    struct policy_index_node *node; /* node 0 is the root */
+    uint32_t *entry_next; /* position + 1 of the next entry ending at the same node */
+    uint8_t *candidate;
+};
+
+/*
+ * Length of the literal prefix of a url pattern: the text up to its first wildcard (* or -*-).
+ */
+size_t am_url_pattern_prefix_length(const char *pattern) {
+    const char *w = strchr(pattern, '*');
+    if (w == NULL) {
+        return strlen(pattern);
+    }
+    if (w > pattern && w[-1] == '-') {
+        w--; /* -*- */
+    }
+    return w - pattern;
+}
+
+static uint32_t policy_index_child(struct am_policy_index *index, uint32_t n, unsigned char c) {
+    uint32_t i;
+    for (i = index->node[n].child; i != POLICY_INDEX_NONE; i = index->node[i].sibling) {
+        if (index->node[i].c == c) {
+            return i;
+        }
+    }
+    return POLICY_INDEX_NONE;
+}
+
+struct am_policy_index *am_policy_index_create(struct am_policy_result *list) {
+    struct am_policy_result *e, *t;
+    struct am_policy_index *index;
+    size_t nodes = 1, size;
+    int count = 0;
+
+    AM_LIST_FOR_EACH(list, e, t) {
+        if (e->resource != NULL) {
+            nodes += am_url_pattern_prefix_length(e->resource);
+        }
+        count++;
+    }
+    if (count == 0 || nodes > UINT32_MAX) {
+        return NULL;
+    }
+
+    size = sizeof (struct am_policy_index) + nodes * sizeof (struct policy_index_node) +
+            count * sizeof (uint32_t) + count;
+    index = malloc(size);
+    if (index == NULL) {
+        return NULL;
+    }
+    index->count = count;
+    index->nodes = 1;
+    index->node = (struct policy_index_node *) (index + 1);
+    index->entry_next = (uint32_t *) (index->node + nodes);
+    index->candidate = (uint8_t *) (index->entry_next + count);
+    memset(index->node, 0, sizeof (struct policy_index_node));
+
+    count = 0;
+    AM_LIST_FOR_EACH(list, e, t) {
+        uint32_t n = 0;
+        if (e->resource != NULL) {
+            size_t i, len = am_url_pattern_prefix_length(e->resource);
+            for (i = 0; i < len; i++) {
+                unsigned char c = (unsigned char) tolower((unsigned char) e->resource[i]);
+                uint32_t child = policy_index_child(index, n, c);
+                if (child == POLICY_INDEX_NONE) {
+                    child = index->nodes++;
+                    index->node[child].c = c;
+                    index->node[child].child = POLICY_INDEX_NONE;
+                    index->node[child].entries = 0;
+                    index->node[child].sibling = index->node[n].child;
+                    index->node[n].child = child;
+                }
+                n = child;
+            }
+        }
+        index->entry_next[count] = index->node[n].entries;
+        index->node[n].entries = count + 1;
+        count++;
+    }
+    return index;
+}
+
+/*
+ * Mark the entries which may match url; see am_policy_index_candidate.
+ */
+void am_policy_index_lookup(struct am_policy_index *index, const char *url) {
+    uint32_t n = 0, p;
+
+    if (index == NULL) {
+        return;
+    }
+    memset(index->candidate, 0, index->count);
+    if (url == NULL) {
+        return;
+    }
+    do {
+        for (p = index->node[n].entries; p != 0; p = index->entry_next[p - 1]) {
+            index->candidate[p - 1] = 1;
+        }
+        if (*url == '\0') {
+            break;
+        }
+        n = policy_index_child(index, n, (unsigned char) tolower((unsigned char) *url++));
+    } while (n != POLICY_INDEX_NONE);
+}
+
+/*
+ * Whether the entry at a position in the indexed list may match the url looked up last. Without an index
+ * every entry is a candidate.
+ */
+am_bool_t am_policy_index_candidate(struct am_policy_index *index, int position) {
+    if (index == NULL || position < 0 || position >= index->count) {
+        return AM_TRUE;
+    }
+    return index->candidate[position] ? AM_TRUE : AM_FALSE;
+}
+
+void am_policy_index_delete(struct am_policy_index **index) {
+    if (index != NULL) {
+        free(*index);
+        *index = NULL;
+    }
+}
+
 int am_scope_to_num(const char *scope) {
     int i;
     if (scope != NULL) {
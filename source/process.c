@@ -156,11 +156,11 @@ static am_bool_t is_json_request(am_request_t *request) {
 #ifndef UNIT_TEST
 static
 #endif
-char *remove_pathinfo_from_url(struct url *url, const char *pathinfo) {
-    char *pos, *tmp, *out = NULL;
+char *remove_pathinfo_from_url(am_request_t *r, struct url *url, const char *pathinfo) {
+    char *pos, *tmp, *decoded;
     int sep_count;
 
-    tmp = strdup(url->path);
+    tmp = am_request_strdup(r, url->path);
     if (tmp == NULL) {
         return NULL;
     }
@@ -172,27 +172,25 @@ char *remove_pathinfo_from_url(struct url *url, const char *pathinfo) {
         pos = am_strrstr(tmp, pathinfo);
     }
     if (pos == NULL) {
-        free(tmp);
-
         /* was not able to find it - try url-decode url path value first */
-        tmp = url_decode(url->path);
-        if (tmp == NULL) {
+        decoded = url_decode(url->path);
+        if (decoded == NULL) {
             return NULL;
         }
 
-        pos = am_strrstr(tmp, pathinfo);
+        pos = am_strrstr(decoded, pathinfo);
         if (pos == NULL) {
             /* still not able to find it - now try url-decoding pathinfo value */
             char *pathinfo_decoded = url_decode(pathinfo);
             if (pathinfo_decoded == NULL) {
-                free(tmp);
+                free(decoded);
                 return NULL;
             }
 
-            pos = am_strrstr(tmp, pathinfo_decoded);
+            pos = am_strrstr(decoded, pathinfo_decoded);
             free(pathinfo_decoded);
             if (pos == NULL) {
-                free(tmp);
+                free(decoded);
                 /* nothing - path_info value is not found in url path */
                 return NULL;
             }
@@ -202,13 +200,10 @@ char *remove_pathinfo_from_url(struct url *url, const char *pathinfo) {
          * find out where the pathinfo is within the original (unencoded) url path */
         *pos = '\0';
 
-        sep_count = char_count(tmp, '/', NULL);
-        free(tmp);
+        sep_count = char_count(decoded, '/', NULL);
+        free(decoded);
 
-        pos = tmp = strdup(url->path);
-        if (tmp == NULL) {
-            return NULL;
-        }
+        pos = tmp;
         while (*pos != '\0') {
             if (*pos == '/' && --sep_count < 0) {
                 break;
@@ -219,15 +214,12 @@ char *remove_pathinfo_from_url(struct url *url, const char *pathinfo) {
     /* path_info value is found - remove it from url path */
     *pos = '\0';
 
-    am_asprintf(&out, "%s://%s:%d%s%s", url->proto, url->host,
+    return am_request_asprintf(r, "%s://%s:%d%s%s", url->proto, url->host,
             url->port, tmp, url->query);
-    free(tmp);
-    return out;
 }
 
-char *get_goto_url(const char *orig_url, struct url *url) {
+static char *get_goto_url(am_request_t *r, const char *orig_url, struct url *url) {
     char org_path[AM_URI_SIZE + 1];
-    char *goto_url = NULL;
     char *p, *q;
 
     memset(org_path, 0, sizeof(org_path));
@@ -251,13 +243,8 @@ char *get_goto_url(const char *orig_url, struct url *url) {
         return NULL;
     }
 
-    am_asprintf(&goto_url, "%s://%s:%d%s%s", url->proto, url->host,
+    return am_request_asprintf(r, "%s://%s:%d%s%s", url->proto, url->host,
             url->port, org_path, url->query);
-    if (goto_url == NULL) {
-        return NULL;
-    }
-
-    return goto_url;
 }
 
 static am_return_t setup_request_data(am_request_t *r) {
@@ -284,7 +271,7 @@ static am_return_t setup_request_data(am_request_t *r) {
 
     s = strstr(r->client_ip, AM_COMMA_CHAR);
     /* if the client ip header contains more than one value, use only the first one */
-    v = s != NULL ? strndup(r->client_ip, s - r->client_ip) : strdup(r->client_ip);
+    v = s != NULL ? am_request_strndup(r, r->client_ip, s - r->client_ip) : am_request_strdup(r, r->client_ip);
     if (v == NULL) {
         AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
         r->status = AM_ENOMEM;
@@ -298,7 +285,7 @@ static am_return_t setup_request_data(am_request_t *r) {
     if (ISVALID(r->client_host)) {
         s = strstr(r->client_host, AM_COMMA_CHAR);
         /* if the client host header contains more than one value, use only the first one */
-        v = s != NULL ? strndup(r->client_host, s - r->client_host) : strdup(r->client_host);
+        v = s != NULL ? am_request_strndup(r, r->client_host, s - r->client_host) : am_request_strdup(r, r->client_host);
         if (v != NULL) {
             s = strstr(v, ":");
             /* if client_host contains the port number, remove it */
@@ -321,8 +308,7 @@ static am_return_t setup_request_data(am_request_t *r) {
                 errcode = getnameinfo((struct sockaddr *) res->ai_addr, slen,
                         client_host, sizeof (client_host), NULL, 0, NI_NAMEREQD);
                 if (errcode == 0) {
-                    am_free(r->client_host);
-                    r->client_host = strdup(client_host);
+                    r->client_host = am_request_strdup(r, client_host);
                     break;
                 }
                 res = res->ai_next;
@@ -358,7 +344,7 @@ static am_return_t setup_request_data(am_request_t *r) {
         AM_LOG_DEBUG(r->instance_id, "%s no token in query parameters", thisfunc);
     }
 
-    am_asprintf(&r->normalized_url, "%s://%s:%d%s%s", r->url.proto, r->url.host,
+    r->normalized_url = am_request_asprintf(r, "%s://%s:%d%s%s", r->url.proto, r->url.host,
             r->url.port, r->url.path, r->url.query);
     if (r->normalized_url == NULL) {
         AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
@@ -367,7 +353,7 @@ static am_return_t setup_request_data(am_request_t *r) {
     }
 
     if (ISVALID(r->path_info) && (r->conf->path_info_ignore_not_enforced || r->conf->path_info_ignore)) {
-        r->normalized_url_pathinfo = remove_pathinfo_from_url(&r->url, r->path_info);
+        r->normalized_url_pathinfo = remove_pathinfo_from_url(r, &r->url, r->path_info);
         if (r->normalized_url_pathinfo == NULL) {
             AM_LOG_ERROR(r->instance_id, "%s path_info %s is not part of the normalized request url %s",
                     thisfunc, r->path_info, r->normalized_url);
@@ -390,12 +376,13 @@ static am_return_t setup_request_data(am_request_t *r) {
         if (r->conf->override_port) {
             request_url.port = agent_url.port;
         }
+        url_free(&agent_url);
     } else {
         AM_LOG_WARNING(r->instance_id, "%s failed to parse agenturi.prefix %s",
                 thisfunc, LOGEMPTY(r->conf->agenturi));
     }
 
-    am_asprintf(&r->overridden_url, "%s://%s:%d%s%s", request_url.proto, request_url.host,
+    r->overridden_url = am_request_asprintf(r, "%s://%s:%d%s%s", request_url.proto, request_url.host,
             request_url.port, request_url.path, request_url.query);
     if (r->overridden_url == NULL) {
         AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
@@ -403,14 +390,14 @@ static am_return_t setup_request_data(am_request_t *r) {
         return AM_FAIL;
     }
 
-    r->goto_url = get_goto_url(r->orig_url, &request_url);
+    r->goto_url = get_goto_url(r, r->orig_url, &request_url);
     if (r->goto_url == NULL) {
         AM_LOG_ERROR(r->instance_id, "%s failed to make goto_url", thisfunc);
         return AM_FAIL;
     }
 
     if (ISVALID(r->path_info) && r->conf->path_info_ignore) {
-        r->overridden_url_pathinfo = remove_pathinfo_from_url(&request_url, r->path_info);
+        r->overridden_url_pathinfo = remove_pathinfo_from_url(r, &request_url, r->path_info);
         if (r->overridden_url_pathinfo == NULL) {
             AM_LOG_ERROR(r->instance_id, "%s path_info %s is not part of the overridden request url %s",
                         thisfunc, r->path_info, r->overridden_url);
@@ -500,7 +487,7 @@ static am_return_t handle_notification(am_request_t *r) {
         }
         status = AM_OK;
         /* process notification message */
-        if (am_worker_dispatch(notification_worker, wd) != 0) {
+        if (am_worker_dispatch_reliable(notification_worker, wd) != 0) {
             am_free(wd->post_data);
             free(wd);
             r->status = AM_ERROR;
@@ -591,14 +578,16 @@ static am_return_t handle_not_enforced(am_request_t *r) {
     static const char *thisfunc = "handle_not_enforced():";
     int i;
     const char *url = r->overridden_url;
-    char *pdp_path = NULL;
+    char *pdp_path;
+    struct am_not_enforced_rules *rules = NULL;
+    struct am_ip_addr client;
 
     AM_LOG_DEBUG(r->instance_id, "%s", thisfunc);
 
     /* post preservation url is not enforced 
      * (will use com.forgerock.agents.config.pdpuri.prefix value if set) 
      */
-    am_asprintf(&pdp_path, "%s%s%s",
+    pdp_path = am_request_asprintf(r, "%s%s%s",
             ISVALID(r->conf->pdp_uri_prefix) && r->conf->pdp_uri_prefix[0] != '/' ? "/" : "",
             NOTNULL(r->conf->pdp_uri_prefix), POST_PRESERVE_URI);
     if (ISVALID(pdp_path) && ISVALID(r->url.query) && strcmp(r->url.path, pdp_path) == 0) {
@@ -614,8 +603,9 @@ static am_return_t handle_not_enforced(am_request_t *r) {
         if (x != NULL) {
             char *key = match_group(x, 1, r->url.query, &slen);
             if (key != NULL) {
-                strncpy(r->url.query, "?", sizeof (r->url.query) - 1);
-                strcat(r->url.query, key);
+                /* the key is a part of the query string, so it is rewritten in place */
+                r->url.query[0] = '?';
+                memmove(r->url.query + 1, key, strlen(key) + 1);
                 free(key);
             }
             pcre_free(x);
@@ -624,10 +614,8 @@ static am_return_t handle_not_enforced(am_request_t *r) {
         AM_LOG_DEBUG(r->instance_id, "%s post preserve url is not enforced", thisfunc);
         r->is_dummypost_url = r->not_enforced = AM_TRUE;
         r->status = AM_SUCCESS;
-        free(pdp_path);
         return AM_QUIT;
     }
-    am_free(pdp_path);
 
     /* check if the request url (normalized) is an application logout url */
     if (ISVALID(r->conf->logout_url_regex) && /* check legacy com.forgerock.agents.agent.logout.url.regex option first */
@@ -704,8 +692,8 @@ static am_return_t handle_not_enforced(am_request_t *r) {
         }
         else {
             /* absolute URL - use parseurl to normalise and then do a full compare*/
-            char* normalised_access_denied_url = NULL;
-            struct url* parsed_url = malloc(sizeof(struct url));
+            char* normalised_access_denied_url;
+            struct url* parsed_url = am_request_alloc(r, sizeof(struct url));
             AM_LOG_DEBUG(r->instance_id, "%s attempting match with absolute access denied url %s", thisfunc, r->conf->access_denied_url);
             if (NULL == parsed_url) {
                 AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
@@ -716,15 +704,13 @@ static am_return_t handle_not_enforced(am_request_t *r) {
             if (parse_url(r->conf->access_denied_url, parsed_url)) {
                 AM_LOG_ERROR(r->instance_id, "%s failed to normalize access denied url: %s (%s)",
                         thisfunc, r->conf->access_denied_url, am_strerror(parsed_url->error));
-                AM_FREE(parsed_url);
                 return AM_FAIL;
             }
 
-            /* create the normalised url and free the parsing structure */
-            am_asprintf(&normalised_access_denied_url, "%s://%s:%d%s%s", parsed_url->proto, parsed_url->host,
+            /* create the normalised url */
+            normalised_access_denied_url = am_request_asprintf(r, "%s://%s:%d%s%s", parsed_url->proto, parsed_url->host,
             parsed_url->port, parsed_url->path, parsed_url->query);
-            AM_FREE(parsed_url);
-            parsed_url = NULL;
+            url_free(parsed_url);
 
             if (normalised_access_denied_url == NULL) {
                 AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
@@ -738,7 +724,6 @@ static am_return_t handle_not_enforced(am_request_t *r) {
             int compare_status = r->conf->url_eval_case_ignore ?
                         strncasecmp(url, normalised_access_denied_url, strlen(normalised_access_denied_url)) :
                         strncmp(url, normalised_access_denied_url, strlen(normalised_access_denied_url));
-            AM_FREE(normalised_access_denied_url);
             
             if (compare_status == 0) {
                 AM_LOG_DEBUG(r->instance_id, "%s have found a match, setting not enforced on this URL", thisfunc);
@@ -755,118 +740,52 @@ static am_return_t handle_not_enforced(am_request_t *r) {
 
     r->not_enforced = AM_FALSE;
 
+    if (r->conf->not_enforced_ip_map_sz > 0 || r->conf->not_enforced_map_sz > 0 ||
+            r->conf->not_enforced_ext_map_sz > 0) {
+        /* not enforced lists are compiled once per configuration */
+        rules = am_not_enforced_rules_get(r->conf);
+        if (rules == NULL) {
+            AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
+            r->status = AM_ENOMEM;
+            return AM_FAIL;
+        }
+    }
+    am_ip_addr_parse(r->client_ip, &client);
+
     /* see if the client ip is in the not enforced client ip list */
     if (r->conf->not_enforced_ip_map_sz > 0) {
-        for (i = 0; i < r->conf->not_enforced_ip_map_sz; i++) {
-            am_config_map_t *m = &r->conf->not_enforced_ip_map[i];
-            char *p = strstr(m->name, AM_COMMA_CHAR);
-            if (p == NULL) {
-                const char *l[1] = {m->value};
-                if (ip_address_match(r->client_ip, l, 1, r->instance_id) == AM_SUCCESS) {
-                    r->not_enforced = AM_TRUE;
-                    if (!r->conf->not_enforced_fetch_attr) {
-                        r->status = AM_SUCCESS;
-                        return AM_QUIT;
-                    }
-                    return AM_OK;
-                }
-                AM_LOG_DEBUG(r->instance_id, "%s client ip address %s does not match %s",
-                        thisfunc, r->client_ip, LOGEMPTY(m->value));
-            } else {
-                char *pv = strndup(m->name, p - m->name);
-                if (pv != NULL) {
-                    int mtn = am_method_str_to_num(pv);
-                    free(pv);
-                    if (r->method == mtn) {
-                        const char *l[1] = {m->value};
-                        if (ip_address_match(r->client_ip, l, 1, r->instance_id) == AM_SUCCESS) {
-                            r->not_enforced = AM_TRUE;
-                            if (!r->conf->not_enforced_fetch_attr) {
-                                r->status = AM_SUCCESS;
-                                return AM_QUIT;
-                            }
-                            return AM_OK;
-                        }
-                        AM_LOG_DEBUG(r->instance_id, "%s client ip address %s does not match %s (%s)",
-                                thisfunc, r->client_ip, LOGEMPTY(m->value), am_method_num_to_str(mtn));
-                    }
-                }
-            }
+        if (am_not_enforced_ip_match(rules, r, &client)) {
+            AM_LOG_DEBUG(r->instance_id, "%s client ip address %s is not enforced", thisfunc, r->client_ip);
+            r->not_enforced = AM_TRUE;
+        } else {
+            AM_LOG_DEBUG(r->instance_id, "%s client ip address %s does not match any not enforced client ip",
+                    thisfunc, LOGEMPTY(r->client_ip));
         }
     } else {
         AM_LOG_DEBUG(r->instance_id, "%s not enforced client ip validation feature is not enabled", thisfunc);
     }
 
-    AM_LOG_DEBUG(r->instance_id, "%s validating %s", thisfunc, url);
-
     /* check the request url (normalized) is in not enforced url list */
-    if (r->conf->not_enforced_map_sz > 0) {
-        int compare_status = 0;
-        for (i = 0; i < r->conf->not_enforced_map_sz; i++) {
-            am_config_map_t *m = &r->conf->not_enforced_map[i];
-            if (ISVALID(m->value)) {
-                char *p = strstr(m->name, AM_COMMA_CHAR);
-                AM_LOG_DEBUG(r->instance_id, "%s trying not enforced pattern %s", thisfunc, m->value);
-                if (p == NULL) {
-
-                    /* regular [0]=not-enforced-url option */
-
-                    if ((r->conf->path_info_ignore_not_enforced || r->conf->path_info_ignore) &&
-                            !r->conf->not_enforced_regex_enable) {
-
-                        if (ISVALID(r->normalized_url_pathinfo)) {
-                            AM_LOG_DEBUG(r->instance_id, "%s validating %s ignoring path_info",
-                                    thisfunc, r->normalized_url_pathinfo);
-                            compare_status += url_matches_pattern(r, m->value, r->normalized_url_pathinfo, AM_FALSE);
-                        } else {
-                            char *url_query_removed = strdup(url);
-                            if (url_query_removed != NULL) {
-                                char *qmark = strchr(url_query_removed, '?');
-                                if (qmark != NULL) {
-                                    *qmark = '\0';
-                                }
-                                AM_LOG_DEBUG(r->instance_id, "%s validating %s ignoring query attributes",
-                                        thisfunc, url_query_removed);
-                                compare_status += url_matches_pattern(r, m->value, url_query_removed, AM_FALSE);
-                                free(url_query_removed);
-                            }
-                        }
-                    } else {
-                        compare_status += url_matches_pattern(r, m->value, url, r->conf->not_enforced_regex_enable);
-                    }
+    if (r->not_enforced) {
+        /* client ip is not enforced */
+    } else if (r->conf->not_enforced_map_sz > 0) {
+        const char *pattern;
 
-                } else {
-
-                    /* method-extended [GET,0]=not-enforced-url option */
-
-                    char *pv = strndup(m->name, p - m->name);
-                    if (pv != NULL) {
-                        int mtn = am_method_str_to_num(pv);
-                        free(pv);
-                        if (r->method != mtn) continue;
-                        compare_status += url_matches_pattern(r, m->value, url, r->conf->not_enforced_regex_enable);
-                    }
-                }
+        AM_LOG_DEBUG(r->instance_id, "%s validating %s", thisfunc, url);
 
-                if (compare_status > 0 && !r->conf->not_enforced_invert) break;
-            }
+        pattern = am_not_enforced_url_match(rules, r, url);
+        if (pattern != NULL) {
+            AM_LOG_DEBUG(r->instance_id, "%s %s matches not enforced pattern %s", thisfunc, url, pattern);
         }
-
-        compare_status = compare_status > 0;
+        r->not_enforced = pattern != NULL;
 
         if (r->conf->not_enforced_invert) {
             AM_LOG_DEBUG(r->instance_id, "%s not enforced list is inverted, "
                     "only not enforced list of urls will be enforced", thisfunc);
-            compare_status = !compare_status;
+            r->not_enforced = !r->not_enforced;
         }
-        if (compare_status) {
+        if (r->not_enforced) {
             AM_LOG_DEBUG(r->instance_id, "%s %s is not enforced", thisfunc, url);
-            r->not_enforced = AM_TRUE;
-            if (!r->conf->not_enforced_fetch_attr) {
-                r->status = AM_SUCCESS;
-                return AM_QUIT;
-            }
-            return AM_OK;
         }
 
     } else {
@@ -874,50 +793,29 @@ static am_return_t handle_not_enforced(am_request_t *r) {
     }
 
     /* check the request url (normalized) is in not enforced url list (extended version) */
-    if (r->conf->not_enforced_ext_map_sz > 0 && ISVALID(r->client_ip)) {
-        for (i = 0; i < r->conf->not_enforced_ext_map_sz; i++) {
-            char *p, *v, *t, *is, *us, found = AM_FALSE;
-            am_config_map_t *m = &r->conf->not_enforced_ext_map[i];
-            if (!ISVALID(m->value)) continue;
-            p = strstr(m->value, AM_PIPE_CHAR); /* 10.1.1.0/24 10.1.2.1-10.1.2.7|url1 url2 */
-            if (p == NULL) continue;
-            is = strndup(m->value, p - m->value);
-            us = strdup(p + 1);
-            if (is == NULL || us == NULL) {
-                AM_FREE(is, us);
-                continue;
-            }
-            for ((v = strtok_r(is, AM_SPACE_CHAR, &t)); v; (v = strtok_r(NULL, AM_SPACE_CHAR, &t))) {
-                const char *vlist[1] = {v};
-                if (ip_address_match(r->client_ip, vlist, 1, r->instance_id) == AM_SUCCESS) {
-                    found = AM_TRUE;
-                    break;
-                }
-            }
-            if (found) {
-                found = AM_FALSE;
-                for ((v = strtok_r(us, AM_SPACE_CHAR, &t)); v; (v = strtok_r(NULL, AM_SPACE_CHAR, &t))) {
-                    if (url_matches_pattern(r, v, url, r->conf->not_enforced_ext_regex_enable)) {
-                        found = AM_TRUE;
-                        break;
-                    }
-                }
-            }
-            AM_FREE(is, us);
-            if (found) {
-                AM_LOG_DEBUG(r->instance_id, "%s %s is not enforced", thisfunc, url);
-                r->not_enforced = AM_TRUE;
-                if (!r->conf->not_enforced_fetch_attr) {
-                    r->status = AM_SUCCESS;
-                    return AM_QUIT;
-                }
-                return AM_OK;
-            }
+    if (r->not_enforced) {
+        /* client ip or url is not enforced */
+    } else if (r->conf->not_enforced_ext_map_sz > 0 && ISVALID(r->client_ip)) {
+        const char *pattern = am_not_enforced_ext_match(rules, r, url, &client);
+        if (pattern != NULL) {
+            AM_LOG_DEBUG(r->instance_id, "%s %s is not enforced (client ip address %s, pattern %s)",
+                    thisfunc, url, r->client_ip, pattern);
+            r->not_enforced = AM_TRUE;
         }
     } else {
         AM_LOG_DEBUG(r->instance_id, "%s extended not enforced url validation feature is not enabled", thisfunc);
     }
 
+    am_not_enforced_rules_release(&rules);
+
+    if (r->not_enforced) {
+        if (!r->conf->not_enforced_fetch_attr) {
+            r->status = AM_SUCCESS;
+            return AM_QUIT;
+        }
+        return AM_OK;
+    }
+
     AM_LOG_DEBUG(r->instance_id, "%s %s is enforced", thisfunc, url);
     return AM_OK;
 }
@@ -1088,84 +986,163 @@ static char *create_profile_attribute_request(am_request_t *r) {
  */
 static const char *get_attr_value(am_request_t *r, const char *name, int mask, char **multiple) {
     static const char *thisfunc = "get_attr_value():";
-    struct am_namevalue *e, *t;
-    char *values = NULL;
+    struct am_namevalue *list;
+    const char **values, *separator;
+    size_t values_sz = 0, separator_sz;
+    int count, i;
+    char *p;
 
+    if (multiple != NULL) {
+        *multiple = NULL;
+    }
     if (r == NULL || !ISVALID(name)) return NULL;
 
     switch (mask) {
         case AM_SESSION_ATTRIBUTE:
-        {
-
             /* session attribute search */
-            AM_LIST_FOR_EACH(r->sattr, e, t) {
-                if (strcmp(e->n, name) == 0) {
-                    if (multiple == NULL) {
-                        return e->v;
-                    }
-                    am_asprintf(&values, "%s%s%s",
-                            values != NULL ? values : "",
-                            values != NULL ? (ISVALID(r->conf->multi_attr_separator) ? r->conf->multi_attr_separator : "|") : "",
-                            e->v);
-                }
-            }
-        }
+            list = r->sattr;
             break;
         case AM_RESPONSE_ATTRIBUTE:
-        {
-
             /* policy response attribute search */
-            AM_LIST_FOR_EACH(r->response_attributes, e, t) {
-                if (strcmp(e->n, name) == 0) {
-                    if (multiple == NULL) {
-                        return e->v;
-                    }
-                    am_asprintf(&values, "%s%s%s",
-                            values != NULL ? values : "",
-                            values != NULL ? (ISVALID(r->conf->multi_attr_separator) ? r->conf->multi_attr_separator : "|") : "",
-                            e->v);
-                }
-            }
-        }
+            list = r->response_attributes;
             break;
         case AM_POLICY_ATTRIBUTE:
-        {
-
             /* policy response decision-attribute search (profile attribute)*/
-            AM_LIST_FOR_EACH(r->response_decisions, e, t) {
-                if (strcmp(e->n, name) == 0) {
-                    if (multiple == NULL) {
-                        return e->v;
-                    }
-                    am_asprintf(&values, "%s%s%s",
-                            values != NULL ? values : "",
-                            values != NULL ? (ISVALID(r->conf->multi_attr_separator) ? r->conf->multi_attr_separator : "|") : "",
-                            e->v);
-                }
-            }
-        }
+            list = r->response_decisions;
             break;
         default:
             AM_LOG_DEBUG(r->instance_id, "%s unknown mask value (%d)", thisfunc, mask);
-            break;
+            return NULL;
+    }
+    if (list == NULL) {
+        return NULL;
     }
 
-    if (multiple != NULL) {
-        *multiple = values;
+    if (!am_attr_index_of(r->attr_index[mask], list)) {
+        r->attr_index[mask] = am_attr_index_create(r, list);
+    }
+    count = am_attr_index_find(r->attr_index[mask], name, &values_sz, &values);
+    if (count == 0) {
+        return NULL;
+    }
+    if (multiple == NULL) {
+        return values[0];
     }
 
+    /* join the values into a buffer of the exact size */
+    separator = ISVALID(r->conf->multi_attr_separator) ? r->conf->multi_attr_separator : "|";
+    separator_sz = strlen(separator);
+    p = *multiple = malloc(values_sz + (count - 1) * separator_sz + 1);
+    if (p == NULL) {
+        AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
+        return NULL;
+    }
+    for (i = 0; i < count; i++) {
+        size_t value_sz = strlen(values[i]);
+        if (i > 0) {
+            memcpy(p, separator, separator_sz);
+            p += separator_sz;
+        }
+        memcpy(p, values[i], value_sz);
+        p += value_sz;
+    }
+    *p = '\0';
     return NULL;
 }
 
 #define MAX_VALIDATE_POLICY_RETRY 3
 
+/*
+ * allow access with the response attributes of a matching policy entry, and set the user parameter value
+ */
+static void set_policy_allow(am_request_t *r, struct am_policy_result *e) {
+    r->response_attributes = e->response_attributes; /* will be used by set header/cookie later */
+    r->response_decisions = e->response_decisions;
+    r->attr_index[AM_RESPONSE_ATTRIBUTE] = r->attr_index[AM_POLICY_ATTRIBUTE] = NULL;
+    r->status = AM_SUCCESS;
+
+    /* set user parameter value */
+    if (ISVALID(r->conf->userid_param) && ISVALID(r->conf->userid_param_type)) {
+        if (strcasecmp(r->conf->userid_param_type, "LDAP") == 0) {
+            r->user_temp = get_attr_value(r, r->conf->userid_param, AM_POLICY_ATTRIBUTE, NULL);
+        }
+        r->user = r->user_temp;
+        r->user_password = get_attr_value(r, "sunIdentityUserPassword", AM_SESSION_ATTRIBUTE, NULL);
+    }
+}
+
+/*
+ * remember a decision made with cached session/policy data, so that the next request for the same url, method and
+ * scope in this session does not need to evaluate the policies again; decisions made with a fresh policy response
+ * are not remembered, as the cache entry they would refer to has been rewritten
+ */
+static void remember_policy_decision(am_request_t *r, struct am_policy_decision *decision, char remote,
+        int entry, int action) {
+    if (remote || r->conf->policy_cache_valid <= 0) {
+        return;
+    }
+    if (am_get_policy_cache_epoch(&decision->epoch) != AM_SUCCESS) {
+        return;
+    }
+    decision->entry = entry;
+    decision->action = action;
+    decision->status = r->status;
+    am_add_policy_decision_memo(r, r->token, decision);
+}
+
+/*
+ * apply a remembered decision to the policy result list it was made with
+ */
+static am_status_t apply_policy_decision(am_request_t *r, struct am_policy_decision *decision) {
+    struct am_policy_result *e, *t;
+    struct am_action_decision *ae, *at;
+    int i = 0;
+
+    AM_LIST_FOR_EACH(r->pattr, e, t) {
+        if (i++ == decision->entry) {
+            break;
+        }
+    }
+    if (e == NULL || e->scope != decision->scope) {
+        return AM_NOT_FOUND;
+    }
+
+    if (decision->action < 0) {
+        if (decision->status != AM_SUCCESS) {
+            return AM_NOT_FOUND;
+        }
+        set_policy_allow(r, e);
+        return AM_SUCCESS;
+    }
+
+    i = 0;
+    AM_LIST_FOR_EACH(e->action_decisions, ae, at) {
+        if (i++ == decision->action) {
+            break;
+        }
+    }
+    if (ae == NULL || ae->method != r->method || (ae->action ? AM_SUCCESS : AM_ACCESS_DENIED) != decision->status) {
+        return AM_NOT_FOUND;
+    }
+
+    if (ae->action /*allow*/) {
+        set_policy_allow(r, e);
+    } else {
+        r->policy_advice = ae->advices;
+        r->status = AM_ACCESS_DENIED;
+    }
+    return AM_SUCCESS;
+}
+
 static am_return_t validate_policy(am_request_t *r) {
     static const char *thisfunc = "validate_policy():";
     struct am_policy_result *e, *t, *policy_cache = NULL;
     struct am_namevalue *session_cache = NULL;
     char is_valid = AM_FALSE, remote = AM_FALSE;
     int status = AM_ERROR, policy_status = AM_NO_MATCH, entry_status = r->status;
-    uint64_t cache_ts = 0;
+    int position = -1, action;
+    struct am_policy_decision decision;
+    uint64_t cache_ts = 0, url_digest[2];
 
     char *pattrs = NULL;
     const char *url = ISVALID(r->overridden_url_pathinfo) && r->conf->path_info_ignore ?
@@ -1212,6 +1189,7 @@ static am_return_t validate_policy(am_request_t *r) {
         r->response_decisions = NULL;
         r->policy_advice = NULL;
         r->pattr = NULL;
+        am_policy_index_delete(&r->pattr_index);
         r->sattr = NULL;
         r->status = AM_ACCESS_DENIED;
         return AM_OK;
@@ -1227,7 +1205,15 @@ static am_return_t validate_policy(am_request_t *r) {
     AM_LOG_DEBUG(r->instance_id, "%s get session cache status: %s",
             thisfunc, am_strerror(status));
 
-    if ((status == AM_SUCCESS && cache_ts > 0) || status != AM_SUCCESS) {
+    if (status != AM_SUCCESS && am_get_invalid_token_entry(r, r->token) == AM_SUCCESS) {
+        /* OpenAM reported this session token as invalid a short while ago, do not ask again */
+        AM_LOG_DEBUG(r->instance_id, "%s session token was reported as invalid recently", thisfunc);
+        if (r->not_enforced && r->conf->not_enforced_fetch_attr) {
+            r->status = AM_SUCCESS;
+            return AM_OK;
+        }
+        status = AM_INVALID_SESSION;
+    } else if ((status == AM_SUCCESS && cache_ts > 0) || status != AM_SUCCESS) {
         struct am_policy_result *policy_cache_new = NULL;
         struct am_namevalue *session_cache_new = NULL;
         am_net_options_t net_options;
@@ -1252,6 +1238,7 @@ static am_return_t validate_policy(am_request_t *r) {
                     &net_options, &session_cache_new, &policy_cache_new);
             if (status == AM_SUCCESS && session_cache_new != NULL && policy_cache_new != NULL) {
                 remote = AM_TRUE;
+                r->pattr_digest = 0; /* attributes are not read from a cache entry */
                 break;
             }
 
@@ -1267,6 +1254,7 @@ static am_return_t validate_policy(am_request_t *r) {
                  */
                 AM_LOG_DEBUG(r->instance_id, "%s fetch attributes for not enforced url failed", thisfunc);
                 am_remove_cache_entry(r->instance_id, r->token);
+                am_add_invalid_token_entry(r, r->token);
                 am_net_options_delete(&net_options);
                 am_free(pattrs);
                 r->status = AM_SUCCESS;
@@ -1278,6 +1266,7 @@ static am_return_t validate_policy(am_request_t *r) {
 
             if (status == AM_INVALID_SESSION) {
                 am_remove_cache_entry(r->instance_id, r->token);
+                am_add_invalid_token_entry(r, r->token);
                 break;
             }
             if (status == AM_INVALID_AGENT_SESSION) {
@@ -1304,6 +1293,9 @@ static am_return_t validate_policy(am_request_t *r) {
             delete_am_policy_result_list(&policy_cache);
             delete_am_namevalue_list(&session_cache);
 
+            /* keep only the attributes the configuration uses, the request reads the same data as a cached one would */
+            am_attr_project(r->conf, policy_cache_new, &session_cache_new);
+
             status = am_add_session_policy_cache_entry(r, r->token,
                     policy_cache_new, session_cache_new);
 
@@ -1343,6 +1335,7 @@ static am_return_t validate_policy(am_request_t *r) {
             r->response_decisions = NULL;
             r->policy_advice = NULL;
             delete_am_policy_result_list(&policy_cache);
+            am_policy_index_delete(&r->pattr_index);
             r->pattr = NULL;
             delete_am_namevalue_list(&session_cache);
             r->sattr = NULL;
@@ -1364,9 +1357,11 @@ static am_return_t validate_policy(am_request_t *r) {
 
     if (session_cache != NULL && is_valid) {
         r->sattr = session_cache;
+        r->attr_index[AM_SESSION_ATTRIBUTE] = NULL;
     }
     if (policy_cache != NULL && is_valid) {
         r->pattr = policy_cache;
+        am_policy_index_delete(&r->pattr_index);
     }
 
     if (r->sattr != NULL && r->pattr != NULL) {
@@ -1389,7 +1384,29 @@ static am_return_t validate_policy(am_request_t *r) {
             r->user_temp = get_attr_value(r, r->conf->userid_param, AM_SESSION_ATTRIBUTE, NULL);
         }
 
+        /* keyed, so that a url can not be made to match the memo of another one */
+        am_cache_digest(url, strlen(url), url_digest);
+        decision.url_digest = url_digest[0];
+        decision.method = r->method;
+        decision.scope = scope;
+        decision.context = (r->conf->policy_scope_subtree ? 1 : 0) | (r->conf->url_eval_case_ignore ? 2 : 0) |
+                (r->not_enforced && (r->conf->not_enforced_fetch_attr || r->is_dummypost_url) ? 4 : 0) |
+                (r->conf->sso_only ? 8 : 0);
+
+        if (!remote && r->conf->policy_cache_valid > 0 && am_get_policy_decision_memo(r, r->token, &decision) == AM_SUCCESS &&
+                apply_policy_decision(r, &decision) == AM_SUCCESS) {
+            AM_LOG_DEBUG(r->instance_id, "%s method: %s, decision: %s (remembered for this session)",
+                    thisfunc, am_method_num_to_str(r->method), r->status == AM_SUCCESS ? "allow" : "deny");
+            return AM_OK;
+        }
+
+        if (r->pattr_index == NULL) {
+            r->pattr_index = am_policy_index_create(r->pattr);
+        }
+        am_policy_index_lookup(r->pattr_index, url);
+
         AM_LIST_FOR_EACH(r->pattr, e, t) {//TODO: work on loop in 2 threads (split loop in 2; search&match in each thread)
+            position++;
 
             if ((r->conf->debug_level & AM_LOG_LEVEL_DEBUG) != 0) {
                 AM_LOG_DEBUG(r->instance_id, "%s trying cache entry for: %s", thisfunc,
@@ -1399,7 +1416,10 @@ static am_return_t validate_policy(am_request_t *r) {
             if (e->scope == scope) {
                 const char *pattern = e->resource;
 
-                if (!r->conf->policy_scope_subtree) {
+                if (!am_policy_index_candidate(r->pattr_index, position)) {
+                    /* the url does not start with the literal prefix of this pattern */
+                    policy_status = AM_NO_MATCH;
+                } else if (!r->conf->policy_scope_subtree) {
                     /* agent is running in self mode and cached entry may or may not contain 
                      * an asterisk character - do exact string match so that
                      * earlier stored request url does not become a pattern to match against 
@@ -1445,6 +1465,7 @@ static am_return_t validate_policy(am_request_t *r) {
                     r->policy_advice = NULL;
 
                     delete_am_policy_result_list(&policy_cache);
+                    am_policy_index_delete(&r->pattr_index);
                     r->pattr = NULL;
                     delete_am_namevalue_list(&session_cache);
                     r->sattr = NULL;
@@ -1465,18 +1486,8 @@ static am_return_t validate_policy(am_request_t *r) {
                                 "%s method: %s, decision: allow, %s",
                                 thisfunc, am_method_num_to_str(r->method),
                                 r->conf->sso_only ? "running sso-only mode" : "not enforced url with attribute fetch enabled");
-                        r->response_attributes = e->response_attributes;
-                        r->response_decisions = e->response_decisions;
-                        r->status = AM_SUCCESS;
-
-                        /* set user parameter value */
-                        if (ISVALID(r->conf->userid_param) && ISVALID(r->conf->userid_param_type)) {
-                            if (strcasecmp(r->conf->userid_param_type, "LDAP") == 0) {
-                                r->user_temp = get_attr_value(r, r->conf->userid_param, AM_POLICY_ATTRIBUTE, NULL);
-                            }
-                            r->user = r->user_temp;
-                            r->user_password = get_attr_value(r, "sunIdentityUserPassword", AM_SESSION_ATTRIBUTE, NULL);
-                        }
+                        set_policy_allow(r, e);
+                        remember_policy_decision(r, &decision, remote, position, -1);
                         return AM_OK;
                     }
 
@@ -1486,7 +1497,9 @@ static am_return_t validate_policy(am_request_t *r) {
                                 thisfunc);
                     }
 
+                    action = -1;
                     AM_LIST_FOR_EACH(e->action_decisions, ae, at) {
+                        action++;
 
                         /* uint64_t ts = ae->ttl;
                         if (difftime(time(NULL), ts) >= 0) {
@@ -1501,18 +1514,8 @@ static am_return_t validate_policy(am_request_t *r) {
 
                         if (ae->method == r->method) {
                             if (ae->action /*allow*/) {
-                                r->response_attributes = e->response_attributes; /* will be used by set header/cookie later */
-                                r->response_decisions = e->response_decisions;
-                                r->status = AM_SUCCESS;
-
-                                /* set user parameter value */
-                                if (ISVALID(r->conf->userid_param) && ISVALID(r->conf->userid_param_type)) {
-                                    if (strcasecmp(r->conf->userid_param_type, "LDAP") == 0) {
-                                        r->user_temp = get_attr_value(r, r->conf->userid_param, AM_POLICY_ATTRIBUTE, NULL);
-                                    }
-                                    r->user = r->user_temp;
-                                    r->user_password = get_attr_value(r, "sunIdentityUserPassword", AM_SESSION_ATTRIBUTE, NULL);
-                                }
+                                set_policy_allow(r, e);
+                                remember_policy_decision(r, &decision, remote, position, action);
 
                                 AM_LOG_DEBUG(r->instance_id, "%s method: %s, decision: allow",
                                         thisfunc, am_method_num_to_str(ae->method));
@@ -1522,6 +1525,7 @@ static am_return_t validate_policy(am_request_t *r) {
                             /* set the pointer to the policy advice(s) if any */
                             r->policy_advice = ae->advices;
                             r->status = AM_ACCESS_DENIED;
+                            remember_policy_decision(r, &decision, remote, position, action);
                             AM_LOG_DEBUG(r->instance_id, "%s method: %s, decision: deny, advice: %s",
                                     thisfunc, am_method_num_to_str(ae->method),
                                     ae->advices == NULL ? "n/a" : "available");
@@ -1541,6 +1545,7 @@ static am_return_t validate_policy(am_request_t *r) {
             r->policy_advice = NULL;
 
             delete_am_policy_result_list(&policy_cache);
+            am_policy_index_delete(&r->pattr_index);
             r->pattr = NULL;
             delete_am_namevalue_list(&session_cache);
             r->sattr = NULL;
@@ -1711,7 +1716,7 @@ static void do_cookie_set_generic(am_request_t *r, const char *prefix, const cha
                 gmtime_s(&now, &raw);
 #endif
                 strftime(time_string, sizeof (time_string),
-                        "%a, %d-%b-%Y %H:%M:%S GMT",
+                        AM_COOKIE_TIME_FORMAT,
 #ifdef _WIN32
                         &now
 #else
@@ -1839,6 +1844,138 @@ static void do_header_set(am_request_t *r, char set_value) {
     }
 }
 
+static void set_attribute_headers(am_request_t *r) {
+    static const char *thisfunc = "set_user_attributes():";
+
+    /* if attributes mode is none, we're done */
+    if (r->conf->profile_attr_fetch == AM_SET_ATTRS_NONE &&
+            r->conf->session_attr_fetch == AM_SET_ATTRS_NONE &&
+            r->conf->response_attr_fetch == AM_SET_ATTRS_NONE) {
+        AM_LOG_DEBUG(r->instance_id, "%s all set user attribute options are set to none",
+                thisfunc);
+        return;
+    }
+
+    /* if no attributes in result, we're done */
+    if (r->conf->profile_attr_map_sz == 0 &&
+            r->conf->session_attr_map_sz == 0 &&
+            r->conf->response_attr_map_sz == 0) {
+        AM_LOG_DEBUG(r->instance_id, "%s all attribute maps are empty - nothing to set",
+                thisfunc);
+        if (!r->not_enforced || r->conf->not_enforced_fetch_attr) {
+            /* clear headers/cookies */
+            do_header_set(r, AM_FALSE);
+            do_cookie_set(r, AM_FALSE, AM_TRUE);
+        }
+        return;
+    }
+
+    /* now go do it */
+    if (!r->not_enforced || r->conf->not_enforced_fetch_attr) {
+        /* clear headers/cookies */
+        AM_LOG_DEBUG(r->instance_id, "%s clearing headers/cookies", thisfunc);
+        do_header_set(r, AM_FALSE);
+        do_cookie_set(r, AM_FALSE, AM_TRUE);
+    }
+
+    /* iterate - set attributes */
+    do_header_set(r, AM_TRUE);
+    do_cookie_set(r, AM_FALSE, AM_FALSE);
+}
+
+/* records the headers and cookies set_attribute_headers makes (see render_user_attributes) */
+struct attr_recording {
+    struct am_attr_render *set;
+    am_status_t status;
+    am_status_t(*set_header_in_request_f)(am_request_t *, const char *, const char *);
+    am_status_t(*add_header_in_response_f)(am_request_t *, const char *, const char *);
+};
+
+static am_status_t record_header_in_request(am_request_t *r, const char *name, const char *value) {
+    struct attr_recording *rec = r->attr_recording;
+    if (rec->status == AM_SUCCESS) {
+        rec->status = am_attr_render_add(&rec->set, AM_FALSE, name, value);
+    }
+    return rec->set_header_in_request_f(r, name, value);
+}
+
+static am_status_t record_header_in_response(am_request_t *r, const char *name, const char *value) {
+    struct attr_recording *rec = r->attr_recording;
+    if (rec->status == AM_SUCCESS) {
+        rec->status = am_attr_render_add(&rec->set, AM_TRUE, name, value);
+    }
+    return rec->add_header_in_response_f(r, name, value);
+}
+
+/**
+ * Set user attribute headers and cookies. What set_attribute_headers makes depends only on the agent
+ * configuration and on the session and policy attributes, so when these were read from a session/policy
+ * cache entry, the headers and cookies are recorded once per session and replayed on later requests.
+ */
+static void render_user_attributes(am_request_t *r) {
+    struct am_attr_render_key key;
+    struct am_attr_render *set;
+    struct attr_recording rec;
+    struct am_policy_result *e;
+
+    if (r->pattr_digest == 0 || r->conf->ts == 0 || ISINVALID(r->token) || r->sattr == NULL || r->pattr == NULL) {
+        set_attribute_headers(r);
+        return;
+    }
+
+    memset(&key, 0, sizeof (key));
+    key.entry_digest = r->pattr_digest;
+    key.ts = r->conf->ts;
+    key.generation = r->conf->generation;
+    key.instance_id = r->instance_id;
+    key.context = (r->not_enforced ? 1 : 0) | (r->conf->not_enforced_fetch_attr ? 2 : 0);
+    key.entry = -1;
+    if (r->response_attributes != NULL || r->response_decisions != NULL) {
+        int i = 0;
+        for (e = r->pattr; e != NULL; e = e->next, i++) {
+            if (e->response_attributes == r->response_attributes && e->response_decisions == r->response_decisions) {
+                key.entry = i;
+                break;
+            }
+        }
+        if (e == NULL) {
+            /* attributes are not from the cached entry */
+            set_attribute_headers(r);
+            return;
+        }
+    }
+
+    set = am_attr_render_get(r, &key, r->token);
+    if (set != NULL) {
+        AM_LOG_DEBUG(r->instance_id, "render_user_attributes(): replaying user attribute headers");
+        am_attr_render_replay(r, set);
+        return;
+    }
+
+    rec.set = am_attr_render_create(&key, r->token);
+    if (rec.set == NULL) {
+        set_attribute_headers(r);
+        return;
+    }
+    rec.status = AM_SUCCESS;
+    rec.set_header_in_request_f = r->am_set_header_in_request_f;
+    rec.add_header_in_response_f = r->am_add_header_in_response_f;
+    r->attr_recording = &rec;
+    r->am_set_header_in_request_f = record_header_in_request;
+    r->am_add_header_in_response_f = record_header_in_response;
+
+    set_attribute_headers(r);
+
+    r->am_set_header_in_request_f = rec.set_header_in_request_f;
+    r->am_add_header_in_response_f = rec.add_header_in_response_f;
+    r->attr_recording = NULL;
+    if (rec.status == AM_SUCCESS) {
+        am_attr_render_put(&rec.set);
+    } else {
+        am_attr_render_delete(&rec.set);
+    }
+}
+
 static void set_user_attributes(am_request_t *r) {
     static const char *thisfunc = "set_user_attributes():";
     int i;
@@ -1899,40 +2036,8 @@ static void set_user_attributes(am_request_t *r) {
             }
         }
 
-        /* if attributes mode is none, we're done */
-        if (r->conf->profile_attr_fetch == AM_SET_ATTRS_NONE &&
-                r->conf->session_attr_fetch == AM_SET_ATTRS_NONE &&
-                r->conf->response_attr_fetch == AM_SET_ATTRS_NONE) {
-            AM_LOG_DEBUG(r->instance_id, "%s all set user attribute options are set to none",
-                    thisfunc);
-            break;
-        }
-
-        /* if no attributes in result, we're done */
-        if (r->conf->profile_attr_map_sz == 0 &&
-                r->conf->session_attr_map_sz == 0 &&
-                r->conf->response_attr_map_sz == 0) {
-            AM_LOG_DEBUG(r->instance_id, "%s all attribute maps are empty - nothing to set",
-                    thisfunc);
-            if (!r->not_enforced || r->conf->not_enforced_fetch_attr) {
-                /* clear headers/cookies */
-                do_header_set(r, AM_FALSE);
-                do_cookie_set(r, AM_FALSE, AM_TRUE);
-            }
-            break;
-        }
-
-        /* now go do it */
-        if (!r->not_enforced || r->conf->not_enforced_fetch_attr) {
-            /* clear headers/cookies */
-            AM_LOG_DEBUG(r->instance_id, "%s clearing headers/cookies", thisfunc);
-            do_header_set(r, AM_FALSE);
-            do_cookie_set(r, AM_FALSE, AM_TRUE);
-        }
-
-        /* iterate - set attributes */
-        do_header_set(r, AM_TRUE);
-        do_cookie_set(r, AM_FALSE, AM_FALSE);
+        /* user attribute headers and cookies */
+        render_user_attributes(r);
 
     } while (0);
 }
@@ -2167,7 +2272,7 @@ static am_return_t handle_exit(am_request_t *r) {
                                     wd->options->server_id = r->conf->lb_enable && ISVALID(r->session_info.si) ? strdup(r->session_info.si) : NULL;
                                 }
 
-                                if (am_worker_dispatch(session_logout_worker, wd) != 0) {
+                                if (am_worker_dispatch_reliable(session_logout_worker, wd) != 0) {
                                     am_net_options_delete(wd->options);
                                     AM_FREE(wd->token, wd->openam, wd->options, wd);
                                     r->status = AM_ERROR;
@@ -2529,6 +2634,7 @@ static am_return_t handle_exit(am_request_t *r) {
                         goto_proto = goto_url.proto;
                         goto_host = goto_url.host;
                         goto_port = goto_url.port;
+                        url_free(&goto_url); /* only proto, host and port are used */
                     } 
                     
                     am_asprintf(&goto_value, "%s://%s:%d%s%s"POST_PRESERVE_URI"?%s%s%s",
@@ -48,7 +48,14 @@
 #endif
 
 
-const struct readlock                       readlock_init = { .readers = 0, .barrier = 0, .pids = { 0 } };
+const struct readlock                       readlock_init = { .readers = 0, .barrier = 0 };
+
+
+static struct reader_registry              *registry = NULL;
+
+static struct readlock                     *lock_base = NULL;
+
+static struct reader_process *volatile      process_cache = NULL;
 
 
 /*
@@ -88,6 +95,218 @@ static int process_dead(pid_t pid) {
 #endif
 }
 
+/*
+ * set up the shared registry of readers for locks in the array starting at base; locks are identified in the
+ * registry by their index in this array, as the array is mapped at different addresses in each process
+ *
+ */
+void read_lock_registry(struct reader_registry *r, struct readlock *base) {
+
+    process_cache = NULL;
+    lock_base = base;
+    registry = r;
+
+}
+
+static uint32_t lock_id(struct readlock *lock) {
+
+    return (uint32_t)(lock - lock_base) + 1;
+
+}
+
+/*
+ * find (or claim) the registry slot for this process, reclaiming the slot of a dead process if necessary
+ *
+ */
+static struct reader_process *process_slot(pid_t pid) {
+    static const char                      *thisfunc = "process_slot():";
+
+    struct reader_process                  *p = process_cache;
+
+    if (p && p->pid == pid) {
+        return p;
+    }
+
+    for (uint32_t n = 0; n < READER_PROCESSES; n++) {
+        uint32_t                            i = (pid + n) % READER_PROCESSES;
+        pid_t                               owner;
+
+        p = registry->processes + i;
+
+        if (( owner = casv(&p->pid, 0, pid) ) && owner != pid) {
+            if (owner == -1 || process_dead(owner) == 0) {
+                continue;                                                             /* in use, or being reclaimed */
+            }
+            if (cas(&p->pid, owner, -1) == 0) {
+                continue;
+            }
+            for (int j = 0; j < READER_HOLDS; j++) {
+                p->holds[j] = 0;                                                      /* locks are recovered by checkers */
+            }
+            p->untracked = 0;
+            p->pid = pid;
+        }
+
+        for (uint32_t used = registry->used; used <= i; used = registry->used) {
+            if (cas(&registry->used, used, i + 1)) {
+                break;
+            }
+        }
+
+        process_cache = p;
+        return p;
+    }
+
+    AM_LOG_DEBUG(0, "%s reader registry is full, read locks held by %"PR_L64" are counted as untracked",
+                     thisfunc, (int64_t)pid);
+    return NULL;
+
+}
+
+/*
+ * count (or uncount) a read lock that is not recorded in the hold records; returns 0 if there is nothing to uncount
+ *
+ */
+static int add_untracked(volatile uint32_t *count, int32_t n) {
+
+    uint32_t                                untracked;
+
+    do {
+        untracked = *count;
+
+        if (n < 0 && untracked == 0) {
+            return 0;
+        }
+
+    } while (cas(count, untracked, untracked + n) == 0);
+
+    return 1;
+
+}
+
+static volatile uint32_t *lock_untracked(struct readlock *lock) {
+
+    return registry->untracked + (lock_id(lock) - 1) % READER_LOCKS;
+
+}
+
+/*
+ * record a read lock held by this process; this is done before the reader is counted, so that a checker can
+ * always see it
+ *
+ * read locks beyond the hold records of the process are counted with the process, and those of a process that can't get
+ * a slot are counted with the lock; either way the reader does not wait for a record to be free
+ *
+ */
+static void add_hold(struct readlock *lock, pid_t pid) {
+
+    struct reader_process                  *p;
+    uint32_t                                id;
+
+    if (registry == NULL) {
+        return;                                                                       /* untracked, no registry */
+    }
+
+    if (( p = process_slot(pid) ) == NULL) {
+        add_untracked(lock_untracked(lock), 1);                                       /* registry is full */
+        return;
+    }
+
+    id = lock_id(lock);
+
+    for (int n = 0; n < READER_HOLDS; n++) {
+        if (cas(p->holds + (id + n) % READER_HOLDS, 0, id)) {
+            return;
+        }
+    }
+
+    add_untracked(&p->untracked, 1);                                                  /* all hold records are in use */
+
+}
+
+/*
+ * remove a record of a read lock held by this process
+ *
+ */
+static void remove_hold(struct readlock *lock, pid_t pid) {
+
+    struct reader_process                  *p;
+    uint32_t                                id;
+
+    if (registry == NULL) {
+        return;
+    }
+
+    if (( p = process_slot(pid) ) != NULL) {
+        id = lock_id(lock);
+
+        for (int n = 0; n < READER_HOLDS; n++) {
+            if (cas(p->holds + (id + n) % READER_HOLDS, id, 0)) {
+                return;
+            }
+        }
+
+        if (add_untracked(&p->untracked, -1)) {
+            return;                                                                   /* taken while the hold records were in use */
+        }
+    }
+
+    add_untracked(lock_untracked(lock), -1);                                          /* taken while the registry was full */
+
+}
+
+/*
+ * count the read locks on a lock held by live processes, discarding those held by processes that are not running;
+ * the read locks a live process holds beyond its hold records may be on any lock, so they are all counted, and read
+ * locks held without a process slot are counted as live (they can't be told apart)
+ *
+ */
+static int live_holds(struct readlock *lock) {
+
+    uint32_t                                id, used;
+    int                                     n = 0;
+
+    if (registry == NULL) {
+        return lock->readers != 0;                                                    /* no way to tell, assume they are live */
+    }
+
+    id = lock_id(lock);
+    used = registry->used;
+
+    for (uint32_t i = 0; i < used && i < READER_PROCESSES; i++) {
+        struct reader_process              *p = registry->processes + i;
+        pid_t                               owner = p->pid;
+        uint32_t                            untracked;
+        int                                 found = 0;
+
+        if (owner <= 0) {
+            continue;
+        }
+
+        for (int j = 0; j < READER_HOLDS; j++) {
+            if (p->holds[j] == id) {
+                found++;
+            }
+        }
+
+        untracked = p->untracked;
+
+        if (found || untracked) {
+            if (process_dead(owner)) {
+                for (int j = 0; j < READER_HOLDS; j++) {
+                    cas(p->holds + j, id, 0);                                         /* remove holds for a dead process */
+                }
+                cas(&p->untracked, untracked, 0);
+            } else {
+                n += found + (int)untracked;
+            }
+        }
+    }
+
+    return n + (int)*lock_untracked(lock);
+
+}
+
 /*
  * quick test whether all readers are finished with the lock; it is used to ensure that writers are not starved
  *
@@ -95,7 +314,9 @@ static int process_dead(pid_t pid) {
 static int wait_for_counted_readers(struct readlock *lock, int tries) {
 
     do {
-        if (lock->readers == 0) {
+        int32_t                             readers = lock->readers;
+
+        if (readers == 0 || readers == READER_BLOCKED) {
             return 1;
         }
 
@@ -108,8 +329,8 @@ static int wait_for_counted_readers(struct readlock *lock, int tries) {
 }
 
 /*
- * robust wait for readers to finish, by using the pid table to wait for it to empty
- * and discarding pids that are not running
+ * robust wait for readers to finish: the lock is blocked as soon as the count of readers gets to zero, or when
+ * the reader registry shows that all remaining readers belong to processes that are not running
  *
  * this will block all readers, but it should be quick because readers are very transient
  *
@@ -118,6 +339,7 @@ static int wait_for_live_readers(struct readlock *lock, pid_t pid, int unblock)
     static const char                      *thisfunc = "wait_for_live_readers():";
 
     pid_t                                   checker = 0;
+    int                                     tries = 0;
 
     if (( checker = casv(&lock->barrier, 0, pid) )) {
         if (checker == pid) {
@@ -135,45 +357,28 @@ static int wait_for_live_readers(struct readlock *lock, pid_t pid, int unblock)
     }
 
     do {
-        int                                 n = 0;
-
-        for (int i = 0; i < THREAD_LIMIT; i++) {
-            pid_t                           writer;
-
-            if (( writer = casv(lock->pids + i, 0, -1) )) {
-                if (writer == -1) {
-                    n++;
-                } else if (process_dead(writer)) {
-                    for (int j = i; j < THREAD_LIMIT; j++) {
-                        cas(lock->pids + j, writer, -1);                              /* remove pids for threads of a dead process */
-                    }
-                    n++;
-                }
-            } else {
-               n++;
-            }
-        }
+        int32_t                             readers = lock->readers;
 
-        if (n == THREAD_LIMIT) {
+        if (readers == READER_BLOCKED || (readers == 0 && cas(&lock->readers, 0, READER_BLOCKED))) {
             break;
         }
 
-        yield();                                                                      /* wait for existing readers to complete */
-
-    } while (1);
+        if (++tries % 100 == 0 && live_holds(lock) == 0) {
+            readers = lock->readers;                                                  /* only readers in dead processes remain */
 
-    int32_t                                 readers = lock->readers;
+            if (cas(&lock->readers, readers, READER_BLOCKED)) {
+                AM_LOG_DEBUG(0, "%s rwlock recovery: %"PR_L64" discards %d readers",
+                                 thisfunc, (int64_t)pid, readers == READER_LIMIT ? 1 : readers);
+                break;
+            }
+        }
 
-    while (cas(&lock->readers, readers, 0) == 0) {
-        yield();
+        yield();                                                                      /* wait for existing readers to complete */
 
-        readers = lock->readers;
-    }
+    } while (1);
 
     if (unblock) {
-        for (int i = 0; i < THREAD_LIMIT; i++) {
-            cas(lock->pids + i, -1, 0);
-        }
+        cas(&lock->readers, READER_BLOCKED, 0);
         cas(&lock->barrier, pid, 0);
     }
 
@@ -197,9 +402,7 @@ int read_block(struct readlock *lock, pid_t pid) {
  */
 int read_unblock(struct readlock *lock, pid_t pid) {
 
-    for (int i = 0; i < THREAD_LIMIT; i++) {
-        cas(lock->pids + i, -1, 0);
-    }
+    cas(&lock->readers, READER_BLOCKED, 0);
 
     return cas(&lock->barrier, pid, 0);
 
@@ -262,24 +465,9 @@ int wait_for_barrier(struct readlock *lock, pid_t pid) {
 
 }
 
-/*
- * atomically add a pid (which represents a thread in a process) to a fixed size array
- *
- */
-static int add_pid_to_array(volatile pid_t *array, size_t array_ln, pid_t old, pid_t new) {
-
-    for (size_t i = 0; i < array_ln; i++) {
-        if (cas(array + i, old, new)) {
-            return 1;
-        }
-    }
-    return 0;
-
-}
-
 /*
  * get read lock, trying to ensure that writers are not starved by enforing a "barrier" where readers -> zero, and
- * remove pid and retry with robust barrier if it is taking too long
+ * remove the hold and retry with robust barrier if it is taking too long
  *
  */
 int read_lock(struct readlock *lock, pid_t pid) {
@@ -289,29 +477,28 @@ int read_lock(struct readlock *lock, pid_t pid) {
 
         ensure_liveness(lock, pid);
                                                                                       /* ensure that any checker can complete */
-        while (add_pid_to_array(lock->pids, THREAD_LIMIT, 0, pid) == 0) {
-            yield();
+        add_hold(lock, pid);
 
-            wait_for_barrier(lock, pid);                                              /* allow write locks by waiting for lockers to complete */
+        if (lock->barrier) {
+            remove_hold(lock, pid);                                                   /* a checker has started, wait for it */
+            continue;
         }
 
         do {
             int32_t                         readers = lock->readers;
     
-            if (readers < THREAD_LIMIT) {
+            if (0 <= readers && readers < READER_LIMIT - 1) {
                 if (cas(&lock->readers, readers, readers + 1)) {
                     return 1;
                 }
-            } else if (wait_for_counted_readers(lock, 100) == 0) {
-                break;                                                                /* too much contention or blockage */
+            } else if (readers == READER_BLOCKED || wait_for_counted_readers(lock, 100) == 0) {
+                break;                                                                /* blocked, or too much contention or blockage */
             }
             yield();
 
         } while (--tries);
 
-        while (add_pid_to_array(lock->pids, THREAD_LIMIT, pid, 0) == 0) {             /* should never fail */
-            yield();
-        }
+        remove_hold(lock, pid);
 
         wait_for_live_readers(lock, pid, 1);                                          /* ensure robustly that writers momentarily go to zero */
 
@@ -325,25 +512,23 @@ int read_lock(struct readlock *lock, pid_t pid) {
  */
 int read_lock_try(struct readlock *lock, pid_t pid, int tries) {
 
-    if (add_pid_to_array(lock->pids, THREAD_LIMIT, 0, pid) == 0) {
-        return 0;
-    }
-
-    do {
-        int32_t                             readers = lock->readers;
+    add_hold(lock, pid);
 
-        if (readers < THREAD_LIMIT && cas(&lock->readers, readers, readers + 1)) {
-            return 1;
-        }
+    if (lock->barrier == 0) {
+        do {
+            int32_t                         readers = lock->readers;
 
-        yield();            
+            if (0 <= readers && readers < READER_LIMIT - 1 && cas(&lock->readers, readers, readers + 1)) {
+                return 1;
+            }
 
-    } while (--tries);
+            yield();            
 
-    while (add_pid_to_array(lock->pids, THREAD_LIMIT, pid, 0) == 0) {                 /* should never fail */
-        yield();            
+        } while (--tries);
     }
 
+    remove_hold(lock, pid);
+
     return 0;
 
 }
@@ -356,7 +541,7 @@ int read_try_unique(struct readlock *lock, int tries) {
 
     do {
 
-        if (cas(&lock->readers, 1, THREAD_LIMIT)) {
+        if (cas(&lock->readers, 1, READER_LIMIT)) {
             return 1;
         }
 
@@ -375,7 +560,7 @@ int read_try_unique(struct readlock *lock, int tries) {
 int read_release_unique(struct readlock *lock) {
 
     do {
-        if (cas(&lock->readers, THREAD_LIMIT, 1)) {
+        if (cas(&lock->readers, READER_LIMIT, 1)) {
             return 1;
         }
 
@@ -392,7 +577,7 @@ int read_release_unique(struct readlock *lock) {
 int read_release_all(struct readlock *lock, pid_t pid) {
 
     do {
-        if (cas(&lock->readers, THREAD_LIMIT, 0)) {
+        if (cas(&lock->readers, READER_LIMIT, 0)) {
             break;
         }
 
@@ -400,9 +585,7 @@ int read_release_all(struct readlock *lock, pid_t pid) {
 
     } while (1);
 
-    while (add_pid_to_array(lock->pids, THREAD_LIMIT, pid, 0) == 0) {                 /* should never fail */
-        yield();            
-    }
+    remove_hold(lock, pid);
 
     return 1;
 
@@ -417,7 +600,7 @@ int read_release(struct readlock *lock, pid_t pid) {
     int32_t                                 readers = lock->readers;
 
     do {
-        if (readers) {
+        if (readers > 0) {
             if (cas(&lock->readers, readers, readers - 1)) {
                 break;
             }
@@ -431,11 +614,8 @@ int read_release(struct readlock *lock, pid_t pid) {
 
     } while (1);
 
-    while (add_pid_to_array(lock->pids, THREAD_LIMIT, pid, 0) == 0) {                 /* should never fail */
-        yield();            
-    }
+    remove_hold(lock, pid);
 
     return 1;
 
 }
-
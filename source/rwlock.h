@@ -14,7 +14,15 @@
  * Copyright 2014 - 2016 ForgeRock AS.
  */
 
-#define THREAD_LIMIT                        20
+#define READER_LIMIT                        0x40000000                                /* value of readers when write locked */
+
+#define READER_BLOCKED                      (-1)                                      /* value of readers when blocked */
+
+#define READER_PROCESSES                    1024                                      /* processes tracked in the reader registry */
+
+#define READER_HOLDS                        64                                        /* read locks concurrently recorded per process */
+
+#define READER_LOCKS                        4096                                      /* locks with their own count of readers without a slot */
 
 struct readlock
 {
@@ -22,13 +30,38 @@ struct readlock
 
     volatile pid_t                          barrier;
 
-    volatile pid_t                          pids[THREAD_LIMIT];
+};
+
+/*
+ * shared registry of read locks held by each process, used to recover locks held by processes that have died
+ *
+ */
+struct reader_process
+{
+    volatile pid_t                          pid;
+
+    volatile uint32_t                       holds[READER_HOLDS];                      /* lock index + 1, or 0 */
+
+    volatile uint32_t                       untracked;                                /* read locks held beyond the hold records */
+
+};
+
+struct reader_registry
+{
+    volatile uint32_t                       used;                                     /* high water mark of process slots */
+
+    struct reader_process                   processes[READER_PROCESSES];
+
+    volatile uint32_t                       untracked[READER_LOCKS];                  /* read locks held without a process slot, by lock */
 
 };
 
 extern const struct readlock                readlock_init;
 
 
+void read_lock_registry(struct reader_registry *registry, struct readlock *base);
+
+
 int read_lock(struct readlock *lock, pid_t pid);
 
 int read_lock_try(struct readlock *lock, pid_t pid, int tries);
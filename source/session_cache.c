@@ -33,24 +33,60 @@
  * ===============================================================
  * key: 'uuid value'
  * 
+ * Policy decision memo cache
+ * ===============================================================
+ * key: AM_DECISION_MEMO_PREFIX 'token value'
+ * 
+ * Invalid session token cache
+ * ===============================================================
+ * key: AM_INVALID_TOKEN_PREFIX 'token value'
+ * 
+ * Shared policy cache (policies referred to by session and policy response attribute cache entries)
+ * ===============================================================
+ * key: AM_POLICY_BLOB_PREFIX 'policy digest'-'policy size'
+ * 
+ * Entries are keyed by the 128 bit keyed digest (am_digest128) of the key values above, with the key created along with the
+ * shared cache, so that keys have a fixed size whatever the token size, compare with two word loads, and can not be made to
+ * collide from outside; the collision list hash is taken from the digest as well. Shared policies, the only entries looked
+ * up by a digest of their content, are compared byte for byte before they are shared.
+ * 
  */
 
 #define key_ln(blob)                    *(uint32_t *)(((char *)(blob)) + 1)
 #define key_addr(blob)                   (((char *)(blob)) + 1 + sizeof(uint32_t))
 
+#define CACHE_KEY_SIZE                  (2 * sizeof(uint64_t))
+
 #define AM_CACHE_GC_INTERVAL            "AM_CACHE_GC_INTERVAL"
 #define AM_CACHE_GC_DEFAULT_INTERVAL    3
+#define AM_CACHE_GC_SLICES              8       /* gc ticks per interval; each tick does 1/AM_CACHE_GC_SLICES of the full sweep */
+#define AM_CACHE_GC_EXPIRY_BUDGET       1024    /* max number of collision lists visited per tick for expiry */
+#define AM_CACHE_GC_DEFRAG_BUDGET       1000    /* max microseconds spent compacting memory clusters per tick */
+
+static am_timer_entry_t                 cache_timer;
+static int                              cache_timer_started = AM_FALSE;
 
-static am_timer_event_t                 *cache_timer = NULL;
+struct cache_key {
+    uint64_t                            digest[2];
+    uint32_t                            hash;                                         /* collision list hash */
+};
 
+/*
+ * incremental cache gc: expired entries are taken from the expiry index (only collision lists with due entries are visited),
+ * while lock barriers, lru ageing and memory scan are spread out over AM_CACHE_GC_SLICES ticks per gc interval; each tick
+ * ends with a time-boxed defragmentation pass over the memory clusters
+ *
+ */
 static void cache_cleanup_event(void *arg) {
     pid_t pid;
 
     if (is_agent_memory_ready() == AM_SUCCESS && is_agent_cache_ready() == AM_SUCCESS) {
         pid = getpid();
-        cache_readlock_total_barrier(pid); /* check that all rw locks can go past 0 locks */
-        cache_purge_expired_entries(pid); /* purge expired cache entries, then deleted entries */
-        cache_garbage_collect();
+        cache_readlock_barrier_slice(pid, AM_CACHE_GC_SLICES); /* check that rw locks can go past 0 locks */
+        cache_purge_due_entries(pid, AM_CACHE_GC_EXPIRY_BUDGET); /* purge cache entries that are due to expire */
+        cache_purge_expired_entries_slice(pid, AM_CACHE_GC_SLICES); /* age entries, purge least recently used */
+        cache_garbage_collect_slice(AM_CACHE_GC_SLICES);
+        cache_defragment(AM_CACHE_GC_DEFRAG_BUDGET); /* compact clusters ahead of allocations needing it */
         cache_stats();
     }
 }
@@ -70,21 +106,18 @@ int am_cache_worker_init() {
         }
     }
 
-    if (cache_timer != NULL) {
+    if (cache_timer_started) {
         return AM_SUCCESS;
     }
 
-    cache_timer = am_create_timer_event(AM_TIMER_EVENT_RECURRING, interval, NULL, cache_cleanup_event);
-
-    if (cache_timer == NULL) {
-        return AM_ENOMEM;
-    }
+    am_timer_entry_init(&cache_timer, cache_cleanup_event, NULL);
+    cache_timer.dispatch = AM_TRUE;                                                   /* a gc tick is too long to run on the timer wheel thread */
 
-    if (cache_timer->error != 0) {
+    if (am_timer_schedule(&cache_timer, interval * 1000 / AM_CACHE_GC_SLICES, interval * 1000 / AM_CACHE_GC_SLICES) != AM_SUCCESS) {
         return AM_ERROR;
     }
 
-    am_start_timer_event(cache_timer);
+    cache_timer_started = AM_TRUE;
 
     return AM_SUCCESS;
 
@@ -92,8 +125,10 @@ int am_cache_worker_init() {
 
 void am_cache_worker_shutdown() {
 
-    am_close_timer_event(cache_timer);
-    cache_timer = NULL;
+    if (cache_timer_started) {
+        am_timer_cancel(&cache_timer);
+        cache_timer_started = AM_FALSE;
+    }
 
 }
 
@@ -105,9 +140,31 @@ void am_cache_worker_shutdown() {
  */
 static int key_equality(void *a, void *b) {
 
-    uint32_t                             len = key_ln(a);
+    return key_ln(a) == key_ln(b) && memcmp(key_addr(a), key_addr(b), CACHE_KEY_SIZE) == 0;
+
+}
+
+/*
+ * keyed digest of a value, for keys and for client supplied values kept in cache entries
+ *
+ */
+void am_cache_digest(const void *buf, size_t len, uint64_t digest[2]) {
 
-    return len == key_ln(b) && memcmp(key_addr(a), key_addr(b), ntohl(len)) == 0;
+    uint64_t                             seed[2];
+
+    cache_key_seed(seed);
+    am_digest128(buf, len, seed, digest);
+
+}
+
+/*
+ * cache key for a key value
+ *
+ */
+static void cache_key_init(struct cache_key *k, const char *key) {
+
+    am_cache_digest(key, strlen(key), k->digest);
+    k->hash = (uint32_t)k->digest[0];
 
 }
 
@@ -121,15 +178,17 @@ int am_remove_cache_entry(unsigned long instance, const char *key) {
 
     int                                  status = AM_SUCCESS;
 
-    uint32_t                             hash = am_hash(key);
+    struct cache_key                     k;
+
+    cache_key_init(&k, key);
 
     cache_object_ctx_init(&ctx);
-    cache_object_write_key(&ctx, (char *)key);
+    cache_object_write_key(&ctx, k.digest);
 
     if (ctx.error) {
         status = ctx.error;
     } else {
-        cache_delete(hash, ctx.data, key_equality);
+        cache_delete(k.hash, ctx.data, key_equality);
     }
 
     cache_object_ctx_destroy(&ctx);
@@ -141,18 +200,18 @@ int am_remove_cache_entry(unsigned long instance, const char *key) {
  * get (readlocked) memory in shared cache
  *
  */
-static int cache_fetch_readable(uint32_t hash, char *key, void **data_addr, uint32_t *sz_addr) {
+static int cache_fetch_readable(const struct cache_key *k, void **data_addr, uint32_t *sz_addr) {
 
     struct cache_object_ctx              ctx;
 
     int                                  status = 0;
 
     cache_object_ctx_init(&ctx);
-    cache_object_write_key(&ctx, key);
+    cache_object_write_key(&ctx, k->digest);
 
     if (ctx.error) {
         status = ctx.error;
-    } else if (cache_get_readlocked_ptr(hash, data_addr, sz_addr, ctx.data, time(0), key_equality)) {
+    } else if (cache_get_readlocked_ptr(k->hash, data_addr, sz_addr, ctx.data, time(0), key_equality)) {
         status = AM_NOT_FOUND;
     }
 
@@ -162,22 +221,24 @@ static int cache_fetch_readable(uint32_t hash, char *key, void **data_addr, uint
 }
 
 /*
- * get validation time in for all policies
+ * get validation time for all policies, 0 when no epoch is set
  *
  */
-int am_check_policy_cache_epoch(uint64_t policy_created) {
+int am_get_policy_cache_epoch(uint64_t *epoch) {
 
     struct cache_object_ctx              ctx;
     int                                  status;
 
-    uint32_t                             hash = am_hash(AM_POLICY_CHANGE_KEY);
+    struct cache_key                     k;
 
     void                                *shm_data;                                    /* pointer into hash table */
     uint32_t                             shm_data_sz;
 
-    uint64_t                             epoch_start;
+    *epoch = 0;
 
-    if (( status = cache_fetch_readable(hash, (char *)AM_POLICY_CHANGE_KEY, &shm_data, &shm_data_sz) )) {
+    cache_key_init(&k, AM_POLICY_CHANGE_KEY);
+
+    if (( status = cache_fetch_readable(&k, &shm_data, &shm_data_sz) )) {
         if (status == AM_NOT_FOUND) {
             return AM_SUCCESS;                                                        /* no epoch set */
         }
@@ -186,14 +247,27 @@ int am_check_policy_cache_epoch(uint64_t policy_created) {
 
     cache_object_ctx_init_data(&ctx, shm_data, (size_t)shm_data_sz);
     cache_object_skip_key(&ctx);
-    am_policy_epoch_deserialise(&ctx, &epoch_start);
+    am_policy_epoch_deserialise(&ctx, epoch);
 
-    cache_release_readlocked_ptr(hash);
+    cache_release_readlocked_ptr(k.hash);
 
     status = ctx.error;
     cache_object_ctx_destroy(&ctx);
 
-    if (status) {
+    return status;
+
+}
+
+/*
+ * check whether policies created at the given time are valid in the current epoch
+ *
+ */
+int am_check_policy_cache_epoch(uint64_t policy_created) {
+
+    uint64_t                             epoch_start;
+    int                                  status;
+
+    if (( status = am_get_policy_cache_epoch(&epoch_start) )) {
         return status;
     }
 
@@ -201,7 +275,7 @@ int am_check_policy_cache_epoch(uint64_t policy_created) {
         return AM_ETIMEDOUT;                                                          /* policy crated before the epoch */
     }
 
-    return status;
+    return AM_SUCCESS;
 
 }
 
@@ -214,15 +288,17 @@ int am_set_policy_cache_epoch(uint64_t epoch_start) {
     struct cache_object_ctx              ctx;
     int                                  status;
 
-    uint32_t                             hash = am_hash(AM_POLICY_CHANGE_KEY);
+    struct cache_key                     k;
+
+    cache_key_init(&k, AM_POLICY_CHANGE_KEY);
 
     cache_object_ctx_init(&ctx);
-    cache_object_write_key(&ctx, (char *)AM_POLICY_CHANGE_KEY);
+    cache_object_write_key(&ctx, k.digest);
     am_policy_epoch_serialise(&ctx, epoch_start);
 
     if (ctx.error) {
         status = ctx.error;
-    } else if (cache_add(hash, ctx.data, ctx.data_size, ~0, key_equality)) {
+    } else if (cache_add(k.hash, ctx.data, ctx.data_size, ~0, key_equality)) {
         status = AM_ERROR;                                                            /* failure here is significant */
     } else {
         status = AM_SUCCESS;
@@ -242,12 +318,14 @@ int am_get_pdp_cache_entry(am_request_t *request, const char *key, char **url, c
     struct cache_object_ctx              ctx;
     int                                  status;
 
-    uint32_t                             hash = am_hash(key);
+    struct cache_key                     k;
 
     void                                *shm_data;                                    /* pointer into hash table */
     uint32_t                             shm_data_sz;
 
-    if (cache_fetch_readable(hash, (char *)key, &shm_data, &shm_data_sz)) {
+    cache_key_init(&k, key);
+
+    if (cache_fetch_readable(&k, &shm_data, &shm_data_sz)) {
         return AM_NOT_FOUND;
     }
 
@@ -255,7 +333,7 @@ int am_get_pdp_cache_entry(am_request_t *request, const char *key, char **url, c
     cache_object_skip_key(&ctx);
     am_pdp_entry_deserialise(&ctx, url, file, content_type, method);
 
-    cache_release_readlocked_ptr(hash);
+    cache_release_readlocked_ptr(k.hash);
 
     status = ctx.error;
     cache_object_ctx_destroy(&ctx);
@@ -273,17 +351,19 @@ int am_add_pdp_cache_entry(am_request_t *request, const char *key, const char *u
     struct cache_object_ctx              ctx;
     int                                  status;
 
-    uint32_t                             hash = am_hash(key);
+    struct cache_key                     k;
 
     int64_t                              expires = time(0) + request->conf->pdp_cache_valid;
 
+    cache_key_init(&k, key);
+
     cache_object_ctx_init(&ctx);
-    cache_object_write_key(&ctx, (char *)key);
+    cache_object_write_key(&ctx, k.digest);
     am_pdp_entry_serialise(&ctx, url, file, content_type, method);
 
     if (ctx.error) {
         status = ctx.error;
-    } else if (cache_add(hash, ctx.data, ctx.data_size, expires, key_equality)) {
+    } else if (cache_add(k.hash, ctx.data, ctx.data_size, expires, key_equality)) {
         status = AM_ERROR;                                                            /* failure here is significant */
     } else {
         status = AM_SUCCESS;
@@ -317,12 +397,26 @@ static int get_session_ttl(am_request_t *request, struct am_namevalue *session)
 }
 
 /*
- * deserialise cached policy and session data
+ * key of a policy shared between session entries
  *
  */
-int am_get_session_policy_cache_entry(am_request_t *request, const char *key, struct am_policy_result **policy, struct am_namevalue **session, uint64_t *ts) {
+static char *policy_blob_key(const struct am_policy_reference *ref) {
 
-    uint32_t                             hash = am_hash(key);
+    char                                *blob_key = NULL;
+
+    am_asprintf(&blob_key, "%s%016llx-%u", AM_POLICY_BLOB_PREFIX, (unsigned long long)ref->digest, ref->size);
+    return blob_key;
+
+}
+
+/*
+ * read a shared policy into a policy result of a session entry, AM_NOT_FOUND when it is no longer cached
+ *
+ */
+static int policy_blob_read(const struct am_policy_reference *ref, struct am_policy_result *policy) {
+
+    char                                *blob_key = policy_blob_key(ref);
+    struct cache_key                     k;
 
     struct cache_object_ctx              ctx;
     int                                  status;
@@ -330,16 +424,26 @@ int am_get_session_policy_cache_entry(am_request_t *request, const char *key, st
     void                                *shm_data;                                    /* pointer into hash table */
     uint32_t                             shm_data_sz;
 
-    if (cache_fetch_readable(hash, (char *)key, &shm_data, &shm_data_sz)) {
+    if (blob_key == NULL) {
+        return AM_ENOMEM;
+    }
+    cache_key_init(&k, blob_key);
+    free(blob_key);
+
+    status = cache_fetch_readable(&k, &shm_data, &shm_data_sz);
+
+    if (status) {
         return AM_NOT_FOUND;
     }
 
     cache_object_ctx_init_data(&ctx, shm_data, (size_t)shm_data_sz);
-    cache_object_skip_key(&ctx);
-    *policy = am_policy_result_deserialise(&ctx);
-    *session = am_name_value_deserialise(&ctx);
+    if (cache_object_skip_key(&ctx) || ctx.data_size - ctx.offset != ref->size) {
+        ctx.error = AM_NOT_FOUND;
+    } else {
+        am_policy_blob_deserialise(&ctx, policy);
+    }
 
-    cache_release_readlocked_ptr(hash);
+    cache_release_readlocked_ptr(k.hash);
 
     status = ctx.error;
     cache_object_ctx_destroy(&ctx);
@@ -349,70 +453,243 @@ int am_get_session_policy_cache_entry(am_request_t *request, const char *key, st
 }
 
 /*
- * cache policy and session data, add existing policies for other resources, overriding existing policies for the same resources
+ * share a serialised policy with other session entries holding the same one, making it live at least until expires; ref
+ * is set up to refer to the shared policy, or to keep the policy inline in the session entry when it can't be shared
  *
  */
-int am_add_session_policy_cache_entry(am_request_t *request, const char *key, struct am_policy_result *policy, struct am_namevalue *session) {
+static void policy_blob_write(struct am_policy_reference *ref, struct cache_object_ctx *blob, int64_t expires) {
 
-    int                                  status;
+    char                                *blob_key;
+    struct cache_key                     k;
+
+    struct cache_object_ctx              ctx;
+    int                                  found, shared = AM_FALSE;
+
+    void                                *shm_data;                                    /* pointer into hash table */
+    uint32_t                             shm_data_sz;
+
+    ref->digest = am_digest64(blob->data, blob->data_size);
+    ref->size = (uint32_t)blob->data_size;
+    ref->data = blob->data;
+
+    if (( blob_key = policy_blob_key(ref) ) == NULL) {
+        return;
+    }
+    cache_key_init(&k, blob_key);
+    free(blob_key);
+
+    found = cache_fetch_readable(&k, &shm_data, &shm_data_sz) == 0;
+    if (found) {
+        cache_object_ctx_init_data(&ctx, shm_data, (size_t)shm_data_sz);
+        shared = cache_object_skip_key(&ctx) == 0 && ctx.data_size - ctx.offset == ref->size &&
+                memcmp((char *)ctx.data + ctx.offset, blob->data, ref->size) == 0;  /* not just the same digest */
+
+        cache_release_readlocked_ptr(k.hash);
+        cache_object_ctx_destroy(&ctx);
+    }
+
+    cache_object_ctx_init(&ctx);
+    cache_object_write_key(&ctx, k.digest);
+
+    if (ctx.error) {
+        shared = AM_FALSE;
+    } else if (shared) {
+        shared = cache_extend(k.hash, ctx.data, expires, key_equality) == 0 ||
+                (ctx.write(&ctx, blob->data, ref->size) == ref->size &&             /* gone since */
+                cache_add(k.hash, ctx.data, ctx.data_size, expires, key_equality) == 0);
+    } else if (!found) {
+        shared = ctx.write(&ctx, blob->data, ref->size) == ref->size &&
+                cache_add(k.hash, ctx.data, ctx.data_size, expires, key_equality) == 0;
+    }
+
+    if (shared) {
+        ref->data = NULL;
+    }
 
-    uint32_t                             hash = am_hash(key);
+    cache_object_ctx_destroy(&ctx);
+
+}
+
+/*
+ * read a session entry, the policies it refers to and (when session is not NULL) the session attributes; digest is set to
+ * the digest of the entry when it is not NULL
+ *
+ * entries hold only the attributes of the working set they were projected with (see attr_project.c), so an entry projected
+ * with a working set other than projection (the reader's) is not found; entries that were not projected (0) suit any reader
+ *
+ */
+static int session_policy_read(const char *key, uint64_t projection, struct am_policy_result **policy, struct am_namevalue **session, uint64_t *digest) {
 
-    struct am_policy_result             *merged = policy;
+    struct cache_key                     k;
 
     struct cache_object_ctx              ctx;
+    int                                  status;
+
+    struct am_policy_reference          *refs = NULL;
+    struct am_policy_result             *list, *p;
+    uint32_t                             count = 0, i;
 
     void                                *shm_data;                                    /* pointer into hash table */
     uint32_t                             shm_data_sz;
+    void                                *data;
 
-    if (cache_fetch_readable(hash, (char *)key, &shm_data, &shm_data_sz) == 0) {
-        struct am_policy_result         *cached;
+    uint64_t                             entry_projection = 0;
 
-        cache_object_ctx_init_data(&ctx, shm_data, (size_t)shm_data_sz);
-        cache_object_skip_key(&ctx);
-        cached = am_policy_result_deserialise(&ctx);                                  /* read cached policy */
+    cache_key_init(&k, key);
 
-        cache_release_readlocked_ptr(hash);
+    if (cache_fetch_readable(&k, &shm_data, &shm_data_sz)) {
+        return AM_NOT_FOUND;
+    }
 
-        status = ctx.error;
-        cache_object_ctx_destroy(&ctx);
+    data = malloc(shm_data_sz);                                                       /* shared policies are read without the entry locked */
+    if (data != NULL) {
+        memcpy(data, shm_data, shm_data_sz);
+    }
 
-        if (status) {
-            return status;                                                            /* serialisation problem */
+    cache_release_readlocked_ptr(k.hash);
+
+    if (data == NULL) {
+        return AM_ENOMEM;
+    }
+
+    cache_object_ctx_init_data(&ctx, data, (size_t)shm_data_sz);
+    cache_object_skip_key(&ctx);
+    if (am_attr_project_digest_deserialise(&ctx, &entry_projection) == 0 &&
+            entry_projection != 0 && entry_projection != projection) {
+        cache_object_ctx_destroy(&ctx);                                               /* attributes this reader needs may be missing */
+        free(data);
+        return AM_NOT_FOUND;
+    }
+    if (digest != NULL) {
+        *digest = am_digest64(data, shm_data_sz);
+    }
+    list = am_policy_reference_deserialise(&ctx, &refs, &count);
+    if (session != NULL) {
+        *session = am_name_value_deserialise(&ctx);
+    }
+
+    for (p = list, i = 0; p != NULL && i < count && ctx.error == 0; p = p->next, i++) {
+        if (refs[i].data != NULL) {
+            struct cache_object_ctx      policy_ctx;
+
+            cache_object_ctx_init_data(&policy_ctx, (void *)refs[i].data, refs[i].size);
+            ctx.error = am_policy_blob_deserialise(&policy_ctx, p);
+            cache_object_ctx_destroy(&policy_ctx);
+        } else {
+            ctx.error = policy_blob_read(refs + i, p);
         }
+    }
+
+    status = ctx.error;
+    cache_object_ctx_destroy(&ctx);
+    free(refs);
+    free(data);
+
+    if (status) {
+        delete_am_policy_result_list(&list);
+        if (session != NULL) {
+            delete_am_namevalue_list(session);
+            *session = NULL;
+        }
+        return status;
+    }
+
+    *policy = list;
+    return AM_SUCCESS;
+
+}
+
+/*
+ * deserialise cached policy and session data
+ *
+ */
+int am_get_session_policy_cache_entry(am_request_t *request, const char *key, struct am_policy_result **policy, struct am_namevalue **session, uint64_t *ts) {
+
+    /* the digest identifies the entry for decision memos */
+    return session_policy_read(key, am_attr_project_digest(request->conf), policy, session, &request->pattr_digest);
+
+}
 
-        while (cached) {                                                              /* add existing policies, new ones override */
-            struct am_policy_result     *p;
+/*
+ * cache policy and session data, add existing policies for other resources, overriding existing policies for the same resources;
+ * policies are stored once (shared by the session entries holding the same policy), without their creation time and ttls,
+ * which are kept with the references to them in the session entry
+ *
+ */
+int am_add_session_policy_cache_entry(am_request_t *request, const char *key, struct am_policy_result *policy, struct am_namevalue *session) {
 
-            for (p = policy; p; p = p->next) {
-                if (strcmp(cached->resource, p->resource) == 0)
-                    break;
-            }
+    int                                  status;
 
-            struct am_policy_result     *next = cached->next;
+    struct cache_key                     k;
 
-            if (p) {
-                cached->next = 0;                                                     /* discard existing policy */
-                delete_am_policy_result_list(&cached);
-            } else {
-                cached->next = merged;                                                /* merge (prepend) existing policy */
-                merged = cached;
-            }
+    struct am_policy_result             *merged = policy, *cached = NULL, *p;
 
-            cached = next;
+    struct cache_object_ctx              ctx, *blobs = NULL;
+    struct am_policy_reference          *refs = NULL;
+    uint32_t                             count = 0, i;
+
+    int64_t                              expires;
+
+    uint64_t                             projection = am_attr_project_digest(request->conf);
+
+    cache_key_init(&k, key);
+
+    status = session_policy_read(key, projection, &cached, NULL, NULL);          /* an entry projected differently is replaced */
+    if (status != AM_SUCCESS && status != AM_NOT_FOUND) {
+        return status;                                                                /* serialisation problem */
+    }
+
+    while (cached) {                                                                  /* add existing policies, new ones override */
+        struct am_policy_result         *next = cached->next;
+
+        for (p = policy; p; p = p->next) {
+            if (strcmp(cached->resource, p->resource) == 0)
+                break;
+        }
+
+        if (p) {
+            cached->next = 0;                                                         /* discard existing policy */
+            delete_am_policy_result_list(&cached);
+        } else {
+            cached->next = merged;                                                    /* merge (prepend) existing policy */
+            merged = cached;
         }
+
+        cached = next;
     }
 
-    int                                  ttl = get_session_ttl(request, session);
+    expires = time(0) + get_session_ttl(request, session);
+
+    for (p = merged; p; p = p->next) {
+        count++;
+    }
+    if (count > 0) {
+        refs = calloc(count, sizeof(struct am_policy_reference));
+        blobs = calloc(count, sizeof(struct cache_object_ctx));
+    }
 
     cache_object_ctx_init(&ctx);
-    cache_object_write_key(&ctx, (char *)key);
-    am_policy_result_serialise(&ctx, merged);
-    am_name_value_serialise(&ctx, session);
+    if (count > 0 && (refs == NULL || blobs == NULL)) {
+        ctx.error = AM_ENOMEM;
+    }
+
+    for (p = merged, i = 0; p && ctx.error == 0; p = p->next, i++) {
+        cache_object_ctx_init(blobs + i);
+        if (( ctx.error = am_policy_blob_serialise(blobs + i, p) ) == 0) {
+            policy_blob_write(refs + i, blobs + i, expires);
+        }
+    }
+
+    if (ctx.error == 0) {
+        cache_object_write_key(&ctx, k.digest);
+        am_attr_project_digest_serialise(&ctx, projection);
+        am_policy_reference_serialise(&ctx, merged, refs);
+        am_name_value_serialise(&ctx, session);
+    }
 
     if (ctx.error) {
         status = ctx.error;
-    } else if (cache_add(hash, ctx.data, ctx.data_size, time(0) + ttl, key_equality)) {
+    } else if (cache_add(k.hash, ctx.data, ctx.data_size, expires, key_equality)) {
         status = AM_ERROR;
     } else {
         status = AM_SUCCESS;
@@ -420,6 +697,12 @@ int am_add_session_policy_cache_entry(am_request_t *request, const char *key, st
 
     cache_object_ctx_destroy(&ctx);
 
+    for (i = 0; blobs != NULL && i < count; i++) {
+        cache_object_ctx_destroy(blobs + i);
+    }
+    free(blobs);
+    free(refs);
+
     while (merged != policy) {                                                        /* free merged policy */
         struct am_policy_result         *next = merged->next;
 
@@ -433,6 +716,273 @@ int am_add_session_policy_cache_entry(am_request_t *request, const char *key, st
 
 }
 
+/*
+ * key of the decision memo for a session
+ *
+ */
+static char *decision_memo_key(const char *key) {
+
+    char                                *memo_key = NULL;
+
+    am_asprintf(&memo_key, "%s%s", AM_DECISION_MEMO_PREFIX, key);
+    return memo_key;
+
+}
+
+/*
+ * read the decision memo of a session, where it belongs to the session/policy cache entry the request read
+ *
+ */
+static int decision_memo_read(am_request_t *request, const struct cache_key *k, struct am_policy_decision *decisions, uint32_t *count) {
+
+    struct cache_object_ctx              ctx;
+    int                                  status;
+
+    void                                *shm_data;                                    /* pointer into hash table */
+    uint32_t                             shm_data_sz;
+
+    uint64_t                             session_digest = 0;
+
+    *count = 0;
+
+    if (cache_fetch_readable(k, &shm_data, &shm_data_sz)) {
+        return AM_NOT_FOUND;
+    }
+
+    cache_object_ctx_init_data(&ctx, shm_data, (size_t)shm_data_sz);
+    cache_object_skip_key(&ctx);
+    am_policy_decision_memo_deserialise(&ctx, &session_digest, decisions, count, AM_DECISION_MEMO_SIZE);
+
+    cache_release_readlocked_ptr(k->hash);
+
+    status = ctx.error;
+    cache_object_ctx_destroy(&ctx);
+
+    if (status == AM_SUCCESS && session_digest != request->pattr_digest) {
+        *count = 0;                                                                   /* session entry has changed since */
+        status = AM_NOT_FOUND;
+    }
+
+    return status;
+
+}
+
+/*
+ * look up a decision made earlier in this session for the url, method, scope and context in the decision argument,
+ * under the current policy epoch
+ *
+ */
+int am_get_policy_decision_memo(am_request_t *request, const char *key, struct am_policy_decision *decision) {
+
+    struct am_policy_decision            decisions[AM_DECISION_MEMO_SIZE];
+    uint32_t                             count, i;
+
+    char                                *memo_key = decision_memo_key(key);
+    struct cache_key                     k;
+    int                                  status;
+
+    uint64_t                             epoch;
+
+    if (memo_key == NULL) {
+        return AM_ENOMEM;
+    }
+    cache_key_init(&k, memo_key);
+    free(memo_key);
+
+    status = decision_memo_read(request, &k, decisions, &count);
+
+    if (status) {
+        return status;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (decisions[i].url_digest == decision->url_digest && decisions[i].method == decision->method &&
+                decisions[i].scope == decision->scope && decisions[i].context == decision->context) {
+            break;
+        }
+    }
+    if (i == count) {
+        return AM_NOT_FOUND;
+    }
+
+    if (( status = am_get_policy_cache_epoch(&epoch) )) {
+        return status;
+    }
+    if (epoch != decisions[i].epoch) {
+        return AM_ETIMEDOUT;                                                          /* policies changed since */
+    }
+
+    *decision = decisions[i];
+    return AM_SUCCESS;
+
+}
+
+/*
+ * remember a decision for the session, most recent first, forgetting the oldest one when the memo is full
+ *
+ */
+int am_add_policy_decision_memo(am_request_t *request, const char *key, const struct am_policy_decision *decision) {
+
+    struct am_policy_decision            decisions[AM_DECISION_MEMO_SIZE + 1];
+    uint32_t                             count, i, n = 1;
+
+    struct cache_object_ctx              ctx;
+    int                                  status;
+
+    char                                *memo_key = decision_memo_key(key);
+    struct cache_key                     k;
+
+    if (memo_key == NULL) {
+        return AM_ENOMEM;
+    }
+    cache_key_init(&k, memo_key);
+    free(memo_key);
+
+    decision_memo_read(request, &k, decisions + 1, &count);                     /* room for the new one first */
+
+    for (i = 1; i <= count && n < AM_DECISION_MEMO_SIZE; i++) {
+        if (decisions[i].url_digest == decision->url_digest && decisions[i].method == decision->method &&
+                decisions[i].scope == decision->scope && decisions[i].context == decision->context) {
+            continue;                                                                 /* replaced */
+        }
+        decisions[n++] = decisions[i];
+    }
+    decisions[0] = *decision;
+
+    cache_object_ctx_init(&ctx);
+    cache_object_write_key(&ctx, k.digest);
+    am_policy_decision_memo_serialise(&ctx, request->pattr_digest, decisions, n);
+
+    if (ctx.error) {
+        status = ctx.error;
+    } else if (cache_add(k.hash, ctx.data, ctx.data_size, time(0) + get_session_ttl(request, request->sattr), key_equality)) {
+        status = AM_ERROR;
+    } else {
+        status = AM_SUCCESS;
+    }
+
+    cache_object_ctx_destroy(&ctx);
+
+    return status;
+
+}
+
+/*
+ * key of the invalid token entry for a session token
+ *
+ */
+static char *invalid_token_key(const char *key) {
+
+    char                                *invalid_key = NULL;
+
+    am_asprintf(&invalid_key, "%s%s", AM_INVALID_TOKEN_PREFIX, key);
+    return invalid_key;
+
+}
+
+/*
+ * seconds a token reported as invalid is rejected without asking OpenAM again, 0 when this is disabled
+ *
+ */
+static int invalid_token_ttl(am_request_t *request) {
+
+    int                                  ttl = request->conf->invalid_token_cache_valid;
+
+    return ttl == 0 ? AM_INVALID_TOKEN_CACHE_DEFAULT : ttl < 0 ? 0 : ttl;
+
+}
+
+/*
+ * check whether OpenAM reported the session token as invalid recently (AM_SUCCESS when it did)
+ *
+ */
+int am_get_invalid_token_entry(am_request_t *request, const char *key) {
+
+    char                                *invalid_key;
+    struct cache_key                     k;
+
+    void                                *shm_data;                                    /* pointer into hash table */
+    uint32_t                             shm_data_sz;
+
+    int                                  status;
+
+    if (invalid_token_ttl(request) == 0) {
+        return AM_NOT_FOUND;
+    }
+    if (( invalid_key = invalid_token_key(key) ) == NULL) {
+        return AM_ENOMEM;
+    }
+    cache_key_init(&k, invalid_key);
+    free(invalid_key);
+
+    status = cache_fetch_readable(&k, &shm_data, &shm_data_sz);
+    if (status == AM_SUCCESS) {
+        cache_release_readlocked_ptr(k.hash);                                         /* the entry is only a key */
+    }
+
+    return status;
+
+}
+
+/*
+ * remember that OpenAM reported the session token as invalid, for a short while
+ *
+ */
+int am_add_invalid_token_entry(am_request_t *request, const char *key) {
+
+    struct cache_object_ctx              ctx;
+    int                                  status;
+
+    char                                *invalid_key;
+    struct cache_key                     k;
+    int                                  ttl = invalid_token_ttl(request);
+
+    if (ttl == 0) {
+        return AM_SUCCESS;
+    }
+    if (( invalid_key = invalid_token_key(key) ) == NULL) {
+        return AM_ENOMEM;
+    }
+    cache_key_init(&k, invalid_key);
+    free(invalid_key);
+
+    cache_object_ctx_init(&ctx);
+    cache_object_write_key(&ctx, k.digest);
+
+    if (ctx.error) {
+        status = ctx.error;
+    } else if (cache_add(k.hash, ctx.data, ctx.data_size, time(0) + ttl, key_equality)) {
+        status = AM_ERROR;
+    } else {
+        status = AM_SUCCESS;
+    }
+
+    cache_object_ctx_destroy(&ctx);
+
+    return status;
+
+}
+
+/*
+ * forget that the session token was reported as invalid
+ *
+ */
+int am_remove_invalid_token_entry(unsigned long instance, const char *key) {
+
+    char                                *invalid_key = invalid_token_key(key);
+    int                                  status;
+
+    if (invalid_key == NULL) {
+        return AM_ENOMEM;
+    }
+
+    status = am_remove_cache_entry(instance, invalid_key);
+    free(invalid_key);
+
+    return status;
+
+}
+
 int am_cache_init(int instance) {
     return cache_initialise(instance);
 }
@@ -31,6 +31,46 @@
 #define AM_ALIGNMENT 8
 #define AM_ALIGN(size) (((size) + (AM_ALIGNMENT-1)) & ~(AM_ALIGNMENT-1))
 
+#if defined(_WIN32)
+#define incr(p) InterlockedIncrement(p)
+#define decr(p) InterlockedDecrement(p)
+#define casv(p, old, new) InterlockedCompareExchange(p, new, old)
+#define cas(p, old, new) (casv(p, old, new) == (old))
+#define release(p) InterlockedExchange(p, 0)
+#define yield() SwitchToThread()
+#elif defined(__sun)
+#include <atomic.h>
+#define incr(p) atomic_inc_32_nv((volatile uint32_t *) (p))
+#define decr(p) atomic_dec_32_nv((volatile uint32_t *) (p))
+#define cas(p, old, new) (atomic_cas_32((volatile uint32_t *) (p), old, new) == (old))
+#define release(p) atomic_swap_32((volatile uint32_t *) (p), 0)
+#define yield() sched_yield()
+#else
+#define incr(p) __sync_add_and_fetch(p, 1)
+#define decr(p) __sync_sub_and_fetch(p, 1)
+#define cas(p, old, new) __sync_bool_compare_and_swap(p, old, new)
+#define release(p) __sync_lock_release(p)
+#define yield() sched_yield()
+#endif
+
+/* segregated size classes (chunk sizes, including the header) with their own free stacks and locks */
+#define AM_SHM_CLASSES 13
+#define AM_SHM_CLASS_MAX 4096
+#define AM_SHM_CLASS_BATCH 8
+
+/* chunk->used value for a chunk in a size class free stack */
+#define AM_CHUNK_CACHED 2
+
+static const uint32_t size_classes[AM_SHM_CLASSES] = {
+    64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+
+struct size_class {
+    volatile int32_t lock;
+    int32_t head;
+    uint32_t count;
+};
+
 struct mem_chunk {
     uint64_t size;
     uint64_t usize;
@@ -46,6 +86,7 @@ struct mem_pool {
     int32_t open;
     int32_t freelist_hdrs[3];
     struct offset_list lh; /* first, last */
+    struct size_class classes[AM_SHM_CLASSES];
 };
 #define SIZEOF_mem_pool AM_ALIGN(sizeof(struct mem_pool))
 
@@ -63,6 +104,11 @@ static void initialise_freelist(struct mem_pool *pool) {
     int i;
     for (i = 0; i < 3; i++)
         pool->freelist_hdrs[i] = FREELIST_END;
+    for (i = 0; i < AM_SHM_CLASSES; i++) {
+        pool->classes[i].lock = 0;
+        pool->classes[i].head = FREELIST_END;
+        pool->classes[i].count = 0;
+    }
 }
 
 /**
@@ -228,6 +274,36 @@ uint64_t get_disk_free_space(const char *vol, uint64_t *total_sz) {
 #endif
 }
 
+/**
+ * enter the pool without holding the mutex; fails if the pool is being, or needs to be, remapped in this process
+ */
+static int enter_fast_path(am_shm_t *am) {
+    incr(&am->fast_users);
+    if (am->remapping || am->local_size != *(am->global_size)) {
+        decr(&am->fast_users);
+        return AM_FALSE;
+    }
+    return AM_TRUE;
+}
+
+static void leave_fast_path(am_shm_t *am) {
+    decr(&am->fast_users);
+}
+
+/**
+ * called with the mutex held: stop new fast path users and wait for current ones before the pool is unmapped
+ */
+static void quiesce_fast_path(am_shm_t *am) {
+    cas(&am->remapping, 0, 1);
+    while (am->fast_users) {
+        yield();
+    }
+}
+
+static void resume_fast_path(am_shm_t *am) {
+    cas(&am->remapping, 1, 0);
+}
+
 int am_shm_lock(am_shm_t *am) {
     int rv = AM_SUCCESS;
 #ifdef _WIN32
@@ -251,6 +327,7 @@ int am_shm_lock(am_shm_t *am) {
     if (am->error == WAIT_FAILED) return AM_ERROR;
 
     if (am->local_size != *(am->global_size)) {
+        quiesce_fast_path(am);
 
         if (InitializeSecurityDescriptor(&sec_descr, SECURITY_DESCRIPTOR_REVISION) &&
                 SetSecurityDescriptorDacl(&sec_descr, TRUE, (PACL) NULL, FALSE)) {
@@ -282,6 +359,7 @@ int am_shm_lock(am_shm_t *am) {
         }
 
         am->local_size = *(am->global_size);
+        resume_fast_path(am);
     }
 
 #else
@@ -295,18 +373,20 @@ int am_shm_lock(am_shm_t *am) {
     if (am->error != 0) return AM_ERROR;
     
     if (am->local_size != *(am->global_size)) {
+        quiesce_fast_path(am);
         am->error = munmap(am->pool, am->local_size);
         if (am->error == -1) {
             am->error = errno;
             rv = AM_EFAULT;
         }
-        am->pool = mmap(NULL, *(am->global_size), PROT_READ | PROT_WRITE, MAP_SHARED, am->fd, 0);
+        am->pool = am_shm_map(am->fd, *(am->global_size));
         if (am->pool == MAP_FAILED) {
             am->error = errno;
             rv = AM_EFAULT;
         }
 
         am->local_size = *(am->global_size);
+        resume_fast_path(am);
     }
 #endif
     return rv;
@@ -361,6 +441,7 @@ int am_shm_lock_timeout(am_shm_t *am, int timeout_msec) {
     if (am->error == WAIT_FAILED) return AM_ERROR;
 
     if (am->local_size != *(am->global_size)) {
+        quiesce_fast_path(am);
 
         if (InitializeSecurityDescriptor(&sec_descr, SECURITY_DESCRIPTOR_REVISION) &&
                 SetSecurityDescriptorDacl(&sec_descr, TRUE, (PACL) NULL, FALSE)) {
@@ -392,6 +473,7 @@ int am_shm_lock_timeout(am_shm_t *am, int timeout_msec) {
         }
 
         am->local_size = *(am->global_size);
+        resume_fast_path(am);
     }
 
 #else
@@ -412,18 +494,20 @@ int am_shm_lock_timeout(am_shm_t *am, int timeout_msec) {
     if (am->error != 0) return AM_ERROR;
     
     if (am->local_size != *(am->global_size)) {
+        quiesce_fast_path(am);
         am->error = munmap(am->pool, am->local_size);
         if (am->error == -1) {
             am->error = errno;
             rv = AM_EFAULT;
         }
-        am->pool = mmap(NULL, *(am->global_size), PROT_READ | PROT_WRITE, MAP_SHARED, am->fd, 0);
+        am->pool = am_shm_map(am->fd, *(am->global_size));
         if (am->pool == MAP_FAILED) {
             am->error = errno;
             rv = AM_EFAULT;
         }
 
         am->local_size = *(am->global_size);
+        resume_fast_path(am);
     }
 #endif
     return rv;
@@ -578,6 +662,99 @@ int am_shm_delete(char *name) {
 
 }
 
+#ifndef _WIN32
+
+enum {
+    AM_SHM_PAGES_DEFAULT = 0,
+    AM_SHM_PAGES_THP,
+    AM_SHM_PAGES_HUGETLB
+};
+
+static int shm_huge_pages = -1;
+static int shm_prefault = -1;
+
+/**
+ * read huge page and pre-fault options for shared memory segments, once per process
+ */
+static void am_shm_map_options() {
+    char *env;
+
+    if (shm_huge_pages != -1) {
+        return;
+    }
+
+    env = getenv(AM_SHARED_HUGE_PAGES_VAR);
+    if (ISVALID(env) && strcasecmp(env, "hugetlb") == 0) {
+        shm_huge_pages = AM_SHM_PAGES_HUGETLB;
+    } else if (ISVALID(env) && (strcasecmp(env, "thp") == 0 || strcasecmp(env, "on") == 0 || strcmp(env, "1") == 0)) {
+        shm_huge_pages = AM_SHM_PAGES_THP;
+    } else {
+        shm_huge_pages = AM_SHM_PAGES_DEFAULT;
+    }
+
+    env = getenv(AM_SHARED_PREFAULT_VAR);
+    shm_prefault = ISVALID(env) && (strcasecmp(env, "on") == 0 || strcmp(env, "1") == 0);
+}
+
+/**
+ * map a shared memory object read/write. segments of AM_SHARED_LARGE_SIZE and above are backed by huge pages
+ * and pre-faulted when so configured; either falls back silently to a plain mapping where the system
+ * does not support it (no hugetlbfs backing, transparent huge pages for shmem disabled, etc.)
+ */
+void *am_shm_map(int fd, uint64_t size) {
+    void *area = MAP_FAILED;
+    char *p;
+    long p_size;
+
+    am_shm_map_options();
+
+    if (size < AM_SHARED_LARGE_SIZE) {
+        return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+#ifdef MAP_HUGETLB
+    if (shm_huge_pages == AM_SHM_PAGES_HUGETLB) {
+        /* only succeeds where the shm object lives on hugetlbfs and the size is a multiple of the huge page size */
+        area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_HUGETLB
+#ifdef MAP_POPULATE
+                | (shm_prefault ? MAP_POPULATE : 0)
+#endif
+                , fd, 0);
+        if (area != MAP_FAILED) {
+            return area;
+        }
+    }
+#endif
+
+    area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (area == MAP_FAILED) {
+        return area;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (shm_huge_pages != AM_SHM_PAGES_DEFAULT) {
+        madvise(area, size, MADV_HUGEPAGE); /* advisory only */
+    }
+#endif
+
+    if (shm_prefault) {
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(area, size, MADV_POPULATE_WRITE) == 0) {
+            return area;
+        }
+#endif
+        /* touch every page; this is a read so it cannot race with writers in other processes */
+        p_size = sysconf(_SC_PAGE_SIZE);
+        for (p = (char *) area; p < (char *) area + size; p += p_size) {
+            (void) *(volatile char *) p;
+        }
+    }
+
+    return area;
+}
+
+#endif
+
 /**
  * get the max pool size for shared memory
  */
@@ -924,7 +1101,7 @@ am_shm_t *am_shm_create(const char *name, uint64_t usize, int use_new_initialise
             am_shm_unlock(ret);
             return ret;
         }
-        area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ret->fd, 0);
+        area = am_shm_map(ret->fd, size);
         if (area == MAP_FAILED) {
             ret->error = errno;
             am_shm_unlock(ret);
@@ -941,7 +1118,7 @@ am_shm_t *am_shm_create(const char *name, uint64_t usize, int use_new_initialise
             am_shm_unlock(ret);
             return ret;
         }
-        area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ret->fd, 0);
+        area = am_shm_map(ret->fd, size);
         if (area == MAP_FAILED) {
             ret->error = errno;
             am_shm_unlock(ret);
@@ -998,7 +1175,7 @@ static BOOL resize_file(HANDLE file, uint64_t new_size) {
 
 #endif
 
-static int am_shm_extend(am_shm_t *am, uint64_t usize) {
+static int am_shm_extend_mapping(am_shm_t *am, uint64_t usize) {
     uint64_t size, osize;
     struct mem_pool *pool;
     int rv = AM_SUCCESS;
@@ -1062,7 +1239,7 @@ static int am_shm_extend(am_shm_t *am, uint64_t usize) {
         return AM_EINVAL;
     }
     munmap(am->pool, osize);
-    am->pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, am->fd, 0);
+    am->pool = am_shm_map(am->fd, size);
     if (am->pool == MAP_FAILED) {
         am->error = errno;
         rv = AM_ERROR;
@@ -1105,25 +1282,24 @@ static int am_shm_extend(am_shm_t *am, uint64_t usize) {
     return rv;
 }
 
-/*
- * This allocator will attempt to allocate, but on failure it will first try to garbage
- * collect the memory pool if the caller has passed a non-null gc argument, and then
- * if the required usize cannot be allocated, it will try to resize the memory pool. It is
- * unable to resize the pool on OS X
+/**
+ * extend the pool; threads of this process in the fast path are held off while it is remapped
  */
-void *am_shm_alloc_with_gc(am_shm_t *am, uint64_t usize, int (* gc)(unsigned long), unsigned long id) {
-    struct mem_pool *pool;
+static int am_shm_extend(am_shm_t *am, uint64_t usize) {
+    int rv;
+    quiesce_fast_path(am);
+    rv = am_shm_extend_mapping(am, usize);
+    resume_fast_path(am);
+    return rv;
+}
+
+/**
+ * take a chunk of at least size bytes from the size-bucketed freelists, splitting it if possible
+ */
+static void *alloc_chunk(struct mem_pool *pool, uint64_t size, uint64_t usize) {
     struct mem_chunk *cmin, *n;
     void *ret = NULL;
-    uint64_t size, s;
-
-    if (usize == 0 || am == NULL ||
-            am->pool == NULL || am_shm_lock(am) != AM_SUCCESS) {
-        return NULL;
-    }
-
-    pool = (struct mem_pool *) am->pool;
-    size = AM_ALIGN(usize + CHUNK_HEADER_SIZE);
+    uint64_t s;
 
     /* find free memory chunk for the size */
     cmin = get_free_chunk_for_size(pool, size);
@@ -1166,62 +1342,19 @@ void *am_shm_alloc_with_gc(am_shm_t *am, uint64_t usize, int (* gc)(unsigned lon
             ret = (void *) ((char *) cmin + CHUNK_HEADER_SIZE);
         }
     }
-
-    if (ret == NULL) {
-        // gc (evict obsolete cache data) from the pool and retry allocation
-        if (gc) {
-            if (gc(id)) {
-                // some content was removed, so try to allocate again
-                am_shm_unlock(am);
-                return am_shm_alloc(am, usize);
-            }
-        }
-
-#ifdef __APPLE__
-        am->error = AM_EOPNOTSUPP;
-#else
-#ifdef FREELIST_DEBUG
-        verify_freelists(pool, "extend (before)");
-#endif
-        if (am_shm_extend(am, (pool->size + size) * 2) == AM_SUCCESS) {
-            am_shm_unlock(am);
-            return am_shm_alloc(am, usize);
-        }
-#ifdef FREELIST_DEBUG
-        verify_freelists(pool, "extend (after)");
-#endif
-#endif
-    }
 #ifdef FREELIST_DEBUG
     verify_freelists(pool, "after insert");
 #endif
-    am_shm_unlock(am);
     return ret;
 }
 
-/*
- * This allocator will not call a garbage collector before resize
+/**
+ * return a chunk to the size-bucketed freelists, coalescing it with free neighbours
  */
-void *am_shm_alloc(am_shm_t *am, uint64_t usize) {
-    return am_shm_alloc_with_gc(am, usize, NULL, 0ul);
-}
-
-void am_shm_free(am_shm_t *am, void *ptr) {
+static void free_chunk(struct mem_pool *pool, struct mem_chunk *e) {
     uint64_t size;
-    struct mem_pool *pool;
-    struct mem_chunk *e, *f;
+    struct mem_chunk *f;
 
-    if (am == NULL || am->pool == NULL ||
-            ptr == NULL || am_shm_lock(am) != AM_SUCCESS) {
-        return;
-    }
-
-    pool = (struct mem_pool *) am->pool;
-    e = (struct mem_chunk *) ((char *) ptr - CHUNK_HEADER_SIZE);
-    if (e->used == 0) {
-        am_shm_unlock(am);
-        return;
-    }
 #ifdef FREELIST_DEBUG
     verify_freelists(pool, "before free");
 #endif
@@ -1266,6 +1399,301 @@ void am_shm_free(am_shm_t *am, void *ptr) {
 #ifdef FREELIST_DEBUG
     verify_freelists(pool, "after free");
 #endif
+}
+
+/**
+ * size class for an allocation of size bytes (including the chunk header), or -1 if it is too large
+ */
+static int size_class_for(uint64_t size) {
+    int c;
+    for (c = 0; c < AM_SHM_CLASSES; c++) {
+        if (size <= size_classes[c])
+            return c;
+    }
+    return -1;
+}
+
+/**
+ * size class that a chunk of exactly this size belongs to, or -1
+ */
+static int size_class_of_chunk(uint64_t size) {
+    int c = size_class_for(size);
+    return c >= 0 && size_classes[c] == size ? c : -1;
+}
+
+static int32_t size_class_pid = 0;
+
+#ifndef _WIN32
+static void size_class_pid_reset() {
+    size_class_pid = 0;
+}
+
+static void size_class_atfork() {
+    pthread_atfork(NULL, NULL, size_class_pid_reset);
+}
+#endif
+
+/**
+ * size class locks are process-shared spinlocks holding the owner's pid; they are only held for a few stores,
+ * and are never held while waiting for anything else. a lock held by a process that has gone is taken over
+ */
+static void size_class_lock(volatile int32_t *lock) {
+    int32_t pid = size_class_pid;
+    int i = 0;
+#ifndef _WIN32
+    int32_t holder;
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+#endif
+
+    if (pid == 0) {
+#ifndef _WIN32
+        pthread_once(&once, size_class_atfork);
+#endif
+        pid = size_class_pid = (int32_t) getpid(); /* not a syscall per lock; reset in a forked child */
+    }
+
+    while (!cas(lock, 0, pid)) {
+        if (++i % 1000 == 0) {
+#ifndef _WIN32
+            holder = *lock;
+            if (holder != 0 && holder != pid && kill(holder, 0) == -1 && errno == ESRCH) {
+                cas(lock, holder, 0);
+            }
+#endif
+            yield();
+        }
+    }
+}
+
+static void size_class_unlock(volatile int32_t *lock) {
+    release(lock);
+}
+
+/**
+ * pop a chunk from a size class free stack; chunks which lie beyond this process's view of the pool
+ * (the pool was extended by another process) are left for the caller to take after remapping under the mutex
+ */
+static void *size_class_pop(am_shm_t *am, int c, uint64_t usize) {
+    struct mem_pool *pool = (struct mem_pool *) am->pool;
+    struct size_class *sc = pool->classes + c;
+    struct mem_chunk *e = NULL;
+    int32_t ofs;
+
+    size_class_lock(&sc->lock);
+    ofs = sc->head;
+    if (ofs != FREELIST_END && ofs + size_classes[c] <= am->local_size) {
+        e = (struct mem_chunk *) AM_GET_POINTER(pool, ofs);
+        sc->head = FREELIST_FROM_CHUNK(e)->next;
+        sc->count--;
+        e->used = 1;
+    }
+    size_class_unlock(&sc->lock);
+
+    if (e == NULL) {
+        return NULL;
+    }
+    e->usize = usize;
+    return (char *) e + CHUNK_HEADER_SIZE;
+}
+
+/**
+ * push a chunk of exactly a size class size onto the class free stack, returning AM_FALSE if it is not in use
+ */
+static int size_class_push(struct mem_pool *pool, int c, struct mem_chunk *e) {
+    struct size_class *sc = pool->classes + c;
+    int ok = AM_FALSE;
+
+    size_class_lock(&sc->lock);
+    if (e->used == 1) {
+        e->used = AM_CHUNK_CACHED;
+        e->usize = 0;
+        FREELIST_FROM_CHUNK(e)->next = sc->head;
+        sc->head = AM_GET_OFFSET(pool, e);
+        sc->count++;
+        ok = AM_TRUE;
+    }
+    size_class_unlock(&sc->lock);
+    return ok;
+}
+
+/**
+ * called with the mutex held: carve a batch of chunks for a size class from the freelists, returning the first
+ * and putting the rest on the class free stack
+ */
+static void *size_class_refill(am_shm_t *am, int c, uint64_t usize) {
+    struct mem_pool *pool = (struct mem_pool *) am->pool;
+    uint32_t size = size_classes[c];
+    int i, n = MIN(AM_SHM_CLASS_BATCH, MAX(1, AM_SHM_CLASS_MAX / 2 / size));
+    struct mem_chunk *e;
+    void *ret, *p;
+
+    if ((ret = alloc_chunk(pool, size, usize)) == NULL) {
+        return NULL;
+    }
+
+    for (i = 1; i < n; i++) {
+        if ((p = alloc_chunk(pool, size, 0)) == NULL) {
+            break;
+        }
+        e = (struct mem_chunk *) ((char *) p - CHUNK_HEADER_SIZE);
+        if (e->size != size || !size_class_push(pool, c, e)) {
+            free_chunk(pool, e); /* could not be split to size */
+            break;
+        }
+    }
+    return ret;
+}
+
+/**
+ * called with the mutex held: return all chunks in the size class free stacks to the freelists, so that they can
+ * be coalesced; returns the number of chunks released
+ */
+static int release_size_classes(am_shm_t *am) {
+    struct mem_pool *pool = (struct mem_pool *) am->pool;
+    struct mem_chunk *e;
+    int32_t ofs;
+    int c, n = 0;
+
+    for (c = 0; c < AM_SHM_CLASSES; c++) {
+        struct size_class *sc = pool->classes + c;
+
+        size_class_lock(&sc->lock);
+        ofs = sc->head;
+        sc->head = FREELIST_END;
+        sc->count = 0;
+        size_class_unlock(&sc->lock);
+
+        while (ofs != FREELIST_END) {
+            e = (struct mem_chunk *) AM_GET_POINTER(pool, ofs);
+            ofs = FREELIST_FROM_CHUNK(e)->next;
+            free_chunk(pool, e);
+            n++;
+        }
+    }
+    return n;
+}
+
+/*
+ * This allocator will attempt to allocate, but on failure it will first try to garbage
+ * collect the memory pool if the caller has passed a non-null gc argument, and then
+ * if the required usize cannot be allocated, it will try to resize the memory pool. It is
+ * unable to resize the pool on OS X
+ *
+ * Small allocations are served from segregated size classes, each with its own free stack and lock, 
+ * without taking the pool mutex unless the class is empty; freed chunks of a class size go back to
+ * their class without being coalesced until the pool runs out of space
+ */
+void *am_shm_alloc_with_gc(am_shm_t *am, uint64_t usize, int (* gc)(unsigned long), unsigned long id) {
+    struct mem_pool *pool;
+    void *ret = NULL;
+    uint64_t size;
+    int c;
+
+    if (usize == 0 || am == NULL || am->pool == NULL) {
+        return NULL;
+    }
+
+    size = AM_ALIGN(usize + CHUNK_HEADER_SIZE);
+    c = size_class_for(size);
+
+    if (c >= 0) {
+        if (enter_fast_path(am)) {
+            ret = size_class_pop(am, c, usize);
+            leave_fast_path(am);
+            if (ret != NULL) {
+                return ret;
+            }
+        }
+        size = size_classes[c];
+    }
+
+    if (am_shm_lock(am) != AM_SUCCESS) {
+        return NULL;
+    }
+
+    pool = (struct mem_pool *) am->pool;
+
+    if (c >= 0) {
+        if ((ret = size_class_pop(am, c, usize)) == NULL) {
+            ret = size_class_refill(am, c, usize);
+        }
+    } else {
+        ret = alloc_chunk(pool, size, usize);
+    }
+
+    if (ret == NULL && release_size_classes(am)) {
+        ret = alloc_chunk(pool, size, usize);
+    }
+
+    if (ret == NULL) {
+        // gc (evict obsolete cache data) from the pool and retry allocation
+        if (gc) {
+            if (gc(id)) {
+                // some content was removed, so try to allocate again
+                am_shm_unlock(am);
+                return am_shm_alloc(am, usize);
+            }
+        }
+
+#ifdef __APPLE__
+        am->error = AM_EOPNOTSUPP;
+#else
+#ifdef FREELIST_DEBUG
+        verify_freelists(pool, "extend (before)");
+#endif
+        if (am_shm_extend(am, (pool->size + size) * 2) == AM_SUCCESS) {
+            am_shm_unlock(am);
+            return am_shm_alloc(am, usize);
+        }
+#ifdef FREELIST_DEBUG
+        verify_freelists(pool, "extend (after)");
+#endif
+#endif
+    }
+    am_shm_unlock(am);
+    return ret;
+}
+
+/*
+ * This allocator will not call a garbage collector before resize
+ */
+void *am_shm_alloc(am_shm_t *am, uint64_t usize) {
+    return am_shm_alloc_with_gc(am, usize, NULL, 0ul);
+}
+
+void am_shm_free(am_shm_t *am, void *ptr) {
+    struct mem_pool *pool;
+    struct mem_chunk *e;
+    int c;
+
+    if (am == NULL || am->pool == NULL || ptr == NULL) {
+        return;
+    }
+
+    e = (struct mem_chunk *) ((char *) ptr - CHUNK_HEADER_SIZE);
+
+    if (enter_fast_path(am)) {
+        c = size_class_of_chunk(e->size);
+        if (c >= 0) {
+            size_class_push((struct mem_pool *) am->pool, c, e);
+        }
+        leave_fast_path(am);
+        if (c >= 0) {
+            return;
+        }
+    }
+
+    if (am_shm_lock(am) != AM_SUCCESS) {
+        return;
+    }
+
+    pool = (struct mem_pool *) am->pool;
+    c = size_class_of_chunk(e->size);
+    if (c >= 0) {
+        size_class_push(pool, c, e);
+    } else if (e->used == 1) {
+        free_chunk(pool, e);
+    }
     am_shm_unlock(am);
 }
 
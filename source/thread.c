@@ -20,7 +20,6 @@
 #include "version.h"
 #include "thread.h"
 #if defined(__sun)
-#include <port.h>
 #include <sys/atomic.h>
 #endif
 #if defined(__APPLE__)
@@ -33,8 +32,6 @@
 
 /* helper structure to wrap various callbacks, args and platforms */
 struct am_callback_args {
-    volatile uint32_t *running;
-    volatile uint32_t *stop;
     void *args;
     void (*callback)(void *);
 };
@@ -49,36 +46,78 @@ static pthread_once_t worker_pool_initialized = PTHREAD_ONCE_INIT;
 static pthread_once_t worker_pool_main_initialized = PTHREAD_ONCE_INIT;
 static sigset_t fillset;
 
+#if defined(__sun)
+#define atomic_add(p, v)                    atomic_add_32((volatile uint32_t *)(p), (int32_t)(v))
+#define atomic_add64(p, v)                  atomic_add_64((volatile uint64_t *)(p), (int64_t)(v))
+#define atomic_read(p)                      atomic_add_32_nv((volatile uint32_t *)(p), 0)
+#define cas(p, old, new)                    (atomic_cas_32((volatile uint32_t *)(p), (uint32_t)(old), (uint32_t)(new)) == (old))
+#define barrier()                           membar_enter()
+#else
+#define atomic_add(p, v)                    __sync_fetch_and_add(p, v)
+#define atomic_add64(p, v)                  __sync_fetch_and_add(p, v)
+#define atomic_read(p)                      __sync_fetch_and_add(p, 0)
+#define cas(p, old, new)                    __sync_bool_compare_and_swap(p, old, new)
+#define barrier()                           __sync_synchronize()
+#endif
+
+#define AM_THREADPOOL_CACHE_LINE 64
+#define AM_THREADPOOL_QUEUE_MASK (AM_WORKER_QUEUE_SIZE - 1)
+
 enum {
     AM_THREADPOOL_WAIT = 0x01,
     AM_THREADPOOL_DESTROY = 0x02
 };
 
 struct am_threadpool_work {
+    volatile uint32_t seq; /* slot sequence number */
     void (*func) (void *);
     void *arg;
-    struct am_threadpool_work *next;
+    uint64_t queued; /* submission time (usec) */
+};
+
+/**
+ * Bounded multi-producer/multi-consumer work queue (one per worker). Slots are preallocated and
+ * claimed with a CAS on head/tail, so that neither the submitter nor the worker take the pool lock.
+ */
+struct am_threadpool_queue {
+    volatile uint32_t head;
+    char pad0[AM_THREADPOOL_CACHE_LINE - sizeof (uint32_t)];
+    volatile uint32_t tail;
+    char pad1[AM_THREADPOOL_CACHE_LINE - sizeof (uint32_t)];
+    struct am_threadpool_work work[AM_WORKER_QUEUE_SIZE];
 };
 
 struct am_threadpool {
-    pthread_mutex_t lock;
+    pthread_mutex_t lock; /* guards worker thread start/exit and idle worker wait/wake-up */
     pthread_cond_t busy;
     pthread_cond_t work;
     pthread_cond_t wait;
-    struct am_threadpool_work *head;
-    struct am_threadpool_work *tail;
     pthread_attr_t attr;
-    int flag;
+    volatile int flag;
     int linger; /* number of seconds excess idle worker threads (greater than min_threads) linger before exiting */
     int min_threads; /* minimum number of threads kept in the pool */
     int max_threads; /* maximum number of threads that can be in the pool */
     int num_threads; /* current number of worker threads */
-    int idle; /* number of idle worker threads */
-
-    struct am_threadpool_active {
+    volatile uint32_t idle; /* number of idle worker threads */
+    volatile uint32_t active; /* number of worker threads running work */
+    volatile uint32_t next; /* submission (round-robin) queue index */
+    volatile uint32_t overflow; /* number of work items in the overflow queue */
+    uint32_t overflow_head; /* oldest work item in the overflow queue, guarded by the pool lock */
+
+    struct am_threadpool_thread {
+        struct am_threadpool *pool;
         pthread_t thread;
-        struct am_threadpool_active *next;
-    } *active; /* list of active threads */
+        int index; /* this worker's own queue */
+        int used;
+        volatile uint32_t busy;
+    } threads[AM_MAX_THREADS_POOL];
+
+    struct am_worker_pool_metrics metrics;
+
+    struct am_threadpool_queue queue[AM_MAX_THREADS_POOL];
+
+    /* work that must not be lost, submitted while all work queues were full (FIFO, guarded by the pool lock) */
+    struct am_threadpool_work overflow_work[AM_WORKER_OVERFLOW_SIZE];
 };
 
 static struct am_threadpool *worker_pool = NULL;
@@ -86,6 +125,126 @@ static struct am_threadpool *worker_pool_main = NULL;
 
 static void *do_work(void *arg);
 
+static uint64_t clock_usec() {
+#ifdef __APPLE__
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static int queue_push(struct am_threadpool_queue *q, void (*func) (void *), void *arg) {
+    struct am_threadpool_work *w;
+    uint32_t pos = q->tail;
+    int32_t dif;
+
+    for (;;) {
+        w = &q->work[pos & AM_THREADPOOL_QUEUE_MASK];
+        dif = (int32_t) (w->seq - pos);
+        if (dif == 0) {
+            if (cas(&q->tail, pos, pos + 1)) break;
+        } else if (dif < 0) {
+            return AM_FALSE; /* queue is full */
+        }
+        pos = q->tail;
+    }
+    w->func = func;
+    w->arg = arg;
+    w->queued = clock_usec();
+    barrier();
+    w->seq = pos + 1;
+    return AM_TRUE;
+}
+
+static int queue_pop(struct am_threadpool_queue *q, struct am_threadpool_work *work) {
+    struct am_threadpool_work *w;
+    uint32_t pos = q->head;
+    int32_t dif;
+
+    for (;;) {
+        w = &q->work[pos & AM_THREADPOOL_QUEUE_MASK];
+        dif = (int32_t) (w->seq - (pos + 1));
+        if (dif == 0) {
+            if (cas(&q->head, pos, pos + 1)) break;
+        } else if (dif < 0) {
+            return AM_FALSE; /* queue is empty */
+        }
+        pos = q->head;
+    }
+    work->func = w->func;
+    work->arg = w->arg;
+    work->queued = w->queued;
+    barrier();
+    w->seq = pos + AM_WORKER_QUEUE_SIZE;
+    return AM_TRUE;
+}
+
+/**
+ * Take the oldest work item from the overflow queue, called with the pool lock held.
+ */
+static int overflow_pop(struct am_threadpool *pool, struct am_threadpool_work *work) {
+    struct am_threadpool_work *w;
+    if (pool->overflow == 0) {
+        return AM_FALSE;
+    }
+    w = &pool->overflow_work[pool->overflow_head];
+    pool->overflow_head = (pool->overflow_head + 1) % AM_WORKER_OVERFLOW_SIZE;
+    pool->overflow--;
+    work->func = w->func;
+    work->arg = w->arg;
+    work->queued = w->queued;
+    return AM_TRUE;
+}
+
+/**
+ * Keep a work item in the overflow queue, unless that one is full too.
+ */
+static int overflow_push(struct am_threadpool *pool, void (*func)(void *), void *arg) {
+    struct am_threadpool_work *w;
+    int kept = AM_FALSE;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->overflow < AM_WORKER_OVERFLOW_SIZE) {
+        w = &pool->overflow_work[(pool->overflow_head + pool->overflow) % AM_WORKER_OVERFLOW_SIZE];
+        w->func = func;
+        w->arg = arg;
+        w->queued = clock_usec();
+        atomic_add(&pool->overflow, 1);
+        kept = AM_TRUE;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return kept;
+}
+
+/**
+ * Take the next work item, from the worker's own queue first and then, if that one is empty,
+ * steal from the other workers' queues, and last from the overflow queue.
+ */
+static int take_work(struct am_threadpool *pool, int index, struct am_threadpool_work *work, int locked) {
+    int i, found = AM_FALSE;
+    for (i = 0; i < pool->max_threads; i++) {
+        if (queue_pop(&pool->queue[(index + i) % pool->max_threads], work)) {
+            atomic_add(&pool->metrics.queued, -1);
+            if (i > 0) {
+                atomic_add64(&pool->metrics.stolen, 1);
+            }
+            return AM_TRUE;
+        }
+    }
+    if (atomic_read(&pool->overflow) > 0) {
+        if (!locked) pthread_mutex_lock(&pool->lock);
+        found = overflow_pop(pool, work);
+        if (!locked) pthread_mutex_unlock(&pool->lock);
+        if (found) {
+            atomic_add(&pool->metrics.queued, -1);
+        }
+    }
+    return found;
+}
+
 static int create_worker(struct am_threadpool *pool) {
     sigset_t oset;
     int error;
@@ -97,13 +256,15 @@ static int create_worker(struct am_threadpool *pool) {
 }
 
 static void worker_cleanup(void *arg) {
-    struct am_threadpool *pool = (struct am_threadpool *) arg;
+    struct am_threadpool_thread *self = (struct am_threadpool_thread *) arg;
+    struct am_threadpool *pool = self->pool;
+    self->used = AM_FALSE;
     --pool->num_threads;
     if (pool->flag & AM_THREADPOOL_DESTROY) {
         if (pool->num_threads == 0) {
             pthread_cond_broadcast(&pool->busy);
         }
-    } else if (pool->head != NULL && pool->num_threads < pool->max_threads &&
+    } else if (atomic_read(&pool->metrics.queued) > 0 && pool->num_threads < pool->max_threads &&
             create_worker(pool) == 0) {
         pool->num_threads++;
     }
@@ -111,24 +272,20 @@ static void worker_cleanup(void *arg) {
 }
 
 static void worker_notify(struct am_threadpool *pool) {
-    if (pool->head == NULL && pool->active == NULL) {
+    if (atomic_read(&pool->active) == 0) {
         pool->flag &= ~AM_THREADPOOL_WAIT;
         pthread_cond_broadcast(&pool->wait);
     }
 }
 
 static void work_cleanup(void *arg) {
-    struct am_threadpool *pool = (struct am_threadpool *) arg;
-    pthread_t thread = pthread_self();
-    struct am_threadpool_active *a, **b;
+    struct am_threadpool_thread *self = (struct am_threadpool_thread *) arg;
+    struct am_threadpool *pool = self->pool;
 
+    /* work function has been cancelled (or called pthread_exit) */
+    self->busy = AM_FALSE;
+    atomic_add(&pool->active, -1);
     pthread_mutex_lock(&pool->lock);
-    for (b = &pool->active; (a = *b) != NULL; b = &a->next) {
-        if (a->thread == thread) {
-            *b = a->next;
-            break;
-        }
-    }
     if (pool->flag & AM_THREADPOOL_WAIT) {
         worker_notify(pool);
     }
@@ -154,33 +311,42 @@ static void cleanup_unlock_mutex(void *arg) {
 
 static void *do_work(void *arg) {
     struct am_threadpool *pool = (struct am_threadpool *) arg;
-    struct am_threadpool_work *cur;
-    struct am_threadpool_active active;
-    int timed_out;
+    struct am_threadpool_thread *self = NULL;
+    struct am_threadpool_work work;
+    int i, timed_out, found;
     struct timespec ts;
-    void (*func) (void *arg);
-    void *func_arg;
+    uint64_t start;
 
     /* worker thread main loop */
     pthread_mutex_lock(&pool->lock);
+
+    /* pick a free slot (and with it - the worker's own queue); num_threads never exceeds max_threads */
+    for (i = 0; i < pool->max_threads; i++) {
+        if (!pool->threads[i].used) {
+            self = &pool->threads[i];
+            break;
+        }
+    }
+    self->used = AM_TRUE;
+    self->busy = AM_FALSE;
+    self->thread = pthread_self();
+
     /* maintain pool integrity in case work function calls pthread_exit() */
-    pthread_cleanup_push(worker_cleanup, pool);
-    active.thread = pthread_self();
+    pthread_cleanup_push(worker_cleanup, self);
 
     while (1) {
-        /* reset (this) thread signal mask and cancellation state back to the initial values 
-         * (since the last work performed) */
-        pthread_sigmask(SIG_SETMASK, &fillset, NULL);
-        pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
-        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-
-        timed_out = 0;
+        timed_out = found = 0;
 
-        pool->idle++;
+        atomic_add(&pool->idle, 1);
         if (pool->flag & AM_THREADPOOL_WAIT) {
             worker_notify(pool);
         }
-        while (pool->head == NULL && !(pool->flag & AM_THREADPOOL_DESTROY)) {
+        while (!(pool->flag & AM_THREADPOOL_DESTROY)) {
+            /* idle count is raised before the queues are checked (and submitter checks idle count 
+             * after the work is queued), so that no wake-up is missed */
+            if ((found = take_work(pool, self->index, &work, AM_TRUE))) {
+                break;
+            }
             if (pool->num_threads <= pool->min_threads) {
                 pthread_cond_wait(&pool->work, &pool->lock);
             } else {
@@ -192,32 +358,42 @@ static void *do_work(void *arg) {
                 }
             }
         }
-        pool->idle--;
+        atomic_add(&pool->idle, -1);
 
         if (pool->flag & AM_THREADPOOL_DESTROY) {
             /* pool is being destroyed - exit now */
             break;
         }
 
-        if ((cur = pool->head) != NULL) {
-            timed_out = 0;
-            /* take out am_threadpool_work from the list and execute it */
-            func = cur->func;
-            func_arg = cur->arg;
-
-            pool->head = cur->next;
-            if (cur == pool->tail) {
-                pool->tail = NULL;
-            }
-            active.next = pool->active;
-            pool->active = &active;
+        if (found) {
             pthread_mutex_unlock(&pool->lock);
 
-            /* do the actual work */
-            pthread_cleanup_push(work_cleanup, pool);
-            free(cur);
-            func(func_arg);
-            pthread_cleanup_pop(1);
+            /* keep on running work without the pool lock for as long as there is any */
+            do {
+                /* reset (this) thread signal mask and cancellation state back to the initial values 
+                 * (since the last work performed) */
+                pthread_sigmask(SIG_SETMASK, &fillset, NULL);
+                pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+                pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+                atomic_add(&pool->active, 1);
+                self->busy = AM_TRUE;
+                start = clock_usec();
+                atomic_add64(&pool->metrics.wait_time, start - work.queued);
+
+                /* do the actual work */
+                pthread_cleanup_push(work_cleanup, self);
+                work.func(work.arg);
+                pthread_cleanup_pop(0);
+
+                atomic_add64(&pool->metrics.run_time, clock_usec() - start);
+                atomic_add64(&pool->metrics.completed, 1);
+                self->busy = AM_FALSE;
+                atomic_add(&pool->active, -1);
+            } while (!(pool->flag & AM_THREADPOOL_DESTROY) && take_work(pool, self->index, &work, AM_FALSE));
+
+            pthread_mutex_lock(&pool->lock);
+            continue;
         }
         if (timed_out && pool->num_threads > pool->min_threads) {
             /* thread timed out (waiting for work) and 
@@ -229,6 +405,39 @@ static void *do_work(void *arg) {
     return NULL;
 }
 
+static struct am_threadpool *create_threadpool_instance() {
+    int i, j;
+    struct am_threadpool *pool;
+
+    sigfillset(&fillset);
+
+    pool = (struct am_threadpool *) calloc(1, sizeof (struct am_threadpool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->linger = AM_THREADS_POOL_LINGER;
+    pool->min_threads = AM_MIN_THREADS_POOL;
+    pool->max_threads = AM_MAX_THREADS_POOL;
+
+    for (i = 0; i < AM_MAX_THREADS_POOL; i++) {
+        pool->threads[i].pool = pool;
+        pool->threads[i].index = i;
+        for (j = 0; j < AM_WORKER_QUEUE_SIZE; j++) {
+            pool->queue[i].work[j].seq = j;
+        }
+    }
+
+    pthread_attr_init(&pool->attr);
+    pthread_attr_setdetachstate(&pool->attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->busy, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->wait, NULL);
+    return pool;
+}
+
 #endif
 
 static
@@ -274,62 +483,15 @@ create_threadpool(
 
 #else
     if (worker_pool != NULL) return;
-
-    sigfillset(&fillset);
-
-    worker_pool = (struct am_threadpool *) malloc(sizeof (struct am_threadpool));
-    if (worker_pool == NULL) {
-        return;
-    }
-
-    worker_pool->active = NULL;
-    worker_pool->head = worker_pool->tail = NULL;
-    worker_pool->flag = 0;
-    worker_pool->linger = AM_THREADS_POOL_LINGER;
-    worker_pool->min_threads = AM_MIN_THREADS_POOL;
-    worker_pool->max_threads = AM_MAX_THREADS_POOL;
-    worker_pool->num_threads = 0;
-    worker_pool->idle = 0;
-
-    pthread_attr_init(&worker_pool->attr);
-    pthread_attr_setdetachstate(&worker_pool->attr, PTHREAD_CREATE_DETACHED);
-
-    pthread_mutex_init(&worker_pool->lock, NULL);
-    pthread_cond_init(&worker_pool->busy, NULL);
-    pthread_cond_init(&worker_pool->work, NULL);
-    pthread_cond_init(&worker_pool->wait, NULL);
+    worker_pool = create_threadpool_instance();
 #endif
 }
 
 #ifndef _WIN32
 
 static void create_threadpool_main() {
-
     if (worker_pool_main != NULL) return;
-
-    sigfillset(&fillset);
-
-    worker_pool_main = (struct am_threadpool *) malloc(sizeof (struct am_threadpool));
-    if (worker_pool_main == NULL) {
-        return;
-    }
-
-    worker_pool_main->active = NULL;
-    worker_pool_main->head = worker_pool_main->tail = NULL;
-    worker_pool_main->flag = 0;
-    worker_pool_main->linger = AM_THREADS_POOL_LINGER;
-    worker_pool_main->min_threads = AM_MIN_THREADS_POOL;
-    worker_pool_main->max_threads = AM_MAX_THREADS_POOL;
-    worker_pool_main->num_threads = 0;
-    worker_pool_main->idle = 0;
-
-    pthread_attr_init(&worker_pool_main->attr);
-    pthread_attr_setdetachstate(&worker_pool_main->attr, PTHREAD_CREATE_DETACHED);
-
-    pthread_mutex_init(&worker_pool_main->lock, NULL);
-    pthread_cond_init(&worker_pool_main->busy, NULL);
-    pthread_cond_init(&worker_pool_main->work, NULL);
-    pthread_cond_init(&worker_pool_main->wait, NULL);
+    worker_pool_main = create_threadpool_instance();
 }
 
 #endif
@@ -374,7 +536,11 @@ static void CALLBACK worker_dispatch_callback(PTP_CALLBACK_INSTANCE instance, vo
 
 #endif
 
-int am_worker_dispatch(void (*worker_f)(void *), void *arg) {
+/**
+ * Queue work for the worker pool; when all work queues are full, the work is rejected (AM_EAGAIN) or, with
+ * overflow set, kept in the overflow queue (and only rejected when that one is full too).
+ */
+static int worker_dispatch(void (*worker_f)(void *), void *arg, int overflow) {
 #ifdef _WIN32
     BOOL status = FALSE;
     struct am_callback_args *cb_arg;
@@ -391,8 +557,9 @@ int am_worker_dispatch(void (*worker_f)(void *), void *arg) {
     }
     return status == FALSE ? AM_ENOMEM : AM_SUCCESS;
 #else
-    struct am_threadpool_work *cur;
     struct am_threadpool *pool = NULL;
+    uint32_t queued, max;
+    int i, next;
 
     if (worker_pool != NULL) {
         /* we've been requested to run a job from within a worker process */
@@ -404,33 +571,76 @@ int am_worker_dispatch(void (*worker_f)(void *), void *arg) {
 
     if (pool == NULL) return AM_EFAULT;
 
-    cur = (struct am_threadpool_work *) malloc(sizeof (struct am_threadpool_work));
-    if (cur == NULL) {
-        return AM_ENOMEM;
-    }
-
-    cur->func = worker_f;
-    cur->arg = arg;
-    cur->next = NULL;
-
-    pthread_mutex_lock(&pool->lock);
+    /* queue depth is raised before the work is queued, so that it is never less than the actual depth */
+    queued = atomic_add(&pool->metrics.queued, 1) + 1;
 
-    if (pool->head == NULL) {
-        pool->head = cur;
-    } else {
-        pool->tail->next = cur;
+    /* submit to the next running worker's queue (round-robin), or to any other one which is not full */
+    next = (int) (atomic_add(&pool->next, 1) % (pool->num_threads > 0 ? pool->num_threads : 1));
+    for (i = 0; i < pool->max_threads; i++) {
+        if (queue_push(&pool->queue[(next + i) % pool->max_threads], worker_f, arg)) {
+            break;
+        }
+    }
+    if (i == pool->max_threads) {
+        if (!overflow || !overflow_push(pool, worker_f, arg)) {
+            /* all queues are full - let the caller deal with it */
+            atomic_add(&pool->metrics.queued, -1);
+            atomic_add64(&pool->metrics.rejected, 1);
+            return AM_EAGAIN;
+        }
+        atomic_add64(&pool->metrics.overflowed, 1);
     }
-    pool->tail = cur;
+    atomic_add64(&pool->metrics.submitted, 1);
+    while ((max = pool->metrics.queued_max) < queued && !cas(&pool->metrics.queued_max, max, queued));
 
-    if (pool->idle > 0) {
+    if (atomic_read(&pool->idle) > 0) {
         /* if there is an idle worker in the pool - wake it up */
+        pthread_mutex_lock(&pool->lock);
         pthread_cond_signal(&pool->work);
-    } else if (pool->num_threads < pool->max_threads &&
-            create_worker(pool) == 0) {
-        /* new worker scheduled */
-        pool->num_threads++;
+        pthread_mutex_unlock(&pool->lock);
+    } else if (pool->num_threads < pool->max_threads) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->num_threads < pool->max_threads && create_worker(pool) == 0) {
+            /* new worker scheduled */
+            pool->num_threads++;
+        }
+        pthread_mutex_unlock(&pool->lock);
     }
+    return AM_SUCCESS;
+#endif
+}
+
+/**
+ * Queue work for the worker pool. Returns AM_EAGAIN if the pool work queues are full.
+ */
+int am_worker_dispatch(void (*worker_f)(void *), void *arg) {
+    return worker_dispatch(worker_f, arg, AM_FALSE);
+}
 
+/**
+ * Queue work that should not be lost (such as notifications and logouts) for the worker pool. When the pool
+ * work queues are full, the work is kept in an overflow queue of AM_WORKER_OVERFLOW_SIZE items; AM_EAGAIN is
+ * returned only when that one is full as well.
+ */
+int am_worker_dispatch_reliable(void (*worker_f)(void *), void *arg) {
+    return worker_dispatch(worker_f, arg, AM_TRUE);
+}
+
+/**
+ * Get a snapshot of the worker pool (in this process) metrics.
+ */
+int am_worker_pool_metrics(struct am_worker_pool_metrics *metrics) {
+#ifdef _WIN32
+    return AM_EOPNOTSUPP;
+#else
+    struct am_threadpool *pool = worker_pool != NULL ? worker_pool : worker_pool_main;
+    if (metrics == NULL) return AM_EINVAL;
+    if (pool == NULL) return AM_ENOTSTARTED;
+
+    pthread_mutex_lock(&pool->lock);
+    memcpy(metrics, &pool->metrics, sizeof (struct am_worker_pool_metrics));
+    metrics->threads = pool->num_threads;
+    metrics->idle = atomic_read(&pool->idle);
     pthread_mutex_unlock(&pool->lock);
     return AM_SUCCESS;
 #endif
@@ -439,9 +649,8 @@ int am_worker_dispatch(void (*worker_f)(void *), void *arg) {
 #ifndef _WIN32
 
 static void worker_pool_shutdown(struct am_threadpool **threadpool) {
-    struct am_threadpool_active *active;
-    struct am_threadpool_work *work;
     struct am_threadpool *pool;
+    int i;
 
     if (threadpool == NULL || *threadpool == NULL) return;
     pool = *threadpool;
@@ -452,13 +661,15 @@ static void worker_pool_shutdown(struct am_threadpool **threadpool) {
     pool->flag |= AM_THREADPOOL_DESTROY;
     pthread_cond_broadcast(&pool->work);
 
-    /* cancel all active workers */
-    for (active = pool->active; active != NULL; active = active->next) {
-        pthread_cancel(active->thread);
+    /* cancel all active workers (worker thread can't exit while we hold the pool lock) */
+    for (i = 0; i < pool->max_threads; i++) {
+        if (pool->threads[i].used && atomic_read(&pool->threads[i].busy)) {
+            pthread_cancel(pool->threads[i].thread);
+        }
     }
 
     /* wait for all active workers to finish */
-    while (pool->active != NULL) {
+    while (atomic_read(&pool->active) != 0) {
         pool->flag |= AM_THREADPOOL_WAIT;
         pthread_cond_wait(&pool->wait, &pool->lock);
     }
@@ -466,12 +677,9 @@ static void worker_pool_shutdown(struct am_threadpool **threadpool) {
     while (pool->num_threads != 0) {
         pthread_cond_wait(&pool->busy, &pool->lock);
     }
-    pthread_cleanup_pop(1);
 
-    for (work = pool->head; work != NULL; work = pool->head) {
-        pool->head = work->next;
-        free(work);
-    }
+    /* work left in the overflow queue is not run (as with the work queues) */
+    pthread_cleanup_pop(1);
 
     pthread_attr_destroy(&pool->attr);
     pthread_mutex_destroy(&pool->lock);
@@ -516,6 +724,18 @@ void am_worker_pool_shutdown_main() {
 #endif
 }
 
+#ifdef _WIN32
+
+/**
+ * Initialise the critical section of an am_static_mutex_t on first use (see AM_STATIC_MUTEX_LOCK).
+ */
+BOOL CALLBACK am_static_mutex_init(PINIT_ONCE once, PVOID param, PVOID *context) {
+    InitializeCriticalSection(&((am_static_mutex_t *) param)->mutex);
+    return TRUE;
+}
+
+#endif
+
 am_event_t *create_event() {
     am_event_t *e = malloc(sizeof (am_event_t));
     if (e != NULL) {
@@ -699,298 +919,474 @@ void close_event(am_event_t **e) {
     }
 }
 
-#ifdef _WIN32
-
-static void CALLBACK timer_callback(void *args, BOOLEAN tw_fired) {
-    struct am_callback_args *cba = (struct am_callback_args *) args;
-    if (cba != NULL && cba->callback != NULL) {
-        if (InterlockedExchangeAdd(cba->stop, 0) == 1)
-            return;
-        if (InterlockedExchangeAdd(cba->running, 1) == 0) {
-            cba->callback(cba->args);
-            InterlockedExchange(cba->running, 0);
-        }
-    }
-}
+/**
+ * Timer wheel: all timers in a process share one hierarchical wheel (AM_TIMER_WHEEL_LEVELS levels of
+ * AM_TIMER_WHEEL_SLOTS slots, AM_TIMER_WHEEL_RESOLUTION msec per level 0 slot), driven by a single thread.
+ * Schedule and cancel are O(1) list operations; the thread sleeps until the next occupied slot is due
+ * and exits when there is nothing left to run.
+ *
+ * Callbacks run on the wheel thread one after another, so a callback that takes long delays every other
+ * timer. Entries with the dispatch flag set have their callback run on the worker pool instead (on the
+ * wheel thread only when it can not be dispatched); an expiry that comes while the previous run of the
+ * entry is still going is skipped.
+ */
 
-#elif defined (LINUX) || defined(AIX)
+#define AM_TIMER_WHEEL_RESOLUTION 10 /* msec */
+#define AM_TIMER_WHEEL_BITS 6
+#define AM_TIMER_WHEEL_SLOTS (1 << AM_TIMER_WHEEL_BITS)
+#define AM_TIMER_WHEEL_MASK (AM_TIMER_WHEEL_SLOTS - 1)
+#define AM_TIMER_WHEEL_LEVELS 4
+#define AM_TIMER_WHEEL_MAX ((uint64_t) 1 << (AM_TIMER_WHEEL_BITS * AM_TIMER_WHEEL_LEVELS))
+#define AM_TIMER_WHEEL_EXPIRED (AM_TIMER_WHEEL_LEVELS * AM_TIMER_WHEEL_SLOTS)
 
-static void timer_callback(union sigval si) {
-    struct am_callback_args *cba = (struct am_callback_args *) si.sival_ptr;
-    if (cba != NULL && cba->callback != NULL) {
-        if (__sync_fetch_and_add(cba->stop, 0) == 1)
-            return;
-        if (__sync_fetch_and_add(cba->running, 1) == 0) {
-            cba->callback(cba->args);
-            __sync_fetch_and_add(cba->running, -1);
-        }
-    }
-}
+enum {
+    AM_TIMER_IDLE = 0,
+    AM_TIMER_SCHEDULED,
+    AM_TIMER_RUNNING
+};
 
+static struct am_timer_wheel {
+    am_mutex_t lock;
+    am_event_t *wake;
+    int running; /* wheel thread is running */
+    uint64_t now; /* last processed tick */
+    uint64_t next; /* tick the wheel thread is going to wake up at */
+    unsigned int count; /* number of scheduled entries */
+    am_timer_entry_t *current; /* entry which callback is being run */
+#ifdef _WIN32
+    DWORD thread;
+#else
+    pthread_t thread;
 #endif
+    uint64_t occupied[AM_TIMER_WHEEL_LEVELS];
+    am_timer_entry_t *slots[AM_TIMER_WHEEL_LEVELS * AM_TIMER_WHEEL_SLOTS + 1]; /* + expired entries list */
+} timer_wheel;
 
-am_timer_event_t *am_create_timer_event(int type, unsigned int interval, void *args, void (*callback)(void *)) {
-#if defined (__sun)
-    port_notify_t pnotif;
-    struct sigevent se;
-#elif defined (LINUX) || defined(AIX)
-    struct sigevent se;
+#ifdef _WIN32
+static INIT_ONCE timer_wheel_initialized = INIT_ONCE_STATIC_INIT;
+#else
+static pthread_once_t timer_wheel_initialized = PTHREAD_ONCE_INIT;
 #endif
-    am_timer_event_t *e = calloc(1, sizeof (am_timer_event_t));
-    if (e != NULL) {
-        if (interval == 0) {
-            e->error = AM_EINVAL;
-            return e;
-        }
-        e->running = AM_FALSE;
-        e->stop = AM_FALSE;
-        e->init_status = AM_ENOTSTARTED;
-        e->type = type;
-        e->interval = interval;
-        e->args = malloc(sizeof (struct am_callback_args));
-        if (e->args == NULL) {
-            e->error = AM_ENOMEM;
-            return e;
-        }
-        ((struct am_callback_args *) e->args)->running = &e->running;
-        ((struct am_callback_args *) e->args)->stop = &e->stop;
-        ((struct am_callback_args *) e->args)->args = args;
-        ((struct am_callback_args *) e->args)->callback = callback;
 
-        e->exit_ev = create_event();
-        if (e->exit_ev == NULL) {
-            e->error = AM_ENOMEM;
-            return e;
-        }
-#if defined(__sun)
-        e->port = port_create();
-        if (e->port == -1) {
-            e->error = errno;
-            return e;
-        }
-        pnotif.portnfy_port = e->port;
-        pnotif.portnfy_user = e->args;
-        se.sigev_notify = SIGEV_PORT;
-        se.sigev_value.sival_ptr = &pnotif;
-        e->error = timer_create(CLOCK_REALTIME, &se, &e->tick);
-        if (e->error == -1) {
-            e->error = errno;
-        }
-#elif defined(__APPLE__)
-        e->tick = kqueue();
-        if (e->tick == -1) {
-            e->error = errno;
-            return e;
-        }
-#elif defined(_WIN32)
-        e->tick_q = CreateTimerQueue();
-        if (e->tick_q == NULL) {
-            e->error = GetLastError();
-            return e;
-        }
-        if (CreateTimerQueueTimer(&e->tick, e->tick_q,
-                (WAITORTIMERCALLBACK) timer_callback, e->args, interval * 1000,
-                type == AM_TIMER_EVENT_ONCE ? 0 : interval * 1000, WT_EXECUTELONGFUNCTION) == 0) {
-            e->error = GetLastError();
-            return e;
-        }
+static uint64_t timer_wheel_tick() {
+#ifdef _WIN32
+    return GetTickCount64() / AM_TIMER_WHEEL_RESOLUTION;
 #else
-        se.sigev_notify = SIGEV_THREAD;
-        se.sigev_value.sival_ptr = e->args;
-        se.sigev_notify_function = timer_callback;
-        se.sigev_notify_attributes = NULL;
-        e->error = timer_create(CLOCK_REALTIME, &se, &e->tick);
-        if (e->error == -1) {
-            e->error = errno;
-        }
+    return clock_usec() / (AM_TIMER_WHEEL_RESOLUTION * 1000);
 #endif
+}
+
+static void timer_wheel_link(am_timer_entry_t *t, int slot) {
+    am_timer_entry_t **head = &timer_wheel.slots[slot];
+    t->slot = slot;
+    t->prev = NULL;
+    t->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = t;
+    }
+    *head = t;
+    if (slot < AM_TIMER_WHEEL_EXPIRED) {
+        timer_wheel.occupied[slot / AM_TIMER_WHEEL_SLOTS] |= (uint64_t) 1 << (slot & AM_TIMER_WHEEL_MASK);
     }
-    return e;
 }
 
-static void *timer_event_loop(void *args) {
-    am_timer_event_t *e = (am_timer_event_t *) args;
+static void timer_wheel_unlink(am_timer_entry_t *t) {
+    int slot = t->slot;
+    if (t->prev != NULL) {
+        t->prev->next = t->next;
+    } else {
+        timer_wheel.slots[slot] = t->next;
+    }
+    if (t->next != NULL) {
+        t->next->prev = t->prev;
+    }
+    if (slot < AM_TIMER_WHEEL_EXPIRED && timer_wheel.slots[slot] == NULL) {
+        timer_wheel.occupied[slot / AM_TIMER_WHEEL_SLOTS] &= ~((uint64_t) 1 << (slot & AM_TIMER_WHEEL_MASK));
+    }
+    t->next = t->prev = NULL;
+    t->slot = -1;
+}
 
-#if defined(__sun)
+/* place the entry into the level (and slot) its expiry tick falls in */
+static void timer_wheel_insert(am_timer_entry_t *t) {
+    uint64_t expires = t->expires, delta;
+    int level;
 
-    port_event_t ev;
-    struct am_callback_args *cba;
-    struct itimerspec ts;
-    if (e->error == 0 && e->tick > 0) {
-        ts.it_value.tv_sec = e->interval;
-        ts.it_value.tv_nsec = 0;
-        ts.it_interval.tv_sec = e->type == AM_TIMER_EVENT_ONCE ? 0 : e->interval;
-        ts.it_interval.tv_nsec = 0;
-        e->error = timer_settime(e->tick, 0, &ts, 0);
-    } else {
-        if (e->error == 0) {
-            e->error = AM_EINVAL;
+    if (expires <= timer_wheel.now) {
+        timer_wheel_link(t, AM_TIMER_WHEEL_EXPIRED);
+        return;
+    }
+    delta = expires - timer_wheel.now;
+    if (delta >= AM_TIMER_WHEEL_MAX) {
+        /* too far out - will be re-inserted when the top level slot cascades */
+        expires = timer_wheel.now + AM_TIMER_WHEEL_MAX - 1;
+        delta = AM_TIMER_WHEEL_MAX - 1;
+    }
+    for (level = 0; level < AM_TIMER_WHEEL_LEVELS - 1; level++) {
+        if (delta < ((uint64_t) 1 << (AM_TIMER_WHEEL_BITS * (level + 1)))) {
+            break;
         }
-        return NULL;
     }
+    timer_wheel_link(t, level * AM_TIMER_WHEEL_SLOTS +
+            (int) ((expires >> (AM_TIMER_WHEEL_BITS * level)) & AM_TIMER_WHEEL_MASK));
+}
 
-    while (1) {
-        if (port_get(e->port, &ev, NULL) < 0) {
-            break;
+/* number of ticks (from now) until the next occupied slot needs attention */
+static uint64_t timer_wheel_next() {
+    uint64_t next = AM_TIMER_WHEEL_MAX, map, span, ticks;
+    int level, index, k;
+
+    for (level = 0; level < AM_TIMER_WHEEL_LEVELS; level++) {
+        map = timer_wheel.occupied[level];
+        if (map == 0) continue;
+        span = (uint64_t) 1 << (AM_TIMER_WHEEL_BITS * level);
+        index = (int) ((timer_wheel.now >> (AM_TIMER_WHEEL_BITS * level)) & AM_TIMER_WHEEL_MASK);
+        /* distance to the first occupied slot after the current one (wrapping around) */
+        for (k = 1; k <= AM_TIMER_WHEEL_SLOTS; k++) {
+            if (map & ((uint64_t) 1 << ((index + k) & AM_TIMER_WHEEL_MASK))) break;
         }
-        if (ev.portev_source != PORT_SOURCE_TIMER) {
-            break;
+        ticks = k * span - (timer_wheel.now & (span - 1));
+        if (ticks < next) {
+            next = ticks;
         }
-        cba = (struct am_callback_args *) ev.portev_user;
-        if (cba == NULL || cba->callback == NULL) {
-            break;
+    }
+    return next;
+}
+
+/* advance the wheel up to the given tick, moving expired entries to the expired list */
+static void timer_wheel_advance(uint64_t tick) {
+    am_timer_entry_t *t, *next;
+    int level, index;
+
+    while (timer_wheel.now < tick) {
+        timer_wheel.now++;
+
+        /* cascade higher level slots down as lower levels wrap around */
+        for (level = 1; level < AM_TIMER_WHEEL_LEVELS; level++) {
+            if (timer_wheel.now & (((uint64_t) 1 << (AM_TIMER_WHEEL_BITS * level)) - 1)) break;
+            index = level * AM_TIMER_WHEEL_SLOTS +
+                    (int) ((timer_wheel.now >> (AM_TIMER_WHEEL_BITS * level)) & AM_TIMER_WHEEL_MASK);
+            for (t = timer_wheel.slots[index]; t != NULL; t = next) {
+                next = t->next;
+                timer_wheel_unlink(t);
+                timer_wheel_insert(t);
+            }
         }
-        if (atomic_add_32_nv(cba->stop, 0) == 1)
-            break;
-        if (atomic_add_32_nv(cba->running, 1) == 0) {
-            cba->callback(cba->args);
-            atomic_swap_32(cba->running, 0);
+
+        index = (int) (timer_wheel.now & AM_TIMER_WHEEL_MASK);
+        for (t = timer_wheel.slots[index]; t != NULL; t = next) {
+            next = t->next;
+            timer_wheel_unlink(t);
+            if (t->expires > timer_wheel.now) {
+                timer_wheel_insert(t);
+            } else {
+                timer_wheel_link(t, AM_TIMER_WHEEL_EXPIRED);
+            }
+        }
+
+        if (timer_wheel.occupied[0] == 0 && timer_wheel.slots[AM_TIMER_WHEEL_EXPIRED] == NULL) {
+            /* nothing due in level 0 - skip straight to the next cascade (or the target) */
+            uint64_t skip = timer_wheel_next();
+            if (skip > 1) {
+                skip = timer_wheel.now + skip - 1;
+                timer_wheel.now = skip < tick ? skip : tick;
+            }
         }
     }
+}
 
-#elif defined(__APPLE__)
+static AM_THREAD_LOCAL am_timer_entry_t *timer_wheel_dispatched_entry = NULL;
 
-    int n;
-    u_short flags = EV_ADD | EV_ENABLE;
-    struct kevent ch, ev;
-    struct am_callback_args *cba = (struct am_callback_args *) e->args;
-    if (cba == NULL || cba->callback == NULL) {
-        return NULL;
+/* worker pool side of a dispatched timer entry */
+static void timer_wheel_dispatched(void *arg) {
+    am_timer_entry_t *t = (am_timer_entry_t *) arg;
+
+    timer_wheel_dispatched_entry = t;
+    t->callback(t->arg);
+    timer_wheel_dispatched_entry = NULL;
+
+    AM_MUTEX_LOCK(&timer_wheel.lock);
+    t->busy = AM_FALSE;
+    AM_MUTEX_UNLOCK(&timer_wheel.lock);
+}
+
+/* called with the lock held */
+static int timer_wheel_dispatch(am_timer_entry_t *t) {
+    if (t->busy) {
+        return AM_SUCCESS; /* still running: this expiry is skipped */
     }
-    if (e->type == AM_TIMER_EVENT_ONCE) {
-        flags |= EV_ONESHOT;
+    t->busy = AM_TRUE;
+    if (am_worker_dispatch(timer_wheel_dispatched, t) != AM_SUCCESS) {
+        t->busy = AM_FALSE;
+        return AM_ERROR;
     }
+    return AM_SUCCESS;
+}
 
-    /* set event */
-    EV_SET(&ch, 1, EVFILT_TIMER, flags, NOTE_SECONDS, e->interval, NULL);
-    kevent(e->tick, &ch, 1, NULL, 0, NULL);
-
-    while (1) {
-        n = kevent(e->tick, NULL, 0, &ev, 1, NULL); /* retrieve event */
-        if (n <= 0 || (ev.flags & EV_ERROR)) {
-            break;
+/* re-arm a recurring entry relative to the last expiry, skipping missed intervals; retire any other one */
+static void timer_wheel_rearm(am_timer_entry_t *t) {
+    if (t->interval > 0) {
+        t->expires += t->interval;
+        if (t->expires <= timer_wheel.now) {
+            t->expires = timer_wheel.now + t->interval;
         }
-        cba->callback(cba->args);
+        t->state = AM_TIMER_SCHEDULED;
+        timer_wheel_insert(t);
+    } else {
+        t->state = AM_TIMER_IDLE;
+        timer_wheel.count--;
     }
+}
+
+static void *timer_wheel_loop(void *arg) {
+    am_timer_entry_t *t;
+    uint64_t tick, next;
+    int timeout;
 
+    AM_MUTEX_LOCK(&timer_wheel.lock);
+#ifdef _WIN32
+    timer_wheel.thread = GetCurrentThreadId();
 #else
+    timer_wheel.thread = pthread_self();
+#endif
+    for (;;) {
+        tick = timer_wheel_tick();
+        timer_wheel_advance(tick);
+
+        while ((t = timer_wheel.slots[AM_TIMER_WHEEL_EXPIRED]) != NULL) {
+            timer_wheel_unlink(t);
+            if (t->dispatch && timer_wheel_dispatch(t) == AM_SUCCESS) {
+                timer_wheel_rearm(t);
+                continue;
+            }
+            t->state = AM_TIMER_RUNNING;
+            timer_wheel.current = t;
+            AM_MUTEX_UNLOCK(&timer_wheel.lock);
 
-#ifndef _WIN32
+            t->callback(t->arg);
 
-    struct itimerspec ts;
-    if (e->error == 0 && e->tick > 0) {
-        ts.it_value.tv_sec = e->interval;
-        ts.it_value.tv_nsec = 0;
-        ts.it_interval.tv_sec = e->type == AM_TIMER_EVENT_ONCE ? 0 : e->interval;
-        ts.it_interval.tv_nsec = 0;
-        e->error = timer_settime(e->tick, 0, &ts, 0);
-    } else {
-        if (e->error == 0) {
-            e->error = AM_EINVAL;
+            AM_MUTEX_LOCK(&timer_wheel.lock);
+            timer_wheel.current = NULL;
+            if (t->state != AM_TIMER_RUNNING) {
+                continue; /* cancelled (or re-scheduled) from within the callback */
+            }
+            timer_wheel_rearm(t);
         }
-        return NULL;
-    }
-
-#endif
 
-    while (1) {
-        if (wait_for_event(e->exit_ev, 1000) == 0) {
-            continue;
+        if (timer_wheel.count == 0) {
+            break;
         }
-        break;
+
+        next = timer_wheel_next();
+        timer_wheel.next = timer_wheel.now + next;
+        timeout = (int) (next * AM_TIMER_WHEEL_RESOLUTION);
+        AM_MUTEX_UNLOCK(&timer_wheel.lock);
+
+        wait_for_event(timer_wheel.wake, timeout > 0 ? timeout : 1);
+
+        AM_MUTEX_LOCK(&timer_wheel.lock);
     }
-#endif
+    timer_wheel.running = AM_FALSE;
+    AM_MUTEX_UNLOCK(&timer_wheel.lock);
     return NULL;
 }
 
-void am_start_timer_event(am_timer_event_t *e) {
-    if (e == NULL || e->error != 0) return;
-#ifdef _WIN32
-    if ((e->tick_thr = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) timer_event_loop, e, 0, NULL)) != NULL) {
-        e->init_status = AM_SUCCESS;
-    }
-#else
-    if (pthread_create(&e->tick_thr, NULL, timer_event_loop, e) == 0) {
-        e->init_status = AM_SUCCESS;
-    }
-#endif
+#ifndef _WIN32
+
+static void timer_wheel_atfork_prepare() {
+    AM_MUTEX_LOCK(&timer_wheel.lock);
+}
+
+static void timer_wheel_atfork_parent() {
+    AM_MUTEX_UNLOCK(&timer_wheel.lock);
 }
 
-static void wait_for_timer_worker(am_timer_event_t *e) {
-    int tries = 1000;
-    
-    /* Stop any upcoming timer callback method from executing */
+static void timer_wheel_atfork_child() {
+    /* timers (and the wheel thread) are not inherited by a child process */
+    memset(timer_wheel.slots, 0, sizeof (timer_wheel.slots));
+    memset(timer_wheel.occupied, 0, sizeof (timer_wheel.occupied));
+    timer_wheel.count = 0;
+    timer_wheel.running = AM_FALSE;
+    timer_wheel.current = NULL;
+    AM_MUTEX_INIT(&timer_wheel.lock);
+}
+
+#endif
+
+static
 #ifdef _WIN32
-    InterlockedExchange(&e->stop, 1);
-#elif (__sun)
-    atomic_swap_32(&e->stop, 1);
+BOOL CALLBACK
 #else
-    __sync_fetch_and_add(&e->stop, 1);
+void
 #endif
-    
-    /* Wait till any outstanding callback is finished */
-    do {
-        if (
-#ifdef _WIN32        
-                InterlockedExchangeAdd
-#elif defined(__sun)
-                atomic_add_32_nv
-#else
-                __sync_fetch_and_add
+create_timer_wheel(
+#ifdef _WIN32
+        PINIT_ONCE io, PVOID p, PVOID *c
 #endif
-                (&e->running, 0) == 0)
-            break;
+        ) {
+    AM_MUTEX_INIT(&timer_wheel.lock);
+    timer_wheel.wake = create_event();
+    timer_wheel.now = timer_wheel_tick();
 #ifdef _WIN32
-        Sleep(100); /* 100 msec */
+    return TRUE;
 #else
-        usleep(100000L);
+    pthread_atfork(timer_wheel_atfork_prepare, timer_wheel_atfork_parent, timer_wheel_atfork_child);
 #endif
-    } while (--tries);
 }
 
-void am_close_timer_event(am_timer_event_t *e) {
-    if (e == NULL) return;
-
-    set_event(e->exit_ev);
-    wait_for_timer_worker(e);
+static int timer_wheel_start() {
+#ifdef _WIN32
+    HANDLE thread;
+    if ((thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) timer_wheel_loop, NULL, 0, NULL)) == NULL) {
+        return AM_ENOMEM;
+    }
+    CloseHandle(thread);
+#else
+    sigset_t set, oset;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int error;
 
-#if defined(__sun)
+    sigfillset(&set);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_sigmask(SIG_SETMASK, &set, &oset);
+    error = pthread_create(&thread, &attr, timer_wheel_loop, NULL);
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+    pthread_attr_destroy(&attr);
+    if (error != 0) {
+        return AM_ENOMEM;
+    }
+#endif
+    timer_wheel.running = AM_TRUE;
+    return AM_SUCCESS;
+}
 
-    close(e->port);
-    timer_delete(e->tick);
+void am_timer_entry_init(am_timer_entry_t *t, void (*callback)(void *), void *arg) {
+    memset(t, 0, sizeof (am_timer_entry_t));
+    t->slot = -1;
+    t->callback = callback;
+    t->arg = arg;
+}
 
-#elif defined(__APPLE__)
+/**
+ * Schedule (or re-schedule) a timer entry to fire after delay msec, and then every interval msec
+ * (interval 0 - fire once). The callback runs on the timer wheel thread and must be short (collect the
+ * work and dispatch it to the worker pool), unless the entry dispatch flag is set.
+ */
+int am_timer_schedule(am_timer_entry_t *t, unsigned int delay, unsigned int interval) {
+    int status = AM_SUCCESS;
+    uint64_t tick;
 
-    close(e->tick);
+    if (t == NULL || t->callback == NULL) {
+        return AM_EINVAL;
+    }
+#ifdef _WIN32
+    InitOnceExecuteOnce(&timer_wheel_initialized, create_timer_wheel, NULL, NULL);
+#else
+    pthread_once(&timer_wheel_initialized, create_timer_wheel);
+#endif
+    if (timer_wheel.wake == NULL) {
+        return AM_ENOMEM;
+    }
 
-#elif defined(_WIN32)
+    tick = timer_wheel_tick();
 
-    if (e->init_status == AM_SUCCESS) {
-        WaitForSingleObject(e->tick_thr, INFINITE);
+    AM_MUTEX_LOCK(&timer_wheel.lock);
+    if (t->state == AM_TIMER_SCHEDULED) {
+        timer_wheel_unlink(t);
+    } else if (t->state == AM_TIMER_IDLE) {
+        timer_wheel.count++;
     }
-    if (e->tick_q != NULL) {
-        if (e->tick != NULL) {
-            DeleteTimerQueueTimer(e->tick_q, e->tick, NULL);
-        }
-        DeleteTimerQueue(e->tick_q);
+    if (!timer_wheel.running) {
+        /* catch up with the time spent idle */
+        timer_wheel.now = tick;
     }
-    if (e->init_status == AM_SUCCESS) {
-        CloseHandle(e->tick_thr);
+    t->interval = (interval + AM_TIMER_WHEEL_RESOLUTION - 1) / AM_TIMER_WHEEL_RESOLUTION;
+    /* current tick is partially gone - add one more, so that the entry never fires early */
+    t->expires = tick + 1 + (delay + AM_TIMER_WHEEL_RESOLUTION - 1) / AM_TIMER_WHEEL_RESOLUTION;
+    t->state = AM_TIMER_SCHEDULED;
+    timer_wheel_insert(t);
+
+    if (!timer_wheel.running) {
+        status = timer_wheel_start();
+        if (status != AM_SUCCESS) {
+            timer_wheel_unlink(t);
+            t->state = AM_TIMER_IDLE;
+            timer_wheel.count--;
+        }
+    } else if (t->expires < timer_wheel.next) {
+        /* wheel thread is going to sleep past this entry's expiry */
+        set_event(timer_wheel.wake);
     }
+    AM_MUTEX_UNLOCK(&timer_wheel.lock);
+    return status;
+}
 
-#else
+/**
+ * Cancel a timer entry. If the entry's callback is running (on another thread) or dispatched, wait for
+ * it to finish, so that the entry can be released once this function returns.
+ */
+void am_timer_cancel(am_timer_entry_t *t) {
+    int tries = 100000;
 
-    timer_delete(e->tick);
+    if (t == NULL || timer_wheel.wake == NULL) return;
 
+    AM_MUTEX_LOCK(&timer_wheel.lock);
+    if (t->state == AM_TIMER_SCHEDULED) {
+        timer_wheel_unlink(t);
+    }
+    if (t->state != AM_TIMER_IDLE) {
+        t->state = AM_TIMER_IDLE;
+        timer_wheel.count--;
+    }
+    while (((timer_wheel.current == t &&
+#ifdef _WIN32
+            timer_wheel.thread != GetCurrentThreadId()
+#else
+            !pthread_equal(timer_wheel.thread, pthread_self())
+#endif
+            ) || (t->busy && timer_wheel_dispatched_entry != t)) && --tries) {
+        AM_MUTEX_UNLOCK(&timer_wheel.lock);
+#ifdef _WIN32
+        Sleep(1);
+#else
+        usleep(1000);
 #endif
+        AM_MUTEX_LOCK(&timer_wheel.lock);
+    }
+    if (timer_wheel.count == 0 && timer_wheel.running) {
+        /* let the wheel thread exit */
+        set_event(timer_wheel.wake);
+    }
+    AM_MUTEX_UNLOCK(&timer_wheel.lock);
+}
 
-#ifndef _WIN32
-    if (e->init_status == AM_SUCCESS) {
-        pthread_join(e->tick_thr, NULL);
+am_timer_event_t *am_create_timer_event(int type, unsigned int interval, void *args, void (*callback)(void *)) {
+    am_timer_event_t *e = calloc(1, sizeof (am_timer_event_t));
+    if (e != NULL) {
+        e->init_status = AM_ENOTSTARTED;
+        e->type = type;
+        e->interval = interval;
+        if (interval == 0 || callback == NULL) {
+            e->error = AM_EINVAL;
+            return e;
+        }
+        am_timer_entry_init(&e->entry, callback, args);
     }
-#endif
+    return e;
+}
+
+void am_start_timer_event(am_timer_event_t *e) {
+    if (e == NULL || e->error != 0) return;
+    e->init_status = am_timer_schedule(&e->entry, e->interval * 1000,
+            e->type == AM_TIMER_EVENT_ONCE ? 0 : e->interval * 1000);
+}
 
-    close_event(&e->exit_ev);
-    am_free(e->args);
+void am_close_timer_event(am_timer_event_t *e) {
+    if (e == NULL) return;
+    if (e->init_status == AM_SUCCESS) {
+        am_timer_cancel(&e->entry);
+    }
     free(e);
 }
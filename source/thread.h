@@ -39,6 +39,28 @@ typedef pthread_t am_thread_t;
 #define AM_THREAD_LOCAL         __thread
 #endif
 
+/* mutex with static storage duration, usable without an explicit initialisation call */
+#ifdef _WIN32
+typedef struct {
+    INIT_ONCE once;
+    CRITICAL_SECTION mutex;
+} am_static_mutex_t;
+#define AM_STATIC_MUTEX_INITIALIZER { INIT_ONCE_STATIC_INIT }
+BOOL CALLBACK am_static_mutex_init(PINIT_ONCE once, PVOID param, PVOID *context);
+#define AM_STATIC_MUTEX_LOCK(m) do { \
+        InitOnceExecuteOnce(&(m)->once, am_static_mutex_init, (m), NULL); \
+        EnterCriticalSection(&(m)->mutex); \
+    } while (0)
+#define AM_STATIC_MUTEX_UNLOCK(m) LeaveCriticalSection(&(m)->mutex)
+#else
+typedef struct {
+    pthread_mutex_t mutex;
+} am_static_mutex_t;
+#define AM_STATIC_MUTEX_INITIALIZER { PTHREAD_MUTEX_INITIALIZER }
+#define AM_STATIC_MUTEX_LOCK(m) pthread_mutex_lock(&(m)->mutex)
+#define AM_STATIC_MUTEX_UNLOCK(m) pthread_mutex_unlock(&(m)->mutex)
+#endif
+
 typedef struct {
 #ifdef _WIN32
     HANDLE event;
@@ -58,29 +80,41 @@ enum {
     AM_TIMER_EVENT_RECURRING
 };
 
+typedef struct am_timer_entry {
+    struct am_timer_entry *next;
+    struct am_timer_entry *prev;
+    uint64_t expires; /* timer wheel tick */
+    unsigned int interval; /* timer wheel ticks, 0 - not recurring */
+    int slot;
+    int state;
+    int dispatch; /* run the callback on the worker pool, not on the timer wheel thread */
+    int busy; /* dispatched callback has not returned yet */
+    void (*callback)(void *);
+    void *arg;
+} am_timer_entry_t;
+
 typedef struct {
-    volatile uint32_t running;
-    volatile uint32_t stop;
     int type;
-    unsigned int interval;
-    void *args;
+    unsigned int interval; /* sec */
     int error;
     int init_status;
-#ifdef _WIN32
-    HANDLE tick;
-    HANDLE tick_q;
-#elif defined(__sun) 
-    timer_t tick;
-    int port;
-#elif defined(__APPLE__) 
-    int tick;
-#else
-    timer_t tick;
-#endif
-    am_thread_t tick_thr;
-    am_event_t *exit_ev;
+    am_timer_entry_t entry;
 } am_timer_event_t;
 
+struct am_worker_pool_metrics {
+    uint64_t submitted; /* number of work items accepted */
+    uint64_t rejected; /* number of work items rejected (all queues were full) */
+    uint64_t overflowed; /* number of work items kept in the overflow queue (all queues were full) */
+    uint64_t completed; /* number of work items run */
+    uint64_t stolen; /* number of work items taken from other worker's queue */
+    uint64_t wait_time; /* total time work items spent queued (usec) */
+    uint64_t run_time; /* total time spent running work items (usec) */
+    volatile uint32_t queued; /* current queue depth */
+    volatile uint32_t queued_max; /* max queue depth seen */
+    uint32_t threads; /* current number of worker threads */
+    uint32_t idle; /* current number of idle worker threads */
+};
+
 #ifndef _WIN32
 void am_clock_gettime(struct timespec *ts);
 #endif
@@ -91,6 +125,10 @@ int wait_for_event(am_event_t *e, int timeout);
 void set_event(am_event_t *e);
 void close_event(am_event_t **e);
 
+void am_timer_entry_init(am_timer_entry_t *t, void (*callback)(void *), void *arg);
+int am_timer_schedule(am_timer_entry_t *t, unsigned int delay, unsigned int interval);
+void am_timer_cancel(am_timer_entry_t *t);
+
 am_timer_event_t *am_create_timer_event(int type, unsigned int interval, void *args, void (*callback)(void *));
 void am_start_timer_event(am_timer_event_t *e);
 void am_close_timer_event(am_timer_event_t *e);
@@ -101,6 +139,8 @@ void am_worker_pool_shutdown_main();
 void am_worker_pool_init_main();
 
 int am_worker_dispatch(void (*worker_f)(void *), void *arg);
+int am_worker_dispatch_reliable(void (*worker_f)(void *), void *arg);
+int am_worker_pool_metrics(struct am_worker_pool_metrics *metrics);
 
 void notification_worker(void *arg);
 void session_logout_worker(void *arg);
@@ -96,8 +96,9 @@ const char *request_method_str[] = {
 #define HD4 URI_HTTP "://" URI_HOST
 
 struct query_attribute {
-    char *key;
-    char *key_value;
+    const char *key_value;
+    size_t key_sz;
+    size_t sz;
 };
 
 enum {
@@ -136,6 +137,26 @@ static const char *hex_chars = "0123456789ABCDEF";
 static const unsigned char base64_table[64] =
         "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
+/* base64_table positions, 64 for characters outside of the alphabet */
+static const unsigned char base64_index[256] = {
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 62, 64, 64, 64, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 64, 64, 64, 64, 64, 64,
+    64,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 64, 64, 64, 64, 64,
+    64, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64
+};
+
 static struct http_status http_status_list[] = {
 #define HTTP_STATUS_CODE(c) c, AM_XSTR(c)
     {HTTP_STATUS_CODE(100), "Continue"},
@@ -333,121 +354,165 @@ char *match_group(pcre *x, int capture_groups, const char *subject, size_t *len)
     return result;
 }
 
-static void uri_normalize(struct url *url, char *path) {
-
-    char *s, *o, *p = path != NULL ? strdup(path) : NULL;
-    int i, m = 0, list_sz = 0;
-    char **segment_list = NULL, **segment_list_norm = NULL, **tmp;
-    char u[AM_URI_SIZE + 1];
-
-    if (p == NULL) {
-        if (url != NULL) {
-            url->error = path != NULL ? AM_ENOMEM : AM_EINVAL;
-        }
-        return;
-    }
-    o = p; /* preserve original pointer */
-
-    /* split path into segments */
-    while ((s = am_strsep(&p, "/")) != NULL) {
-        if (strcmp(s, ".") == 0) {
-            continue; /* remove (ignore) single dot segments */
-        }
-        tmp = (char **) realloc(segment_list, sizeof (char *) * (++list_sz));
-        if (tmp == NULL) {
-            AM_FREE(o, segment_list);
-            url->error = AM_ENOMEM;
-            return;
-        }
-        segment_list = tmp;
-        segment_list[list_sz - 1] = s;
-    }
-    if (list_sz == 0) {
-        /* nothing to do here */
-        AM_FREE(o, segment_list);
-        if (url != NULL) {
-            url->error = AM_SUCCESS;
-        }
-        return;
-    }
-
-    /* create a list for normalized segment storage */
-    segment_list_norm = (char **) calloc(list_sz, sizeof (char *));
-    if (segment_list_norm == NULL) {
-        AM_FREE(o, segment_list);
-        if (url != NULL) {
-            url->error = AM_ENOMEM;
-        }
-        return;
-    }
+#define BASE16_TO_BASE10(x) (isdigit(x) ? ((x) - '0') : (toupper((x)) - 'A' + 10))
 
-    for (i = 0; i < list_sz; i++) {
-        if (strcmp(segment_list[i], "..") == 0) {
-            /* remove double dot segments */
-            if (m-- <= 1) {
-                m = 1;
-                continue;
-            }
-            segment_list_norm[m] = NULL;
+/**
+ * Url-decode, collapse consecutive '/' and remove dot segments (RFC-2396, section-5.2)
+ * of a path in a single pass.
+ *
+ * A segment is copied to the output as it is decoded; once it is complete, a "." segment is
+ * dropped and a ".." segment is dropped together with the segment before it (the root is never
+ * removed). A decoded NUL ends the path.
+ *
+ * @param path path value (not NUL terminated), starting with '/'
+ * @param path_sz path value size
+ * @param out output buffer, at least path_sz + 1 bytes
+ * @return normalized path size
+ */
+static size_t uri_normalize(const char *path, size_t path_sz, char *out) {
+    const char *c, *end = path + path_sz;
+    char *o = out, *segment = NULL;
+    int last = 0, ch;
+
+    for (c = path; c <= end; c++) {
+        if (c == end) {
+            ch = 0;
+        } else if (*c == '%' && c + 2 < end && isxdigit((unsigned char) c[1]) && isxdigit((unsigned char) c[2])) {
+            ch = (BASE16_TO_BASE10(c[1]) * 16) + (BASE16_TO_BASE10(c[2]));
+            c += 2;
         } else {
-            segment_list_norm[m++] = segment_list[i];
+            ch = *c == '+' ? ' ' : (unsigned char) *c;
         }
-    }
 
-    memset(&u[0], 0, sizeof (u));
-    /* join normalized segments */
-    for (i = 0; i < list_sz; i++) {
-        if (segment_list_norm[i] == NULL) {
-            break;
+        if (ch == '/' && last == '/') {
+            continue; /* consecutive '/' */
         }
-        if (i == 0) {
-            strncpy(u, segment_list_norm[i], sizeof (u) - 1);
-            if ((i + 1) < list_sz && segment_list_norm[i + 1] != NULL) {
-                strncat(u, "/", sizeof (u) - 1);
+        last = ch;
+
+        if (ch == '/' || ch == 0) {
+            if (segment != NULL) {
+                /* segment [segment, o) is complete, segment[-1] is its '/' */
+                size_t sz = o - segment;
+                if (sz == 1 && segment[0] == '.') {
+                    o = segment - 1;
+                } else if (sz == 2 && segment[0] == '.' && segment[1] == '.') {
+                    o = segment - 1;
+                    while (o > out && *--o != '/')
+                        ;
+                }
             }
-        } else {
-            strncat(u, segment_list_norm[i], sizeof (u) - 1);
-            if ((i + 1) < list_sz && segment_list_norm[i + 1] != NULL) {
-                strncat(u, "/", sizeof (u) - 1);
+            if (ch == 0) {
+                break;
             }
+            *o++ = '/';
+            segment = o;
+            continue;
         }
+        *o++ = (char) ch;
     }
-    memcpy(path, u, sizeof (u));
-
-    AM_FREE(segment_list_norm, segment_list, o);
+    *o = 0;
+    return o - out;
+}
 
-    if (url != NULL) {
-        url->error = AM_SUCCESS;
+static int span_compare(const char *a, size_t a_sz, const char *b, size_t b_sz) {
+    int status = memcmp(a, b, a_sz < b_sz ? a_sz : b_sz);
+    if (status == 0 && a_sz != b_sz) {
+        status = a_sz < b_sz ? -1 : 1;
     }
+    return status;
 }
 
 static int query_attribute_compare(const void *a, const void *b) {
     int status;
     struct query_attribute *ia = (struct query_attribute *) a;
     struct query_attribute *ib = (struct query_attribute *) b;
-    status = strcmp(ia->key, ib->key);
+    status = span_compare(ia->key_value, ia->key_sz, ib->key_value, ib->key_sz);
     if (status == 0) {
         /* variable names (keys) are the same, we need to further compare the values */
-        status = strcmp(ia->key_value, ib->key_value);
+        status = span_compare(ia->key_value, ia->sz, ib->key_value, ib->sz);
     }
     return status;
 }
 
+#define QUERY_ATTRIBUTES 32
+
+/**
+ * Sort query parameters (empty parameters are removed) by name and value.
+ *
+ * @param query query value, without the leading '?' (not NUL terminated)
+ * @param query_sz query value size
+ * @param out output buffer, at least query_sz + 1 bytes
+ * @return AM_SUCCESS or AM_ENOMEM
+ */
+static int query_normalize(const char *query, size_t query_sz, char *out) {
+    struct query_attribute list_static[QUERY_ATTRIBUTES], *list = list_static;
+    const char *p = query, *end = query + query_sz, *sep;
+    int count = 1, i, n = 0;
+
+    for (sep = query; (sep = memchr(sep, '&', end - sep)) != NULL; sep++) {
+        count++;
+    }
+    if (count > QUERY_ATTRIBUTES) {
+        list = (struct query_attribute *) malloc(count * sizeof (struct query_attribute));
+        if (list == NULL) {
+            return AM_ENOMEM;
+        }
+    }
+
+    while (p < end) {
+        const char *eq;
+        sep = memchr(p, '&', end - p);
+        if (sep == NULL) {
+            sep = end;
+        }
+        if (sep > p) {
+            struct query_attribute *elm = &list[n++];
+            eq = memchr(p, '=', sep - p);
+            elm->key_value = p;
+            elm->sz = sep - p;
+            elm->key_sz = eq != NULL ? (size_t) (eq - p) : elm->sz;
+        }
+        p = sep + 1;
+    }
+
+    qsort(list, n, sizeof (struct query_attribute), query_attribute_compare);
+
+    for (i = 0; i < n; i++) {
+        if (i > 0) {
+            *out++ = '&';
+        }
+        memcpy(out, list[i].key_value, list[i].sz);
+        out += list[i].sz;
+    }
+    *out = 0;
+
+    if (list != list_static) {
+        free(list);
+    }
+    return AM_SUCCESS;
+}
+
 /**
  * Parse a URL into a struct url which contains members broken out into protocol,
  * host, path, etc.
  *
+ * Path and query values point into a single buffer holding the normalized path
+ * (url-decoded, without dot segments) and the sorted query string; it is released with url_free.
+ *
  * @param u The url to break out
  * @param url The broken out url structure to break out into
  * @return AM_SUCCESS if all goes well, AM_ERROR if it does not.
  */
 int parse_url(const char *u, struct url *url) {
-    int i = 0, port = 0, last = 0;
-    char *d, *p, uri[AM_URI_SIZE + 1];
+    int port = 0, n = 0;
+    const char *path = NULL, *query;
+    size_t path_sz = 0, query_sz = 0;
 
     if (url == NULL) {
         return AM_ERROR;
     }
+    url->buf = NULL;
+    url->path = url->query = (char *) "";
     if (u == NULL) {
         url->error = AM_EINVAL;
         return AM_ERROR;
@@ -458,20 +523,20 @@ int parse_url(const char *u, struct url *url) {
     }
 
     url->error = url->ssl = url->port = 0;
-    memset(&uri[0], 0, sizeof (uri));
     memset(&url->proto[0], 0, sizeof (url->proto));
     memset(&url->host[0], 0, sizeof (url->host));
-    memset(&url->path[0], 0, sizeof (url->path));
-    memset(&url->query[0], 0, sizeof (url->query));
 
-    if (sscanf(u, HD1, url->proto, url->host, &port, url->path) == 4) {
-        ;
-    } else if (sscanf(u, HD2, url->proto, url->host, url->path) == 3) {
-        ;
-    } else if (sscanf(u, HD3, url->proto, url->host, &port) == 3) {
-        ;
-    } else if (sscanf(u, HD4, url->proto, url->host) == 2) {
-        ;
+    /* proto://host:port/path or proto://host/path; the path value, if any, 
+     * is the first whitespace delimited word after the '/' */
+    if (sscanf(u, HD3 "/%n", url->proto, url->host, &port, &n) == 3 ||
+            sscanf(u, HD4 "/%n", url->proto, url->host, &n) == 2) {
+        if (n > 0) {
+            for (path = u + n; isspace((unsigned char) *path); path++)
+                ;
+            while (path_sz < AM_URI_SIZE && path[path_sz] != '\0' && !isspace((unsigned char) path[path_sz])) {
+                path_sz++;
+            }
+        }
     } else {
         url->error = AM_EOF;
         return AM_ERROR;
@@ -488,94 +553,62 @@ int parse_url(const char *u, struct url *url) {
     } else if (strcasecmp(url->proto, "http") == 0 && url->port == 0) {
         url->port = 80;
     }
-    if (!ISVALID(url->path)) {
-        strcpy(url->path, "/");
-    } else if (url->path[0] != '/') {
-        size_t ul = strlen(url->path);
-        if (ul < sizeof (url->path)) {
-            memmove(url->path + 1, url->path, ul);
-        }
-        url->path[0] = '/';
-    }
-
-    /* split out a query string, if any and sort query parameters */
-    p = strchr(url->path, '?');
-    if (p != NULL) {
-        char *token, *temp, query[AM_URI_SIZE + 1], *sep;
-        struct query_attribute *list;
-        int sep_count, sep_count_init, j;
-        strncpy(url->query, p, sizeof (url->query) - 1);
-        *p = 0;
-
-        strncpy(query, url->query + 1 /* skip '?' */, sizeof (url->query) - 1);
-        sep_count = char_count(query, '&', NULL);
-        if (sep_count > 0) {
-            list = (struct query_attribute *) calloc(++sep_count, sizeof (struct query_attribute));
-            if (list == NULL) {
-                url->error = AM_ENOMEM;
-                return AM_ERROR;
-            }
-            sep_count_init = sep_count;
-            sep_count = 0;
-
-            for ((token = strtok_r(query, "&", &temp)); token; (token = strtok_r(NULL, "&", &temp))) {
-                struct query_attribute *elm = &list[sep_count++];
-                elm->key_value = token;
-                elm->key = strdup(token);
-                if (elm->key == NULL) {
-                    for (j = 0; j < sep_count_init; j++) {
-                        struct query_attribute *elm = &list[j];
-                        am_free(elm->key);
-                    }
-                    free(list);
-                    url->error = AM_ENOMEM;
-                    return AM_ERROR;
-                }
-                sep = strchr(elm->key, '=');
-                if (sep != NULL) {
-                    *sep = '\0';
-                }
-            }
-
-            qsort(list, sep_count, sizeof (struct query_attribute), query_attribute_compare);
 
-            strncpy(url->query, "?", sizeof (url->query) - 1);
-            for (j = 0; j < sep_count; j++) {
-                struct query_attribute *elm = &list[j];
-                if (j > 0) {
-                    strcat(url->query, "&");
-                }
-                strcat(url->query, elm->key_value);
-                free(elm->key);
-            }
-            free(list);
-        }
+    /* split out a query string, if any */
+    query = path_sz > 0 ? memchr(path, '?', path_sz) : NULL;
+    if (query != NULL) {
+        query_sz = path + path_sz - query;
+        path_sz = query - path;
     }
 
-    d = url_decode(url->path);
-    if (d == NULL) {
+    /* path value is prefixed with '/', if it is not there already */
+    url->buf = malloc(path_sz + query_sz + 3);
+    if (url->buf == NULL) {
         url->error = AM_ENOMEM;
         return AM_ERROR;
     }
-    
-    p = d;
-    /* replace all consecutive '/' with a single '/' */
-    while (*p != '\0') {
-        if (*p != '/' || (*p == '/' && last != '/')) {
-            uri[i++] = *p;
+    url->buf[0] = '/';
+    if (path_sz > 0) {
+        if (path[0] == '/') {
+            path++;
+            path_sz--;
+        }
+        memcpy(url->buf + 1, path, path_sz);
+    }
+    url->path = url->buf;
+    url->query = url->buf + path_sz + 2;
+
+    /* query parameters are sorted when there are more than one */
+    if (query_sz > 0) {
+        url->query[0] = '?';
+        if (memchr(query, '&', query_sz) == NULL) {
+            memcpy(url->query + 1, query + 1, query_sz - 1);
+            url->query[query_sz] = 0;
+        } else if (query_normalize(query + 1, query_sz - 1, url->query + 1) != AM_SUCCESS) {
+            url_free(url);
+            url->error = AM_ENOMEM;
+            return AM_ERROR;
         }
-        last = *p;
-        p++;
+    } else {
+        url->query[0] = 0;
     }
-    free(d);
 
-    /* normalize path segments, RFC-2396, section-5.2 */
-    uri_normalize(url, uri);
-
-    strncpy(url->path, uri, sizeof (url->path) - 1);
+    /* normalize the path in place; the normalized value is never longer */
+    uri_normalize(url->buf, path_sz + 1, url->buf);
     return AM_SUCCESS;
 }
 
+/**
+ * Release the path and query storage of a url parsed with parse_url.
+ */
+void url_free(struct url *url) {
+    if (url != NULL) {
+        am_free(url->buf);
+        url->buf = NULL;
+        url->path = url->query = (char *) "";
+    }
+}
+
 /**
  * Encode characters in a URL, copying the encoded URL into dynamic memory.
  *
@@ -638,8 +671,6 @@ char *url_decode(const char *str) {
         return NULL;
     }
 
-#define BASE16_TO_BASE10(x) (isdigit(x) ? ((x) - '0') : (toupper((x)) - 'A' + 10))
-
     for (c = str; *c; c++) {
         if (*c != '%' || !isxdigit(c[1]) || !isxdigit(c[2])) {
             *ptr++ = *c == '+' ? ' ' : *c;
@@ -1029,13 +1060,81 @@ int am_method_str_to_num(const char *method_str) {
     return AM_REQUEST_UNKNOWN;
 }
 
+/*
+ * Delimited list (Cookie header, query string) element, as spans into the list value.
+ */
+struct list_token {
+    const char *start; /* element, delimiter excluded */
+    const char *end;
+    const char *name; /* text before the first '=' */
+    size_t name_sz;
+    const char *value; /* text after the first '=', NULL if there is no '=' */
+    size_t value_sz;
+};
+
+static void span_trim(const char **s, size_t *sz) {
+    const char *b = *s, *e = b + *sz;
+    while (b < e && isspace((unsigned char) *b)) b++;
+    while (e > b && isspace((unsigned char) e[-1])) e--;
+    *s = b;
+    *sz = e - b;
+}
+
+/**
+ * Split the next element off a delimited list, without copying or modifying the list value.
+ * Delimiters are searched with memchr, which the C library compares a word (or a vector register) at a time.
+ *
+ * @param p start of the element
+ * @param end end of the list value
+ * @param delimiter element delimiter
+ * @param trim AM_TRUE to trim white space around the name and the value
+ * @param t element spans
+ * @return start of the following element, or NULL if this is the last one
+ */
+static const char *next_list_token(const char *p, const char *end, char delimiter, am_bool_t trim, struct list_token *t) {
+    const char *sep = memchr(p, delimiter, end - p);
+    const char *eq;
+
+    t->start = p;
+    t->end = sep != NULL ? sep : end;
+    eq = memchr(p, '=', t->end - p);
+    t->name = p;
+    if (eq != NULL) {
+        t->name_sz = eq - p;
+        t->value = eq + 1;
+        t->value_sz = t->end - t->value;
+    } else {
+        t->name_sz = t->end - p;
+        t->value = NULL;
+        t->value_sz = 0;
+    }
+    if (trim) {
+        span_trim(&t->name, &t->name_sz);
+        if (t->value != NULL) {
+            span_trim(&t->value, &t->value_sz);
+        }
+    }
+    return sep != NULL ? sep + 1 : NULL;
+}
+
+/**
+ * Find a cookie value in a Cookie header. Cookie name and value are trimmed of white space,
+ * the value also of double-quotes; the first cookie with a non-empty value is returned.
+ *
+ * @param rq request
+ * @param separator cookie separator (";")
+ * @param cookie_name cookie name
+ * @param cookie_header_val Cookie header value
+ * @param value cookie value (allocated)
+ * @return AM_SUCCESS, AM_NOT_FOUND, AM_EINVAL or AM_ENOMEM
+ */
 am_status_t get_cookie_value(am_request_t *rq, const char *separator, const char *cookie_name,
         const char *cookie_header_val, char **value) {
-    size_t value_len = 0, ec = 0;
-    am_status_t found = AM_NOT_FOUND;
-    char *a, *b, *header_val = NULL, *c = NULL;
+    struct list_token t;
+    const char *p, *end;
+    size_t cookie_name_sz;
 
-    if (ISINVALID(cookie_name)) {
+    if (ISINVALID(cookie_name) || ISINVALID(separator)) {
         return AM_EINVAL;
     }
     if (ISINVALID(cookie_header_val)) {
@@ -1043,80 +1142,77 @@ am_status_t get_cookie_value(am_request_t *rq, const char *separator, const char
     }
 
     *value = NULL;
-    header_val = strdup(cookie_header_val);
-    if (header_val == NULL) {
-        return AM_ENOMEM;
-    }
+    cookie_name_sz = strlen(cookie_name);
+    end = cookie_header_val + strlen(cookie_header_val);
 
     AM_LOG_DEBUG(rq->instance_id, "get_cookie_value(%s): parsing cookie header: %s",
             separator, cookie_header_val);
 
-    for ((a = strtok_r(header_val, separator, &b)); a; (a = strtok_r(NULL, separator, &b))) {
-        if (strcmp(separator, "=") == 0 || strcmp(separator, "~") == 0) {
-            /* trim any leading/trailing whitespace */
-            trim(a, ' ');
-            if (found != AM_SUCCESS && strcmp(a, cookie_name) == 0) found = AM_SUCCESS;
-            else if (found == AM_SUCCESS && a[0] != '\0') {
-                value_len = strlen(a);
-                if ((*value = strdup(a)) == NULL) {
-                    found = AM_NOT_FOUND;
-                } else {
-                    (*value)[value_len] = '\0';
-                    /* trim any leading/trailing double-quotes */
-                    trim(*value, '"');
-                }
-            }
-        } else {
-            if (strstr(a, cookie_name) == NULL) continue;
-            for (ec = 0, c = a; *c != '\0'; ++c) {
-                if (*c == '=') ++ec;
-            }
-            if (ec > 1) {
-                c = strchr(a, '=');
-                *c = '~';
-                if ((found = get_cookie_value(rq, "~", cookie_name, a, value)) == AM_SUCCESS) break;
-            } else {
-                if ((found = get_cookie_value(rq, "=", cookie_name, a, value)) == AM_SUCCESS) break;
-            }
+    for (p = cookie_header_val; p != NULL;) {
+        p = next_list_token(p, end, separator[0], AM_TRUE, &t);
+        if (t.value == NULL || t.name_sz != cookie_name_sz || memcmp(t.name, cookie_name, cookie_name_sz) != 0) {
+            continue;
+        }
+        /* trim any leading/trailing double-quotes */
+        while (t.value_sz > 0 && t.value[0] == '"') {
+            t.value++;
+            t.value_sz--;
+        }
+        while (t.value_sz > 0 && t.value[t.value_sz - 1] == '"') {
+            t.value_sz--;
+        }
+        if (t.value_sz > 0) {
+            *value = strndup(t.value, t.value_sz);
+            return *value != NULL ? AM_SUCCESS : AM_ENOMEM;
         }
     }
-    free(header_val);
-    return found;
+    return AM_NOT_FOUND;
 }
 
+/**
+ * Look for a session token (cookie-less mode, or LARES encoded with CDSSO) in the request query parameters
+ * and remove them from the query; remaining parameters are moved down in place.
+ *
+ * @param rq request
+ * @return AM_SUCCESS if the token is found, AM_NOT_FOUND or AM_EINVAL
+ */
 am_status_t get_token_from_url(am_request_t *rq) {
-    char *token, *tmp = ISVALID(rq->url.query) ?
-            strdup(rq->url.query + 1) : NULL;
-    char *query = NULL;
-    int ql = 0;
-    char *o = tmp;
+    struct list_token t;
+    const char *p, *end;
+    char *out;
     size_t cn_sz;
+    int kept = 0;
 
-    if (tmp == NULL) return AM_ENOMEM;
     if (!ISVALID(rq->conf->cookie_name)) {
-        free(tmp);
         return AM_EINVAL;
     }
+    if (!ISVALID(rq->url.query)) {
+        return AM_NOT_FOUND;
+    }
     cn_sz = strlen(rq->conf->cookie_name);
+    end = rq->url.query + strlen(rq->url.query);
+    out = rq->url.query + 1; /* skip '?' */
 
-    while ((token = am_strsep(&tmp, "&")) != NULL) {
-        if (!ISVALID(rq->token) &&
-                strncmp(token, rq->conf->cookie_name, cn_sz) == 0) {
+    for (p = out; p != NULL;) {
+        p = next_list_token(p, end, '&', AM_FALSE, &t);
+        if (!ISVALID(rq->token) && t.name_sz == cn_sz &&
+                memcmp(t.name, rq->conf->cookie_name, cn_sz) == 0) {
             /* session token as a query parameter (cookie-less mode) */
-            char *v = strstr(token, "=");
-            if (v != NULL && *(v + 1) != '\n') {
-                rq->token = strdup(v + 1);
+            if (t.value_sz > 0 && t.value[0] != '\n') {
+                rq->token = strndup(t.value, t.value_sz);
             }
-        } else if (!ISVALID(rq->token) &&
-                rq->conf->cdsso_enable && strncmp(token, "LARES=", 6) == 0) {
+            continue;
+        }
+        if (!ISVALID(rq->token) && rq->conf->cdsso_enable && t.value != NULL &&
+                t.name_sz == 5 && memcmp(t.name, "LARES", 5) == 0) {
             /* session token (LARES/SAML encoded) as a query parameter */
-            size_t clear_sz = strlen(token) - 6;
-            char *clear = clear_sz > 0 ? base64_decode(token + 6, &clear_sz) : NULL;
+            size_t clear_sz = t.value_sz;
+            char *clear = clear_sz > 0 ? base64_decode(t.value, &clear_sz) : NULL;
             if (clear != NULL) {
-                struct am_namevalue *e, *t, *session_list;
+                struct am_namevalue *e, *tmp, *session_list;
                 session_list = am_parse_session_saml(rq->instance_id, clear, clear_sz);
 
-                AM_LIST_FOR_EACH(session_list, e, t) {
+                AM_LIST_FOR_EACH(session_list, e, tmp) {
                     if (strcmp(e->n, "sid") == 0 && ISVALID(e->v)) {
                         rq->token = strdup(e->v);
                         break;
@@ -1125,31 +1221,41 @@ am_status_t get_token_from_url(am_request_t *rq) {
                 delete_am_namevalue_list(&session_list);
                 free(clear);
             }
-        } else {
-            /* reconstruct query parameters w/o a session token(s) */
-            if (query == NULL) {
-                ql = am_asprintf(&query, "?%s&", token);
-            } else {
-                ql = am_asprintf(&query, "%s%s&", query, token);
-            }
+            continue;
+        }
+        /* keep the parameter; the output never overtakes the parameter being read */
+        if (kept++ > 0) {
+            *out++ = '&';
         }
+        memmove(out, t.start, t.end - t.start);
+        out += t.end - t.start;
     }
 
-    if (ql > 0 && query[ql - 1] == '&') {
-        query[ql - 1] = 0;
-        strncpy(rq->url.query, query, sizeof (rq->url.query) - 1);
-    } else if (ql == 0 && ISVALID(rq->token)) {
+    if (kept > 0) {
+        *out = 0;
+    } else if (ISVALID(rq->token)) {
         /* token is the only query parameter - clear it */
-        memset(rq->url.query, 0, sizeof (rq->url.query));
+        rq->url.query[0] = 0;
         /* TODO: should a question mark be left there even when token is the only parameter? */
     }
-    AM_FREE(query, o);
     return ISVALID(rq->token) ? AM_SUCCESS : AM_NOT_FOUND;
 }
 
+/**
+ * Make a Cookie header value without the named cookie (empty elements are dropped,
+ * leading white space is trimmed).
+ *
+ * @param rq request
+ * @param cookie_name cookie name
+ * @param cookie_hdr new header value (allocated), NULL if no other cookie is left
+ * @return AM_SUCCESS if the cookie is removed, AM_NOT_FOUND if there is no such cookie, AM_EINVAL or AM_ENOMEM
+ */
 int remove_cookie(am_request_t *rq, const char *cookie_name, char **cookie_hdr) {
-    char *tmp, *tok, *last = NULL;
-    size_t cookie_name_len;
+    struct list_token t;
+    const char *p, *end;
+    size_t cookie_name_len, sz = 0;
+    int status = AM_NOT_FOUND;
+    char *hdr;
 
     if (rq == NULL || rq->ctx == NULL || !ISVALID(cookie_name)) {
         return AM_EINVAL;
@@ -1159,44 +1265,39 @@ int remove_cookie(am_request_t *rq, const char *cookie_name, char **cookie_hdr)
         return AM_SUCCESS;
     }
 
-    if (strstr(rq->cookies, cookie_name) == NULL) {
-        return AM_NOT_FOUND;
+    end = rq->cookies + strlen(rq->cookies);
+    /* never longer than the original header */
+    hdr = malloc(end - rq->cookies + 1);
+    if (hdr == NULL) {
+        return AM_ENOMEM;
     }
-
-    tmp = strdup(rq->cookies);
-    if (tmp == NULL) return AM_ENOMEM;
-
     cookie_name_len = strlen(cookie_name);
 
-    tok = strtok_r(tmp, ";", &last);
-    while (tok != NULL) {
-        char match = AM_FALSE;
-        char *equal_sign = strchr(tok, '=');
-        /* trim space before the cookie name in the cookie header */
-        while (isspace(*tok)) tok++;
-        if (equal_sign != NULL && equal_sign != tok) {
-            /* trim white space after the cookie name in the cookie header */
-            while ((--equal_sign) >= tok && isspace(*equal_sign))
-                ;
-            equal_sign++;
-            /* now compare the cookie names */
-            if (equal_sign != tok && (equal_sign - tok) == cookie_name_len &&
-                    !strncmp(tok, cookie_name, cookie_name_len)) {
-                match = AM_TRUE;
-            }
+    for (p = rq->cookies; p != NULL;) {
+        p = next_list_token(p, end, ';', AM_TRUE, &t);
+        if (t.value != NULL && t.name_sz == cookie_name_len && memcmp(t.name, cookie_name, cookie_name_len) == 0) {
+            status = AM_SUCCESS;
+            continue;
+        }
+        if (t.name_sz == 0 && t.value == NULL) {
+            continue;
         }
         /* put cookie in a header only if it didn't match cookie name */
-        if (!match) {
-            am_asprintf(cookie_hdr, "%s%s%s",
-                    *cookie_hdr == NULL ? "" : *cookie_hdr,
-                    *cookie_hdr != NULL ? ";" : "",
-                    tok);
+        if (sz > 0) {
+            hdr[sz++] = ';';
         }
-        tok = strtok_r(NULL, ";", &last);
+        memcpy(hdr + sz, t.name, t.end - t.name);
+        sz += t.end - t.name;
     }
 
-    free(tmp);
-    return AM_SUCCESS;
+    if (sz == 0) {
+        free(hdr);
+        hdr = NULL;
+    } else {
+        hdr[sz] = 0;
+    }
+    *cookie_hdr = hdr;
+    return status;
 }
 
 char *load_file(const char *filepath, size_t *data_sz) {
@@ -1396,55 +1497,43 @@ char* base64_decode(const char* src, size_t* sz) {
         }
     }
 #else
-    unsigned char table[256];
-    unsigned char* out;
-    unsigned char* pos;
-    unsigned char* in;
-    size_t i, count;
+    const unsigned char *in, *end;
+    unsigned char *out, *pos;
+    size_t i;
 
     if (src == NULL || sz == NULL) {
         return NULL;
     }
 
-    memset(table, 64, 256);
-    for (i = 0; i < sizeof (base64_table); i++) {
-        table[base64_table[i]] = i;
-    }
-
-    for (in = (unsigned char *) src; table[*in++] <= 63; /* void */)
+    /* decoding stops at the first character outside of the alphabet (padding or terminator) */
+    for (end = (const unsigned char *) src; base64_index[*end] <= 63; end++)
         ;
+    i = end - (const unsigned char *) src;
 
-    i = (in - (unsigned char *) src) - 1;
-    count = (((i + 3) / 4) * 3) + 1;
-
-    pos = out = malloc(count);
+    pos = out = malloc((i / 4) * 3 + 3);
     if (out == NULL) {
         return NULL;
     }
 
-    in = (unsigned char *) src;
-
-    while (i > 4) {
-        *pos++ = (unsigned char) (table[in[0]] << 2 | table[in[1]] >> 4);
-        *pos++ = (unsigned char) (table[in[1]] << 4 | table[in[2]] >> 2);
-        *pos++ = (unsigned char) (table[in[2]] << 6 | table[in[3]]);
-        in += 4;
-        i -= 4;
+    for (in = (const unsigned char *) src; i >= 4; in += 4, i -= 4) {
+        uint32_t v = (uint32_t) base64_index[in[0]] << 18 | (uint32_t) base64_index[in[1]] << 12 |
+                (uint32_t) base64_index[in[2]] << 6 | base64_index[in[3]];
+        pos[0] = (unsigned char) (v >> 16);
+        pos[1] = (unsigned char) (v >> 8);
+        pos[2] = (unsigned char) v;
+        pos += 3;
     }
 
+    /* 2 or 3 characters left make 1 or 2 bytes, a single character is ignored */
     if (i > 1) {
-        *pos++ = (unsigned char) (table[in[0]] << 2 | table[in[1]] >> 4);
+        *pos++ = (unsigned char) (base64_index[in[0]] << 2 | base64_index[in[1]] >> 4);
     }
     if (i > 2) {
-        *pos++ = (unsigned char) (table[in[1]] << 4 | table[in[2]] >> 2);
-    }
-    if (i > 3) {
-        *pos++ = (unsigned char) (table[in[2]] << 6 | table[in[3]]);
+        *pos++ = (unsigned char) (base64_index[in[1]] << 4 | base64_index[in[2]] >> 2);
     }
 
     *pos = '\0';
-    count -= (4 - i) & 3;
-    *sz = count - 1;
+    *sz = pos - out;
 #endif
     return (char *) out;
 }
@@ -1454,7 +1543,7 @@ char* base64_decode(const char* src, size_t* sz) {
  * heap and is not only null terminated, but has its size returned in what "sz" points to.  It is very
  * important to set what "sz" points to before calling this function.  Setting it to less than the
  * length of the string will result in only that amount of text being encoded.  Setting it to zero
- * will result in a serious crash.
+ * results in an empty string.
  *
  * @param src The value to encode into base 64 text
  * @param sz The number of bytes to encode, then the number of bytes in the result
@@ -1475,11 +1564,13 @@ char *base64_encode(const void *in, size_t *sz) {
         return NULL;
     }
 
-    for (i = 0; i < *sz - 2; i += 3) {
-        *p++ = base64_table[(src[i] >> 2) & 0x3F];
-        *p++ = base64_table[((src[i] & 0x3) << 4) | ((int) (src[i + 1] & 0xF0) >> 4)];
-        *p++ = base64_table[((src[i + 1] & 0xF) << 2) | ((int) (src[i + 2] & 0xC0) >> 6)];
-        *p++ = base64_table[src[i + 2] & 0x3F];
+    for (i = 0; i + 2 < *sz; i += 3) {
+        uint32_t v = (uint32_t) src[i] << 16 | (uint32_t) src[i + 1] << 8 | src[i + 2];
+        p[0] = base64_table[v >> 18];
+        p[1] = base64_table[(v >> 12) & 0x3F];
+        p[2] = base64_table[(v >> 6) & 0x3F];
+        p[3] = base64_table[v & 0x3F];
+        p += 4;
     }
 
     if (i < *sz) {
@@ -1574,6 +1665,34 @@ am_status_t concat(char **str, size_t *str_sz, const char *s2, size_t s2sz) {
     return AM_SUCCESS;
 }
 
+/**
+ * Fill a buffer with random bytes from the system random source.
+ *
+ * @return AM_SUCCESS, or AM_ERROR if the random source can not be read (the buffer is then not filled)
+ */
+int am_random_bytes(void *buf, size_t buflen) {
+    int status = AM_ERROR;
+#ifdef _WIN32
+    HCRYPTPROV hcp;
+    if (CryptAcquireContextA(&hcp, NULL, NULL, PROV_RSA_FULL,
+            CRYPT_VERIFYCONTEXT | CRYPT_SILENT)) {
+        if (CryptGenRandom(hcp, (DWORD) buflen, buf)) {
+            status = AM_SUCCESS;
+        }
+        CryptReleaseContext(hcp, 0);
+    }
+#else
+    FILE *fp = fopen("/dev/urandom", "r");
+    if (fp != NULL) {
+        if (fread(buf, 1, buflen, fp) == buflen) {
+            status = AM_SUCCESS;
+        }
+        fclose(fp);
+    }
+#endif
+    return status;
+}
+
 /**
  * Generate something that looks like a UUID.  It contains random values and has no guarantee
  * of uniqueness other than it is random.
@@ -1595,21 +1714,7 @@ void uuid(char *buf, size_t buflen) {
         unsigned char __rnd[16];
     } uuid_data;
 
-#ifdef _WIN32
-    HCRYPTPROV hcp;
-    if (CryptAcquireContextA(&hcp, NULL, NULL, PROV_RSA_FULL,
-            CRYPT_VERIFYCONTEXT | CRYPT_SILENT)) {
-        CryptGenRandom(hcp, sizeof (uuid_data), uuid_data.__rnd);
-        CryptReleaseContext(hcp, 0);
-    }
-#else
-    size_t sz;
-    FILE *fp = fopen("/dev/urandom", "r");
-    if (fp != NULL) {
-        sz = fread(uuid_data.__rnd, 1, sizeof (uuid_data), fp);
-        fclose(fp);
-    }
-#endif
+    am_random_bytes(uuid_data.__rnd, sizeof (uuid_data));
 
     uuid_data.u.clk_seq_hi_res = (uuid_data.u.clk_seq_hi_res & ~0xC0) | 0x80;
     uuid_data.u.time_hi_and_version = htons((uuid_data.u.time_hi_and_version & ~0xF000) | 0x4000);
@@ -1621,22 +1726,145 @@ void uuid(char *buf, size_t buflen) {
             uuid_data.u.node[3], uuid_data.u.node[4], uuid_data.u.node[5]);
 }
 
+/*
+ * Decoded session information (SI, S1 and SK values) of recently seen tokens.
+ *
+ * The values are a function of the token alone and a token is presented on many requests, so the
+ * c66/base 64 decode and the record walk are done once per token and the result is kept in a small
+ * per-process table: SESSION_INFO_SETS sets of SESSION_INFO_WAYS entries, the least recently used entry
+ * of a set is replaced. An entry is a single block holding the token and the values.
+ */
+
+#define SESSION_INFO_SETS 64
+#define SESSION_INFO_WAYS 4
+
+struct session_info_entry {
+    uint64_t digest;
+    uint64_t used;
+    char *si;
+    char *s1;
+    char *sk;
+    char token[1];
+};
+
+static struct session_info_entry *session_info_cache[SESSION_INFO_SETS][SESSION_INFO_WAYS];
+static uint64_t session_info_clock = 0;
+static am_static_mutex_t session_info_lock = AM_STATIC_MUTEX_INITIALIZER;
+
+static void lock_session_info() {
+    AM_STATIC_MUTEX_LOCK(&session_info_lock);
+}
+
+static am_bool_t session_info_cache_get(am_request_t *r, uint64_t digest) {
+    struct session_info_entry **set = session_info_cache[digest % SESSION_INFO_SETS];
+    am_bool_t found = AM_FALSE;
+    int i;
+
+    lock_session_info();
+    for (i = 0; i < SESSION_INFO_WAYS; i++) {
+        struct session_info_entry *e = set[i];
+        if (e != NULL && e->digest == digest && strcmp(e->token, r->token) == 0) {
+            e->used = ++session_info_clock;
+            r->session_info.si = am_request_strdup(r, e->si);
+            r->session_info.s1 = am_request_strdup(r, e->s1);
+            r->session_info.sk = am_request_strdup(r, e->sk);
+            found = (e->si == NULL || r->session_info.si != NULL) && (e->s1 == NULL || r->session_info.s1 != NULL) &&
+                    (e->sk == NULL || r->session_info.sk != NULL);
+            break;
+        }
+    }
+    AM_STATIC_MUTEX_UNLOCK(&session_info_lock);
+    return found;
+}
+
+static void session_info_cache_put(am_request_t *r, uint64_t digest) {
+    struct session_info_entry **set = session_info_cache[digest % SESSION_INFO_SETS], *e, *old;
+    size_t token_sz = strlen(r->token) + 1;
+    size_t si_sz = r->session_info.si != NULL ? strlen(r->session_info.si) + 1 : 0;
+    size_t s1_sz = r->session_info.s1 != NULL ? strlen(r->session_info.s1) + 1 : 0;
+    size_t sk_sz = r->session_info.sk != NULL ? strlen(r->session_info.sk) + 1 : 0;
+    char *p;
+    int i, way = 0;
+
+    e = malloc(sizeof (struct session_info_entry) + token_sz + si_sz + s1_sz + sk_sz);
+    if (e == NULL) {
+        return;
+    }
+    e->digest = digest;
+    memcpy(e->token, r->token, token_sz);
+    p = e->token + token_sz;
+    e->si = si_sz > 0 ? memcpy(p, r->session_info.si, si_sz) : NULL;
+    p += si_sz;
+    e->s1 = s1_sz > 0 ? memcpy(p, r->session_info.s1, s1_sz) : NULL;
+    p += s1_sz;
+    e->sk = sk_sz > 0 ? memcpy(p, r->session_info.sk, sk_sz) : NULL;
+
+    lock_session_info();
+    for (i = 0; i < SESSION_INFO_WAYS; i++) {
+        if (set[i] == NULL) {
+            way = i;
+            break;
+        }
+        if (set[i]->used < set[way]->used) {
+            way = i;
+        }
+    }
+    e->used = ++session_info_clock;
+    old = set[way];
+    set[way] = e;
+    AM_STATIC_MUTEX_UNLOCK(&session_info_lock);
+    free(old);
+}
+
+/**
+ * Drop all decoded session information.
+ */
+void am_session_decode_shutdown() {
+    struct session_info_entry *e;
+    int i, j;
+
+    lock_session_info();
+    for (i = 0; i < SESSION_INFO_SETS; i++) {
+        for (j = 0; j < SESSION_INFO_WAYS; j++) {
+            e = session_info_cache[i][j];
+            session_info_cache[i][j] = NULL;
+            free(e);
+        }
+    }
+    AM_STATIC_MUTEX_UNLOCK(&session_info_lock);
+}
+
+/**
+ * Fill in r->session_info with the SI, S1 and SK values carried in the session token. The values are
+ * allocated from the request arena.
+ *
+ * @return AM_SUCCESS, or AM_EINVAL if there is no token (session_info.error is AM_ENOMEM when the
+ * values could not be allocated)
+ */
 int am_session_decode(am_request_t *r) {
     size_t tl, i;
     int nv = 0;
-    char *begin, *end;
+    char *token, *begin, *end;
+    uint64_t digest;
 
     enum {
         AM_NA, AM_SI, AM_SK, AM_S1
     } ty = AM_NA;
 
-    char *token = (r != NULL && ISVALID(r->token)) ?
-            strdup(r->token) : NULL;
-
-    if (token == NULL) return AM_EINVAL;
+    if (r == NULL || ISINVALID(r->token)) return AM_EINVAL;
 
     memset(&r->session_info, 0, sizeof (struct am_session_info));
-    tl = strlen(token);
+    tl = strlen(r->token);
+    digest = am_digest64(r->token, tl);
+    if (session_info_cache_get(r, digest)) {
+        return AM_SUCCESS;
+    }
+
+    token = am_request_strdup(r, r->token);
+    if (token == NULL) {
+        r->session_info.error = AM_ENOMEM;
+        return AM_SUCCESS;
+    }
 
     if (strchr(token, '*') != NULL) {
         /* c66 decode */
@@ -1659,9 +1887,9 @@ int am_session_decode(am_request_t *r) {
         }
     }
 
-    begin = strstr(token, "@");
+    begin = strchr(token, '@');
     if (begin != NULL) {
-        end = strstr(begin + 1, "#");
+        end = strchr(begin + 1, '#');
         if (end != NULL) {
             size_t ssz = end - begin - 1;
             unsigned char *c = ssz > 0 ?
@@ -1670,55 +1898,34 @@ int am_session_decode(am_request_t *r) {
                 unsigned char *raw = c;
                 size_t l = ssz;
 
-                while (l > 0) {
-                    uint16_t sz;
-                    uint8_t len[2]; /* network byte order */
+                /* name and value records, each prefixed with its size (network byte order) */
+                while (l >= 2) {
+                    uint16_t sz = (uint16_t) (raw[0] << 8 | raw[1]);
+                    char **value = NULL;
 
-                    memcpy(len, raw, sizeof (len));
-                    if (is_big_endian()) {
-                        sz = (*((uint16_t *) len));
-                    } else {
-                        sz = len[1] | len[0] << 8;
+                    l -= 2;
+                    raw += 2;
+                    if (sz > l) {
+                        break;
                     }
 
-                    l -= sizeof (len);
-                    raw += sizeof (len);
-
                     if (nv % 2 == 0) {
-                        if (memcmp(raw, "SI", 2) == 0) {
+                        if (sz >= 2 && memcmp(raw, "SI", 2) == 0) {
                             ty = AM_SI;
-                        } else if (memcmp(raw, "SK", 2) == 0) {
+                        } else if (sz >= 2 && memcmp(raw, "SK", 2) == 0) {
                             ty = AM_SK;
-                        } else if (memcmp(raw, "S1", 2) == 0) {
+                        } else if (sz >= 2 && memcmp(raw, "S1", 2) == 0) {
                             ty = AM_S1;
                         } else {
                             break;
                         }
                     } else {
-                        if (ty == AM_SI) {
-                            r->session_info.si = malloc(sz + 1);
-                            if (r->session_info.si == NULL) {
-                                r->session_info.error = AM_ENOMEM;
-                                break;
-                            }
-                            memcpy(r->session_info.si, raw, sz);
-                            r->session_info.si[sz] = 0;
-                        } else if (ty == AM_SK) {
-                            r->session_info.sk = malloc(sz + 1);
-                            if (r->session_info.sk == NULL) {
-                                r->session_info.error = AM_ENOMEM;
-                                break;
-                            }
-                            memcpy(r->session_info.sk, raw, sz);
-                            r->session_info.sk[sz] = 0;
-                        } else if (ty == AM_S1) {
-                            r->session_info.s1 = malloc(sz + 1);
-                            if (r->session_info.s1 == NULL) {
-                                r->session_info.error = AM_ENOMEM;
-                                break;
-                            }
-                            memcpy(r->session_info.s1, raw, sz);
-                            r->session_info.s1[sz] = 0;
+                        value = ty == AM_SI ? &r->session_info.si :
+                                ty == AM_SK ? &r->session_info.sk : &r->session_info.s1;
+                        *value = am_request_strndup(r, (const char *) raw, sz);
+                        if (*value == NULL) {
+                            r->session_info.error = AM_ENOMEM;
+                            break;
                         }
                     }
                     l -= sz;
@@ -1730,7 +1937,9 @@ int am_session_decode(am_request_t *r) {
         }
     }
 
-    free(token);
+    if (r->session_info.error == AM_SUCCESS) {
+        session_info_cache_put(r, digest);
+    }
     return AM_SUCCESS;
 }
 
@@ -2017,14 +2226,186 @@ void decrypt_agent_passwords(am_config_t *r) {
     }
 }
 
+/*
+ * Attribute name index.
+ *
+ * Session and policy attribute lists are looked up by name once for each configured header/cookie mapping,
+ * so a request with large attribute lists and many mappings used to compare every name for every mapping.
+ * The index is an open-addressing hash table of attribute names, built in one pass over the list: each name
+ * refers to its values (in list order) and their total size, so that multi-valued attributes can be joined
+ * into a buffer of the exact size. The index is allocated from the request arena and lives as long as the
+ * request (or until the list it was built from is replaced); am_attr_index_new builds one on the heap for
+ * lists that outlive a request (attribute projection working sets, see attr_project.c).
+ */
+
+struct attr_index_slot {
+    const char *name; /* NULL if the slot is free */
+    uint32_t hash;
+    uint32_t first; /* position of the first value in the value table */
+    uint32_t count;
+    size_t values_sz;
+};
+
+struct am_attr_index {
+    const struct am_namevalue *list;
+    uint32_t mask;
+    struct attr_index_slot *slot;
+    const char **value; /* values grouped by name */
+};
+
+static struct attr_index_slot *attr_index_slot(struct am_attr_index *index, const char *name, uint32_t hash) {
+    uint32_t i = hash & index->mask;
+    while (index->slot[i].name != NULL &&
+            (index->slot[i].hash != hash || strcmp(index->slot[i].name, name) != 0)) {
+        i = (i + 1) & index->mask;
+    }
+    return &index->slot[i];
+}
+
+static void *attr_index_request_alloc(void *r, size_t size) {
+    return am_request_alloc((am_request_t *) r, size);
+}
+
+static void *attr_index_heap_alloc(void *unused, size_t size) {
+    return malloc(size);
+}
+
+static struct am_attr_index *attr_index_build(const struct am_namevalue *list,
+        void *(*alloc)(void *, size_t), void *alloc_arg) {
+    const struct am_namevalue *e;
+    struct am_attr_index *index;
+    struct attr_index_slot **element_slot;
+    uint32_t count = 0, slots = 8, position = 0, i;
+
+    for (e = list; e != NULL; e = e->next) {
+        if (e->n != NULL) {
+            count++;
+        }
+    }
+    if (count == 0) {
+        return NULL;
+    }
+    while (slots < count * 2) {
+        slots <<= 1;
+    }
+
+    /* index, slots, value table and the slot of each list element (build only) in one block */
+    index = alloc(alloc_arg, sizeof (struct am_attr_index) + slots * sizeof (struct attr_index_slot) +
+            count * sizeof (char *) + count * sizeof (struct attr_index_slot *));
+    if (index == NULL) {
+        return NULL;
+    }
+    index->list = list;
+    index->mask = slots - 1;
+    index->slot = (struct attr_index_slot *) (index + 1);
+    index->value = (const char **) (index->slot + slots);
+    element_slot = (struct attr_index_slot **) (index->value + count);
+    memset(index->slot, 0, slots * sizeof (struct attr_index_slot));
+
+    /* count values and their size by name */
+    count = 0;
+    for (e = list; e != NULL; e = e->next) {
+        struct attr_index_slot *slot;
+        uint32_t hash;
+        if (e->n == NULL) {
+            continue;
+        }
+        hash = am_hash(e->n);
+        slot = attr_index_slot(index, e->n, hash);
+        if (slot->name == NULL) {
+            slot->name = e->n;
+            slot->hash = hash;
+        }
+        slot->count++;
+        slot->values_sz += e->v != NULL ? strlen(e->v) : 0;
+        element_slot[count++] = slot;
+    }
+
+    /* lay out the value table and fill it in list order */
+    for (i = 0; i < slots; i++) {
+        index->slot[i].first = position;
+        position += index->slot[i].count;
+        index->slot[i].count = 0;
+    }
+    count = 0;
+    for (e = list; e != NULL; e = e->next) {
+        struct attr_index_slot *slot;
+        if (e->n == NULL) {
+            continue;
+        }
+        slot = element_slot[count++];
+        index->value[slot->first + slot->count++] = e->v != NULL ? e->v : "";
+    }
+    return index;
+}
+
+/**
+ * Build a name index over an attribute list, in the request arena.
+ *
+ * @return index, or NULL if the list is empty or on allocation failure
+ */
+struct am_attr_index *am_attr_index_create(am_request_t *r, const struct am_namevalue *list) {
+    return attr_index_build(list, attr_index_request_alloc, r);
+}
+
+/**
+ * Build a name index over an attribute list, on the heap (for indexes that outlive a request).
+ * The list must outlive the index; release the index with am_attr_index_delete.
+ *
+ * @return index, or NULL if the list is empty or on allocation failure
+ */
+struct am_attr_index *am_attr_index_new(const struct am_namevalue *list) {
+    return attr_index_build(list, attr_index_heap_alloc, NULL);
+}
+
+void am_attr_index_delete(struct am_attr_index **index) {
+    if (index != NULL && *index != NULL) {
+        free(*index);
+        *index = NULL;
+    }
+}
+
+/**
+ * Whether the index was built from this list.
+ */
+am_bool_t am_attr_index_of(const struct am_attr_index *index, const struct am_namevalue *list) {
+    return index != NULL && index->list == list ? AM_TRUE : AM_FALSE;
+}
+
+/**
+ * Look up the values of an attribute.
+ *
+ * @param index attribute index
+ * @param name attribute name
+ * @param values_sz set to the total size of the values (optional)
+ * @param values set to the values, in list order
+ * @return number of values
+ */
+int am_attr_index_find(const struct am_attr_index *index, const char *name, size_t *values_sz, const char ***values) {
+    struct attr_index_slot *slot;
+
+    if (index == NULL || name == NULL) {
+        return 0;
+    }
+    slot = attr_index_slot((struct am_attr_index *) index, name, am_hash(name));
+    if (slot->name == NULL) {
+        return 0;
+    }
+    if (values_sz != NULL) {
+        *values_sz = slot->values_sz;
+    }
+    *values = index->value + slot->first;
+    return (int) slot->count;
+}
+
 void am_request_free(am_request_t *r) {
     if (r != NULL) {
-        AM_FREE(r->normalized_url, r->overridden_url, r->normalized_url_pathinfo,
-                r->overridden_url_pathinfo, r->token, r->goto_url,
-                r->client_ip, r->client_host, r->post_data, r->post_data_fn,
-                r->session_info.s1, r->session_info.si, r->session_info.sk);
+        AM_FREE(r->token, r->post_data, r->post_data_fn);
         delete_am_policy_result_list(&r->pattr);
+        am_policy_index_delete(&r->pattr_index);
         delete_am_namevalue_list(&r->sattr);
+        url_free(&r->url);
+        am_request_arena_free(r);
     }
 }
 
@@ -3034,18 +3415,104 @@ uint32_t am_hash(const void *k) {
 }
 
 uint32_t am_hash_buffer(const void *k, size_t sz) {
-    void *tmp;
-    uint32_t hash;
+    const unsigned char *str = (const unsigned char *) k;
+    uint64_t hash = 0;
+    uint32_t i;
+    size_t n;
     if (k == NULL || sz == 0) {
         return 0;
     }
-    tmp = calloc(1, sz + 1);
-    if (tmp == NULL) {
-        return 0;
+    /* same value as am_hash on a NUL terminated copy of the buffer */
+    for (n = 0; n < sz && str[n] != '\0'; n++) {
+        hash = str[n] + (hash << 6) + (hash << 16) - hash;
+    }
+    i = (uint32_t) hash;
+    i += ~(i << 9);
+    i ^= ((i >> 14) | (i << 18));
+    i += (i << 4);
+    i ^= ((i >> 10) | (i << 22));
+    return i;
+}
+
+#define SIP_ROTL(x, b) (uint64_t) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIP_ROUND(v0, v1, v2, v3) \
+    do { \
+        v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+        v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+    } while (0)
+
+static uint64_t sip_load64(const unsigned char *p) {
+    return (uint64_t) p[0] | ((uint64_t) p[1] << 8) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24) |
+            ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40) | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+/**
+ * Keyed 128 bit digest of a buffer (SipHash-2-4, 128 bit output).
+ *
+ * Unlike am_hash and am_digest64, values can not be predicted (or collisions crafted) without the key, so
+ * the digest can stand in for a client supplied value, such as a session token, as a cache key.
+ * The buffer is read eight bytes at a time.
+ */
+void am_digest128(const void *k, size_t sz, const uint64_t key[2], uint64_t digest[2]) {
+    const unsigned char *p = (const unsigned char *) k;
+    const unsigned char *end = p + (sz - sz % 8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+    uint64_t v1 = (0x646f72616e646f6dULL ^ key[1]) ^ 0xee;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+    uint64_t m, b = ((uint64_t) sz) << 56;
+
+    for (; p != end; p += 8) {
+        m = sip_load64(p);
+        v3 ^= m;
+        SIP_ROUND(v0, v1, v2, v3);
+        SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    switch (sz & 7) {
+        case 7: b |= ((uint64_t) p[6]) << 48;
+        case 6: b |= ((uint64_t) p[5]) << 40;
+        case 5: b |= ((uint64_t) p[4]) << 32;
+        case 4: b |= ((uint64_t) p[3]) << 24;
+        case 3: b |= ((uint64_t) p[2]) << 16;
+        case 2: b |= ((uint64_t) p[1]) << 8;
+        case 1: b |= ((uint64_t) p[0]);
+        default: break;
+    }
+
+    v3 ^= b;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= b;
+
+    v2 ^= 0xee;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    digest[0] = v0 ^ v1 ^ v2 ^ v3;
+
+    v1 ^= 0xdd;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    digest[1] = v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* 64 bit FNV-1a digest of a buffer */
+uint64_t am_digest64(const void *k, size_t sz) {
+    const unsigned char *p = (const unsigned char *) k;
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < sz; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
     }
-    memcpy(tmp, k, sz);
-    hash = am_hash(tmp);
-    free(tmp);
     return hash;
 }
 
@@ -21,7 +21,13 @@
 #include "net_client.h"
 
 #define AM_POLICY_CHANGE_KEY    "AM_POLICY_CHANGE_KEY"
+#define AM_DECISION_MEMO_PREFIX "AM_DECISION_MEMO:"
+#define AM_DECISION_MEMO_SIZE   16 /* decisions remembered per session */
+#define AM_INVALID_TOKEN_PREFIX "AM_INVALID_TOKEN:"
+#define AM_POLICY_BLOB_PREFIX   "AM_POLICY_BLOB:"
+#define AM_INVALID_TOKEN_CACHE_DEFAULT 30 /* seconds an invalid session token is rejected locally */
 #define AM_CACHE_TIMEFORMAT     "%Y-%m-%d %H:%M:%S"
+#define AM_COOKIE_TIME_FORMAT   "%a, %d-%b-%Y %H:%M:%S GMT"
 #define ARRAY_SIZE(array)       sizeof(array) / sizeof(array[0])
 #define AM_BASE_TEN             10
 #define AM_SPACE_CHAR           " "
@@ -107,6 +113,8 @@ typedef struct {
     void *pool;
     void *base_ptr;  
     char init;
+    volatile int32_t fast_users; /* threads in this process using the pool without the mutex */
+    volatile int32_t remapping; /* set while this process remaps the pool */
     char name[4][AM_PATH_SIZE];
 } am_shm_t;
 
@@ -140,6 +148,23 @@ struct am_policy_result {
     struct am_policy_result *next;
 };
 
+struct am_policy_reference {
+    uint64_t digest; /*digest of the serialised policy (am_policy_blob_serialise)*/
+    uint32_t size; /*size of the serialised policy*/
+    const void *data; /*serialised policy when it is kept in the session entry, NULL when it is shared*/
+};
+
+struct am_policy_decision {
+    uint64_t url_digest; /*digest of the url evaluated (after path info handling)*/
+    int32_t method;
+    int32_t scope;
+    int32_t context; /*agent settings the decision depends on*/
+    int32_t entry; /*position of the matching entry in the policy result list*/
+    int32_t action; /*position of the deciding action decision in the entry, or -1 when allowed without one*/
+    int32_t status; /*AM_SUCCESS or AM_ACCESS_DENIED*/
+    uint64_t epoch; /*policy cache epoch the decision was made under*/
+};
+
 struct notification_worker_data {
     unsigned long instance_id;
     char *post_data;
@@ -155,7 +180,11 @@ struct logout_worker_data {
 
 struct audit_worker_data {
     unsigned long instance_id;
+    int compress;
     char *logdata;
+    char *entries; /* the batch entries (as stored), each one nul terminated, to keep if the batch can't be sent */
+    size_t entries_sz;
+    char *server_id;
     char *openam;
     am_net_options_t *options;
 };
@@ -188,12 +217,39 @@ void am_timer_report(unsigned long instance_id, am_timer_t *t, const char *op);
 
 const char *get_valid_openam_url(am_request_t *r);
 
+void *am_request_alloc(am_request_t *r, size_t size);
+char *am_request_strdup(am_request_t *r, const char *s);
+char *am_request_strndup(am_request_t *r, const char *s, size_t n);
+char *am_request_asprintf(am_request_t *r, const char *fmt, ...);
+void am_request_arena_free(am_request_t *r);
+
 am_status_t ip_address_match(const char *ip, const char **list, unsigned int listsize, unsigned long instance_id);
 
+struct am_ip_addr {
+    int family; /* 4 or 6; 0 when the text is not a single ip address */
+    uint64_t hi;
+    uint64_t lo; /* ip v4 address is held in the low 32 bits */
+};
+
+am_bool_t am_ip_addr_parse(const char *ip, struct am_ip_addr *addr);
+struct am_ip_set *am_ip_set_create(const char **list, unsigned int listsize);
+am_bool_t am_ip_set_match(const struct am_ip_set *set, const struct am_ip_addr *addr);
+void am_ip_set_delete(struct am_ip_set **set);
+
+struct am_not_enforced_rules *am_not_enforced_rules_get(am_config_t *conf);
+void am_not_enforced_rules_release(struct am_not_enforced_rules **rules);
+void am_not_enforced_rules_shutdown();
+am_bool_t am_not_enforced_ip_match(struct am_not_enforced_rules *rules, am_request_t *r,
+        const struct am_ip_addr *client);
+const char *am_not_enforced_url_match(struct am_not_enforced_rules *rules, am_request_t *r, const char *url);
+const char *am_not_enforced_ext_match(struct am_not_enforced_rules *rules, am_request_t *r, const char *url,
+        const struct am_ip_addr *client);
+
 am_status_t get_token_from_url(am_request_t *rq);
 am_status_t get_cookie_value(am_request_t *rq, const char *separator, const char *cookie_name,
         const char *cookie_header_val, char **value);
 int parse_url(const char *u, struct url *url);
+void url_free(struct url *url);
 char *url_encode(const char *str);
 char *url_decode(const char *str);
 
@@ -219,6 +275,9 @@ void am_shm_set_user_offset(am_shm_t *r, unsigned int s);
 void *am_shm_get_user_pointer(am_shm_t *am);
 void am_shm_info(am_shm_t *);
 void am_shm_destroy(am_shm_t* am);
+#ifndef _WIN32
+void *am_shm_map(int fd, uint64_t size);
+#endif
 
 int am_create_agent_dir(const char *sep, const char *path, char **created_name,
         char **created_name_simple, uid_t* uid, gid_t* gid, void (*log)(const char *, ...));
@@ -265,8 +324,41 @@ ssize_t write_file(const char *filepath, const void *data, size_t data_sz);
 int get_line(char **line, size_t *size, FILE *file);
 
 int am_session_decode(am_request_t *r);
+void am_session_decode_shutdown();
 
 char policy_compare_url(am_request_t *r, const char *pattern, const char *resource);
+size_t am_url_pattern_prefix_length(const char *pattern);
+struct am_policy_index *am_policy_index_create(struct am_policy_result *list);
+void am_policy_index_lookup(struct am_policy_index *index, const char *url);
+am_bool_t am_policy_index_candidate(struct am_policy_index *index, int position);
+void am_policy_index_delete(struct am_policy_index **index);
+struct am_attr_index *am_attr_index_create(am_request_t *r, const struct am_namevalue *list);
+struct am_attr_index *am_attr_index_new(const struct am_namevalue *list);
+void am_attr_index_delete(struct am_attr_index **index);
+am_bool_t am_attr_index_of(const struct am_attr_index *index, const struct am_namevalue *list);
+int am_attr_index_find(const struct am_attr_index *index, const char *name, size_t *values_sz, const char ***values);
+
+struct am_attr_render_key {
+    uint64_t entry_digest; /* session/policy cache entry the attributes are read from (pattr_digest) */
+    uint64_t ts; /* agent configuration snapshot */
+    uint64_t generation;
+    unsigned long instance_id;
+    int32_t entry; /* policy entry the response attributes are read from, -1 if none */
+    int32_t context; /* not enforced url and attribute fetch flags */
+};
+
+struct am_attr_render *am_attr_render_create(const struct am_attr_render_key *key, const char *token);
+am_status_t am_attr_render_add(struct am_attr_render **set, char response, const char *name, const char *value);
+struct am_attr_render *am_attr_render_get(am_request_t *r, const struct am_attr_render_key *key, const char *token);
+void am_attr_render_put(struct am_attr_render **set);
+void am_attr_render_replay(am_request_t *r, struct am_attr_render *set);
+void am_attr_render_delete(struct am_attr_render **set);
+void am_attr_render_shutdown();
+
+void am_attr_project(am_config_t *conf, struct am_policy_result *policy, struct am_namevalue **session);
+uint64_t am_attr_project_digest(am_config_t *conf);
+void am_attr_project_shutdown();
+
 const char *am_policy_strerror(char status);
 
 char* am_strsep(char** sp, const char* sep);
@@ -297,6 +389,8 @@ int am_audit_shutdown();
 int am_audit_processor_init();
 void am_audit_processor_shutdown();
 int am_audit_register_instance(am_config_t *conf);
+void am_audit_compress_disable(unsigned long instance_id);
+am_status_t am_audit_spill_batch(unsigned long instance_id, const char *server_id, const char *entries, size_t entries_sz);
 int am_add_remote_audit_entry(unsigned long instance_id, const char *agent_token,
         const char *agent_token_server_id, const char *file_name,
         const char *user_token, const char *format, ...);
@@ -331,11 +425,18 @@ int am_add_session_policy_cache_entry(am_request_t *request, const char *key,
         struct am_policy_result *policy, struct am_namevalue *session);
 int am_get_session_policy_cache_entry(am_request_t *request, const char *key,
         struct am_policy_result **policy, struct am_namevalue **session, uint64_t *ts);
+int am_get_policy_decision_memo(am_request_t *request, const char *key, struct am_policy_decision *decision);
+int am_add_policy_decision_memo(am_request_t *request, const char *key, const struct am_policy_decision *decision);
+int am_get_policy_cache_epoch(uint64_t *epoch);
+int am_get_invalid_token_entry(am_request_t *request, const char *key);
+int am_add_invalid_token_entry(am_request_t *request, const char *key);
+int am_remove_invalid_token_entry(unsigned long instance_id, const char *key);
 
 int am_get_cache_entry(unsigned long instance_id, int valid, const char *key);
 int am_add_cache_entry(unsigned long instance_id, const char *key);
 
 int am_remove_cache_entry(unsigned long instance_id, const char *key);
+void am_cache_digest(const void *buf, size_t len, uint64_t digest[2]);
 
 void* mem2cpy(void* dest, const void* source1, size_t size1, const void* source2, size_t size2);
 void* mem3cpy(void* dest, const void* source1, size_t size1, const void* source2, size_t size2, const void* source3, size_t size3);
@@ -359,17 +460,26 @@ char ** property_map_get_value_addr(property_map_t * map, const char * key);
 char * property_map_write_to_buffer(property_map_t * map, size_t * data_sz);
 
 uint32_t am_hash_buffer(const void *buf, size_t len);
+uint64_t am_digest64(const void *buf, size_t len);
+void am_digest128(const void *buf, size_t len, const uint64_t key[2], uint64_t digest[2]);
+int am_random_bytes(void *buf, size_t buflen);
 uint32_t am_hash(const void *buf);
 
 void cache_object_ctx_init(struct cache_object_ctx *ctx);
 void cache_object_ctx_init_data(struct cache_object_ctx *ctx, void *data, size_t sz);
 void cache_object_ctx_destroy(struct cache_object_ctx *ctx);
-int cache_object_write_key(struct cache_object_ctx *ctx, char *key);
+int cache_object_write_key(struct cache_object_ctx *ctx, const uint64_t digest[2]);
 int cache_object_skip_key(struct cache_object_ctx *ctx);
 int am_policy_result_serialise(struct cache_object_ctx *ctx, struct am_policy_result *list);
 int am_name_value_serialise(struct cache_object_ctx *ctx, struct am_namevalue *list);
 struct am_policy_result *am_policy_result_deserialise(struct cache_object_ctx *ctx);
 struct am_namevalue *am_name_value_deserialise(struct cache_object_ctx *ctx);
+int am_policy_blob_serialise(struct cache_object_ctx *ctx, const struct am_policy_result *p);
+int am_policy_blob_deserialise(struct cache_object_ctx *ctx, struct am_policy_result *p);
+int am_policy_reference_serialise(struct cache_object_ctx *ctx, struct am_policy_result *list,
+        const struct am_policy_reference *refs);
+struct am_policy_result *am_policy_reference_deserialise(struct cache_object_ctx *ctx,
+        struct am_policy_reference **refs, uint32_t *ref_count);
 
 int am_pdp_entry_serialise(struct cache_object_ctx *ctx, const char *url,
         const char *file, const char *content_type, int method);
@@ -378,6 +488,12 @@ int am_pdp_entry_deserialise(struct cache_object_ctx *ctx, char **url,
 
 int am_policy_epoch_deserialise(struct cache_object_ctx *ctx, uint64_t *p_time);
 int am_policy_epoch_serialise(struct cache_object_ctx *ctx, uint64_t time);
+int am_attr_project_digest_deserialise(struct cache_object_ctx *ctx, uint64_t *digest);
+int am_attr_project_digest_serialise(struct cache_object_ctx *ctx, uint64_t digest);
+int am_policy_decision_memo_serialise(struct cache_object_ctx *ctx, uint64_t session_digest,
+        const struct am_policy_decision *decisions, uint32_t count);
+int am_policy_decision_memo_deserialise(struct cache_object_ctx *ctx, uint64_t *session_digest,
+        struct am_policy_decision *decisions, uint32_t *count, uint32_t max);
 
 int am_cache_worker_init();
 void am_cache_worker_shutdown();
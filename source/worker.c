@@ -70,8 +70,12 @@ void notification_worker(void *arg) {
         }
     }
 
-    if (ISVALID(token) && destroyed) {
-        am_remove_cache_entry(r->instance_id, token);
+    if (ISVALID(token)) {
+        /* a session notification supersedes what OpenAM reported earlier */
+        am_remove_invalid_token_entry(r->instance_id, token);
+        if (destroyed) {
+            am_remove_cache_entry(r->instance_id, token);
+        }
     }
 
     if (ISVALID(agentid)) {
@@ -96,8 +100,20 @@ void session_logout_worker(void *arg) {
 }
 
 void remote_audit_worker(void *arg) {
+    static const char *thisfunc = "remote_audit_worker():";
     struct audit_worker_data *r = (struct audit_worker_data *) arg;
-    am_agent_audit_request(r->instance_id, r->openam, r->logdata, r->options);
+    int status = am_agent_audit_request(r->instance_id, r->openam, r->logdata, r->compress, r->options);
+    if (status == AM_EOPNOTSUPP && r->compress) {
+        /* server does not accept compressed batches - send this one (and the rest) as is */
+        am_audit_compress_disable(r->instance_id);
+        status = am_agent_audit_request(r->instance_id, r->openam, r->logdata, AM_FALSE, r->options);
+    }
+    if (status != AM_SUCCESS) {
+        /* keep the batch in the overflow journal, it is sent again with the next batches */
+        AM_LOG_WARNING(r->instance_id, "%s failed to send audit log messages to %s (%s)",
+                thisfunc, LOGEMPTY(r->openam), am_strerror(status));
+        am_audit_spill_batch(r->instance_id, r->server_id, r->entries, r->entries_sz);
+    }
     am_net_options_delete(r->options);
-    AM_FREE(r->openam, r->logdata, r->options, r);
+    AM_FREE(r->openam, r->logdata, r->entries, r->server_id, r->options, r);
 }
@@ -70,6 +70,34 @@ static am_status_t write_entries_to_server(const char *openam, int count, struct
     return AM_SUCCESS;
 }
 
+static int fail_batches = 0;
+
+static am_status_t write_entries_or_fail(const char *openam, int count, struct am_audit_transfer *batch) {
+    if (fail_batches > 0) {
+        fail_batches--;
+        return AM_EAGAIN; /* as when the worker pool can't take the batch */
+    }
+    proc += count;
+    return AM_SUCCESS;
+}
+
+static char *sent_entries = NULL;
+static size_t sent_entries_sz = 0;
+
+static am_status_t write_entries_and_keep(const char *openam, int count, struct am_audit_transfer *batch) {
+    int i;
+
+    /* keep the batch entries as the worker gets them (see write_entries_to_server) */
+    for (i = 0; i < count; i++) {
+        size_t size = strlen(batch[i].message) + 1;
+        sent_entries = realloc(sent_entries, sent_entries_sz + size);
+        assert_non_null(sent_entries);
+        memcpy(sent_entries + sent_entries_sz, batch[i].message, size);
+        sent_entries_sz += size;
+    }
+    return AM_SUCCESS;
+}
+
 void test_audit_shm(void **state) {
     int i;
     am_config_t conf;
@@ -80,6 +108,8 @@ void test_audit_shm(void **state) {
     conf.naming_url_sz = 1;
     conf.naming_url = am;
 
+    proc = 0;
+
     assert_int_equal(am_audit_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
     assert_int_equal(am_audit_register_instance(&conf), AM_SUCCESS);
 
@@ -97,3 +127,137 @@ void test_audit_shm(void **state) {
 
     am_audit_shutdown();
 }
+
+void test_audit_spill(void **state) {
+    int i;
+    am_config_t conf;
+    char *am[] = {"http://localhost/am"};
+    const char *spill_file = "."FILE_PATH_SEP"remote_audit_1.jnl";
+    memset(&conf, 0, sizeof (am_config_t));
+    conf.instance_id = INSTANCE_ID;
+    conf.config = "agent.conf";
+    conf.audit_file = "."FILE_PATH_SEP"audit.log";
+    conf.naming_url_sz = 1;
+    conf.naming_url = am;
+
+    proc = 0;
+    am_delete_file(spill_file);
+
+    /* limit audit shared memory size so that most of the entries go to the overflow journal */
+#ifdef _WIN32
+    _putenv_s(AM_SHARED_MAX_SIZE_VAR, "0x40000");
+#else
+    setenv(AM_SHARED_MAX_SIZE_VAR, "0x40000", 1);
+#endif
+
+    assert_int_equal(am_audit_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+    assert_int_equal(am_audit_register_instance(&conf), AM_SUCCESS);
+
+    for (i = 0; i < NUM_ENTRIES; i++) {
+        assert_int_equal(am_add_remote_audit_entry(INSTANCE_ID, "AGENT_TOKEN", "01", "remote-file.log",
+                "USER_TOKEN", MESSAGE_TEMPLATE, i), AM_SUCCESS);
+    }
+    assert_true(file_exists(spill_file));
+
+    extract_audit_entries(INSTANCE_ID, write_entries_to_server);
+    printf("extracted %d entries\n", proc);
+
+    assert_int_equal(proc, NUM_ENTRIES);
+    assert_false(file_exists(spill_file));
+
+    am_audit_shutdown();
+#ifdef _WIN32
+    _putenv_s(AM_SHARED_MAX_SIZE_VAR, "");
+#else
+    unsetenv(AM_SHARED_MAX_SIZE_VAR);
+#endif
+}
+
+void test_audit_send_failure(void **state) {
+    int i;
+    am_config_t conf;
+    char *am[] = {"http://localhost/am"};
+    const char *spill_file = "."FILE_PATH_SEP"remote_audit_1.jnl";
+    memset(&conf, 0, sizeof (am_config_t));
+    conf.instance_id = INSTANCE_ID;
+    conf.config = "agent.conf";
+    conf.audit_file = "."FILE_PATH_SEP"audit.log";
+    conf.naming_url_sz = 1;
+    conf.naming_url = am;
+
+    proc = 0;
+    am_delete_file(spill_file);
+
+    assert_int_equal(am_audit_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+    assert_int_equal(am_audit_register_instance(&conf), AM_SUCCESS);
+
+    for (i = 0; i < 1000; i++) {
+        assert_int_equal(am_add_remote_audit_entry(INSTANCE_ID, "AGENT_TOKEN", "01", "remote-file.log",
+                "USER_TOKEN", MESSAGE_TEMPLATE, i), AM_SUCCESS);
+    }
+
+    /* the first batch can't be sent - it is kept in the overflow journal, and extraction stops */
+    fail_batches = 1;
+    extract_audit_entries(INSTANCE_ID, write_entries_or_fail);
+    assert_int_equal(proc, 0);
+    assert_true(file_exists(spill_file));
+
+    /* entries left in shared memory and the ones in the journal are sent next time */
+    extract_audit_entries(INSTANCE_ID, write_entries_or_fail);
+    assert_int_equal(proc, 1000);
+    assert_false(file_exists(spill_file));
+
+    /* the last batch can't be sent either */
+    for (i = 0; i < 10; i++) {
+        assert_int_equal(am_add_remote_audit_entry(INSTANCE_ID, "AGENT_TOKEN", "01", "remote-file.log",
+                "USER_TOKEN", MESSAGE_TEMPLATE, i), AM_SUCCESS);
+    }
+    fail_batches = 1;
+    extract_audit_entries(INSTANCE_ID, write_entries_or_fail);
+    assert_int_equal(proc, 1000);
+    extract_audit_entries(INSTANCE_ID, write_entries_or_fail);
+    assert_int_equal(proc, 1010);
+    assert_false(file_exists(spill_file));
+
+    am_audit_shutdown();
+}
+
+void test_audit_worker_send_failure(void **state) {
+    int i;
+    am_config_t conf;
+    char *am[] = {"http://localhost/am"};
+    const char *spill_file = "."FILE_PATH_SEP"remote_audit_1.jnl";
+    memset(&conf, 0, sizeof (am_config_t));
+    conf.instance_id = INSTANCE_ID;
+    conf.config = "agent.conf";
+    conf.audit_file = "."FILE_PATH_SEP"audit.log";
+    conf.naming_url_sz = 1;
+    conf.naming_url = am;
+
+    proc = 0;
+    fail_batches = 0;
+    am_delete_file(spill_file);
+
+    assert_int_equal(am_audit_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+    assert_int_equal(am_audit_register_instance(&conf), AM_SUCCESS);
+
+    for (i = 0; i < 100; i++) {
+        assert_int_equal(am_add_remote_audit_entry(INSTANCE_ID, "AGENT_TOKEN", "01", "remote-file.log",
+                "USER_TOKEN", MESSAGE_TEMPLATE, i), AM_SUCCESS);
+    }
+
+    /* the batch was handed on to the worker, which could not send it to OpenAM */
+    extract_audit_entries(INSTANCE_ID, write_entries_and_keep);
+    assert_int_equal(am_audit_spill_batch(INSTANCE_ID, "01", sent_entries, sent_entries_sz), AM_SUCCESS);
+    assert_true(file_exists(spill_file));
+
+    /* it is sent again next time */
+    extract_audit_entries(INSTANCE_ID, write_entries_or_fail);
+    assert_int_equal(proc, 100);
+    assert_false(file_exists(spill_file));
+
+    AM_FREE(sent_entries);
+    sent_entries = NULL;
+    sent_entries_sz = 0;
+    am_audit_shutdown();
+}
@@ -502,3 +502,153 @@ void test_handle_exits_with_access_denied(void **state) {
     cookie_table_dump("headers out", &ctx.out);
     cookie_table_dump("error headers out", &ctx.err_out);
 }
+
+static const char * cookie_table_find(struct cookie_table * table, const char * key, const char * prefix)
+{
+    int i;
+    for (i = 0; i < table->c; i++)
+        if (table->keys [i] && strcmp(table->keys [i], key) == 0 && strncmp(table->values [i], prefix, strlen(prefix)) == 0)
+            return table->values [i];
+    
+    return 0;
+}
+
+static void run_exit_with_attributes(am_config_t *config, struct cookie_ctx *ctx, uint64_t digest, const char *suffix) {
+
+    am_state_func_t const * func_array = NULL;
+    int array_len = 0;
+    struct am_namevalue *el;
+    struct am_policy_result *pattr = calloc(1, sizeof (struct am_policy_result));
+    char value[64];
+    
+    am_request_t request =
+    {
+        .instance_id                    = 0,
+        .conf                           = config,
+        .ctx                            = ctx,
+        
+        .am_get_request_url_f           = am_get_url_encoded_token_url,
+        
+        .client_ip                      = "209.173.53.167",
+        .client_host                    = "d.e.f",
+        
+        .method                         = AM_REQUEST_GET,
+        
+        .status                         = AM_SUCCESS,
+        .am_add_header_in_response_f    = add_header_in_response,
+        .am_set_header_in_request_f     = set_header_in_request,
+        
+        .token                          = TOKEN_VALUE,
+        .cookies                        = "a=b;c=d",
+        .pattr_digest                   = digest,
+    };
+    
+    assert_non_null(pattr);
+    
+    snprintf(value, sizeof (value), "session-value-%s", suffix);
+    el = new_namevalue("ldap-session-0", value);
+    AM_LIST_INSERT(request.sattr, el);
+    snprintf(value, sizeof (value), "profile-value-%s", suffix);
+    el = new_namevalue("ldap-profile-0", value);
+    AM_LIST_INSERT(pattr->response_decisions, el);
+    snprintf(value, sizeof (value), "response-value-%s", suffix);
+    el = new_namevalue("ldap-response-0", value);
+    AM_LIST_INSERT(pattr->response_attributes, el);
+    
+    /* attributes of the (only) matching policy entry */
+    request.pattr = pattr;
+    request.response_attributes = pattr->response_attributes;
+    request.response_decisions = pattr->response_decisions;
+    
+    am_test_get_state_funcs(&func_array, &array_len);
+    assert_int_equal(func_array [7](&request), AM_OK);
+    
+    delete_am_policy_result_list(&pattr);
+    delete_am_namevalue_list(&request.sattr);
+    url_free(&request.url);
+    am_request_arena_free(&request);
+}
+
+void test_handle_exits_replays_rendered_attributes(void **state) {
+
+    struct cookie_ctx ctx;
+    const char * cookie;
+    
+    am_config_map_t session_attr_map [] =
+    {
+        { "ldap-session-0", "Session-header-0" },
+    };
+    
+    am_config_map_t profile_attr_map [] =
+    {
+        { "ldap-profile-0", "Profile-header-0" },
+    };
+    
+    am_config_map_t response_attr_map [] =
+    {
+        { "ldap-response-0", "Response-cookie-0" },
+    };
+    
+    am_config_t config =
+    {
+        .instance_id                    = 0,
+        .ts                             = 1,
+        .agenturi                       = "https://www.override.com:90/am",
+        .cookie_name                    = TOKEN_NAME,
+        
+        .profile_attr_fetch             = AM_SET_ATTRS_AS_HEADER,
+        .profile_attr_map_sz            = array_len(profile_attr_map),
+        .profile_attr_map               = profile_attr_map,
+        
+        .session_attr_fetch             = AM_SET_ATTRS_AS_HEADER,
+        .session_attr_map_sz            = array_len(session_attr_map),
+        .session_attr_map               = session_attr_map,
+        
+        .response_attr_fetch            = AM_SET_ATTRS_AS_COOKIE,
+        .response_attr_map_sz           = array_len(response_attr_map),
+        .response_attr_map              = response_attr_map,
+    };
+    
+    /* first request of the session renders the attributes */
+    memset(&ctx, 0, sizeof (ctx));
+    run_exit_with_attributes(&config, &ctx, 0x1234, "0");
+    assert_string_equal(cookie_table_get(&ctx.in, "Session-header-0"), "session-value-0");
+    assert_string_equal(cookie_table_get(&ctx.in, "Profile-header-0"), "profile-value-0");
+    cookie = cookie_table_find(&ctx.err_out, "Set-Cookie", "Response-cookie-0=response-value-0;");
+    assert_non_null(cookie);
+    
+    /* same cache entry: headers and cookies are replayed, not made from the (here different) attributes */
+    cookie_table_clear(&ctx.in);
+    cookie_table_clear(&ctx.out);
+    cookie_table_clear(&ctx.err_out);
+    run_exit_with_attributes(&config, &ctx, 0x1234, "1");
+    assert_string_equal(cookie_table_get(&ctx.in, "Session-header-0"), "session-value-0");
+    assert_string_equal(cookie_table_get(&ctx.in, "Profile-header-0"), "profile-value-0");
+    cookie = cookie_table_find(&ctx.err_out, "Set-Cookie", "Response-cookie-0=response-value-0;Max-Age=300;Expires=");
+    assert_non_null(cookie);
+    assert_non_null(strstr(cookie, " GMT;Path=/"));
+    
+    /* another cache entry is rendered again */
+    cookie_table_clear(&ctx.in);
+    cookie_table_clear(&ctx.out);
+    cookie_table_clear(&ctx.err_out);
+    run_exit_with_attributes(&config, &ctx, 0x5678, "2");
+    assert_string_equal(cookie_table_get(&ctx.in, "Session-header-0"), "session-value-2");
+    assert_string_equal(cookie_table_get(&ctx.in, "Profile-header-0"), "profile-value-2");
+    assert_non_null(cookie_table_find(&ctx.err_out, "Set-Cookie", "Response-cookie-0=response-value-2;"));
+    
+    /* a configuration reloaded in the same second (same ts) is rendered again */
+    cookie_table_clear(&ctx.in);
+    cookie_table_clear(&ctx.out);
+    cookie_table_clear(&ctx.err_out);
+    session_attr_map[0].value = "Session-header-1";
+    config.generation++;
+    run_exit_with_attributes(&config, &ctx, 0x5678, "3");
+    assert_string_equal(cookie_table_get(&ctx.in, "Session-header-1"), "session-value-3");
+    assert_null(cookie_table_get(&ctx.in, "Session-header-0"));
+    
+    cookie_table_clear(&ctx.in);
+    cookie_table_clear(&ctx.out);
+    cookie_table_clear(&ctx.err_out);
+    am_attr_render_shutdown();
+}
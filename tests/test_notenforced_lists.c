@@ -35,13 +35,27 @@ am_status_t ip_address_match(const char *ip, const char **list, unsigned int lis
 #define test_cidr(expect, addr, range) do \
 { \
 assert_int_equal(ip_address_match(addr, array_of(range), 1, 0l), expect ? AM_SUCCESS : AM_NOT_FOUND); \
+assert_int_equal(ip_set_match(addr, range), expect); \
 } while (0)
 
 #define test_hyphenated(expect, addr, range) do \
 { \
 assert_int_equal(ip_address_match(addr, array_of(range), 1, 0l), expect ? AM_SUCCESS : AM_NOT_FOUND); \
+assert_int_equal(ip_set_match(addr, range), expect); \
 } while (0)
 
+/* the same test with a compiled ip address list */
+static int ip_set_match(const char *addr, const char *range) {
+    struct am_ip_set *set = am_ip_set_create(array_of(range), 1);
+    struct am_ip_addr a;
+    int rv;
+    assert_non_null(set);
+    am_ip_addr_parse(addr, &a);
+    rv = am_ip_set_match(set, &a) ? 1 : 0;
+    am_ip_set_delete(&set);
+    return rv;
+}
+
 
 
 // this is in ip.c, as an alternative to inet_net_pton, which is not protable and seems faulty.
@@ -498,3 +512,138 @@ void test_deny_url_notenforced_get(void **state) {
     assert_int_equal(notenforced_handler(&request), AM_OK);
     assert_int_equal(request.not_enforced, AM_TRUE);
 }
+
+
+static am_bool_t is_not_enforced(am_config_t *config, int method, const char *client_ip, const char *url) {
+
+    am_state_func_t const * func_array = NULL;
+    int array_len = 0;
+    am_state_func_t notenforced_handler;
+    am_bool_t not_enforced;
+    char *request_url = strdup(url), *request_ip = strdup(client_ip); /* the request has writable strings */
+    
+    struct ctx {
+        void *dummy;
+    } ctx;
+    
+    am_request_t request = {
+        .instance_id                = 0,
+        .conf                       = config,
+        .ctx                        = &ctx,
+        
+        .method                     = method,
+        .token                      = NULL,
+        
+        .overridden_url             = request_url,
+        .normalized_url             = request_url,
+        
+        .client_ip                  = request_ip,
+    };
+    
+    am_test_get_state_funcs(&func_array, &array_len);
+    notenforced_handler = func_array [5];
+    
+    parse_url(url, &request.url);
+    
+    assert_int_equal(notenforced_handler(&request), AM_OK);
+    not_enforced = request.not_enforced;
+    free(request_url);
+    free(request_ip);
+    return not_enforced;
+}
+
+void test_not_enforced_rules(void **state) {
+
+    struct am_not_enforced_rules *rules, *cached;
+    
+    struct am_config_map not_enforced_ips[] = {
+        { "POST,0",  "10.0.0.0/8" },
+        { "1",       "192.168.1.1-192.168.1.9" },
+        { "2",       "fe80::/10" },
+    };
+    
+    struct am_config_map not_enforced_map[] = {
+        { "0",       "http://www.example.com:80/public/*" },
+        { "GET,1",   "http://www.example.com:80/get-only/*" },
+        { "2",       "http://www.example.com:80/exact.html" },
+        { "3",       "*" },                                         /* invalid - never matches */
+        { "4",       "http://www.example.com:80/*/-*-.gif" },
+    };
+    
+    struct am_config_map not_enforced_ext[] = {
+        { "0",       "172.16.0.0/12 2001:db8::1-2001:db8::9|http://www.example.com:80/ext/* http://www.example.com:80/ext.html" },
+        { "1",       "no urls" },
+    };
+    
+    am_config_t config = {
+        .instance_id                = 0,
+        .ts                         = 1,
+        
+        .url_eval_case_ignore       = AM_TRUE,
+        
+        .not_enforced_ip_map_sz     = array_len(not_enforced_ips),
+        .not_enforced_ip_map        = not_enforced_ips,
+        
+        .not_enforced_fetch_attr    = AM_TRUE,
+        
+        .not_enforced_map_sz        = array_len(not_enforced_map),
+        .not_enforced_map           = not_enforced_map,
+        
+        .not_enforced_ext_map_sz    = array_len(not_enforced_ext),
+        .not_enforced_ext_map       = not_enforced_ext,
+        
+        .logout_map_sz              = 0,
+    };
+    
+    /* url list, with methods and case folding */
+    assert_true(is_not_enforced(&config, AM_REQUEST_GET, "1.2.3.4", "http://www.EXAMPLE.com:80/public/index.html"));
+    assert_true(is_not_enforced(&config, AM_REQUEST_GET, "1.2.3.4", "http://www.example.com:80/get-only/a"));
+    assert_false(is_not_enforced(&config, AM_REQUEST_POST, "1.2.3.4", "http://www.example.com:80/get-only/a"));
+    assert_true(is_not_enforced(&config, AM_REQUEST_POST, "1.2.3.4", "http://www.example.com:80/exact.html"));
+    assert_false(is_not_enforced(&config, AM_REQUEST_POST, "1.2.3.4", "http://www.example.com:80/exact.htm"));
+    assert_true(is_not_enforced(&config, AM_REQUEST_GET, "1.2.3.4", "http://www.example.com:80/img/logo.gif"));
+    assert_false(is_not_enforced(&config, AM_REQUEST_GET, "1.2.3.4", "http://www.example.com:80/private"));
+    
+    /* client ip list, with methods */
+    assert_true(is_not_enforced(&config, AM_REQUEST_POST, "10.1.2.3", "http://www.example.com:80/private"));
+    assert_false(is_not_enforced(&config, AM_REQUEST_GET, "10.1.2.3", "http://www.example.com:80/private"));
+    assert_true(is_not_enforced(&config, AM_REQUEST_GET, "192.168.1.9", "http://www.example.com:80/private"));
+    assert_false(is_not_enforced(&config, AM_REQUEST_GET, "192.168.1.10", "http://www.example.com:80/private"));
+    assert_true(is_not_enforced(&config, AM_REQUEST_GET, "fe80::1", "http://www.example.com:80/private"));
+    
+    /* extended list: client ip and url */
+    assert_true(is_not_enforced(&config, AM_REQUEST_GET, "172.20.0.1", "http://www.example.com:80/ext/a"));
+    assert_true(is_not_enforced(&config, AM_REQUEST_GET, "2001:db8::5", "http://www.example.com:80/ext.html"));
+    assert_false(is_not_enforced(&config, AM_REQUEST_GET, "172.32.0.1", "http://www.example.com:80/ext/a"));
+    assert_false(is_not_enforced(&config, AM_REQUEST_GET, "172.20.0.1", "http://www.example.com:80/ext2.html"));
+    
+    /* inverted url list */
+    config.not_enforced_invert = AM_TRUE;
+    assert_false(is_not_enforced(&config, AM_REQUEST_GET, "1.2.3.4", "http://www.example.com:80/public/index.html"));
+    assert_true(is_not_enforced(&config, AM_REQUEST_GET, "1.2.3.4", "http://www.example.com:80/private"));
+    config.not_enforced_invert = AM_FALSE;
+    
+    /* regular expressions */
+    config.not_enforced_regex_enable = AM_TRUE;
+    not_enforced_map[0].value = "^http://www\\.example\\.com:80/public/.+$";
+    config.ts = 2;
+    assert_true(is_not_enforced(&config, AM_REQUEST_GET, "1.2.3.4", "http://www.example.com:80/public/index.html"));
+    assert_false(is_not_enforced(&config, AM_REQUEST_GET, "1.2.3.4", "http://www.example.com:80/public/"));
+    
+    /* compiled rules are shared while the configuration does not change */
+    rules = am_not_enforced_rules_get(&config);
+    cached = am_not_enforced_rules_get(&config);
+    assert_non_null(rules);
+    assert_ptr_equal(rules, cached);
+    am_not_enforced_rules_release(&cached);
+    am_not_enforced_rules_release(&rules);
+    assert_null(rules);
+
+    /* a configuration reloaded in the same second (same ts) with another list */
+    not_enforced_map[0].value = "^http://www\\.example\\.com:80/open/.+$";
+    config.generation++;
+    assert_true(is_not_enforced(&config, AM_REQUEST_GET, "1.2.3.4", "http://www.example.com:80/open/index.html"));
+    assert_false(is_not_enforced(&config, AM_REQUEST_GET, "1.2.3.4", "http://www.example.com:80/public/index.html"));
+    
+    am_not_enforced_rules_shutdown();
+}
@@ -24,6 +24,7 @@
 #include "platform.h"
 #include "utility.h"
 #include "log.h"
+#include "list.h"
 #include "cmocka.h"
 
 static void check_normalisation(char *pattern, char *expect) {
@@ -442,6 +443,35 @@ void test_compare_pattern_resource(void **state) {
 
 }
 
+void test_compare_pattern_resource_pathological(void **state) {
+    am_config_t config = { .instance_id = 101, .url_eval_case_ignore = 0 };
+    am_request_t request = { .conf = &config, };
+    char pattern[1024], url[1024];
+    int i;
+
+    /* a backtracking matcher retries every split of the a's between the wildcards before it fails */
+    assert_false(MATCH(&request, "*a*a*a*a*a*a*a*a*a*a*b?", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa?"));
+    assert_false(MATCH(&request, "-*-a-*-a-*-a-*-a-*-a-*-a-*-a-*-b/", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa/"));
+    assert_true(MATCH(&request, "*a*a*a*a*a*a*a*a*a*a*?", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa?"));
+
+    /* longer than the patterns matched with states on the stack */
+    for (i = 0; i < 300; i++) {
+        pattern[i] = i % 10 ? 'x' : '*';
+        url[i] = 'x';
+    }
+    pattern[i] = url[i] = '\0';
+    assert_true(MATCH(&request, pattern, url));
+    url[i - 1] = '?';
+    assert_false(MATCH(&request, pattern, url));
+
+    /* ignoring case, in runs long enough to be compared 16 characters at a time */
+    config.url_eval_case_ignore = 1;
+    assert_true(MATCH(&request, "/APPLICATION/RESOURCES/STATIC/*", "/application/resources/static/images/logo.png"));
+    assert_false(MATCH(&request, "/APPLICATION/RESOURCES/STATIK/*", "/application/resources/static/images/logo.png"));
+    config.url_eval_case_ignore = 0;
+    assert_false(MATCH(&request, "/APPLICATION/RESOURCES/STATIC/*", "/application/resources/static/images/logo.png"));
+}
+
 static void match_wildcard(const char* url, const char *ptn) {
     am_config_t config = { .instance_id = 101, .url_eval_case_ignore = 1 };
     am_request_t request = { .conf = &config, };
@@ -469,3 +499,59 @@ void test_am_policy_results(void **state) {
 
 }
 
+
+void test_policy_index(void **state) {
+    static const char *patterns[] = {
+        "http://h/a*", "http://h/axb", "http://h/ab", "http://a.b.c/-*-/b", "http://*.c*/-*-/z",
+        "http://vb2.*/test*", "http://a.b.c:*/x/y/z", "http://a.b.*/*/z", "http://a.b.*/-*-/z",
+        "http*://*example.com:*/fred/*", "http://www.google.com*", "http://www.google.com:80/*/blah/wibble/*/blah",
+        "http://example.com:80/index.*?*", "HTTP://EXAMPLE.COM:80/index.*?a=b", "*", "http://h/a-*-",
+        "http://a.b.c:90/x/y/z?a/b", "no.protocol.com/*"
+    };
+    static const char *urls[] = {
+        "http://h/a*b", "http://h/ab", "http://h/b", "http://a.b.c/a*/b", "http://a.b.c:90/x/z",
+        "http://vb3.local.com:80/test/path", "http://a.b.c:90/x", "http://a.b.c:90/x/y/z",
+        "http://example.com:80/fred/index.html", "https://www.example.com:443/fred/x",
+        "http://www.google.com:80/asdf/hello/blah/wibble/asdf/blah", "http://www.google.com.co.uk:80/blah",
+        "http://example.com:80/index.html?a=b", "http://H/A", "http://h/a-b", "http://a.b.c:90/x/y/z?a/b",
+        "no.protocol.com/x", "", "http://"
+    };
+    am_config_t config = { .instance_id = 101 };
+    am_request_t r = { .conf = &config, };
+    struct am_policy_result *list = NULL, *e;
+    struct am_policy_index *index;
+    int i, j, c;
+
+    for (i = 0; i < array_len(patterns); i++) {
+        e = calloc(1, sizeof (struct am_policy_result));
+        assert_non_null(e);
+        e->resource = strdup(patterns[i]);
+        AM_LIST_INSERT(list, e);
+    }
+
+    index = am_policy_index_create(list);
+    assert_non_null(index);
+
+    for (c = 0; c <= 1; c++) {
+        config.url_eval_case_ignore = c;
+
+        for (i = 0; i < array_len(urls); i++) {
+            am_policy_index_lookup(index, urls[i]);
+
+            for (j = 0, e = list; e != NULL; e = e->next, j++) {
+                /* every entry that matches must be a candidate */
+                if (policy_compare_url(&r, e->resource, urls[i]) != AM_NO_MATCH) {
+                    assert_true(am_policy_index_candidate(index, j));
+                }
+            }
+        }
+    }
+
+    am_policy_index_lookup(index, "http://h/ab");
+    assert_false(am_policy_index_candidate(index, 5)); /* http://vb2.* */
+    assert_true(am_policy_index_candidate(index, 14)); /* * */
+
+    am_policy_index_delete(&index);
+    assert_null(index);
+    delete_am_policy_result_list(&list);
+}
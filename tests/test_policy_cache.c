@@ -337,6 +337,392 @@ void test_policy_cache_simple(void **state) {
 }
 
 
+void test_policy_decision_memo(void **state) {
+
+    am_config_t config = { .token_cache_valid = 100 };
+    am_request_t request = { .conf = &config } ;
+    char* buffer = NULL;
+    struct am_policy_result * result;
+    uint64_t ets;
+    struct am_policy_result * r = NULL;
+    struct am_namevalue * session = NULL;
+    struct am_policy_decision decision, found;
+
+    am_asprintf(&buffer, pll, policy_xml);
+    result = am_parse_policy_xml(0l, buffer, strlen(buffer), 0);
+    free(buffer);
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    assert_int_equal(am_add_session_policy_cache_entry(&request, "Memo-key", result, NULL), AM_SUCCESS);
+    delete_am_policy_result_list(&result);
+    assert_int_equal(am_get_session_policy_cache_entry(&request, "Memo-key", &r, &session, &ets), AM_SUCCESS);
+    assert_int_not_equal(request.pattr_digest, 0);
+
+    memset(&decision, 0, sizeof (decision));
+    decision.url_digest = am_digest64("http://a.b.c:80/x", 17);
+    decision.method = AM_REQUEST_GET;
+    decision.context = 1;
+    found = decision;
+    assert_int_equal(am_get_policy_decision_memo(&request, "Memo-key", &found), AM_NOT_FOUND);
+
+    decision.entry = 1;
+    decision.action = 0;
+    decision.status = AM_SUCCESS;
+    assert_int_equal(am_add_policy_decision_memo(&request, "Memo-key", &decision), AM_SUCCESS);
+
+    assert_int_equal(am_get_policy_decision_memo(&request, "Memo-key", &found), AM_SUCCESS);
+    assert_int_equal(found.entry, 1);
+    assert_int_equal(found.action, 0);
+    assert_int_equal(found.status, AM_SUCCESS);
+
+    found = decision;
+    found.method = AM_REQUEST_POST;
+    assert_int_equal(am_get_policy_decision_memo(&request, "Memo-key", &found), AM_NOT_FOUND);
+
+    /* a policy change starts a new epoch */
+    found = decision;
+    assert_int_equal(am_set_policy_cache_epoch(time(NULL)), AM_SUCCESS);
+    assert_int_equal(am_get_policy_decision_memo(&request, "Memo-key", &found), AM_ETIMEDOUT);
+
+    /* decisions belong to the session entry they were made with */
+    assert_int_equal(am_get_policy_cache_epoch(&decision.epoch), AM_SUCCESS);
+    assert_int_equal(am_add_policy_decision_memo(&request, "Memo-key", &decision), AM_SUCCESS);
+    assert_int_equal(am_get_policy_decision_memo(&request, "Memo-key", &found), AM_SUCCESS);
+    request.pattr_digest++;
+    assert_int_equal(am_get_policy_decision_memo(&request, "Memo-key", &found), AM_NOT_FOUND);
+
+    am_cache_shutdown();
+
+    delete_am_policy_result_list(&r);
+    delete_am_namevalue_list(&session);
+}
+
+
+void test_policy_cache_shared_policies(void **state) {
+
+    am_config_t config = { .token_cache_valid = 100 };
+    am_request_t request = { .conf = &config } ;
+    char* buffer = NULL;
+    char* blob_key = NULL;
+    struct am_policy_result * result;
+    struct am_policy_result * other;
+    struct cache_object_ctx ctx;
+    uint64_t ets;
+    struct am_policy_result * r = NULL;
+    struct am_namevalue * session = NULL;
+
+    am_asprintf(&buffer, pll, policy_xml);
+    result = am_parse_policy_xml(0l, buffer, strlen(buffer), 0);
+    other = am_parse_policy_xml(0l, buffer, strlen(buffer), 0);
+    free(buffer);
+
+    /* same policy, evaluated at another time */
+    other->created = result->created + 60;
+    other->action_decisions->ttl = 4321;
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    assert_int_equal(am_add_session_policy_cache_entry(&request, "Shared-key-1", result, NULL), AM_SUCCESS);
+    assert_int_equal(am_add_session_policy_cache_entry(&request, "Shared-key-2", other, NULL), AM_SUCCESS);
+
+    /* each session keeps its own creation time and ttls */
+    assert_int_equal(am_get_session_policy_cache_entry(&request, "Shared-key-2", &r, &session, &ets), AM_SUCCESS);
+    assert_non_null(r);
+    assert_int_equal(r->created, other->created);
+    assert_int_equal(r->action_decisions->ttl, 4321);
+    assert_string_equal(r->resource, "http://vb2.local.com:80/testwebsite");
+    delete_am_policy_result_list(&r);
+    delete_am_namevalue_list(&session);
+    session = NULL;
+
+    assert_int_equal(am_get_session_policy_cache_entry(&request, "Shared-key-1", &r, &session, &ets), AM_SUCCESS);
+    assert_int_equal(r->created, result->created);
+    test_policy_structure(r);
+    r = NULL;
+
+    /* both sessions refer to the one stored policy */
+    cache_object_ctx_init(&ctx);
+    assert_int_equal(am_policy_blob_serialise(&ctx, result), AM_SUCCESS);
+    am_asprintf(&blob_key, "%s%016llx-%u", AM_POLICY_BLOB_PREFIX,
+            (unsigned long long) am_digest64(ctx.data, ctx.data_size), (unsigned int) ctx.data_size);
+    cache_object_ctx_destroy(&ctx);
+    assert_int_equal(am_remove_cache_entry(0, blob_key), AM_SUCCESS);
+    free(blob_key);
+
+    assert_int_equal(am_get_session_policy_cache_entry(&request, "Shared-key-1", &r, &session, &ets), AM_NOT_FOUND);
+    assert_null(r);
+    assert_int_equal(am_get_session_policy_cache_entry(&request, "Shared-key-2", &r, &session, &ets), AM_NOT_FOUND);
+    assert_null(r);
+
+    am_cache_shutdown();
+
+    delete_am_policy_result_list(&result);
+    delete_am_policy_result_list(&other);
+}
+
+
+static struct am_namevalue *attribute_list(const char **names, int count) {
+    struct am_namevalue *list = NULL, *e;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        assert_int_equal(create_am_namevalue_node(names[i], strlen(names[i]), "value", 5, &e), 0);
+        AM_LIST_INSERT(list, e);
+    }
+    return list;
+}
+
+static int attribute_count(struct am_namevalue *list, const char *name) {
+    int count = 0;
+
+    for (; list != NULL; list = list->next) {
+        if (name == NULL || strcmp(list->n, name) == 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+void test_attribute_projection(void **state) {
+
+    const char *session_names[] = { "maxtime", "timeleft", "maxcaching", "Host", "UserId", "mail", "Locale", "uid", "cn" };
+    const char *response_names[] = { "role", "team", "cn" };
+    const char *profile_names[] = { "uid", "cn", "mail", "cn" };
+    am_config_map_t session_map[] = { { "mail", "MAIL" } };
+    am_config_map_t response_map[] = { { "role", "ROLE" } };
+    am_config_map_t profile_map[] = { { "cn", "CN" } };
+    am_config_t config = {
+        .instance_id = 1,
+        .session_attr_map = session_map, .session_attr_map_sz = 1,
+        .response_attr_map = response_map, .response_attr_map_sz = 1,
+        .profile_attr_map = profile_map, .profile_attr_map_sz = 1,
+        .userid_param = "UserId", .userid_param_type = "session"
+    };
+    struct am_policy_result policy;
+    struct am_namevalue *session;
+    int pass;
+
+    /* configuration snapshot (cached working set) and not cached (ts 0) */
+    for (pass = 0; pass < 2; pass++) {
+        config.ts = pass == 0 ? 1000 : 0;
+
+        memset(&policy, 0, sizeof (policy));
+        policy.response_attributes = attribute_list(response_names, ARRAY_SIZE(response_names));
+        policy.response_decisions = attribute_list(profile_names, ARRAY_SIZE(profile_names));
+        session = attribute_list(session_names, ARRAY_SIZE(session_names));
+
+        am_attr_project(&config, &policy, &session);
+
+        assert_int_equal(attribute_count(session, NULL), 5);
+        assert_int_equal(attribute_count(session, "timeleft"), 1);
+        assert_int_equal(attribute_count(session, "maxcaching"), 1);
+        assert_int_equal(attribute_count(session, "Host"), 1);
+        assert_int_equal(attribute_count(session, "UserId"), 1);
+        assert_int_equal(attribute_count(session, "mail"), 1);
+
+        assert_int_equal(attribute_count(policy.response_attributes, NULL), 1);
+        assert_int_equal(attribute_count(policy.response_attributes, "role"), 1);
+
+        /* multiple values are all kept */
+        assert_int_equal(attribute_count(policy.response_decisions, NULL), 2);
+        assert_int_equal(attribute_count(policy.response_decisions, "cn"), 2);
+
+        delete_am_namevalue_list(&session);
+        delete_am_namevalue_list(&policy.response_attributes);
+        delete_am_namevalue_list(&policy.response_decisions);
+    }
+
+    /* a changed configuration gets a new working set */
+    config.ts = 2000;
+    config.userid_param_type = "LDAP";
+    memset(&policy, 0, sizeof (policy));
+    policy.response_decisions = attribute_list(profile_names, ARRAY_SIZE(profile_names));
+    session = attribute_list(session_names, ARRAY_SIZE(session_names));
+
+    am_attr_project(&config, &policy, &session);
+
+    assert_int_equal(attribute_count(session, "UserId"), 0);
+    assert_int_equal(attribute_count(policy.response_decisions, "uid"), 0);
+    config.userid_param = "uid";
+    config.ts = 3000;
+    delete_am_namevalue_list(&policy.response_decisions);
+    policy.response_decisions = attribute_list(profile_names, ARRAY_SIZE(profile_names));
+    am_attr_project(&config, &policy, NULL);
+    assert_int_equal(attribute_count(policy.response_decisions, "uid"), 1);
+    assert_int_equal(attribute_count(policy.response_decisions, NULL), 3);
+
+    /* a configuration reloaded in the same second (same ts) with other names */
+    profile_map[0].name = "mail";
+    config.generation++;
+    delete_am_namevalue_list(&policy.response_decisions);
+    policy.response_decisions = attribute_list(profile_names, ARRAY_SIZE(profile_names));
+    am_attr_project(&config, &policy, NULL);
+    assert_int_equal(attribute_count(policy.response_decisions, "cn"), 0);
+    assert_int_equal(attribute_count(policy.response_decisions, "mail"), 1);
+    assert_int_equal(attribute_count(policy.response_decisions, NULL), 2);
+
+    delete_am_namevalue_list(&session);
+    delete_am_namevalue_list(&policy.response_decisions);
+    am_attr_project_shutdown();
+}
+
+
+void test_attribute_projection_shared_entry(void **state) {
+
+    const char *session_names[] = { "timeleft", "maxcaching", "mail", "cn", "Locale" };
+    am_config_map_t mail_map[] = { { "mail", "MAIL" } };
+    am_config_map_t cn_map[] = { { "cn", "CN" } };
+    am_config_t config_mail = {
+        .instance_id = 1, .ts = 1000, .token_cache_valid = 100,
+        .session_attr_map = mail_map, .session_attr_map_sz = 1
+    };
+    am_config_t config_cn = {
+        .instance_id = 2, .ts = 1000, .token_cache_valid = 100,
+        .session_attr_map = cn_map, .session_attr_map_sz = 1
+    };
+    am_request_t request_mail = { .conf = &config_mail };
+    am_request_t request_cn = { .conf = &config_cn };
+    struct am_policy_result *result, *r = NULL;
+    struct am_namevalue *session, *cached = NULL;
+    char *buffer = NULL;
+    uint64_t ets;
+
+    am_asprintf(&buffer, pll, policy_xml);
+    result = am_parse_policy_xml(0l, buffer, strlen(buffer), 0);
+    free(buffer);
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    /* the first configuration caches the token with its working set */
+    session = attribute_list(session_names, ARRAY_SIZE(session_names));
+    am_attr_project(&config_mail, result, &session);
+    assert_int_equal(am_add_session_policy_cache_entry(&request_mail, "Projected-key", result, session), AM_SUCCESS);
+    delete_am_namevalue_list(&session);
+
+    assert_int_equal(am_get_session_policy_cache_entry(&request_mail, "Projected-key", &r, &cached, &ets), AM_SUCCESS);
+    assert_int_equal(attribute_count(cached, "mail"), 1);
+    assert_int_equal(attribute_count(cached, "cn"), 0);
+    delete_am_policy_result_list(&r);
+    delete_am_namevalue_list(&cached);
+
+    /* a configuration that reads other attributes does not use it */
+    r = NULL;
+    cached = NULL;
+    assert_int_equal(am_get_session_policy_cache_entry(&request_cn, "Projected-key", &r, &cached, &ets), AM_NOT_FOUND);
+    assert_null(cached);
+
+    /* and replaces it with its own */
+    session = attribute_list(session_names, ARRAY_SIZE(session_names));
+    am_attr_project(&config_cn, result, &session);
+    assert_int_equal(am_add_session_policy_cache_entry(&request_cn, "Projected-key", result, session), AM_SUCCESS);
+    delete_am_namevalue_list(&session);
+
+    assert_int_equal(am_get_session_policy_cache_entry(&request_cn, "Projected-key", &r, &cached, &ets), AM_SUCCESS);
+    assert_int_equal(attribute_count(cached, "cn"), 1);
+    assert_int_equal(attribute_count(cached, "mail"), 0);
+    delete_am_policy_result_list(&r);
+    delete_am_namevalue_list(&cached);
+    assert_int_equal(am_get_session_policy_cache_entry(&request_mail, "Projected-key", &r, &cached, &ets), AM_NOT_FOUND);
+
+    /* a new snapshot of a configuration with the same attribute names still reads it */
+    config_cn.ts = 2000;
+    assert_int_equal(am_get_session_policy_cache_entry(&request_cn, "Projected-key", &r, &cached, &ets), AM_SUCCESS);
+    assert_int_equal(attribute_count(cached, "cn"), 1);
+    delete_am_policy_result_list(&r);
+    delete_am_namevalue_list(&cached);
+
+    delete_am_policy_result_list(&result);
+    am_cache_shutdown();
+    am_attr_project_shutdown();
+}
+
+void test_invalid_token_cache(void **state) {
+
+    am_config_t config = { .invalid_token_cache_valid = 0 };
+    am_request_t request = { .conf = &config } ;
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    assert_int_equal(am_get_invalid_token_entry(&request, "Invalid-key"), AM_NOT_FOUND);
+    assert_int_equal(am_add_invalid_token_entry(&request, "Invalid-key"), AM_SUCCESS);
+    assert_int_equal(am_get_invalid_token_entry(&request, "Invalid-key"), AM_SUCCESS);
+    assert_int_equal(am_get_invalid_token_entry(&request, "Other-key"), AM_NOT_FOUND);
+
+    /* invalid token entries are kept apart from the session/policy entries of the same token */
+    assert_int_equal(am_remove_cache_entry(0, "Invalid-key"), AM_SUCCESS);
+    assert_int_equal(am_get_invalid_token_entry(&request, "Invalid-key"), AM_SUCCESS);
+
+    /* a session notification forgets it */
+    assert_int_equal(am_remove_invalid_token_entry(0, "Invalid-key"), AM_SUCCESS);
+    assert_int_equal(am_get_invalid_token_entry(&request, "Invalid-key"), AM_NOT_FOUND);
+
+    /* disabled */
+    config.invalid_token_cache_valid = -1;
+    assert_int_equal(am_add_invalid_token_entry(&request, "Invalid-key"), AM_SUCCESS);
+    config.invalid_token_cache_valid = 0;
+    assert_int_equal(am_get_invalid_token_entry(&request, "Invalid-key"), AM_NOT_FOUND);
+
+    am_cache_shutdown();
+}
+
+
+void test_cache_digest_keys(void **state) {
+
+    am_config_t config = { .pdp_cache_valid = 60 };
+    am_request_t request = { .conf = &config } ;
+    uint64_t seed[2], other_seed[2], digest[2], other[2];
+    char long_key[4096];
+    char *url, *file, *content_type;
+    int method;
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    cache_key_seed(seed);
+    assert_false(seed[0] == 0 && seed[1] == 0);
+    am_cache_digest("token value", 11, digest);
+    am_cache_digest("token value", 11, other);
+    assert_memory_equal(digest, other, sizeof (digest));
+
+    /* keys of any size are stored as digests */
+    memset(long_key, 'k', sizeof (long_key) - 1);
+    long_key[sizeof (long_key) - 1] = '\0';
+    assert_int_equal(am_add_pdp_cache_entry(&request, long_key, "http://a.example.com/", "file-a", "text/plain", AM_REQUEST_GET), AM_SUCCESS);
+    assert_int_equal(am_add_pdp_cache_entry(&request, "k", "http://b.example.com/", "file-b", "text/plain", AM_REQUEST_POST), AM_SUCCESS);
+
+    assert_int_equal(am_get_pdp_cache_entry(&request, long_key, &url, &file, &content_type, &method), AM_SUCCESS);
+    assert_string_equal(url, "http://a.example.com/");
+    assert_int_equal(method, AM_REQUEST_GET);
+    AM_FREE(url, file, content_type);
+
+    assert_int_equal(am_get_pdp_cache_entry(&request, "k", &url, &file, &content_type, &method), AM_SUCCESS);
+    assert_string_equal(url, "http://b.example.com/");
+    assert_int_equal(method, AM_REQUEST_POST);
+    AM_FREE(url, file, content_type);
+
+    long_key[sizeof (long_key) - 2] = 'x';
+    assert_int_equal(am_get_pdp_cache_entry(&request, long_key, &url, &file, &content_type, &method), AM_NOT_FOUND);
+    long_key[sizeof (long_key) - 2] = 'k';
+
+    assert_int_equal(am_remove_cache_entry(0, long_key), AM_SUCCESS);
+    assert_int_equal(am_get_pdp_cache_entry(&request, long_key, &url, &file, &content_type, &method), AM_NOT_FOUND);
+
+    /* a new cache gets a new digest key */
+    am_cache_shutdown();
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+    cache_key_seed(other_seed);
+    assert_false(seed[0] == other_seed[0] && seed[1] == other_seed[1]);
+
+    am_cache_shutdown();
+}
+
+
 const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789*";
 
 
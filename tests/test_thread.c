@@ -0,0 +1,290 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2016 ForgeRock AS.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "thread.h"
+#include "cmocka.h"
+
+void am_worker_pool_init_reset();
+
+#define NUM_WORK 10000
+
+static volatile uint32_t done = 0;
+static volatile uint32_t hold = 0;
+static volatile uint32_t held = 0;
+
+static void count_worker(void *arg) {
+    __sync_fetch_and_add(&done, 1);
+}
+
+static void hold_worker(void *arg) {
+    __sync_fetch_and_add(&held, 1);
+    while (__sync_fetch_and_add(&hold, 0)) {
+        usleep(1000);
+    }
+    __sync_fetch_and_add(&done, 1);
+}
+
+static void wait_for_work(uint32_t count) {
+    int tries = 1000;
+    while (__sync_fetch_and_add(&done, 0) < count && --tries) {
+        usleep(10000);
+    }
+}
+
+void test_worker_pool_dispatch(void **state) {
+    int i;
+    struct am_worker_pool_metrics metrics;
+
+    done = 0;
+    am_worker_pool_init();
+
+    for (i = 0; i < NUM_WORK; i++) {
+        while (am_worker_dispatch(count_worker, NULL) == AM_EAGAIN) {
+            usleep(100);
+        }
+    }
+    wait_for_work(NUM_WORK);
+    assert_int_equal(done, NUM_WORK);
+
+    assert_int_equal(am_worker_pool_metrics(&metrics), AM_SUCCESS);
+    assert_int_equal(metrics.submitted, NUM_WORK);
+    assert_int_equal(metrics.submitted, metrics.completed);
+    assert_true(metrics.queued_max > 0);
+    assert_true(metrics.threads > 0);
+
+    am_worker_pool_shutdown();
+    am_worker_pool_init_reset();
+}
+
+void test_worker_pool_backpressure(void **state) {
+    int i, accepted = 0, status = AM_SUCCESS;
+    struct am_worker_pool_metrics metrics;
+
+    done = 0;
+    hold = 1;
+    am_worker_pool_init();
+
+    /* workers are all blocked - submission must be rejected once all queues fill up */
+    for (i = 0; i < AM_MAX_THREADS_POOL * (AM_WORKER_QUEUE_SIZE + 1) + 1; i++) {
+        status = am_worker_dispatch(hold_worker, NULL);
+        if (status != AM_SUCCESS) {
+            break;
+        }
+        accepted++;
+    }
+    assert_int_equal(status, AM_EAGAIN);
+
+    assert_int_equal(am_worker_pool_metrics(&metrics), AM_SUCCESS);
+    assert_int_equal(metrics.rejected, 1);
+    assert_int_equal(metrics.submitted, accepted);
+
+    __sync_fetch_and_add(&hold, -1);
+    wait_for_work(accepted);
+    assert_int_equal(done, accepted);
+
+    am_worker_pool_shutdown();
+    am_worker_pool_init_reset();
+}
+
+void test_worker_pool_overflow(void **state) {
+    int i, tries, accepted = 0;
+    struct am_worker_pool_metrics metrics;
+
+    done = 0;
+    held = 0;
+    hold = 1;
+    am_worker_pool_init();
+
+    /* block every worker (started one by one, as each submission finds all running workers busy) */
+    for (i = 0; i < AM_MAX_THREADS_POOL; i++) {
+        assert_int_equal(am_worker_dispatch(hold_worker, NULL), AM_SUCCESS);
+        accepted++;
+        for (tries = 1000; __sync_fetch_and_add(&held, 0) < (uint32_t) accepted && --tries; ) {
+            usleep(1000);
+        }
+        assert_int_equal(held, accepted);
+    }
+    assert_int_equal(am_worker_pool_metrics(&metrics), AM_SUCCESS);
+    assert_int_equal(metrics.threads, AM_MAX_THREADS_POOL);
+
+    /* workers are all blocked - fill up all queues */
+    while (am_worker_dispatch(hold_worker, NULL) == AM_SUCCESS) {
+        accepted++;
+    }
+    assert_int_equal(accepted, AM_MAX_THREADS_POOL * (AM_WORKER_QUEUE_SIZE + 1));
+
+    /* work that should not be lost is kept past the full queues, up to the overflow queue size */
+    for (i = 0; i < AM_WORKER_OVERFLOW_SIZE; i++) {
+        assert_int_equal(am_worker_dispatch_reliable(hold_worker, NULL), AM_SUCCESS);
+    }
+    assert_int_equal(am_worker_dispatch_reliable(hold_worker, NULL), AM_EAGAIN);
+
+    assert_int_equal(am_worker_pool_metrics(&metrics), AM_SUCCESS);
+    assert_int_equal(metrics.rejected, 2);
+    assert_int_equal(metrics.overflowed, AM_WORKER_OVERFLOW_SIZE);
+    assert_int_equal(metrics.submitted, accepted + AM_WORKER_OVERFLOW_SIZE);
+
+    __sync_fetch_and_add(&hold, -1);
+    wait_for_work(accepted + AM_WORKER_OVERFLOW_SIZE);
+    assert_int_equal(done, accepted + AM_WORKER_OVERFLOW_SIZE);
+
+    am_worker_pool_shutdown();
+    am_worker_pool_init_reset();
+}
+
+struct timer_test {
+    am_timer_entry_t entry;
+    uint64_t scheduled;
+    uint64_t fired;
+    unsigned int delay;
+    volatile uint32_t count;
+};
+
+static uint64_t now_msec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void timer_worker(void *arg) {
+    struct timer_test *t = (struct timer_test *) arg;
+    if (t->fired == 0) {
+        t->fired = now_msec();
+    }
+    __sync_fetch_and_add(&t->count, 1);
+}
+
+void test_timer_wheel(void **state) {
+    int i;
+    struct timer_test timers[64], recurring, cancelled;
+
+    for (i = 0; i < 64; i++) {
+        memset(&timers[i], 0, sizeof (struct timer_test));
+        am_timer_entry_init(&timers[i].entry, timer_worker, &timers[i]);
+        timers[i].delay = (i * 37) % 1500; /* spans level 0 and level 1 of the wheel */
+        timers[i].scheduled = now_msec();
+        assert_int_equal(am_timer_schedule(&timers[i].entry, timers[i].delay, 0), AM_SUCCESS);
+    }
+
+    memset(&recurring, 0, sizeof (struct timer_test));
+    am_timer_entry_init(&recurring.entry, timer_worker, &recurring);
+    assert_int_equal(am_timer_schedule(&recurring.entry, 100, 100), AM_SUCCESS);
+
+    memset(&cancelled, 0, sizeof (struct timer_test));
+    am_timer_entry_init(&cancelled.entry, timer_worker, &cancelled);
+    assert_int_equal(am_timer_schedule(&cancelled.entry, 500, 0), AM_SUCCESS);
+    am_timer_cancel(&cancelled.entry);
+
+    usleep(2000 * 1000);
+
+    for (i = 0; i < 64; i++) {
+        assert_int_equal(timers[i].count, 1);
+        assert_true(timers[i].fired + 1 >= timers[i].scheduled + timers[i].delay);
+        assert_true(timers[i].fired <= timers[i].scheduled + timers[i].delay + 500);
+    }
+    assert_int_equal(cancelled.count, 0);
+
+    am_timer_cancel(&recurring.entry);
+    assert_true(recurring.count >= 10);
+    i = recurring.count;
+    usleep(300 * 1000);
+    assert_int_equal(recurring.count, i);
+}
+
+void test_timer_event(void **state) {
+    struct timer_test t;
+    am_timer_event_t *e;
+
+    memset(&t, 0, sizeof (struct timer_test));
+    e = am_create_timer_event(AM_TIMER_EVENT_RECURRING, 1, &t, timer_worker);
+    assert_non_null(e);
+    assert_int_equal(e->error, 0);
+    am_start_timer_event(e);
+    assert_int_equal(e->init_status, AM_SUCCESS);
+    usleep(2500 * 1000);
+    am_close_timer_event(e);
+    assert_int_equal(t.count, 2);
+}
+
+struct dispatch_test {
+    am_timer_entry_t entry;
+    pthread_t thread;
+    uint64_t last;
+    uint64_t max_gap;
+    volatile uint32_t count;
+    volatile uint32_t running;
+};
+
+static void slow_timer_worker(void *arg) {
+    struct dispatch_test *t = (struct dispatch_test *) arg;
+    __sync_fetch_and_add(&t->running, 1);
+    t->thread = pthread_self();
+    usleep(300 * 1000);
+    __sync_fetch_and_add(&t->count, 1);
+    __sync_fetch_and_add(&t->running, -1);
+}
+
+static void quick_timer_worker(void *arg) {
+    struct dispatch_test *t = (struct dispatch_test *) arg;
+    uint64_t now = now_msec();
+    t->thread = pthread_self();
+    if (t->last != 0 && now - t->last > t->max_gap) {
+        t->max_gap = now - t->last;
+    }
+    t->last = now;
+    __sync_fetch_and_add(&t->count, 1);
+}
+
+void test_timer_dispatch(void **state) {
+    struct dispatch_test slow, quick;
+
+    am_worker_pool_init();
+
+    memset(&slow, 0, sizeof (struct dispatch_test));
+    am_timer_entry_init(&slow.entry, slow_timer_worker, &slow);
+    slow.entry.dispatch = AM_TRUE;
+    memset(&quick, 0, sizeof (struct dispatch_test));
+    am_timer_entry_init(&quick.entry, quick_timer_worker, &quick);
+
+    assert_int_equal(am_timer_schedule(&slow.entry, 50, 50), AM_SUCCESS);
+    assert_int_equal(am_timer_schedule(&quick.entry, 20, 20), AM_SUCCESS);
+    usleep(1000 * 1000);
+
+    /* the slow callback runs on a worker thread, one run at a time, and does not hold up the other timer */
+    assert_true(slow.count >= 2 && slow.count <= 4);
+    assert_false(pthread_equal(slow.thread, quick.thread));
+    assert_true(quick.count >= 20);
+    assert_true(quick.max_gap < 200);
+
+    /* cancel waits for a dispatched run to finish */
+    while (slow.running == 0) {
+        usleep(1000);
+    }
+    am_timer_cancel(&slow.entry);
+    assert_int_equal(slow.running, 0);
+    am_timer_cancel(&quick.entry);
+
+    am_worker_pool_shutdown();
+    am_worker_pool_init_reset();
+}
@@ -23,6 +23,7 @@
 #include "am.h"
 #include "platform.h"
 #include "utility.h"
+#include "list.h"
 #include "log.h"
 #include "cmocka.h"
 
@@ -348,6 +349,116 @@ void test_base64_encode_decode(void** state) {
     assert_string_equal(richard3, decoded);
 }
 
+/**
+ * Test base 64 against the RFC 4648 vectors and round trip binary values of every length up to 64 bytes.
+ */
+void test_base64_vectors(void** state) {
+    const char* vectors[][2] = {
+        { "", "" }, { "f", "Zg==" }, { "fo", "Zm8=" }, { "foo", "Zm9v" },
+        { "foob", "Zm9vYg==" }, { "fooba", "Zm9vYmE=" }, { "foobar", "Zm9vYmFy" }
+    };
+    unsigned char binary[64];
+    size_t i, length;
+    char *encoded, *decoded;
+    
+    for (i = 0; i < sizeof (vectors) / sizeof (vectors[0]); i++) {
+        length = strlen(vectors[i][0]);
+        encoded = base64_encode(vectors[i][0], &length);
+        assert_string_equal(encoded, vectors[i][1]);
+        assert_int_equal(length, strlen(vectors[i][1]));
+        decoded = base64_decode(encoded, &length);
+        assert_string_equal(decoded, vectors[i][0]);
+        assert_int_equal(length, strlen(vectors[i][0]));
+        free(encoded);
+        free(decoded);
+    }
+    
+    for (i = 0; i < sizeof (binary); i++) {
+        binary[i] = (unsigned char) (i * 37 + 255);
+    }
+    for (i = 0; i <= sizeof (binary); i++) {
+        length = i;
+        encoded = base64_encode(binary, &length);
+        assert_int_equal(length, (i + 2) / 3 * 4);
+        decoded = base64_decode(encoded, &length);
+        assert_int_equal(length, i);
+        assert_memory_equal(decoded, binary, i);
+        free(encoded);
+        free(decoded);
+    }
+    
+    /* decoding stops at the first character outside of the alphabet */
+    decoded = base64_decode("Zm9v#YmFy", &length);
+    assert_string_equal(decoded, "foo");
+    assert_int_equal(length, 3);
+    free(decoded);
+}
+
+/**
+ * Test the keyed digest against the SipHash-2-4 (128 bit output) reference vectors, and the buffer hash against the string hash.
+ */
+void test_digest_vectors(void** state) {
+    const uint64_t vectors[][2] = {
+        { 0xe6a825ba047f81a3ULL, 0x930255c71472f66dULL }, /* 0 bytes */
+        { 0x61f55862baa9623bULL, 0xb49714f364e2830fULL }, /* 8 bytes */
+        { 0x11a8b03399e99354ULL, 0xd9c3cf970fec087eULL }  /* 15 bytes */
+    };
+    const size_t lengths[] = { 0, 8, 15 };
+    unsigned char data[64];
+    uint64_t key[2], digest[2], other[2];
+    size_t i;
+    
+    for (i = 0; i < sizeof (data); i++) {
+        data[i] = (unsigned char) i;
+    }
+    key[0] = 0x0706050403020100ULL;
+    key[1] = 0x0f0e0d0c0b0a0908ULL;
+    
+    for (i = 0; i < sizeof (lengths) / sizeof (lengths[0]); i++) {
+        am_digest128(data, lengths[i], key, digest);
+        assert_true(digest[0] == vectors[i][0]);
+        assert_true(digest[1] == vectors[i][1]);
+    }
+    
+    /* the same value with another key gives another digest */
+    key[0] ^= 1;
+    am_digest128(data, 15, key, other);
+    assert_false(other[0] == digest[0] && other[1] == digest[1]);
+    
+    assert_int_equal(am_hash_buffer("token value", 11), am_hash("token value"));
+    assert_int_equal(am_hash_buffer("token value\0trailer", 19), am_hash("token value"));
+    assert_int_equal(am_hash_buffer("token value", 5), am_hash("token"));
+}
+
+/**
+ * Test that session information is decoded from the token, and the same again once it is remembered.
+ */
+void test_session_decode(void** state) {
+    const char* token = "AQIC5wM2LY4Sfcyro187TdQ7LJIs373_tJP4Lb2VXBv-Qoc.*AAJTSQACMDEAAlNLABM5MjExNjg2Nzk3Mjg3MjI4MDA2*";
+    am_request_t r;
+    int i;
+    
+    for (i = 0; i < 2; i++) {
+        memset(&r, 0, sizeof (am_request_t));
+        r.token = strdup(token);
+        assert_int_equal(am_session_decode(&r), AM_SUCCESS);
+        assert_int_equal(r.session_info.error, AM_SUCCESS);
+        assert_string_equal(r.session_info.si, "01");
+        assert_string_equal(r.session_info.sk, "9211686797287228006");
+        assert_null(r.session_info.s1);
+        am_request_free(&r);
+    }
+    
+    /* a record larger than the decoded data is ignored */
+    memset(&r, 0, sizeof (am_request_t));
+    r.token = strdup("AQIC5wM2LY4Sfcyro187TdQ7LJIs373_tJP4Lb2VXBv-Qoc.*AAJTSQ__MDEA*");
+    assert_int_equal(am_session_decode(&r), AM_SUCCESS);
+    assert_null(r.session_info.si);
+    am_request_free(&r);
+    
+    am_session_decode_shutdown();
+}
+
 /**
  * Note that I can't think of a good way to test delete_am_cookie_list.
  */
@@ -481,6 +592,7 @@ void test_parse_url(void** state) {
     assert_string_equal(url_struct.path, PATH1);
     assert_string_equal(url_struct.query, QUERY1);
     assert_int_equal(result, AM_SUCCESS);
+    url_free(&url_struct);
     
     result = parse_url(buff2, &url_struct);
     assert_int_equal(url_struct.port, 443);
@@ -491,6 +603,7 @@ void test_parse_url(void** state) {
     assert_string_equal(url_struct.path, PATH2);
     assert_string_equal(url_struct.query, "");
     assert_int_equal(result, AM_SUCCESS);
+    url_free(&url_struct);
 
     result = parse_url(buff3, &url_struct);
     assert_int_equal(url_struct.port, 80);
@@ -501,10 +614,24 @@ void test_parse_url(void** state) {
     assert_string_equal(url_struct.path, "/");
     assert_string_equal(url_struct.query, "");
     assert_int_equal(result, AM_SUCCESS);
+    url_free(&url_struct);
 
     result = parse_url(buff4, &url_struct);
     assert_int_not_equal(url_struct.error, 0);
     assert_int_equal(result, AM_ERROR);
+
+    /* path is decoded and normalized, query parameters are sorted */
+    result = parse_url("http://host:8080//a/./b/../c%2Fd//e?z=1&&a=2&a=1", &url_struct);
+    assert_int_equal(result, AM_SUCCESS);
+    assert_string_equal(url_struct.path, "/a/c/d/e");
+    assert_string_equal(url_struct.query, "?a=1&a=2&z=1");
+    url_free(&url_struct);
+
+    result = parse_url("https://host/a/b/../../c", &url_struct);
+    assert_int_equal(result, AM_SUCCESS);
+    assert_string_equal(url_struct.path, "/c");
+    assert_string_equal(url_struct.query, "");
+    url_free(&url_struct);
 }
 
 /**
@@ -898,9 +1025,10 @@ void test_header_value_encoding(void **state) {
     free(val);
 }
 
-char *remove_pathinfo_from_url(struct url *url, const char *pathinfo);
+char *remove_pathinfo_from_url(am_request_t *r, struct url *url, const char *pathinfo);
 
 void test_pathinfo_removal(void **state) {
+    am_request_t r;
     struct url u;
     char *res;
     int i;
@@ -925,18 +1053,157 @@ void test_pathinfo_removal(void **state) {
         {.url = iso88591_url, .pathinfo = "/caf%E9.gif", .result = "http://host:80/caf%C3%A9/index.cgi"}
     };
 
+    memset(&r, 0, sizeof (am_request_t));
     for (i = 0; i < ARRAY_SIZE(ut); i++) {
         struct url_test *e = &ut[i];
         memset(&u, 0, sizeof (struct url));
         assert_int_equal(parse_url(e->url, &u), AM_SUCCESS);
-        res = remove_pathinfo_from_url(&u, e->pathinfo);
+        res = remove_pathinfo_from_url(&r, &u, e->pathinfo);
         if (e->result == NULL) {
             assert_true(res == NULL);
         } else {
             assert_true(res != NULL);
             assert_string_equal(res, e->result);
         }
-        am_free(res);
+        url_free(&u);
     }
+    am_request_free(&r);
     AM_FREE(iso88591, iso88591_url);
 }
+
+void test_request_arena(void **state) {
+    am_request_t r;
+    char *small[1000], *large, *fmt, *dup;
+    int i;
+
+    memset(&r, 0, sizeof (am_request_t));
+
+    /* small values span several arena blocks */
+    for (i = 0; i < ARRAY_SIZE(small); i++) {
+        small[i] = am_request_asprintf(&r, "value-%d", i);
+        assert_non_null(small[i]);
+        assert_true(((uintptr_t) small[i] & 15) == 0);
+    }
+    /* a value larger than a quarter of a block gets a block of its own */
+    large = am_request_alloc(&r, 20000);
+    assert_non_null(large);
+    memset(large, 'x', 20000);
+    fmt = am_request_asprintf(&r, "%s:%.*s", small[999], 3000, large);
+    assert_non_null(fmt);
+    assert_int_equal(strlen(fmt), strlen("value-999:") + 3000);
+
+    dup = am_request_strndup(&r, "client.example.com:8080", 18);
+    assert_string_equal(dup, "client.example.com");
+    assert_null(am_request_strdup(&r, NULL));
+
+    for (i = 0; i < ARRAY_SIZE(small); i++) {
+        char expect[32];
+        snprintf(expect, sizeof (expect), "value-%d", i);
+        assert_string_equal(small[i], expect);
+    }
+
+    am_request_free(&r);
+    assert_null(r.arena);
+
+    /* the released backing block is reused by the next request */
+    assert_string_equal(am_request_strdup(&r, "192.0.2.7"), "192.0.2.7");
+    am_request_free(&r);
+}
+
+void test_cookie_and_query_token(void **state) {
+    am_request_t r;
+    am_config_t c;
+    char *value = NULL, *hdr = NULL;
+    int ctx = 0;
+
+    memset(&r, 0, sizeof (am_request_t));
+    memset(&c, 0, sizeof (am_config_t));
+    c.cookie_name = "iPlanetDirectoryPro";
+    r.conf = &c;
+    r.ctx = &ctx;
+
+    /* cookie name and value are trimmed, the value also of double-quotes, and may contain '=' */
+    assert_int_equal(get_cookie_value(&r, ";", c.cookie_name,
+            "a=iPlanetDirectoryPro; iPlanetDirectoryPro2=x;  iPlanetDirectoryPro = \"AQIC5w==@AAJTSQ==\" ;b=c",
+            &value), AM_SUCCESS);
+    assert_string_equal(value, "AQIC5w==@AAJTSQ==");
+    free(value);
+    assert_int_equal(get_cookie_value(&r, ";", c.cookie_name, "iPlanetDirectoryPro=;;iPlanetDirectoryPro=x", &value),
+            AM_SUCCESS);
+    assert_string_equal(value, "x");
+    free(value);
+    assert_int_equal(get_cookie_value(&r, ";", c.cookie_name, "iPlanetDirectoryPro;a=b", &value), AM_NOT_FOUND);
+    assert_null(value);
+
+    r.cookies = " a=b ;; iPlanetDirectoryPro=x; c=d=e";
+    assert_int_equal(remove_cookie(&r, c.cookie_name, &hdr), AM_SUCCESS);
+    assert_string_equal(hdr, "a=b ;c=d=e");
+    free(hdr);
+    r.cookies = "iPlanetDirectoryPro=x";
+    assert_int_equal(remove_cookie(&r, c.cookie_name, &hdr), AM_SUCCESS);
+    assert_null(hdr);
+    r.cookies = "a=b";
+    assert_int_equal(remove_cookie(&r, c.cookie_name, &hdr), AM_NOT_FOUND);
+    assert_string_equal(hdr, "a=b");
+    free(hdr);
+
+    /* the token parameter is removed from the query, other parameters are kept in order */
+    assert_int_equal(parse_url("http://host/app?a=1&iPlanetDirectoryPro=AQIC5w&iPlanetDirectoryProX=2&z=3", &r.url),
+            AM_SUCCESS);
+    assert_int_equal(get_token_from_url(&r), AM_SUCCESS);
+    assert_string_equal(r.token, "AQIC5w");
+    assert_string_equal(r.url.query, "?a=1&iPlanetDirectoryProX=2&z=3");
+    free(r.token);
+    r.token = NULL;
+    url_free(&r.url);
+
+    assert_int_equal(parse_url("http://host/app?iPlanetDirectoryPro=AQIC5w", &r.url), AM_SUCCESS);
+    assert_int_equal(get_token_from_url(&r), AM_SUCCESS);
+    assert_string_equal(r.url.query, "");
+    free(r.token);
+    r.token = NULL;
+    url_free(&r.url);
+
+    assert_int_equal(parse_url("http://host/app?b=2&a=1", &r.url), AM_SUCCESS);
+    assert_int_equal(get_token_from_url(&r), AM_NOT_FOUND);
+    assert_string_equal(r.url.query, "?a=1&b=2");
+    url_free(&r.url);
+}
+
+void test_attr_index(void **state) {
+    am_request_t r;
+    struct am_namevalue e[200], *list = NULL;
+    struct am_attr_index *index;
+    const char **values;
+    char names[100][16];
+    size_t values_sz;
+    int i;
+
+    memset(&r, 0, sizeof (am_request_t));
+    memset(e, 0, sizeof (e));
+    for (i = 0; i < 100; i++) {
+        snprintf(names[i], sizeof (names[i]), "attr%d", i);
+    }
+    /* every attribute has two values, and the list is not ordered by name */
+    for (i = 0; i < 200; i++) {
+        e[i].n = names[(i * 37) % 100];
+        e[i].v = i < 100 ? "first" : "second-value";
+        AM_LIST_INSERT(list, &e[i]);
+    }
+
+    assert_null(am_attr_index_create(&r, NULL));
+    index = am_attr_index_create(&r, list);
+    assert_non_null(index);
+    assert_true(am_attr_index_of(index, list));
+    assert_false(am_attr_index_of(index, &e[1]));
+
+    for (i = 0; i < 100; i++) {
+        assert_int_equal(am_attr_index_find(index, names[i], &values_sz, &values), 2);
+        assert_string_equal(values[0], "first");
+        assert_string_equal(values[1], "second-value");
+        assert_int_equal(values_sz, strlen("first") + strlen("second-value"));
+    }
+    assert_int_equal(am_attr_index_find(index, "attr100", &values_sz, &values), 0);
+    assert_int_equal(am_attr_index_find(index, "", &values_sz, &values), 0);
+    am_request_free(&r);
+}